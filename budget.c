@@ -0,0 +1,59 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+
+#include "budget.h"
+#include "wsock.h"
+
+/* Coroutines of a process run one at a time, so plain counters will do. */
+static size_t wsock_budget_limit = 0;
+static size_t wsock_budget_used = 0;
+
+void wsock_budget_charge(size_t sz) {
+    wsock_budget_used += sz;
+}
+
+int wsock_budget_take(size_t sz) {
+    if(wsock_budget_limit && (sz > wsock_budget_limit ||
+          wsock_budget_used > wsock_budget_limit - sz)) {
+        errno = ENOBUFS; return -1;}
+    wsock_budget_used += sz;
+    return 0;
+}
+
+void wsock_budget_give(size_t sz) {
+    wsock_budget_used -= sz;
+}
+
+int wsock_budget_exceeded(void) {
+    return wsock_budget_limit && wsock_budget_used >= wsock_budget_limit;
+}
+
+void wsockbudget(size_t bytes) {
+    wsock_budget_limit = bytes;
+}
+
+size_t wsockbudgetused(void) {
+    return wsock_budget_used;
+}
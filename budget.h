@@ -0,0 +1,46 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#ifndef WSOCK_BUDGET_INCLUDED
+#define WSOCK_BUDGET_INCLUDED
+
+#include <stddef.h>
+
+/*  Process-wide accounting of the memory used by wsock's buffers: transport
+    buffers, queued control frames and messages collected for extensions.
+    The limit is set by wsockbudget(); 0 means there's none. */
+
+/*  Accounts for memory that has to be allocated anyway, e.g. the buffers
+    of a new connection. */
+void wsock_budget_charge(size_t sz);
+
+/*  Accounts for memory that can be refused. Fails with ENOBUFS if it would
+    exceed the limit. */
+int wsock_budget_take(size_t sz);
+
+void wsock_budget_give(size_t sz);
+
+/*  Returns 1 if the usage has reached the limit. */
+int wsock_budget_exceeded(void);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+#include "wsock.h"
+
+struct wsockcap {
+    int fd;
+    int flags;
+    /* The mapped file. It starts with the header. */
+    uint8_t *map;
+    size_t size;
+    int64_t start;
+    uint32_t nextconn;
+    /* The user and each connection the log is attached to. */
+    int refs;
+};
+
+/* Time in microseconds. */
+static int64_t wsock_cap_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* 64-bit FNV-1a. */
+static uint64_t wsock_cap_hash(const uint8_t *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for(i = 0; i != len; ++i) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+wsockcap wsockcapopen(const char *path, size_t size, int flags) {
+    if(!path || size < sizeof(struct wsockcaphdr) ||
+          flags & ~WSOCK_CAPHASH) {
+        errno = EINVAL; return NULL;}
+    struct wsockcap *cap = malloc(sizeof(struct wsockcap));
+    if(!cap) {errno = ENOMEM; goto error1;}
+    cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(cap->fd < 0)
+        goto error2;
+    if(ftruncate(cap->fd, size) != 0)
+        goto error3;
+    cap->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        cap->fd, 0);
+    if(cap->map == MAP_FAILED)
+        goto error3;
+    cap->flags = flags;
+    cap->size = size;
+    cap->start = wsock_cap_now();
+    cap->nextconn = 1;
+    cap->refs = 1;
+    struct wsockcaphdr *hdr = (struct wsockcaphdr*)cap->map;
+    memcpy(hdr->magic, WSOCK_CAPMAGIC, sizeof(hdr->magic));
+    hdr->version = WSOCK_CAPVERSION;
+    hdr->flags = flags;
+    hdr->used = sizeof(struct wsockcaphdr);
+    hdr->dropped = 0;
+    return cap;
+error3:
+    flags = errno;
+    close(cap->fd);
+    unlink(path);
+    errno = flags;
+error2:
+    free(cap);
+error1:
+    return NULL;
+}
+
+void wsockcapclose(wsockcap cap) {
+    wsock_cap_unref(cap);
+}
+
+void wsock_cap_ref(struct wsockcap *cap) {
+    ++cap->refs;
+}
+
+void wsock_cap_unref(struct wsockcap *cap) {
+    if(--cap->refs)
+        return;
+    /* Unused part of the file is cut off. */
+    int err = errno;
+    size_t used = ((struct wsockcaphdr*)cap->map)->used;
+    munmap(cap->map, cap->size);
+    if(ftruncate(cap->fd, used) != 0) {}
+    close(cap->fd);
+    free(cap);
+    errno = err;
+}
+
+uint32_t wsock_cap_conn(struct wsockcap *cap) {
+    return cap->nextconn++;
+}
+
+void wsock_cap_record(struct wsockcap *cap, uint32_t conn, int dir,
+      int opcode, const void *data, size_t len, uint64_t size) {
+    struct wsockcaphdr *hdr = (struct wsockcaphdr*)cap->map;
+    size_t stored = !data ? 0 : cap->flags & WSOCK_CAPHASH ? 8 : len;
+    size_t sz = (sizeof(struct wsockcaprec) + stored + 7) & ~(size_t)7;
+    if(stored > cap->size || sz > cap->size - hdr->used) {
+        ++hdr->dropped;
+        return;
+    }
+    struct wsockcaprec *rec = (struct wsockcaprec*)(cap->map + hdr->used);
+    rec->time = wsock_cap_now() - cap->start;
+    rec->size = size;
+    rec->conn = conn;
+    rec->stored = (uint32_t)stored;
+    rec->dir = (uint8_t)dir;
+    rec->opcode = (uint8_t)opcode;
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+    if(data && cap->flags & WSOCK_CAPHASH) {
+        uint64_t h = wsock_cap_hash((const uint8_t*)data, len);
+        memcpy(rec + 1, &h, 8);
+    }
+    else if(stored) {
+        memcpy(rec + 1, data, len);
+    }
+    /* The record becomes visible to readers of the file only once it's
+       complete. */
+    hdr->used += sz;
+}
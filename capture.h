@@ -0,0 +1,48 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+
+#ifndef WSOCK_CAPTURE_INCLUDED
+#define WSOCK_CAPTURE_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wsock.h"
+
+/*  Capture log is shared by all the connections it's attached to. It goes
+    away once it was closed by the user and detached from all of them. */
+void wsock_cap_ref(struct wsockcap *cap);
+void wsock_cap_unref(struct wsockcap *cap);
+
+/*  Returns a new connection ID. */
+uint32_t wsock_cap_conn(struct wsockcap *cap);
+
+/*  Appends a record. 'data' is the payload, or the part of it available,
+    NULL if it's not available at all. 'size' is the full size of
+    the payload. If the log is full the record
+    is dropped. Never fails and leaves errno unchanged. */
+void wsock_cap_record(struct wsockcap *cap, uint32_t conn, int dir,
+    int opcode, const void *data, size_t len, uint64_t size);
+
+#endif
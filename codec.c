@@ -0,0 +1,1416 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "base64.h"
+#include "budget.h"
+#include "codec.h"
+#include "random.h"
+#include "sha1.h"
+#include "wire.h"
+
+/* Set once the close frame was sent. */
+#define WSOCK_CODEC_DONE 4
+
+/* Parts of the opening handshake seen so far. */
+#define WSOCK_HS_FIRSTLINE 1
+#define WSOCK_HS_CR 2
+#define WSOCK_HS_UPGRADE 4
+#define WSOCK_HS_CONNECTION 8
+#define WSOCK_HS_KEY 16
+#define WSOCK_HS_SEENPROTOCOL 32
+#define WSOCK_HS_PROTOCOL 64
+
+/* Limit on the size of the stored header fields. */
+#define WSOCK_CODEC_MAXFIELDS 16384
+
+/* Used when hashing WebSocket keys. See RFC 6455, chapter 4. */
+static const char *wsock_uuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+/* Appends data to the output queue. */
+static int wsock_codec_put(struct wsockcodec *c, const void *buf,
+      size_t len) {
+    if(c->outlen + len > c->outcap) {
+        size_t cap = c->outcap ? c->outcap * 2 : 256;
+        while(cap < c->outlen + len)
+            cap *= 2;
+        if(wsock_budget_take(cap - c->outcap) != 0)
+            return -1;
+        uint8_t *out = realloc(c->out, cap);
+        if(!out) {
+            wsock_budget_give(cap - c->outcap);
+            errno = ENOMEM;
+            return -1;
+        }
+        c->out = out;
+        c->outcap = cap;
+    }
+    memcpy(c->out + c->outlen, buf, len);
+    c->outlen += len;
+    return 0;
+}
+
+static int wsock_codec_puts(struct wsockcodec *c, const char *s) {
+    return wsock_codec_put(c, s, strlen(s));
+}
+
+/* Masking is an XOR with a 4-byte key. 'off' keeps track of the position
+   within the key across multiple chunks of the same payload. */
+static void wsock_codec_xor(uint8_t *buf, size_t len, const uint8_t *mask,
+      size_t *off) {
+    size_t i;
+    for(i = 0; i != len; ++i)
+        buf[i] ^= mask[(*off + i) % 4];
+    *off = (*off + len) % 4;
+}
+
+/* Computes the value of Sec-WebSocket-Accept field for the given key. */
+static void wsock_codec_acceptkey(const char *key, size_t keysz, char *buf,
+      size_t bufsz) {
+    struct wsock_sha1 sha1;
+    wsock_sha1_init(&sha1);
+    size_t i;
+    for(i = 0; i != keysz; ++i)
+        wsock_sha1_hashbyte(&sha1, key[i]);
+    for(i = 0; i != 36; ++i)
+        wsock_sha1_hashbyte(&sha1, wsock_uuid[i]);
+    int sz = wsock_base64_encode(wsock_sha1_result(&sha1), 20, buf, bufsz);
+    assert(sz > 0);
+}
+
+static const char *wsock_hassubprotocol(const char *available,
+      const char *requested, size_t rqsz, size_t *ressz) {
+    /* This algorithm has quadratic complexity but we assume the list of
+       subprotocols is short, so we don't care. */
+    /* Walk through all requested subprotocols. */
+    while(rqsz) {
+        size_t rsz = 0;
+        while(rqsz && requested[rsz] != ',')
+            ++rsz, --rqsz;
+        if(rqsz)
+            --rqsz;
+        /* Walk through all the available subprotocols. */
+        const char *av = available;
+        while(av[0]) {
+            size_t asz = 0;
+            while(av[asz] != 0 && av[asz] != ',')
+                ++asz;
+            if(rsz == asz && memcmp(requested, av, asz) == 0) {
+                if(ressz)
+                    *ressz = asz;
+                return av;
+            }
+            av += asz + 1;
+        }
+        requested += rsz + 1;
+    }
+    return NULL;
+}
+
+/* Returns the length of the first element of an extension offer list,
+   an offer or a parameter, depending on the separator. Separators within
+   quoted parameter values don't count. */
+static size_t wsock_codec_extspan(const char *s, size_t sz, char sep) {
+    int quoted = 0;
+    size_t i;
+    for(i = 0; i != sz; ++i) {
+        if(quoted && s[i] == '\\' && i + 1 != sz)
+            ++i;
+        else if(s[i] == '"')
+            quoted = !quoted;
+        else if(!quoted && s[i] == sep)
+            break;
+    }
+    return i;
+}
+
+/* Strips the whitespace around an element of an extension offer. */
+static void wsock_codec_exttrim(const char **s, size_t *sz) {
+    while(*sz && (**s == ' ' || **s == '\t'))
+        ++*s, --*sz;
+    while(*sz && ((*s)[*sz - 1] == ' ' || (*s)[*sz - 1] == '\t'))
+        --*sz;
+}
+
+/* Returns the next character of a parameter value with the quotes and
+   escapes of a quoted string removed, -1 at the end of the value. */
+static int wsock_codec_extchar(const char **v, size_t *vsz) {
+    while(*vsz) {
+        char c = **v;
+        ++*v, --*vsz;
+        if(c == '"')
+            continue;
+        if(c == '\\' && *vsz) {
+            c = **v;
+            ++*v, --*vsz;
+        }
+        return (unsigned char)c;
+    }
+    return -1;
+}
+
+/* Compares two extension parameters, "name" or "name=value". The value may
+   be quoted. */
+static int wsock_codec_parameq(const char *a, size_t asz, const char *b,
+      size_t bsz) {
+    size_t an = wsock_codec_extspan(a, asz, '=');
+    size_t bn = wsock_codec_extspan(b, bsz, '=');
+    const char *av = a + an;
+    const char *bv = b + bn;
+    size_t avsz = asz - an;
+    size_t bvsz = bsz - bn;
+    wsock_codec_exttrim(&a, &an);
+    wsock_codec_exttrim(&b, &bn);
+    if(an != bn || memcmp(a, b, an) != 0 || !avsz != !bvsz)
+        return 0;
+    if(!avsz)
+        return 1;
+    ++av, --avsz, ++bv, --bvsz;
+    wsock_codec_exttrim(&av, &avsz);
+    wsock_codec_exttrim(&bv, &bvsz);
+    while(1) {
+        int c = wsock_codec_extchar(&av, &avsz);
+        if(c != wsock_codec_extchar(&bv, &bvsz))
+            return 0;
+        if(c < 0)
+            return 1;
+    }
+}
+
+/* Checks that all the parameters in 'p' are in 'q' as well. Both are
+   lists of parameters, each preceded by a semicolon. */
+static int wsock_codec_paramsin(const char *p, size_t psz, const char *q,
+      size_t qsz) {
+    while(psz) {
+        ++p, --psz;
+        size_t n = wsock_codec_extspan(p, psz, ';');
+        const char *r = q;
+        size_t rsz = qsz;
+        int found = 0;
+        while(rsz && !found) {
+            ++r, --rsz;
+            size_t m = wsock_codec_extspan(r, rsz, ';');
+            found = wsock_codec_parameq(p, n, r, m);
+            r += m;
+            rsz -= m;
+        }
+        if(!found)
+            return 0;
+        p += n;
+        psz -= n;
+    }
+    return 1;
+}
+
+/* Compares two extension offers. The names, i.e. the tokens before the first
+   semicolon, have to be the same. So do the parameters, as they may tell
+   e.g. which dictionary is used, but not their order, the whitespace around
+   them or the quoting of their values. */
+static int wsock_codec_exteq(const char *a, size_t asz, const char *b,
+      size_t bsz) {
+    size_t an = wsock_codec_extspan(a, asz, ';');
+    size_t bn = wsock_codec_extspan(b, bsz, ';');
+    const char *aname = a;
+    const char *bname = b;
+    size_t anamesz = an;
+    size_t bnamesz = bn;
+    wsock_codec_exttrim(&aname, &anamesz);
+    wsock_codec_exttrim(&bname, &bnamesz);
+    if(anamesz != bnamesz || memcmp(aname, bname, anamesz) != 0)
+        return 0;
+    return wsock_codec_paramsin(a + an, asz - an, b + bn, bsz - bn) &&
+        wsock_codec_paramsin(b + bn, bsz - bn, a + an, asz - an);
+}
+
+/* Returns the first of the requested extensions that is available, with
+   the whitespace around it stripped. Same as with subprotocols, the lists
+   are assumed to be short. */
+static const char *wsock_hasextension(const char *available,
+      const char *requested, size_t rqsz, size_t *ressz) {
+    while(rqsz) {
+        size_t rsz = wsock_codec_extspan(requested, rqsz, ',');
+        const char *av = available;
+        size_t avsz = strlen(available);
+        while(avsz) {
+            size_t asz = wsock_codec_extspan(av, avsz, ',');
+            if(wsock_codec_exteq(requested, rsz, av, asz)) {
+                wsock_codec_exttrim(&av, &asz);
+                *ressz = asz;
+                return av;
+            }
+            if(asz != avsz)
+                ++asz;
+            av += asz;
+            avsz -= asz;
+        }
+        if(rsz != rqsz)
+            ++rsz;
+        requested += rsz;
+        rqsz -= rsz;
+    }
+    return NULL;
+}
+
+/* Queues the client's opening handshake. */
+static int wsock_codec_request(struct wsockcodec *c) {
+    const char *url = wsock_str_get(&c->url);
+    const char *protocols = wsock_str_get(&c->protocols);
+    const char *extensions = wsock_str_get(&c->extensions);
+    uint32_t nonce[4];
+    int i;
+    for(i = 0; i != 4; ++i)
+        nonce[i] = wsock_random();
+    char swsk[32];
+    int swsksz = wsock_base64_encode((uint8_t*)nonce, sizeof(nonce),
+        swsk, sizeof(swsk));
+    assert(swsksz > 0);
+    wsock_codec_acceptkey(swsk, swsksz, c->key, sizeof(c->key));
+    if(wsock_codec_puts(c, "GET ") != 0 ||
+          wsock_codec_puts(c, url) != 0 ||
+          wsock_codec_puts(c,
+              " HTTP/1.1\r\n"
+              "Upgrade: websocket\r\n"
+              "Connection: Upgrade\r\n"
+              "Sec-WebSocket-Key: ") != 0 ||
+          wsock_codec_put(c, swsk, swsksz) != 0)
+        return -1;
+    if(protocols) {
+        if(wsock_codec_puts(c, "\r\nSec-WebSocket-Protocol: ") != 0 ||
+              wsock_codec_puts(c, protocols) != 0)
+            return -1;
+    }
+    if(extensions) {
+        if(wsock_codec_puts(c, "\r\nSec-WebSocket-Extensions: ") != 0 ||
+              wsock_codec_puts(c, extensions) != 0)
+            return -1;
+    }
+    return wsock_codec_puts(c, "\r\n\r\n");
+}
+
+/* Queues the server's reply to the opening handshake. */
+static int wsock_codec_reply(struct wsockcodec *c) {
+    if(wsock_codec_puts(c,
+              "HTTP/1.1 101 Switching Protocols\r\n"
+              "Upgrade: websocket\r\n"
+              "Connection: Upgrade\r\n"
+              "Sec-WebSocket-Accept: ") != 0 ||
+          wsock_codec_puts(c, c->key) != 0)
+        return -1;
+    if(c->hs & WSOCK_HS_PROTOCOL) {
+        if(wsock_codec_puts(c, "\r\nSec-WebSocket-Protocol: ") != 0 ||
+              wsock_codec_puts(c, wsock_str_get(&c->subprotocol)) != 0)
+            return -1;
+    }
+    const char *extension = wsock_str_get(&c->extension);
+    if(extension) {
+        if(wsock_codec_puts(c, "\r\nSec-WebSocket-Extensions: ") != 0 ||
+              wsock_codec_puts(c, extension) != 0)
+            return -1;
+    }
+    return wsock_codec_puts(c, "\r\n\r\n");
+}
+
+/* Splits a header line into the name and the value. */
+static int wsock_codec_split(char *buf, size_t sz, size_t *nsz,
+      char **vstart, size_t *vsz) {
+    char *lend = buf + sz;
+    char *nend = (char*)memchr(buf, ':', sz);
+    if(!nend || nend == buf) {errno = EPROTO; return -1;}
+    *nsz = nend - buf;
+    char *v = nend + 1;
+    while(v != lend && isspace(*v))
+        ++v;
+    *vstart = v;
+    *vsz = lend - v;
+    return 0;
+}
+
+/* Processes one line of the client's opening handshake. Returns 1 once
+   the handshake is complete. */
+static int wsock_codec_serverline(struct wsockcodec *c, char *buf,
+      size_t sz) {
+    char *lend = buf + sz;
+    if(!(c->hs & WSOCK_HS_FIRSTLINE)) {
+        char *wstart = buf;
+        char *wend = (char*)memchr(buf, ' ', lend - wstart);
+        if(!wend || wend - wstart != 3 || memcmp(wstart, "GET", 3) != 0)
+            goto proto;
+        wstart = wend + 1;
+        wend = (char*)memchr(wstart, ' ', lend - wstart);
+        if(!wend)
+            goto proto;
+        wsock_str_init(&c->url, wstart, wend - wstart);
+        wstart = wend + 1;
+        wend = (char*)memchr(wstart, ' ', lend - wstart);
+        if(wend || lend - wstart != 8 || memcmp(wstart, "HTTP/1.1", 8) != 0)
+            goto proto;
+        c->hs |= WSOCK_HS_FIRSTLINE;
+        return 0;
+    }
+    if(sz == 0) {
+        if(!(c->hs & WSOCK_HS_UPGRADE) || !(c->hs & WSOCK_HS_CONNECTION) ||
+              !(c->hs & WSOCK_HS_KEY))
+            goto proto;
+        if(c->hs & WSOCK_HS_SEENPROTOCOL && !(c->hs & WSOCK_HS_PROTOCOL))
+            goto proto;
+        /* If the subprotocol was not specified by the client, we still want
+           to use one of the server-supported protocols locally. */
+        const char *available = wsock_str_get(&c->protocols);
+        if(!(c->hs & WSOCK_HS_PROTOCOL) && available) {
+            size_t asz = 0;
+            while(available[asz] != 0 && available[asz] != ',')
+                ++asz;
+            wsock_str_init(&c->subprotocol, available, asz);
+        }
+        if(wsock_codec_reply(c) != 0)
+            return -1;
+        return 1;
+    }
+    size_t nsz;
+    char *vstart;
+    size_t vsz;
+    if(wsock_codec_split(buf, sz, &nsz, &vstart, &vsz) != 0)
+        return -1;
+    if(nsz == 7 && strncasecmp(buf, "Upgrade", 7) == 0) {
+        if(c->hs & WSOCK_HS_UPGRADE || vsz != 9 ||
+              memcmp(vstart, "websocket", 9) != 0)
+            goto proto;
+        c->hs |= WSOCK_HS_UPGRADE;
+        return 0;
+    }
+    if(nsz == 10 && strncasecmp(buf, "Connection", 10) == 0) {
+        if(c->hs & WSOCK_HS_CONNECTION || vsz != 7 ||
+              memcmp(vstart, "Upgrade", 7) != 0)
+            goto proto;
+        c->hs |= WSOCK_HS_CONNECTION;
+        return 0;
+    }
+    if(nsz == 17 && strncasecmp(buf, "Sec-WebSocket-Key", 17) == 0) {
+        if(c->hs & WSOCK_HS_KEY)
+            goto proto;
+        wsock_codec_acceptkey(vstart, vsz, c->key, sizeof(c->key));
+        c->hs |= WSOCK_HS_KEY;
+        return 0;
+    }
+    if(nsz == 22 && strncasecmp(buf, "Sec-WebSocket-Protocol", 22) == 0) {
+        c->hs |= WSOCK_HS_SEENPROTOCOL;
+        /* RFC6455, section 11.3.4 allows for multiple instances of this
+           field. Therefore we are going to ignore it once we have
+           a subprotocol selected. */
+        if(c->hs & WSOCK_HS_PROTOCOL)
+            return 0;
+        const char *subprotocol = vstart;
+        size_t subprotocolsz = vsz;
+        const char *available = wsock_str_get(&c->protocols);
+        if(available) {
+            subprotocol = wsock_hassubprotocol(available, vstart, vsz,
+                &subprotocolsz);
+            /* No matching subprotocol? Never mind, there may be one
+               present in following instance of this field. */
+            if(!subprotocol)
+                return 0;
+        }
+        c->hs |= WSOCK_HS_PROTOCOL;
+        wsock_str_init(&c->subprotocol, subprotocol, subprotocolsz);
+        return 0;
+    }
+    if(nsz == 24 && strncasecmp(buf, "Sec-WebSocket-Extensions", 24) == 0) {
+        /* The field may be repeated as well. The first supported extension
+           wins, the rest are declined by not mentioning them in the
+           reply. */
+        const char *available = wsock_str_get(&c->extensions);
+        if(wsock_str_get(&c->extension) || !available)
+            return 0;
+        size_t extsz;
+        const char *ext = wsock_hasextension(available, vstart, vsz, &extsz);
+        if(ext)
+            wsock_str_init(&c->extension, ext, extsz);
+        return 0;
+    }
+    return 0;
+proto:
+    errno = EPROTO;
+    return -1;
+}
+
+/* Processes one line of the server's reply to the opening handshake.
+   Returns 1 once the handshake is complete. */
+static int wsock_codec_clientline(struct wsockcodec *c, char *buf,
+      size_t sz) {
+    char *lend = buf + sz;
+    if(!(c->hs & WSOCK_HS_FIRSTLINE)) {
+        char *wstart = buf;
+        char *wend = (char*)memchr(buf, ' ', lend - wstart);
+        if(!wend || wend - wstart != 8 || memcmp(wstart, "HTTP/1.1", 8) != 0)
+            goto proto;
+        wstart = wend + 1;
+        wend = (char*)memchr(wstart, ' ', lend - wstart);
+        if(!wend || wend - wstart != 3 || memcmp(wstart, "101", 3) != 0)
+            goto proto;
+        c->hs |= WSOCK_HS_FIRSTLINE;
+        return 0;
+    }
+    if(sz == 0) {
+        if(!(c->hs & WSOCK_HS_UPGRADE) || !(c->hs & WSOCK_HS_CONNECTION) ||
+              !(c->hs & WSOCK_HS_KEY))
+            goto proto;
+        return 1;
+    }
+    size_t nsz;
+    char *vstart;
+    size_t vsz;
+    if(wsock_codec_split(buf, sz, &nsz, &vstart, &vsz) != 0)
+        return -1;
+    if(nsz == 7 && strncasecmp(buf, "Upgrade", 7) == 0) {
+        if(c->hs & WSOCK_HS_UPGRADE || vsz != 9 ||
+              memcmp(vstart, "websocket", 9) != 0)
+            goto proto;
+        c->hs |= WSOCK_HS_UPGRADE;
+        return 0;
+    }
+    if(nsz == 10 && strncasecmp(buf, "Connection", 10) == 0) {
+        if(c->hs & WSOCK_HS_CONNECTION || vsz != 7 ||
+              memcmp(vstart, "Upgrade", 7) != 0)
+            goto proto;
+        c->hs |= WSOCK_HS_CONNECTION;
+        return 0;
+    }
+    if(nsz == 20 && strncasecmp(buf, "Sec-WebSocket-Accept", 20) == 0) {
+        /* Check whether the received key matches the expected one. */
+        if(c->hs & WSOCK_HS_KEY || vsz != strlen(c->key) ||
+              memcmp(vstart, c->key, vsz) != 0)
+            goto proto;
+        c->hs |= WSOCK_HS_KEY;
+        return 0;
+    }
+    if(nsz == 22 && strncasecmp(buf, "Sec-WebSocket-Protocol", 22) == 0) {
+        const char *requested = wsock_str_get(&c->protocols);
+        if(c->hs & WSOCK_HS_PROTOCOL || !requested ||
+              memchr(vstart, ',', vsz) ||
+              !wsock_hassubprotocol(requested, vstart, vsz, NULL))
+            goto proto;
+        wsock_str_init(&c->subprotocol, vstart, vsz);
+        c->hs |= WSOCK_HS_PROTOCOL;
+        return 0;
+    }
+    if(nsz == 24 && strncasecmp(buf, "Sec-WebSocket-Extensions", 24) == 0) {
+        /* The server may only accept a single extension we've offered. */
+        const char *offered = wsock_str_get(&c->extensions);
+        size_t extsz;
+        const char *ext = offered ?
+            wsock_hasextension(offered, vstart, vsz, &extsz) : NULL;
+        if(wsock_str_get(&c->extension) || !ext ||
+              wsock_codec_extspan(vstart, vsz, ',') != vsz)
+            goto proto;
+        wsock_str_init(&c->extension, ext, extsz);
+        return 0;
+    }
+    return 0;
+proto:
+    errno = EPROTO;
+    return -1;
+}
+
+/* Makes room for at least one more byte of the header line. */
+static int wsock_codec_growfields(struct wsockcodec *c) {
+    if(c->fieldscap == WSOCK_CODEC_MAXFIELDS) {errno = ENOBUFS; return -1;}
+    size_t cap = c->fieldscap ? c->fieldscap * 2 : 256;
+    if(cap > WSOCK_CODEC_MAXFIELDS)
+        cap = WSOCK_CODEC_MAXFIELDS;
+    if(wsock_budget_take(cap - c->fieldscap) != 0)
+        return -1;
+    char *fields = realloc(c->fields, cap);
+    if(!fields) {
+        wsock_budget_give(cap - c->fieldscap);
+        errno = ENOMEM;
+        return -1;
+    }
+    c->fields = fields;
+    c->fieldscap = cap;
+    return 0;
+}
+
+/* Turns the processed header line at the end of the arena into a stored
+   field. */
+static int wsock_codec_keepfield(struct wsockcodec *c, char *buf,
+      size_t sz) {
+    if(c->nfields == c->indexcap) {
+        size_t cap = c->indexcap ? c->indexcap * 2 : 16;
+        if(wsock_budget_take((cap - c->indexcap) * sizeof(uint32_t)) != 0)
+            return -1;
+        uint32_t *index = realloc(c->index, cap * sizeof(uint32_t));
+        if(!index) {
+            wsock_budget_give((cap - c->indexcap) * sizeof(uint32_t));
+            errno = ENOMEM;
+            return -1;
+        }
+        c->index = index;
+        c->indexcap = cap;
+    }
+    size_t nsz;
+    char *vstart;
+    size_t vsz;
+    int rc = wsock_codec_split(buf, sz, &nsz, &vstart, &vsz);
+    assert(rc == 0);
+    buf[nsz] = 0;
+    memmove(buf + nsz + 1, vstart, vsz);
+    buf[nsz + 1 + vsz] = 0;
+    c->index[c->nfields++] = (uint32_t)c->fieldslen;
+    c->fieldslen += nsz + vsz + 2;
+    return 0;
+}
+
+/* Processes one byte of the opening handshake. Lines are CRLF-delimited.
+   All leading and trailing whitespace is trimmed and any remaining whitespace
+   sequences are replaced by single space. Header fields are kept once they
+   were processed. Returns 1 once the handshake is complete. */
+static int wsock_codec_handshake(struct wsockcodec *c, char ch) {
+    if(c->hs & WSOCK_HS_CR) {
+        if(ch != '\n') {errno = EPROTO; return -1;}
+        c->hs &= ~WSOCK_HS_CR;
+        char *buf = c->fields + c->fieldslen;
+        size_t sz = c->linelen;
+        c->linelen = 0;
+        size_t i = 0;
+        while(i != sz && isspace(buf[i]))
+            ++i;
+        size_t pos = 0;
+        while(i != sz) {
+            if(isspace(buf[i])) {
+                while(i != sz && isspace(buf[i]))
+                    ++i;
+                --i;
+            }
+            buf[pos++] = buf[i++];
+        }
+        if(pos && isspace(buf[pos - 1]))
+            --pos;
+        int field = pos && c->hs & WSOCK_HS_FIRSTLINE;
+        int rc = c->flags & WSOCK_CODEC_CLIENT ?
+            wsock_codec_clientline(c, buf, pos) :
+            wsock_codec_serverline(c, buf, pos);
+        if(rc != 0 || !field)
+            return rc;
+        return wsock_codec_keepfield(c, buf, pos);
+    }
+    /* Keep a spare byte for the terminator of the stored field. */
+    if(c->fieldslen + c->linelen + 1 >= c->fieldscap &&
+          wsock_codec_growfields(c) != 0)
+        return -1;
+    if(ch == '\r') {
+        c->hs |= WSOCK_HS_CR;
+        return 0;
+    }
+    if((uint8_t)ch < 32 || (uint8_t)ch > 127) {errno = EPROTO; return -1;}
+    c->fields[c->fieldslen + c->linelen++] = ch;
+    return 0;
+}
+
+/* Called once the first two bytes of the frame header are available.
+   Checks them and computes the full size of the header. */
+static int wsock_codec_hdrsize(struct wsockcodec *c) {
+    uint8_t *hdr = c->hdr;
+    int opcode = hdr[0] & 0x0f;
+    if((opcode > 2 && opcode < 8) || opcode > 10) {errno = EPROTO; return -1;}
+    /* RSV1 marks messages transformed by the negotiated extension. It's
+       set on the first frame of a message only. */
+    if(hdr[0] & 0x70 && ((hdr[0] & 0x70) != 0x40 || opcode == 0 ||
+          opcode >= 8 || !wsock_str_get(&c->extension))) {
+        errno = EPROTO; return -1;}
+    /* Frames sent by the client are masked, frames sent by the server
+       are not. */
+    if(!!(c->flags & WSOCK_CODEC_CLIENT) == !!(hdr[1] & 0x80)) {
+        errno = EPROTO; return -1;}
+    size_t sz = hdr[1] & 0x7f;
+    /* Control frames can't be fragmented and their payload is short. */
+    if(opcode >= 8 && (!(hdr[0] & 0x80) || sz > 125)) {
+        errno = EPROTO; return -1;}
+    if(sz == 126)
+        c->hdrneed += 2;
+    else if(sz == 127)
+        c->hdrneed += 8;
+    if(hdr[1] & 0x80)
+        c->hdrneed += 4;
+    return 0;
+}
+
+/* Called once the whole frame header is available. */
+static int wsock_codec_hdr(struct wsockcodec *c) {
+    uint8_t *hdr = c->hdr;
+    size_t pos = 2;
+    uint64_t sz = hdr[1] & 0x7f;
+    if(sz == 126) {
+        sz = wsock_gets(hdr + 2);
+        pos = 4;
+    }
+    else if(sz == 127) {
+        sz = wsock_getll(hdr + 2);
+        if(sz >> 63) {errno = EPROTO; return -1;}
+        pos = 10;
+    }
+    if(hdr[1] & 0x80)
+        memcpy(c->rmask, hdr + pos, 4);
+    c->rmaskoff = 0;
+    c->remaining = sz;
+    c->ctllen = 0;
+    c->state = (hdr[0] & 0x0f) >= 8 ? WSOCK_CODEC_CONTROL :
+        WSOCK_CODEC_PAYLOAD;
+    return 0;
+}
+
+/* Queues a control frame. */
+static int wsock_codec_ctlframe(struct wsockcodec *c, uint8_t opcode,
+      const uint8_t *payload, size_t len) {
+    uint8_t frame[6 + 125];
+    frame[0] = 0x80 | opcode;
+    frame[1] = (uint8_t)len;
+    size_t sz = 2;
+    if(len)
+        memcpy(frame + 2, payload, len);
+    if(c->flags & WSOCK_CODEC_CLIENT) {
+        uint32_t mask = wsock_random();
+        frame[1] |= 0x80;
+        memmove(frame + 6, frame + 2, len);
+        memcpy(frame + 2, &mask, 4);
+        size_t off = 0;
+        wsock_codec_xor(frame + 6, len, frame + 2, &off);
+        sz = 6;
+    }
+    return wsock_codec_put(c, frame, sz + len);
+}
+
+/* Called once the whole control frame was received. Replies to pings and
+   close frames are queued automatically unless the close frame was already
+   sent. */
+static int wsock_codec_control(struct wsockcodec *c, struct wsockevent *ev) {
+    int opcode = c->hdr[0] & 0x0f;
+    size_t off = 0;
+    wsock_codec_xor(c->ctl, c->ctllen, c->rmask, &off);
+    c->hdrlen = 0;
+    c->hdrneed = 2;
+    c->remaining = 0;
+    c->state = WSOCK_CODEC_HEADER;
+    ev->data = c->ctl;
+    ev->len = c->ctllen;
+    if(opcode == 9) {
+        if(!(c->flags & WSOCK_CODEC_DONE)) {
+            if(wsock_codec_ctlframe(c, 0x0a, c->ctl, c->ctllen) != 0)
+                return -1;
+        }
+        ev->type = WSOCK_PING;
+        return 0;
+    }
+    if(opcode == 10) {
+        ev->type = WSOCK_PONG;
+        return 0;
+    }
+    /* Echo the status code, if any. */
+    if(!(c->flags & WSOCK_CODEC_DONE)) {
+        if(wsock_codec_ctlframe(c, 0x08, c->ctl,
+              c->ctllen < 2 ? 0 : 2) != 0)
+            return -1;
+        c->flags |= WSOCK_CODEC_DONE;
+    }
+    c->state = WSOCK_CODEC_CLOSED;
+    ev->type = WSOCK_CLOSE;
+    return 0;
+}
+
+int wsock_codec_init(struct wsockcodec *c, int flags, const char *protocols,
+      const char *url) {
+    c->flags = flags & WSOCK_CODEC_CLIENT;
+    c->state = flags & WSOCK_CODEC_OPEN ? WSOCK_CODEC_HEADER :
+        WSOCK_CODEC_HANDSHAKE;
+    c->hs = 0;
+    c->key[0] = 0;
+    c->fields = NULL;
+    c->fieldslen = 0;
+    c->fieldscap = 0;
+    c->linelen = 0;
+    c->index = NULL;
+    c->nfields = 0;
+    c->indexcap = 0;
+    wsock_str_init(&c->protocols, protocols, wsock_str_len(protocols));
+    wsock_str_init(&c->url, url, wsock_str_len(url));
+    wsock_str_init(&c->subprotocol, NULL, 0);
+    wsock_str_init(&c->extensions, NULL, 0);
+    wsock_str_init(&c->extension, NULL, 0);
+    c->hdrlen = 0;
+    c->hdrneed = 2;
+    c->remaining = 0;
+    c->rmaskoff = 0;
+    c->ctllen = 0;
+    c->smaskoff = 0;
+    c->out = NULL;
+    c->outpos = 0;
+    c->outlen = 0;
+    c->outcap = 0;
+    if(c->state == WSOCK_CODEC_HANDSHAKE && c->flags & WSOCK_CODEC_CLIENT) {
+        if(wsock_codec_request(c) != 0) {
+            wsock_codec_term(c);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void wsock_codec_term(struct wsockcodec *c) {
+    wsock_str_term(&c->protocols);
+    wsock_str_term(&c->url);
+    wsock_str_term(&c->subprotocol);
+    wsock_str_term(&c->extensions);
+    wsock_str_term(&c->extension);
+    wsock_codec_dropfields(c);
+    wsock_budget_give(c->outcap);
+    free(c->out);
+}
+
+const char *wsock_codec_field(struct wsockcodec *c, const char *name) {
+    size_t i;
+    for(i = 0; i != c->nfields; ++i) {
+        const char *n = c->fields + c->index[i];
+        if(strcasecmp(n, name) == 0)
+            return n + strlen(n) + 1;
+    }
+    return NULL;
+}
+
+const char *wsock_codec_fieldat(struct wsockcodec *c, size_t idx,
+      const char **name) {
+    if(idx >= c->nfields)
+        return NULL;
+    const char *n = c->fields + c->index[idx];
+    if(name)
+        *name = n;
+    return n + strlen(n) + 1;
+}
+
+void wsock_codec_dropfields(struct wsockcodec *c) {
+    wsock_budget_give(c->fieldscap + c->indexcap * sizeof(uint32_t));
+    free(c->fields);
+    free(c->index);
+    c->fields = NULL;
+    c->fieldslen = 0;
+    c->fieldscap = 0;
+    c->linelen = 0;
+    c->index = NULL;
+    c->nfields = 0;
+    c->indexcap = 0;
+}
+
+int wsock_codec_extensions(struct wsockcodec *c, const char *extensions) {
+    if(c->state != WSOCK_CODEC_HANDSHAKE || c->hs || c->outpos) {
+        errno = EBUSY; return -1;}
+    wsock_str_term(&c->extensions);
+    wsock_str_init(&c->extensions, extensions, wsock_str_len(extensions));
+    /* The client's request is queued in advance. Build it anew. */
+    if(c->flags & WSOCK_CODEC_CLIENT) {
+        c->outlen = 0;
+        if(wsock_codec_request(c) != 0) {
+            c->state = WSOCK_CODEC_BROKEN;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Size of the fixed part of the saved state. */
+#define WSOCK_CODEC_STATESZ (4 + WSOCK_MAXHEADER + 8 + 4 + 2 + 4 + 1)
+/* Length of a string that is not set. */
+#define WSOCK_CODEC_NOSTR 0xffff
+
+static size_t wsock_codec_strlen(const char *s) {
+    return s ? strlen(s) : WSOCK_CODEC_NOSTR;
+}
+
+static uint8_t *wsock_codec_putstr(uint8_t *pos, const char *s, size_t len) {
+    wsock_puts(pos, (uint16_t)len);
+    if(len != WSOCK_CODEC_NOSTR) {
+        memcpy(pos + 2, s, len);
+        pos += len;
+    }
+    return pos + 2;
+}
+
+/* Restores the header fields stored as "name\0value\0" pairs. Returns
+   NULL with errno set if they are malformed or can't be allocated. */
+static const uint8_t *wsock_codec_getfields(struct wsockcodec *c,
+      const uint8_t *pos, const uint8_t *end) {
+    wsock_codec_dropfields(c);
+    errno = EPROTO;
+    if(end - pos < 2)
+        return NULL;
+    size_t len = wsock_gets(pos);
+    pos += 2;
+    if(len >= WSOCK_CODEC_MAXFIELDS || (size_t)(end - pos) < len ||
+          (len && pos[len - 1] != 0))
+        return NULL;
+    size_t nfields = 0;
+    size_t i;
+    for(i = 0; i != len; ++i)
+        if(pos[i] == 0)
+            ++nfields;
+    if(nfields % 2)
+        return NULL;
+    nfields /= 2;
+    if(!len)
+        return pos;
+    if(wsock_budget_take(len + nfields * sizeof(uint32_t)) != 0)
+        return NULL;
+    c->fields = malloc(len);
+    c->index = malloc(nfields * sizeof(uint32_t));
+    if(!c->fields || !c->index) {
+        free(c->fields);
+        free(c->index);
+        c->fields = NULL;
+        c->index = NULL;
+        wsock_budget_give(len + nfields * sizeof(uint32_t));
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(c->fields, pos, len);
+    c->fieldslen = len;
+    c->fieldscap = len;
+    c->indexcap = nfields;
+    size_t off = 0;
+    while(off != len) {
+        c->index[c->nfields++] = (uint32_t)off;
+        off += strlen(c->fields + off) + 1;
+        off += strlen(c->fields + off) + 1;
+    }
+    return pos + len;
+}
+
+/* Returns NULL if the string doesn't fit into the buffer. */
+static const uint8_t *wsock_codec_getstr(const uint8_t *pos,
+      const uint8_t *end, struct wsock_str *str) {
+    if(end - pos < 2)
+        return NULL;
+    size_t len = wsock_gets(pos);
+    pos += 2;
+    wsock_str_term(str);
+    if(len == WSOCK_CODEC_NOSTR) {
+        wsock_str_init(str, NULL, 0);
+        return pos;
+    }
+    if((size_t)(end - pos) < len) {
+        wsock_str_init(str, NULL, 0);
+        return NULL;
+    }
+    wsock_str_init(str, (const char*)pos, len);
+    return pos + len;
+}
+
+size_t wsock_codec_save(struct wsockcodec *c, uint8_t *buf) {
+    if(c->state == WSOCK_CODEC_HANDSHAKE || c->outlen) {
+        errno = EBUSY; return 0;}
+    if(c->state == WSOCK_CODEC_BROKEN) {errno = ECONNABORTED; return 0;}
+    /* State of the extension lives outside of the codec. */
+    if(wsock_str_get(&c->extension)) {errno = ENOTSUP; return 0;}
+    const char *url = wsock_str_get(&c->url);
+    const char *subprotocol = wsock_str_get(&c->subprotocol);
+    size_t urllen = wsock_codec_strlen(url);
+    size_t subprotocollen = wsock_codec_strlen(subprotocol);
+    if((url && urllen >= WSOCK_CODEC_NOSTR) ||
+          (subprotocol && subprotocollen >= WSOCK_CODEC_NOSTR)) {
+        errno = EMSGSIZE; return 0;}
+    size_t sz = WSOCK_CODEC_STATESZ + c->ctllen + 2 + (url ? urllen : 0) +
+        2 + (subprotocol ? subprotocollen : 0) + 2 + c->fieldslen;
+    errno = 0;
+    if(!buf)
+        return sz;
+    uint8_t *pos = buf;
+    *pos++ = (uint8_t)c->state;
+    *pos++ = (uint8_t)c->flags;
+    *pos++ = (uint8_t)c->hdrlen;
+    *pos++ = (uint8_t)c->hdrneed;
+    memcpy(pos, c->hdr, WSOCK_MAXHEADER);
+    pos += WSOCK_MAXHEADER;
+    wsock_putll(pos, c->remaining);
+    pos += 8;
+    memcpy(pos, c->rmask, 4);
+    pos += 4;
+    *pos++ = (uint8_t)c->rmaskoff;
+    *pos++ = (uint8_t)c->ctllen;
+    memcpy(pos, c->smask, 4);
+    pos += 4;
+    *pos++ = (uint8_t)c->smaskoff;
+    memcpy(pos, c->ctl, c->ctllen);
+    pos += c->ctllen;
+    pos = wsock_codec_putstr(pos, url, urllen);
+    pos = wsock_codec_putstr(pos, subprotocol, subprotocollen);
+    /* The header fields are smaller than WSOCK_CODEC_MAXFIELDS. */
+    wsock_puts(pos, (uint16_t)c->fieldslen);
+    memcpy(pos + 2, c->fields, c->fieldslen);
+    pos += 2 + c->fieldslen;
+    assert((size_t)(pos - buf) == sz);
+    return sz;
+}
+
+size_t wsock_codec_load(struct wsockcodec *c, const uint8_t *buf,
+      size_t len) {
+    if(len < WSOCK_CODEC_STATESZ)
+        goto error;
+    const uint8_t *pos = buf;
+    int state = *pos++;
+    int flags = *pos++;
+    size_t hdrlen = *pos++;
+    size_t hdrneed = *pos++;
+    if(state < WSOCK_CODEC_HEADER || state > WSOCK_CODEC_CLOSED ||
+          flags & ~(WSOCK_CODEC_CLIENT | WSOCK_CODEC_DONE) ||
+          hdrneed < 2 || hdrneed > WSOCK_MAXHEADER || hdrlen > hdrneed)
+        goto error;
+    memcpy(c->hdr, pos, WSOCK_MAXHEADER);
+    pos += WSOCK_MAXHEADER;
+    uint64_t remaining = wsock_getll(pos);
+    pos += 8;
+    memcpy(c->rmask, pos, 4);
+    pos += 4;
+    c->rmaskoff = *pos++ % 4;
+    size_t ctllen = *pos++;
+    memcpy(c->smask, pos, 4);
+    pos += 4;
+    c->smaskoff = *pos++ % 4;
+    if(ctllen > sizeof(c->ctl) || len - (pos - buf) < ctllen)
+        goto error;
+    /* The frame being received must be in a state the codec could have
+       left it in. Between frames the header is incomplete and nothing
+       remains. Within a frame the header is complete and matches the
+       state: some payload remains, for control frames no more than they
+       can carry. */
+    int opcode = c->hdr[0] & 0x0f;
+    switch(state) {
+    case WSOCK_CODEC_PAYLOAD:
+        if(hdrlen != hdrneed || opcode >= 8 || remaining == 0 ||
+              remaining >> 63)
+            goto error;
+        break;
+    case WSOCK_CODEC_CONTROL:
+        if(hdrlen != hdrneed || opcode < 8 || remaining == 0 ||
+              remaining > 125 || ctllen >= remaining)
+            goto error;
+        break;
+    default:
+        if(hdrlen == hdrneed || (hdrlen < 2 && hdrneed != 2) ||
+              remaining != 0)
+            goto error;
+    }
+    memcpy(c->ctl, pos, ctllen);
+    pos += ctllen;
+    pos = wsock_codec_getstr(pos, buf + len, &c->url);
+    if(!pos)
+        goto error;
+    pos = wsock_codec_getstr(pos, buf + len, &c->subprotocol);
+    if(!pos)
+        goto error;
+    pos = wsock_codec_getfields(c, pos, buf + len);
+    if(!pos)
+        return 0;
+    c->state = state;
+    c->flags = flags;
+    c->hdrlen = hdrlen;
+    c->hdrneed = hdrneed;
+    c->remaining = remaining;
+    c->ctllen = ctllen;
+    errno = 0;
+    return pos - buf;
+error:
+    errno = EPROTO;
+    return 0;
+}
+
+wsockcodec wsockcodecserver(const char *subprotocol) {
+    if(!wsock_str_check(subprotocol))
+        return NULL;
+    struct wsockcodec *c = malloc(sizeof(struct wsockcodec));
+    if(!c) {errno = ENOMEM; return NULL;}
+    if(wsock_codec_init(c, 0, subprotocol, NULL) != 0) {
+        free(c); errno = ENOMEM; return NULL;}
+    errno = 0;
+    return c;
+}
+
+wsockcodec wsockcodecclient(const char *subprotocol, const char *url) {
+    if(!url || !wsock_str_check(url) || !wsock_str_check(subprotocol)) {
+        errno = EINVAL; return NULL;}
+    struct wsockcodec *c = malloc(sizeof(struct wsockcodec));
+    if(!c) {errno = ENOMEM; return NULL;}
+    if(wsock_codec_init(c, WSOCK_CODEC_CLIENT, subprotocol, url) != 0) {
+        free(c); errno = ENOMEM; return NULL;}
+    errno = 0;
+    return c;
+}
+
+int wsockcodecextensions(wsockcodec c, const char *extensions) {
+    if(!wsock_str_check(extensions)) {errno = EINVAL; return -1;}
+    if(wsock_codec_extensions(c, extensions) != 0)
+        return -1;
+    errno = 0;
+    return 0;
+}
+
+size_t wsockcodecfeed(wsockcodec c, void *buf, size_t len,
+      struct wsockevent *ev) {
+    uint8_t *pos = (uint8_t*)buf;
+    uint8_t *end = pos + len;
+    ev->type = WSOCK_NONE;
+    ev->last = 0;
+    ev->data = NULL;
+    ev->len = 0;
+    ev->rsv = 0;
+    if(c->state == WSOCK_CODEC_BROKEN) {errno = EPROTO; return 0;}
+    if(c->state == WSOCK_CODEC_CLOSED) {errno = ECONNRESET; return 0;}
+    while(pos != end) {
+        if(c->state == WSOCK_CODEC_HANDSHAKE) {
+            int rc = wsock_codec_handshake(c, *pos++);
+            if(rc < 0)
+                goto error;
+            if(rc > 0) {
+                c->state = WSOCK_CODEC_HEADER;
+                ev->type = WSOCK_OPEN;
+                break;
+            }
+            continue;
+        }
+        if(c->state == WSOCK_CODEC_HEADER) {
+            size_t sz = c->hdrneed - c->hdrlen;
+            if(sz > (size_t)(end - pos))
+                sz = end - pos;
+            memcpy(c->hdr + c->hdrlen, pos, sz);
+            c->hdrlen += sz;
+            pos += sz;
+            if(c->hdrlen != c->hdrneed)
+                continue;
+            if(c->hdrlen == 2) {
+                if(wsock_codec_hdrsize(c) != 0)
+                    goto error;
+                if(c->hdrneed != 2)
+                    continue;
+            }
+            if(wsock_codec_hdr(c) != 0)
+                goto error;
+            if(c->remaining > 0)
+                continue;
+            /* Frames with no payload are reported straight away. */
+            if(c->state == WSOCK_CODEC_CONTROL) {
+                if(wsock_codec_control(c, ev) != 0)
+                    goto error;
+                break;
+            }
+            ev->type = WSOCK_DATA;
+            ev->last = c->hdr[0] & 0x80 ? 1 : 0;
+            ev->rsv = c->hdr[0] & 0x70;
+            ev->data = pos;
+            c->hdrlen = 0;
+            c->hdrneed = 2;
+            c->state = WSOCK_CODEC_HEADER;
+            break;
+        }
+        if(c->state == WSOCK_CODEC_PAYLOAD) {
+            /* Message payload is unmasked in place. */
+            size_t sz = end - pos;
+            if(sz > c->remaining)
+                sz = c->remaining;
+            if(!(c->flags & WSOCK_CODEC_CLIENT))
+                wsock_codec_xor(pos, sz, c->rmask, &c->rmaskoff);
+            c->remaining -= sz;
+            ev->type = WSOCK_DATA;
+            ev->rsv = c->hdr[0] & 0x70;
+            ev->data = pos;
+            ev->len = sz;
+            pos += sz;
+            if(c->remaining == 0) {
+                ev->last = c->hdr[0] & 0x80 ? 1 : 0;
+                c->hdrlen = 0;
+                c->hdrneed = 2;
+                c->state = WSOCK_CODEC_HEADER;
+            }
+            break;
+        }
+        assert(c->state == WSOCK_CODEC_CONTROL);
+        size_t sz = c->remaining - c->ctllen;
+        if(sz > (size_t)(end - pos))
+            sz = end - pos;
+        memcpy(c->ctl + c->ctllen, pos, sz);
+        c->ctllen += sz;
+        pos += sz;
+        if(c->ctllen != c->remaining)
+            continue;
+        if(wsock_codec_control(c, ev) != 0)
+            goto error;
+        break;
+    }
+    errno = 0;
+    return pos - (uint8_t*)buf;
+error:
+    c->state = WSOCK_CODEC_BROKEN;
+    return pos - (uint8_t*)buf;
+}
+
+size_t wsockcodecwant(wsockcodec c) {
+    switch(c->state) {
+    case WSOCK_CODEC_HANDSHAKE:
+        return 1;
+    case WSOCK_CODEC_HEADER:
+        return c->hdrneed - c->hdrlen;
+    case WSOCK_CODEC_PAYLOAD:
+        return c->remaining > SIZE_MAX ? SIZE_MAX : (size_t)c->remaining;
+    case WSOCK_CODEC_CONTROL:
+        return c->remaining - c->ctllen;
+    default:
+        return 0;
+    }
+}
+
+size_t wsock_codec_smallsize(struct wsockcodec *c, const uint8_t *hdr) {
+    if(c->state != WSOCK_CODEC_HEADER || c->hdrlen != 0)
+        return 0;
+    if(hdr[0] != 0x81 && hdr[0] != 0x82)
+        return 0;
+    size_t sz = hdr[1] & 0x7f;
+    if(sz > 125)
+        return 0;
+    if(c->flags & WSOCK_CODEC_CLIENT)
+        return hdr[1] & 0x80 ? 0 : 2 + sz;
+    return hdr[1] & 0x80 ? 6 + sz : 0;
+}
+
+size_t wsock_codec_frame(struct wsockcodec *c, const uint8_t *buf,
+      size_t len, void *msg, size_t msglen, size_t *msgsz) {
+    if(len < 2 || c->state != WSOCK_CODEC_HEADER || c->hdrlen != 0)
+        return 0;
+    if(buf[0] != 0x81 && buf[0] != 0x82)
+        return 0;
+    if(!(c->flags & WSOCK_CODEC_CLIENT) != !!(buf[1] & 0x80))
+        return 0;
+    size_t hsz = 2;
+    uint64_t psz = buf[1] & 0x7f;
+    if(psz == 126) {
+        if(len < 4)
+            return 0;
+        psz = wsock_gets(buf + 2);
+        hsz = 4;
+    }
+    else if(psz == 127) {
+        if(len < 10)
+            return 0;
+        psz = wsock_getll(buf + 2);
+        hsz = 10;
+    }
+    if(buf[1] & 0x80)
+        hsz += 4;
+    if(len < hsz || len - hsz < psz)
+        return 0;
+    size_t tocopy = psz < msglen ? psz : msglen;
+    if(c->flags & WSOCK_CODEC_CLIENT) {
+        memcpy(msg, buf + hsz, tocopy);
+    }
+    else {
+        const uint8_t *mask = buf + hsz - 4;
+        const uint8_t *payload = buf + hsz;
+        size_t i;
+        for(i = 0; i != tocopy; ++i)
+            ((uint8_t*)msg)[i] = payload[i] ^ mask[i % 4];
+    }
+    *msgsz = psz;
+    return hsz + psz;
+}
+
+size_t wsockcodecpending(wsockcodec c, const void **buf) {
+    *buf = c->out + c->outpos;
+    return c->outlen - c->outpos;
+}
+
+void wsockcodecsent(wsockcodec c, size_t len) {
+    assert(len <= c->outlen - c->outpos);
+    c->outpos += len;
+    if(c->outpos == c->outlen) {
+        c->outpos = 0;
+        c->outlen = 0;
+    }
+}
+
+size_t wsockcodecheader(wsockcodec c, size_t len, void *buf) {
+    uint8_t *hdr = (uint8_t*)buf;
+    size_t sz;
+    hdr[0] = 0x82;
+    if(len > 0xffff) {
+        hdr[1] = 127;
+        wsock_putll(hdr + 2, len);
+        sz = 10;
+    }
+    else if(len > 125) {
+        hdr[1] = 126;
+        wsock_puts(hdr + 2, len);
+        sz = 4;
+    }
+    else {
+        hdr[1] = (uint8_t)len;
+        sz = 2;
+    }
+    if(c->flags & WSOCK_CODEC_CLIENT) {
+        uint32_t mask = wsock_random();
+        memcpy(c->smask, &mask, 4);
+        c->smaskoff = 0;
+        hdr[1] |= 0x80;
+        memcpy(hdr + sz, c->smask, 4);
+        sz += 4;
+    }
+    return sz;
+}
+
+void wsockcodecmask(wsockcodec c, void *buf, size_t len) {
+    if(c->flags & WSOCK_CODEC_CLIENT)
+        wsock_codec_xor((uint8_t*)buf, len, c->smask, &c->smaskoff);
+}
+
+size_t wsockcodecencode(wsockcodec c, const void *msg, size_t len,
+      void *buf, size_t bufsz) {
+    uint8_t hdr[WSOCK_MAXHEADER];
+    size_t sz = wsockcodecheader(c, len, hdr);
+    if(bufsz < sz || bufsz - sz < len) {errno = ENOBUFS; return 0;}
+    memcpy(buf, hdr, sz);
+    memcpy((uint8_t*)buf + sz, msg, len);
+    wsockcodecmask(c, (uint8_t*)buf + sz, len);
+    errno = 0;
+    return sz + len;
+}
+
+void wsockcodecping(wsockcodec c) {
+    if(wsock_codec_ctlframe(c, 0x09, NULL, 0) != 0)
+        return;
+    errno = 0;
+}
+
+void wsockcodecpong(wsockcodec c) {
+    if(wsock_codec_ctlframe(c, 0x0a, NULL, 0) != 0)
+        return;
+    errno = 0;
+}
+
+int wsock_codec_close(struct wsockcodec *c, int code) {
+    if(c->flags & WSOCK_CODEC_DONE)
+        return 0;
+    uint8_t status[2] = {(uint8_t)(code >> 8), (uint8_t)code};
+    if(wsock_codec_ctlframe(c, 0x08, status, 2) != 0)
+        return -1;
+    c->flags |= WSOCK_CODEC_DONE;
+    return 0;
+}
+
+int wsock_codec_ctl(struct wsockcodec *c, int opcode, const uint8_t *payload,
+      size_t len) {
+    if(c->flags & WSOCK_CODEC_DONE)
+        return 0;
+    if(wsock_codec_ctlframe(c, (uint8_t)opcode, payload, len) != 0)
+        return -1;
+    if(opcode == 0x08)
+        c->flags |= WSOCK_CODEC_DONE;
+    return 0;
+}
+
+void wsock_codec_relay(struct wsockcodec *from, struct wsockcodec *to,
+      uint8_t *buf, size_t len) {
+    assert(from->state == WSOCK_CODEC_PAYLOAD && len <= from->remaining);
+    /* Frames received by the server and sent by the client are masked. */
+    int unmask = !(from->flags & WSOCK_CODEC_CLIENT);
+    int mask = to->flags & WSOCK_CODEC_CLIENT;
+    if(unmask || mask) {
+        /* Both keys combined, aligned with the start of the buffer. */
+        uint8_t key[8];
+        size_t i;
+        for(i = 0; i != 4; ++i) {
+            key[i] = (unmask ? from->rmask[(from->rmaskoff + i) % 4] : 0) ^
+                (mask ? to->smask[(to->smaskoff + i) % 4] : 0);
+            key[i + 4] = key[i];
+        }
+        uint64_t k;
+        memcpy(&k, key, 8);
+        for(i = 0; i + 8 <= len; i += 8) {
+            uint64_t w;
+            memcpy(&w, buf + i, 8);
+            w ^= k;
+            memcpy(buf + i, &w, 8);
+        }
+        for(; i != len; ++i)
+            buf[i] ^= key[i % 4];
+        from->rmaskoff = (from->rmaskoff + len) % 4;
+        to->smaskoff = (to->smaskoff + len) % 4;
+    }
+    from->remaining -= len;
+    if(from->remaining == 0) {
+        from->hdrlen = 0;
+        from->hdrneed = 2;
+        from->state = WSOCK_CODEC_HEADER;
+    }
+}
+
+int wsock_codec_skip(struct wsockcodec *c, size_t len) {
+    assert(c->state == WSOCK_CODEC_PAYLOAD && len <= c->remaining &&
+        c->flags & WSOCK_CODEC_CLIENT);
+    c->remaining -= len;
+    if(c->remaining > 0)
+        return 0;
+    c->hdrlen = 0;
+    c->hdrneed = 2;
+    c->state = WSOCK_CODEC_HEADER;
+    return c->hdr[0] & 0x80 ? 1 : 0;
+}
+
+void wsockcodecdone(wsockcodec c) {
+    if(!(c->flags & WSOCK_CODEC_DONE)) {
+        if(wsock_codec_ctlframe(c, 0x08, NULL, 0) != 0)
+            return;
+        c->flags |= WSOCK_CODEC_DONE;
+    }
+    errno = 0;
+}
+
+const char *wsockcodecurl(wsockcodec c) {
+    return wsock_str_get(&c->url);
+}
+
+const char *wsockcodecsubprotocol(wsockcodec c) {
+    return wsock_str_get(&c->subprotocol);
+}
+
+const char *wsockcodecextension(wsockcodec c) {
+    return wsock_str_get(&c->extension);
+}
+
+const char *wsockcodecfield(wsockcodec c, const char *name) {
+    return wsock_codec_field(c, name);
+}
+
+void wsockcodecclose(wsockcodec c) {
+    wsock_codec_term(c);
+    free(c);
+}
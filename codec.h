@@ -0,0 +1,155 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#ifndef WSOCK_CODEC_INCLUDED
+#define WSOCK_CODEC_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "str.h"
+#include "wsockcodec.h"
+
+/* Flags passed to wsock_codec_init(). */
+#define WSOCK_CODEC_CLIENT 1
+/* Skip the opening handshake. */
+#define WSOCK_CODEC_OPEN 2
+
+/* What the codec expects to get next. */
+#define WSOCK_CODEC_HANDSHAKE 0
+#define WSOCK_CODEC_HEADER 1
+#define WSOCK_CODEC_PAYLOAD 2
+#define WSOCK_CODEC_CONTROL 3
+#define WSOCK_CODEC_CLOSED 4
+#define WSOCK_CODEC_BROKEN 5
+
+/* The structure is exposed so that it can be embedded into struct wsock. */
+struct wsockcodec {
+    int flags;
+    int state;
+    /* Opening handshake. 'hs' is a set of flags tracking which parts of
+       the request or the response were seen so far. 'key' is the accept key
+       sent by the server or expected by the client. */
+    int hs;
+    char key[32];
+    /* Header fields of the opening handshake, stored as "name\0value\0"
+       pairs. 'index' holds the offsets of the names. The line being parsed
+       is collected at the end of the arena, 'linelen' bytes long. */
+    char *fields;
+    size_t fieldslen;
+    size_t fieldscap;
+    size_t linelen;
+    uint32_t *index;
+    size_t nfields;
+    size_t indexcap;
+    /* Subprotocols requested by the client or available on the server. */
+    struct wsock_str protocols;
+    struct wsock_str url;
+    struct wsock_str subprotocol;
+    /* Extensions offered by the client or supported by the server and the
+       one agreed on in the opening handshake. */
+    struct wsock_str extensions;
+    struct wsock_str extension;
+    /* Frame being received. */
+    uint8_t hdr[WSOCK_MAXHEADER];
+    size_t hdrlen;
+    size_t hdrneed;
+    uint64_t remaining;
+    uint8_t rmask[4];
+    size_t rmaskoff;
+    size_t ctllen;
+    uint8_t ctl[125];
+    /* Message being sent. */
+    uint8_t smask[4];
+    size_t smaskoff;
+    /* Queued output: handshake and control frames. */
+    uint8_t *out;
+    size_t outpos;
+    size_t outlen;
+    size_t outcap;
+};
+
+int wsock_codec_init(struct wsockcodec *c, int flags, const char *protocols,
+    const char *url);
+void wsock_codec_term(struct wsockcodec *c);
+/* Sets the comma-separated list of extensions to offer or to support. Has
+   to be done before the opening handshake starts. Only a single extension
+   is agreed on; it is the only thing allowed to set RSV1 on data frames. */
+int wsock_codec_extensions(struct wsockcodec *c, const char *extensions);
+
+/* Returns the value of the first header field of the opening handshake with
+   the given name, or NULL if there's none. The name is case-insensitive. */
+const char *wsock_codec_field(struct wsockcodec *c, const char *name);
+/* Returns the name and the value of the header field at the given position,
+   or NULL if there are fewer fields. */
+const char *wsock_codec_fieldat(struct wsockcodec *c, size_t idx,
+    const char **name);
+/* Deallocates the stored header fields. */
+void wsock_codec_dropfields(struct wsockcodec *c);
+
+/* Queues the close frame with the given status code, unless it was already
+   sent. */
+int wsock_codec_close(struct wsockcodec *c, int code);
+
+/* Queues a control frame with the given payload, unless the close frame
+   was already sent. Queuing the close frame marks it as sent. */
+int wsock_codec_ctl(struct wsockcodec *c, int opcode, const uint8_t *payload,
+    size_t len);
+
+/* Relaying. Takes the next 'len' bytes of the payload of the data frame
+   received by 'from' and turns them into the payload of the frame being sent
+   by 'to'. The mask of the former is removed and the mask of the latter is
+   applied in a single pass over the data. If neither of them is masked, the
+   data is left untouched. */
+void wsock_codec_relay(struct wsockcodec *from, struct wsockcodec *to,
+    uint8_t *buf, size_t len);
+
+/* Accounts for the next 'len' bytes of the payload of an unmasked data frame
+   that were moved past the codec, e.g. spliced to a file. Returns 1 if that
+   completes the message, 0 otherwise. */
+int wsock_codec_skip(struct wsockcodec *c, size_t len);
+
+/* Fast path for small messages. If the two header bytes start a final data
+   frame with a 7-bit length and the codec is between frames, returns the
+   size of the whole frame. Returns 0 otherwise. */
+size_t wsock_codec_smallsize(struct wsockcodec *c, const uint8_t *hdr);
+/* If the codec is between frames and the buffer starts with a complete final
+   data frame, decodes it, unmasks the payload into 'msg' and returns the size
+   of the frame. The size of the payload is stored in 'msgsz'. What doesn't
+   fit into 'msg' is dropped. Returns 0 and does nothing otherwise. */
+size_t wsock_codec_frame(struct wsockcodec *c, const uint8_t *buf,
+    size_t len, void *msg, size_t msglen, size_t *msgsz);
+
+/* Serializes the state of an open connection, including a partially
+   received frame, so that it can be restored in another process. Queued
+   output has to be sent first, otherwise it fails with EBUSY. If 'buf' is
+   NULL only the size is computed. Returns the size of the state, or 0 with
+   errno set. */
+size_t wsock_codec_save(struct wsockcodec *c, uint8_t *buf);
+/* Restores the state into a codec initialised with WSOCK_CODEC_OPEN.
+   Returns the number of bytes consumed, or 0 with errno set to EPROTO if
+   the state is malformed or to ENOMEM. */
+size_t wsock_codec_load(struct wsockcodec *c, const uint8_t *buf,
+    size_t len);
+
+#endif
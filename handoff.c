@@ -0,0 +1,201 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <libmill.h>
+
+#include "handoff.h"
+
+/* Byte carrying the file descriptor. Sending at least one byte of regular
+   data is required for the ancillary data to get through. */
+#define WSOCK_HANDOFF_FD 'F'
+#define WSOCK_HANDOFF_ACK 'A'
+
+int wsock_handoff_init(int sock) {
+    int opt = fcntl(sock, F_GETFL, 0);
+    if(opt == -1 || fcntl(sock, F_SETFL, opt | O_NONBLOCK) == -1)
+        return -1;
+    errno = 0;
+    return 0;
+}
+
+int wsock_handoff_send(int sock, int fd, int64_t deadline) {
+    char b = WSOCK_HANDOFF_FD;
+    struct iovec iov = {&b, 1};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = ctl.buf;
+    hdr.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    while(1) {
+        ssize_t sz = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+        if(sz == 1)
+            break;
+        if(sz < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(!fdwait(sock, FDW_OUT, deadline)) {errno = ETIMEDOUT; return -1;}
+    }
+    errno = 0;
+    return 0;
+}
+
+int wsock_handoff_recv(int sock, int64_t deadline) {
+    char b;
+    struct iovec iov = {&b, 1};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr hdr;
+    while(1) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = ctl.buf;
+        hdr.msg_controllen = sizeof(ctl.buf);
+        ssize_t sz = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+        if(sz == 0) {errno = ECONNRESET; return -1;}
+        if(sz > 0)
+            break;
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(!fdwait(sock, FDW_IN, deadline)) {errno = ETIMEDOUT; return -1;}
+    }
+    /* Exactly one file descriptor is expected. Any that arrived are ours
+       to close if the message is malformed. Those that didn't fit into
+       the buffer were discarded by the kernel. */
+    int fd = -1;
+    int bad = b != WSOCK_HANDOFF_FD || hdr.msg_flags & MSG_CTRUNC;
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            bad = 1;
+            continue;
+        }
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t i;
+        for(i = 0; i != n; ++i) {
+            int f;
+            memcpy(&f, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if(fd < 0) {
+                fd = f;
+            }
+            else {
+                close(f);
+                bad = 1;
+            }
+        }
+    }
+    if(bad || fd < 0) {
+        if(fd >= 0)
+            close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    errno = 0;
+    return fd;
+}
+
+int wsock_handoff_ack(int sock, int64_t deadline) {
+    char b = WSOCK_HANDOFF_ACK;
+    while(1) {
+        ssize_t sz = send(sock, &b, 1, MSG_NOSIGNAL);
+        if(sz == 1)
+            break;
+        if(sz < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(!fdwait(sock, FDW_OUT, deadline)) {errno = ETIMEDOUT; return -1;}
+    }
+    errno = 0;
+    return 0;
+}
+
+int wsock_handoff_wait(int sock, int64_t deadline) {
+    char b;
+    while(1) {
+        ssize_t sz = recv(sock, &b, 1, 0);
+        if(sz == 0) {errno = ECONNRESET; return -1;}
+        if(sz == 1)
+            break;
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(!fdwait(sock, FDW_IN, deadline)) {errno = ETIMEDOUT; return -1;}
+    }
+    if(b != WSOCK_HANDOFF_ACK) {errno = EPROTO; return -1;}
+    errno = 0;
+    return 0;
+}
+
+int wsock_handoff_write(int sock, const void *buf, size_t len,
+      int64_t deadline) {
+    size_t sent = 0;
+    while(sent != len) {
+        ssize_t sz = send(sock, (const uint8_t*)buf + sent, len - sent,
+            MSG_NOSIGNAL);
+        if(sz < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if(!fdwait(sock, FDW_OUT, deadline)) {
+                errno = ETIMEDOUT; return -1;}
+            continue;
+        }
+        sent += sz;
+    }
+    errno = 0;
+    return 0;
+}
+
+int wsock_handoff_read(int sock, void *buf, size_t len, int64_t deadline) {
+    size_t received = 0;
+    while(received != len) {
+        ssize_t sz = recv(sock, (uint8_t*)buf + received, len - received, 0);
+        if(sz == 0) {errno = ECONNRESET; return -1;}
+        if(sz < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if(!fdwait(sock, FDW_IN, deadline)) {
+                errno = ETIMEDOUT; return -1;}
+            continue;
+        }
+        received += sz;
+    }
+    errno = 0;
+    return 0;
+}
+
@@ -0,0 +1,54 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#ifndef WSOCK_HANDOFF_INCLUDED
+#define WSOCK_HANDOFF_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  Passing a socket to another process over a connected Unix domain socket
+    'sock'. Both ends are non-blocking. All the functions return -1 with
+    errno set on error. */
+
+/*  Switches a socket supplied by the user to non-blocking mode. */
+int wsock_handoff_init(int sock);
+
+/*  Sends 'fd' as SCM_RIGHTS ancillary data. */
+int wsock_handoff_send(int sock, int fd, int64_t deadline);
+
+/*  Receives a file descriptor sent by wsock_handoff_send(). */
+int wsock_handoff_recv(int sock, int64_t deadline);
+
+/*  The receiver confirms it has taken over the socket. The sender keeps
+    serving until it gets the confirmation. */
+int wsock_handoff_ack(int sock, int64_t deadline);
+int wsock_handoff_wait(int sock, int64_t deadline);
+
+/*  Transfer exactly 'len' bytes of additional data. */
+int wsock_handoff_write(int sock, const void *buf, size_t len,
+    int64_t deadline);
+int wsock_handoff_read(int sock, void *buf, size_t len, int64_t deadline);
+
+#endif
+
@@ -0,0 +1,551 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "str.h"
+#include "wire.h"
+#include "wsock.h"
+
+/* Every WebSocket message carries a single fragment of a channel message or
+   a control frame: type (1 byte), channel ID (4 bytes) and, in case of
+   credit, its increment (4 bytes). */
+#define WSOCK_MUX_OPEN 0
+#define WSOCK_MUX_DATA 1
+#define WSOCK_MUX_LAST 2
+#define WSOCK_MUX_CREDIT 3
+#define WSOCK_MUX_CLOSE 4
+#define WSOCK_MUX_HDRSZ 5
+
+/* Largest fragment. Channels with data to send take turns, one fragment
+   each, so a large message doesn't hold up the others. */
+#define WSOCK_MUX_FRAGMENT 16384
+/* How many bytes a channel can receive before the user consumes them. */
+#define WSOCK_MUX_WINDOW 262144
+/* Maximum number of channels open at the same time. Channels opened by
+   the peer above the limit are closed straight away. */
+#define WSOCK_MUX_MAXCHANS 1024
+/* How often the reader checks whether the multiplexer was closed. */
+#define WSOCK_MUX_SLICE 100
+
+/* IDs are local to each side. The bit is set on channels opened by the peer
+   and flipped on the way out, so both sides can open channels without
+   coordinating. */
+#define WSOCK_MUX_PEER 0x80000000u
+
+struct wsock_muxchunk {
+    struct wsock_muxchunk *next;
+    size_t len;
+    int last;
+    uint8_t data[];
+};
+
+struct wsock_muxctl {
+    struct wsock_muxctl *next;
+    size_t len;
+    uint8_t frame[WSOCK_MUX_HDRSZ + 4];
+};
+
+struct wsockchan {
+    struct wsockmux *mux;
+    uint32_t id;
+    /* All the open channels, and those waiting for wsockmuxaccept(). */
+    struct wsockchan *next;
+    struct wsockchan *anext;
+    int peerclosed;
+    /* Fragments received but not consumed yet. 'rbuffered' is their total
+       size, which is limited by the window. 'rconsumed' is the number of
+       bytes consumed since the peer was last given credit. 'rpos' is
+       the size of the message being received so far. */
+    struct wsock_muxchunk *rfirst;
+    struct wsock_muxchunk *rlast;
+    size_t rbuffered;
+    size_t rconsumed;
+    size_t rpos;
+    chan rwake;
+    /* Message being sent. 'sactive' is set until its last fragment has
+       been passed to the writer. 'sending' is set while the user waits for
+       it in wsockchansend(); the writer touches the message only then.
+       'queued' is set if the channel is waiting for its turn. 'credit' is
+       the number of bytes the peer is willing to accept. */
+    const uint8_t *sbuf;
+    size_t slen;
+    size_t spos;
+    int sactive;
+    int sending;
+    int queued;
+    struct wsockchan *qnext;
+    uint64_t credit;
+    chan swake;
+};
+
+struct wsockmux {
+    wsock s;
+    int err;
+    int closed;
+    uint32_t lastid;
+    int nchans;
+    struct wsockchan *chans;
+    struct wsockchan *afirst;
+    struct wsockchan *alast;
+    chan awake;
+    /* Channels waiting for their turn to send a fragment, and control
+       frames, which are sent before any fragment. */
+    struct wsockchan *qfirst;
+    struct wsockchan *qlast;
+    struct wsock_muxctl *cfirst;
+    struct wsock_muxctl *clast;
+    chan wake;
+    chan stopped;
+    uint8_t sbuf[WSOCK_MUX_HDRSZ + WSOCK_MUX_FRAGMENT];
+    uint8_t rbuf[WSOCK_MUX_HDRSZ + WSOCK_MUX_FRAGMENT];
+};
+
+/* Wakes up a coroutine unless it was already woken up. */
+static void wsock_mux_signal(chan ch) {
+    choose {
+    out(ch, int, 0):
+    otherwise:
+    end
+    }
+}
+
+static int wsock_mux_wait(chan ch, int64_t deadline) {
+    int rc = 0;
+    choose {
+    in(ch, int, val):
+        (void)val;
+    deadline(deadline):
+        rc = -1;
+    end
+    }
+    return rc;
+}
+
+/* Gives the channel its turn to send. */
+static void wsock_mux_schedule(struct wsockmux *m, struct wsockchan *ch) {
+    ch->qnext = NULL;
+    if(m->qlast)
+        m->qlast->qnext = ch;
+    else
+        m->qfirst = ch;
+    m->qlast = ch;
+    ch->queued = 1;
+    wsock_mux_signal(m->wake);
+}
+
+static void wsock_mux_unschedule(struct wsockmux *m, struct wsockchan *ch) {
+    struct wsockchan **p = &m->qfirst;
+    struct wsockchan *prev = NULL;
+    while(*p != ch) {
+        prev = *p;
+        p = &(*p)->qnext;
+    }
+    *p = ch->qnext;
+    if(m->qlast == ch)
+        m->qlast = prev;
+    ch->queued = 0;
+}
+
+static int wsock_mux_ctl(struct wsockmux *m, int type, uint32_t id,
+      int hasval, uint32_t val) {
+    struct wsock_muxctl *ctl = malloc(sizeof(struct wsock_muxctl));
+    if(!ctl) {errno = ENOMEM; return -1;}
+    ctl->next = NULL;
+    ctl->frame[0] = (uint8_t)type;
+    wsock_putl(ctl->frame + 1, id ^ WSOCK_MUX_PEER);
+    ctl->len = WSOCK_MUX_HDRSZ;
+    if(hasval) {
+        wsock_putl(ctl->frame + WSOCK_MUX_HDRSZ, val);
+        ctl->len += 4;
+    }
+    if(m->clast)
+        m->clast->next = ctl;
+    else
+        m->cfirst = ctl;
+    m->clast = ctl;
+    wsock_mux_signal(m->wake);
+    return 0;
+}
+
+static struct wsockchan *wsock_mux_find(struct wsockmux *m, uint32_t id) {
+    struct wsockchan *ch;
+    for(ch = m->chans; ch; ch = ch->next) {
+        if(ch->id == id)
+            return ch;
+    }
+    return NULL;
+}
+
+static struct wsockchan *wsock_mux_chan(struct wsockmux *m, uint32_t id) {
+    struct wsockchan *ch = malloc(sizeof(struct wsockchan));
+    if(!ch) {errno = ENOMEM; return NULL;}
+    ch->mux = m;
+    ch->id = id;
+    ch->anext = NULL;
+    ch->peerclosed = 0;
+    ch->rfirst = NULL;
+    ch->rlast = NULL;
+    ch->rbuffered = 0;
+    ch->rconsumed = 0;
+    ch->rpos = 0;
+    ch->rwake = chmake(int, 1);
+    ch->sbuf = NULL;
+    ch->slen = 0;
+    ch->spos = 0;
+    ch->sactive = 0;
+    ch->sending = 0;
+    ch->queued = 0;
+    ch->credit = WSOCK_MUX_WINDOW;
+    ch->swake = chmake(int, 1);
+    ch->next = m->chans;
+    m->chans = ch;
+    ++m->nchans;
+    return ch;
+}
+
+static void wsock_mux_free(struct wsockchan *ch) {
+    while(ch->rfirst) {
+        struct wsock_muxchunk *c = ch->rfirst;
+        ch->rfirst = c->next;
+        free(c);
+    }
+    chclose(ch->rwake);
+    chclose(ch->swake);
+    free(ch);
+}
+
+/* Connection failed. Everybody waiting gets the error. */
+static void wsock_mux_fail(struct wsockmux *m, int err) {
+    if(!m->err)
+        m->err = err;
+    struct wsockchan *ch;
+    for(ch = m->chans; ch; ch = ch->next) {
+        wsock_mux_signal(ch->rwake);
+        wsock_mux_signal(ch->swake);
+    }
+    wsock_mux_signal(m->awake);
+    wsock_mux_signal(m->wake);
+}
+
+/* Dispatches a single frame received from the peer. */
+static int wsock_mux_dispatch(struct wsockmux *m, size_t sz) {
+    if(sz < WSOCK_MUX_HDRSZ || sz > sizeof(m->rbuf)) {
+        errno = EPROTO; return -1;}
+    int type = m->rbuf[0];
+    uint32_t id = wsock_getl(m->rbuf + 1);
+    struct wsockchan *ch = wsock_mux_find(m, id);
+    switch(type) {
+    case WSOCK_MUX_OPEN:
+        if(ch || !(id & WSOCK_MUX_PEER)) {errno = EPROTO; return -1;}
+        if(m->nchans >= WSOCK_MUX_MAXCHANS)
+            return wsock_mux_ctl(m, WSOCK_MUX_CLOSE, id, 0, 0);
+        ch = wsock_mux_chan(m, id);
+        if(!ch)
+            return -1;
+        if(m->alast)
+            m->alast->anext = ch;
+        else
+            m->afirst = ch;
+        m->alast = ch;
+        wsock_mux_signal(m->awake);
+        return 0;
+    case WSOCK_MUX_DATA:
+    case WSOCK_MUX_LAST:
+        /* The channel may have been closed locally in the meantime. */
+        if(!ch)
+            return 0;
+        sz -= WSOCK_MUX_HDRSZ;
+        if(ch->rbuffered + sz > WSOCK_MUX_WINDOW) {errno = EPROTO; return -1;}
+        struct wsock_muxchunk *c = malloc(sizeof(struct wsock_muxchunk) + sz);
+        if(!c) {errno = ENOMEM; return -1;}
+        c->next = NULL;
+        c->len = sz;
+        c->last = type == WSOCK_MUX_LAST;
+        memcpy(c->data, m->rbuf + WSOCK_MUX_HDRSZ, sz);
+        if(ch->rlast)
+            ch->rlast->next = c;
+        else
+            ch->rfirst = c;
+        ch->rlast = c;
+        ch->rbuffered += sz;
+        wsock_mux_signal(ch->rwake);
+        return 0;
+    case WSOCK_MUX_CREDIT:
+        if(sz != WSOCK_MUX_HDRSZ + 4) {errno = EPROTO; return -1;}
+        if(!ch)
+            return 0;
+        ch->credit += wsock_getl(m->rbuf + WSOCK_MUX_HDRSZ);
+        if(ch->sending && !ch->queued)
+            wsock_mux_schedule(m, ch);
+        return 0;
+    case WSOCK_MUX_CLOSE:
+        if(!ch)
+            return 0;
+        ch->peerclosed = 1;
+        wsock_mux_signal(ch->rwake);
+        wsock_mux_signal(ch->swake);
+        return 0;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+coroutine static void wsock_mux_reader(struct wsockmux *m) {
+    while(!m->closed) {
+        size_t sz = wsockrecv(m->s, m->rbuf, sizeof(m->rbuf),
+            now() + WSOCK_MUX_SLICE);
+        /* The next call continues where this one stopped. */
+        if(errno == ETIMEDOUT || errno == EAGAIN)
+            continue;
+        if(errno != 0 || wsock_mux_dispatch(m, sz) != 0) {
+            wsock_mux_fail(m, errno);
+            break;
+        }
+    }
+    chs(m->stopped, int, 0);
+}
+
+/* The only coroutine that sends to the underlying connection. */
+coroutine static void wsock_mux_writer(struct wsockmux *m) {
+    while(!m->err) {
+        if(m->cfirst) {
+            struct wsock_muxctl *ctl = m->cfirst;
+            m->cfirst = ctl->next;
+            if(!m->cfirst)
+                m->clast = NULL;
+            wsocksend(m->s, ctl->frame, ctl->len, -1);
+            free(ctl);
+            if(errno != 0) {wsock_mux_fail(m, errno); break;}
+            continue;
+        }
+        struct wsockchan *ch = m->qfirst;
+        if(!ch) {
+            if(m->closed)
+                break;
+            (void)chr(m->wake, int);
+            continue;
+        }
+        wsock_mux_unschedule(m, ch);
+        size_t sz = ch->slen - ch->spos;
+        if(sz > WSOCK_MUX_FRAGMENT)
+            sz = WSOCK_MUX_FRAGMENT;
+        if(sz > ch->credit)
+            sz = ch->credit;
+        /* Out of credit. The channel gets back in line once the peer
+           gives it more. */
+        if(!sz && ch->spos != ch->slen)
+            continue;
+        int last = ch->spos + sz == ch->slen;
+        m->sbuf[0] = last ? WSOCK_MUX_LAST : WSOCK_MUX_DATA;
+        wsock_putl(m->sbuf + 1, ch->id ^ WSOCK_MUX_PEER);
+        memcpy(m->sbuf + WSOCK_MUX_HDRSZ, ch->sbuf + ch->spos, sz);
+        ch->spos += sz;
+        ch->credit -= sz;
+        /* The channel is not touched after sending, the user may close it
+           as soon as it's woken up. */
+        if(last) {
+            ch->sactive = 0;
+            ch->spos = 0;
+            wsock_mux_signal(ch->swake);
+        }
+        else {
+            wsock_mux_schedule(m, ch);
+        }
+        wsocksend(m->s, m->sbuf, WSOCK_MUX_HDRSZ + sz, -1);
+        if(errno != 0) {wsock_mux_fail(m, errno); break;}
+    }
+    chs(m->stopped, int, 0);
+}
+
+wsockmux wsockmuxmake(wsock s) {
+    if(!wsock_str_eq(wsocksubprotocol(s), WSOCK_MUX)) {
+        errno = EPROTO; return NULL;}
+    struct wsockmux *m = malloc(sizeof(struct wsockmux));
+    if(!m) {errno = ENOMEM; return NULL;}
+    m->s = s;
+    m->err = 0;
+    m->closed = 0;
+    m->lastid = 0;
+    m->nchans = 0;
+    m->chans = NULL;
+    m->afirst = NULL;
+    m->alast = NULL;
+    m->awake = chmake(int, 1);
+    m->qfirst = NULL;
+    m->qlast = NULL;
+    m->cfirst = NULL;
+    m->clast = NULL;
+    m->wake = chmake(int, 1);
+    m->stopped = chmake(int, 2);
+    go(wsock_mux_reader(m));
+    go(wsock_mux_writer(m));
+    errno = 0;
+    return m;
+}
+
+wsockchan wsockmuxopen(wsockmux m) {
+    if(m->err) {errno = m->err; return NULL;}
+    if(m->nchans >= WSOCK_MUX_MAXCHANS ||
+          m->lastid + 1 >= WSOCK_MUX_PEER) {
+        errno = EMFILE; return NULL;}
+    struct wsockchan *ch = wsock_mux_chan(m, m->lastid + 1);
+    if(!ch)
+        return NULL;
+    ++m->lastid;
+    /* Data can follow straight away, there's no need to wait for the peer
+       to accept the channel. */
+    if(wsock_mux_ctl(m, WSOCK_MUX_OPEN, ch->id, 0, 0) != 0) {
+        int err = errno;
+        wsockchanclose(ch);
+        errno = err;
+        return NULL;
+    }
+    errno = 0;
+    return ch;
+}
+
+wsockchan wsockmuxaccept(wsockmux m, int64_t deadline) {
+    while(!m->afirst) {
+        if(m->err) {errno = m->err; return NULL;}
+        if(wsock_mux_wait(m->awake, deadline) != 0) {
+            errno = ETIMEDOUT; return NULL;}
+    }
+    struct wsockchan *ch = m->afirst;
+    m->afirst = ch->anext;
+    if(!m->afirst)
+        m->alast = NULL;
+    ch->anext = NULL;
+    errno = 0;
+    return ch;
+}
+
+size_t wsockchansend(wsockchan ch, const void *msg, size_t len,
+      int64_t deadline) {
+    struct wsockmux *m = ch->mux;
+    if(m->err) {errno = m->err; return 0;}
+    if(ch->peerclosed) {errno = EPIPE; return 0;}
+    /* Message interrupted by a deadline has to be finished first. */
+    if(ch->sactive && len != ch->slen) {errno = EINVAL; return 0;}
+    ch->sbuf = (const uint8_t*)msg;
+    ch->slen = len;
+    ch->sactive = 1;
+    ch->sending = 1;
+    if(!ch->queued)
+        wsock_mux_schedule(m, ch);
+    int err = 0;
+    while(ch->sactive) {
+        if(m->err) {err = m->err; break;}
+        if(ch->peerclosed) {err = EPIPE; break;}
+        if(wsock_mux_wait(ch->swake, deadline) != 0) {err = ETIMEDOUT; break;}
+    }
+    ch->sending = 0;
+    if(err) {
+        if(ch->queued)
+            wsock_mux_unschedule(m, ch);
+        errno = err;
+        return 0;
+    }
+    errno = 0;
+    return len;
+}
+
+size_t wsockchanrecv(wsockchan ch, void *msg, size_t len, int64_t deadline) {
+    struct wsockmux *m = ch->mux;
+    while(1) {
+        struct wsock_muxchunk *c = ch->rfirst;
+        if(!c) {
+            if(ch->peerclosed) {errno = ECONNRESET; return 0;}
+            if(m->err) {errno = m->err; return 0;}
+            /* The part received so far is kept in the buffer. */
+            if(wsock_mux_wait(ch->rwake, deadline) != 0) {
+                errno = ETIMEDOUT; return 0;}
+            continue;
+        }
+        if(ch->rpos < len)
+            memcpy((uint8_t*)msg + ch->rpos, c->data,
+                c->len < len - ch->rpos ? c->len : len - ch->rpos);
+        ch->rpos += c->len;
+        ch->rbuffered -= c->len;
+        ch->rconsumed += c->len;
+        int last = c->last;
+        ch->rfirst = c->next;
+        if(!ch->rfirst)
+            ch->rlast = NULL;
+        free(c);
+        /* Credit is returned in batches to keep the overhead low. */
+        if(ch->rconsumed >= WSOCK_MUX_WINDOW / 2 && !ch->peerclosed) {
+            if(wsock_mux_ctl(m, WSOCK_MUX_CREDIT, ch->id, 1,
+                  (uint32_t)ch->rconsumed) == 0)
+                ch->rconsumed = 0;
+        }
+        if(last) {
+            size_t res = ch->rpos;
+            ch->rpos = 0;
+            errno = 0;
+            return res;
+        }
+    }
+}
+
+void wsockchanclose(wsockchan ch) {
+    struct wsockmux *m = ch->mux;
+    /* Best effort. If it fails the peer finds out when the connection
+       is closed. */
+    if(!m->err && !m->closed)
+        wsock_mux_ctl(m, WSOCK_MUX_CLOSE, ch->id, 0, 0);
+    if(ch->queued)
+        wsock_mux_unschedule(m, ch);
+    struct wsockchan **p;
+    for(p = &m->chans; *p != ch; p = &(*p)->next);
+    *p = ch->next;
+    --m->nchans;
+    wsock_mux_free(ch);
+}
+
+void wsockmuxclose(wsockmux m) {
+    m->closed = 1;
+    wsock_mux_signal(m->wake);
+    (void)chr(m->stopped, int);
+    (void)chr(m->stopped, int);
+    while(m->chans) {
+        struct wsockchan *ch = m->chans;
+        m->chans = ch->next;
+        wsock_mux_free(ch);
+    }
+    while(m->cfirst) {
+        struct wsock_muxctl *ctl = m->cfirst;
+        m->cfirst = ctl->next;
+        free(ctl);
+    }
+    chclose(m->awake);
+    chclose(m->wake);
+    chclose(m->stopped);
+    wsockclose(m->s);
+    free(m);
+}
+
@@ -0,0 +1,82 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Measures the CPU cost of the framing code alone by running it over
+   an in-memory pipe. */
+
+static size_t msgsize;
+static int count;
+
+coroutine void sender(wsock s) {
+    char *buf = malloc(msgsize);
+    assert(buf);
+    memset(buf, 'x', msgsize);
+    int i;
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, buf, msgsize, -1);
+        assert(errno == 0);
+    }
+    free(buf);
+}
+
+static void run(const char *name, int fromclient) {
+    wsock c, s;
+    wsockpair(&c, &s);
+    assert(errno == 0);
+    go(sender(fromclient ? c : s));
+    wsock r = fromclient ? s : c;
+    char *buf = malloc(msgsize);
+    assert(buf);
+    int64_t start = now();
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsockrecv(r, buf, msgsize, -1);
+        assert(errno == 0 && sz == msgsize);
+    }
+    int64_t elapsed = now() - start;
+    if(elapsed == 0)
+        elapsed = 1;
+    printf("%-16s %10.0f msgs/s  %8.1f MB/s\n", name,
+        (double)count * 1000 / elapsed,
+        (double)msgsize * count / elapsed / 1000);
+    free(buf);
+    wsockclose(c);
+    wsockclose(s);
+}
+
+int main(int argc, char *argv[]) {
+    msgsize = argc > 1 ? atol(argv[1]) : 64;
+    count = argc > 2 ? atoi(argv[2]) : 1000000;
+    run("client->server", 1);
+    run("server->client", 0);
+    return 0;
+}
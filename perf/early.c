@@ -0,0 +1,159 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <fcntl.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../wsock.h"
+
+/* Measures a short request/response exchange on a fresh connection, with
+   and without sending the request optimistically along with the opening
+   handshake. Traffic goes through a proxy that delays everything by
+   a fixed amount of time in each direction to simulate network latency. */
+
+#define SERVER 5566
+#define PROXY 5567
+
+static int64_t delay;
+
+/* Forwards bytes in one direction. Each chunk is forwarded 'delay' ms after
+   it arrived, so chunks in flight don't delay each other. */
+coroutine void pump(int from, int to, chan done) {
+    char buf[65536];
+    while(1) {
+        fdwait(from, FDW_IN, -1);
+        ssize_t sz = read(from, buf, sizeof(buf));
+        if(sz < 0 && errno == EAGAIN)
+            continue;
+        if(sz <= 0)
+            break;
+        msleep(now() + delay);
+        ssize_t pos = 0;
+        while(pos != sz) {
+            ssize_t rc = write(to, buf + pos, sz - pos);
+            if(rc < 0 && errno == EAGAIN) {
+                fdwait(to, FDW_OUT, -1);
+                continue;
+            }
+            if(rc < 0)
+                goto out;
+            pos += rc;
+        }
+    }
+out:
+    shutdown(to, SHUT_WR);
+    chs(done, int, 0);
+}
+
+coroutine void proxyconn(tcpsock u) {
+    int a = tcpdetach(u);
+    tcpsock v = tcpconnect(ipremote("127.0.0.1", SERVER, 0, -1), -1);
+    assert(v);
+    int b = tcpdetach(v);
+    fcntl(a, F_SETFL, fcntl(a, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(b, F_SETFL, fcntl(b, F_GETFL, 0) | O_NONBLOCK);
+    chan done = chmake(int, 2);
+    go(pump(a, b, done));
+    go(pump(b, a, done));
+    (void)chr(done, int);
+    (void)chr(done, int);
+    chclose(done);
+    fdclean(a);
+    close(a);
+    fdclean(b);
+    close(b);
+}
+
+coroutine void proxy(tcpsock ls) {
+    while(1) {
+        tcpsock u = tcpaccept(ls, -1);
+        assert(u);
+        go(proxyconn(u));
+    }
+}
+
+coroutine void handler(wsock s) {
+    char buf[256];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0);
+    wsocksend(s, buf, sz, -1);
+    assert(errno == 0);
+    /* Wait for the client to go away. */
+    wsockrecv(s, buf, sizeof(buf), -1);
+    wsockclose(s);
+}
+
+coroutine void server(wsock ls) {
+    while(1) {
+        wsock s = wsockaccept(ls, -1);
+        assert(s);
+        go(handler(s));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 100;
+    delay = argc > 2 ? atoi(argv[2]) : 5;
+    wsock ls = wsocklisten(iplocal("127.0.0.1", SERVER, 0), NULL, 10);
+    assert(ls);
+    go(server(ls));
+    tcpsock pls = tcplisten(iplocal("127.0.0.1", PROXY, 0), 10);
+    assert(pls);
+    go(proxy(pls));
+    ipaddr addr = ipremote("127.0.0.1", PROXY, 0, -1);
+    char buf[256];
+    struct wsockmsg req = {"request", 7};
+    int i, early;
+    for(early = 0; early != 2; ++early) {
+        int64_t start = now();
+        for(i = 0; i != count; ++i) {
+            wsock s;
+            if(early) {
+                s = wsockconnectearly(addr, NULL, "/", &req, 1, -1);
+                assert(s);
+            }
+            else {
+                s = wsockconnect(addr, NULL, "/", -1);
+                assert(s);
+                wsocksend(s, req.buf, req.len, -1);
+                assert(errno == 0);
+            }
+            size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+            assert(errno == 0 && sz == req.len);
+            wsockclose(s);
+        }
+        int64_t elapsed = now() - start;
+        printf("%-18s %8.2f ms/exchange (%d ms one-way delay)\n",
+            early ? "wsockconnectearly" : "wsockconnect",
+            (double)elapsed / count, (int)delay);
+    }
+    return 0;
+}
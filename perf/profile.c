@@ -0,0 +1,117 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Shows the effect of the socket option profiles on loopback TCP: round
+   trip time of small messages and throughput of large ones. Both peers run
+   in the same process. */
+
+#define PORT 5569
+#define BULKSIZE 65536
+
+static int count;
+
+coroutine void client(const char *profile, chan done) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", PORT, 0, -1), NULL, "/", -1);
+    assert(s);
+    if(profile) {
+        int rc = wsockprofile(s, profile);
+        assert(rc == 0);
+    }
+    char *buf = malloc(BULKSIZE);
+    assert(buf);
+    memset(buf, 'x', BULKSIZE);
+    int i;
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, buf, 64, -1);
+        assert(errno == 0);
+        size_t sz = wsockrecv(s, buf, 64, -1);
+        assert(errno == 0 && sz == 64);
+    }
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, buf, BULKSIZE, -1);
+        assert(errno == 0);
+    }
+    wsockrecv(s, buf, 1, -1);
+    assert(errno == 0);
+    free(buf);
+    wsockclose(s);
+    chs(done, int, 0);
+}
+
+static void run(const char *profile) {
+    wsock ls = wsocklisten(iplocal("127.0.0.1", PORT, 0), NULL, 10);
+    assert(ls);
+    if(profile) {
+        int rc = wsockprofile(ls, profile);
+        assert(rc == 0);
+    }
+    chan done = chmake(int, 0);
+    go(client(profile, done));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    char *buf = malloc(BULKSIZE);
+    assert(buf);
+    int64_t start = now();
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsockrecv(s, buf, 64, -1);
+        assert(errno == 0 && sz == 64);
+        wsocksend(s, buf, 64, -1);
+        assert(errno == 0);
+    }
+    int64_t rtt = now() - start;
+    start = now();
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsockrecv(s, buf, BULKSIZE, -1);
+        assert(errno == 0 && sz == BULKSIZE);
+    }
+    int64_t bulk = now() - start;
+    wsocksend(s, buf, 1, -1);
+    assert(errno == 0);
+    (void)chr(done, int);
+    chclose(done);
+    free(buf);
+    wsockclose(s);
+    wsockclose(ls);
+    printf("%-12s %8.1f us/round trip %10.1f MB/s\n",
+        profile ? profile : "default", (double)rtt * 1000 / count,
+        bulk ? (double)count * BULKSIZE / 1000 / bulk : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    count = argc > 1 ? atoi(argv[1]) : 20000;
+    run(NULL);
+    run("low-latency");
+    run("bulk");
+    return 0;
+}
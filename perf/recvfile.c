@@ -0,0 +1,118 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+/* Measures storing large messages to a file, either by receiving each one
+   into a buffer of its size and writing it out, or by wsockrecvfile(). Both
+   directions are measured: the server has to unmask the payload, on the
+   client it can be spliced from the socket to the file. */
+
+#define PORT 5587
+
+static int count;
+static size_t msgsz;
+
+coroutine void sender(wsock s, chan done) {
+    char *msg = malloc(msgsz);
+    assert(msg);
+    memset(msg, 'x', msgsz);
+    int i;
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, msg, msgsz, -1);
+        assert(errno == 0);
+    }
+    free(msg);
+    chs(done, int, 0);
+}
+
+coroutine void dial(chan conns) {
+    wsock c = wsockconnect(ipremote("127.0.0.1", PORT, 0, -1), NULL, "/",
+        -1);
+    assert(c);
+    chs(conns, wsock, c);
+}
+
+static void store(wsock from, wsock to, int fd, int direct) {
+    chan done = chmake(int, 0);
+    go(sender(from, done));
+    char *buf = direct ? NULL : malloc(msgsz);
+    int i;
+    for(i = 0; i != count; ++i) {
+        if(direct) {
+            size_t sz = wsockrecvfile(to, fd, 0, -1);
+            assert(errno == 0 && sz == msgsz);
+            continue;
+        }
+        size_t sz = wsockrecv(to, buf, msgsz, -1);
+        assert(errno == 0 && sz == msgsz);
+        ssize_t rc = pwrite(fd, buf, sz, 0);
+        assert(rc == sz);
+    }
+    (void)chr(done, int);
+    chclose(done);
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    count = argc > 1 ? atoi(argv[1]) : 100;
+    msgsz = argc > 2 ? (size_t)atol(argv[2]) : 16 * 1024 * 1024;
+    FILE *f = tmpfile();
+    assert(f);
+    int fd = fileno(f);
+    wsock ls = wsocklisten(iplocal("127.0.0.1", PORT, 0), NULL, 10);
+    assert(ls);
+    chan conns = chmake(wsock, 1);
+    go(dial(conns));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    wsock c = chr(conns, wsock);
+    int client, direct;
+    for(client = 0; client != 2; ++client) {
+        for(direct = 0; direct != 2; ++direct) {
+            int64_t start = now();
+            store(client ? s : c, client ? c : s, fd, direct);
+            int64_t elapsed = now() - start;
+            printf("%-6s %-17s %8.1f MB/s (%d messages of %zu bytes)\n",
+                client ? "client" : "server",
+                direct ? "wsockrecvfile" : "wsockrecv/pwrite",
+                (double)count * msgsz / 1048576 / (elapsed ? elapsed : 1) *
+                1000, count, msgsz);
+        }
+    }
+    wsockclose(c);
+    wsockclose(s);
+    wsockclose(ls);
+    chclose(conns);
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Measures a proxy that forwards messages from a client to a backend, either
+   by receiving each message in full and sending it on, or by wsockrelay().
+   Client-to-server traffic is masked on both hops, so the former unmasks and
+   re-masks each byte separately while the latter does it in a single pass
+   and never holds more than a chunk of the message. */
+
+#define FRONT 5579
+#define BACK 5580
+
+static int count;
+static size_t msgsz;
+
+coroutine void client(void) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", FRONT, 0, -1), NULL, "/",
+        -1);
+    assert(s);
+    char *msg = malloc(msgsz);
+    assert(msg);
+    memset(msg, 'x', msgsz);
+    int i;
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, msg, msgsz, -1);
+        assert(errno == 0);
+    }
+    wsockdone(s, -1);
+    char buf[16];
+    wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockclose(s);
+    free(msg);
+}
+
+coroutine void backend(wsock ls, chan done) {
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    char *buf = malloc(msgsz);
+    assert(buf);
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsockrecv(s, buf, msgsz, -1);
+        assert(errno == 0 && sz == msgsz);
+    }
+    wsockrecv(s, buf, msgsz, -1);
+    assert(errno == ECONNRESET);
+    wsockclose(s);
+    free(buf);
+    chs(done, int, 0);
+}
+
+static void proxy(wsock fls, wsock bls, int relay) {
+    chan done = chmake(int, 0);
+    go(backend(bls, done));
+    go(client());
+    wsock f = wsockaccept(fls, -1);
+    assert(f);
+    wsock b = wsockconnect(ipremote("127.0.0.1", BACK, 0, -1), NULL, "/", -1);
+    assert(b);
+    char *buf = relay ? NULL : malloc(msgsz);
+    while(1) {
+        if(relay) {
+            wsockrelay(f, b, -1);
+            if(errno == ECONNRESET)
+                break;
+            assert(errno == 0);
+            continue;
+        }
+        size_t sz = wsockrecv(f, buf, msgsz, -1);
+        if(errno == ECONNRESET) {
+            wsockdone(b, -1);
+            assert(errno == 0);
+            break;
+        }
+        assert(errno == 0);
+        wsocksend(b, buf, sz, -1);
+        assert(errno == 0);
+    }
+    (void)chr(done, int);
+    chclose(done);
+    wsockclose(f);
+    wsockclose(b);
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    count = argc > 1 ? atoi(argv[1]) : 1000;
+    msgsz = argc > 2 ? (size_t)atol(argv[2]) : 1024 * 1024;
+    wsock fls = wsocklisten(iplocal("127.0.0.1", FRONT, 0), NULL, 10);
+    assert(fls);
+    wsock bls = wsocklisten(iplocal("127.0.0.1", BACK, 0), NULL, 10);
+    assert(bls);
+    int relay;
+    for(relay = 0; relay != 2; ++relay) {
+        int64_t start = now();
+        proxy(fls, bls, relay);
+        int64_t elapsed = now() - start;
+        printf("%-18s %8.1f MB/s (%d messages of %zu bytes)\n",
+            relay ? "wsockrelay" : "wsockrecv/send",
+            (double)count * msgsz / 1048576 / (elapsed ? elapsed : 1) * 1000,
+            count, msgsz);
+    }
+    wsockclose(bls);
+    wsockclose(fls);
+    return 0;
+}
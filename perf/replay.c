@@ -0,0 +1,285 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+/* Replays a capture log against a server over loopback, keeping the sizes
+   of the messages and the timing of the original traffic, sped up by the
+   given factor (0 means as fast as possible). Each captured connection gets
+   its own client connection, which sends the messages the server received
+   on the original one and counts the replies.
+
+       replay [log] [speed] [port]
+
+   With no port, the messages are sent to a built-in echo server. With no
+   log, or "-", a synthetic workload is captured by the built-in server
+   first: a few connections sending mostly small messages with an occasional
+   large one at random intervals. */
+
+#define PORT 5581
+#define NCONNS 8
+#define NMSGS 200
+#define MAXMSG (256 * 1024)
+
+struct conn {
+    struct wsockcaprec **recs;
+    int nrecs;
+};
+
+static int port = PORT;
+static double speed;
+static int64_t start;
+static int64_t lagsum;
+static int64_t lagmax;
+static long replies;
+
+coroutine void echo(wsock s) {
+    char *buf = malloc(MAXMSG);
+    assert(buf);
+    while(1) {
+        size_t sz = wsockrecv(s, buf, MAXMSG, -1);
+        if(errno != 0)
+            break;
+        wsocksend(s, buf, sz < MAXMSG ? sz : MAXMSG, -1);
+        if(errno != 0)
+            break;
+    }
+    wsockclose(s);
+    free(buf);
+}
+
+coroutine void server(wsock ls) {
+    while(1) {
+        wsock s = wsockaccept(ls, -1);
+        if(!s)
+            break;
+        go(echo(s));
+    }
+}
+
+static wsock dial(void) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", port, 0, -1), NULL, "/", -1);
+    assert(s);
+    return s;
+}
+
+/* Synthetic traffic: the message sizes are heavily skewed towards small
+   ones. */
+coroutine void generator(chan done) {
+    static char msg[MAXMSG];
+    wsock s = dial();
+    char buf[16];
+    int i;
+    for(i = 0; i != NMSGS; ++i) {
+        int r = rand() % 100;
+        size_t sz = r < 80 ? 16 + rand() % 240 :
+            r < 98 ? 1024 + rand() % 15360 : 65536 + rand() % 196608;
+        msleep(now() + rand() % 5);
+        wsocksend(s, msg, sz, -1);
+        assert(errno == 0);
+        wsockrecv(s, buf, sizeof(buf), -1);
+        assert(errno == 0);
+    }
+    wsockclose(s);
+    chs(done, int, 0);
+}
+
+static void generate(wsock ls, const char *path) {
+    wsockcap cap = wsockcapopen(path, 64 * 1024 * 1024, 0);
+    assert(cap);
+    wsockcapture(ls, cap);
+    chan done = chmake(int, NCONNS);
+    int i;
+    for(i = 0; i != NCONNS; ++i)
+        go(generator(done));
+    for(i = 0; i != NCONNS; ++i)
+        (void)chr(done, int);
+    chclose(done);
+    wsockcapture(ls, NULL);
+    wsockcapclose(cap);
+}
+
+coroutine void reader(wsock s, chan done) {
+    char *buf = malloc(MAXMSG);
+    assert(buf);
+    while(1) {
+        wsockrecv(s, buf, MAXMSG, -1);
+        if(errno != 0 && errno != EAGAIN)
+            break;
+        if(errno == 0)
+            ++replies;
+    }
+    free(buf);
+    chs(done, int, 0);
+}
+
+coroutine void player(struct conn *c, chan done) {
+    static char msg[MAXMSG];
+    wsock s = NULL;
+    chan rdone = chmake(int, 1);
+    int i;
+    for(i = 0; i != c->nrecs; ++i) {
+        struct wsockcaprec *rec = c->recs[i];
+        if(speed > 0) {
+            int64_t deadline = start + (int64_t)(rec->time / 1000 / speed);
+            msleep(deadline);
+            int64_t lag = now() - deadline;
+            lagsum += lag;
+            if(lag > lagmax)
+                lagmax = lag;
+        }
+        /* Connect when the original connection sent its first message. */
+        if(!s) {
+            s = dial();
+            go(reader(s, rdone));
+        }
+        size_t sz = rec->size < MAXMSG ? rec->size : MAXMSG;
+        const void *data = rec->stored == sz ? (const void*)(rec + 1) : msg;
+        wsocksend(s, data, sz, -1);
+        assert(errno == 0);
+    }
+    if(s) {
+        wsockdone(s, -1);
+        (void)chr(rdone, int);
+        wsockclose(s);
+    }
+    chclose(rdone);
+    chs(done, int, 0);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "-";
+    speed = argc > 2 ? atof(argv[2]) : 1.0;
+    port = argc > 3 ? atoi(argv[3]) : PORT;
+    wsock ls = NULL;
+    if(argc <= 3) {
+        ls = wsocklisten(iplocal("127.0.0.1", PORT, 0), NULL, 100);
+        assert(ls);
+        go(server(ls));
+    }
+    char tmp[] = "/tmp/wsockreplayXXXXXX";
+    if(strcmp(path, "-") == 0) {
+        int fd = mkstemp(tmp);
+        assert(fd >= 0);
+        close(fd);
+        path = tmp;
+        generate(ls, path);
+    }
+
+    /* Load the log. */
+    FILE *f = fopen(path, "rb");
+    if(!f) {perror(path); return 1;}
+    fseek(f, 0, SEEK_END);
+    size_t logsz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *log = malloc(logsz);
+    assert(log);
+    assert(fread(log, 1, logsz, f) == logsz);
+    fclose(f);
+    if(path == tmp)
+        unlink(tmp);
+    struct wsockcaphdr *hdr = (struct wsockcaphdr*)log;
+    if(logsz < sizeof(*hdr) || memcmp(hdr->magic, WSOCK_CAPMAGIC, 8) != 0 ||
+          hdr->version != WSOCK_CAPVERSION || hdr->used > logsz) {
+        fprintf(stderr, "%s: not a capture log\n", path);
+        return 1;
+    }
+
+    /* Sort the messages received by the server by connection. */
+    uint32_t nconns = 0;
+    size_t pos;
+    for(pos = sizeof(*hdr); pos < hdr->used;) {
+        struct wsockcaprec *rec = (struct wsockcaprec*)(log + pos);
+        if(rec->conn > nconns)
+            nconns = rec->conn;
+        pos += (sizeof(*rec) + rec->stored + 7) & ~(size_t)7;
+    }
+    struct conn *conns = calloc(nconns + 1, sizeof(struct conn));
+    assert(conns);
+    long msgs = 0;
+    uint64_t bytes = 0;
+    uint64_t duration = 0;
+    int pass;
+    for(pass = 0; pass != 2; ++pass) {
+        for(pos = sizeof(*hdr); pos < hdr->used;) {
+            struct wsockcaprec *rec = (struct wsockcaprec*)(log + pos);
+            pos += (sizeof(*rec) + rec->stored + 7) & ~(size_t)7;
+            if(rec->dir != WSOCK_CAPIN || rec->opcode != 2)
+                continue;
+            struct conn *c = &conns[rec->conn];
+            if(pass == 1) {
+                c->recs[c->nrecs++] = rec;
+                continue;
+            }
+            ++c->nrecs;
+            ++msgs;
+            bytes += rec->size;
+            duration = rec->time;
+        }
+        if(pass == 1)
+            break;
+        uint32_t i;
+        for(i = 0; i <= nconns; ++i) {
+            conns[i].recs = malloc((conns[i].nrecs + 1) * sizeof(void*));
+            assert(conns[i].recs);
+            conns[i].nrecs = 0;
+        }
+    }
+    printf("recorded: %ld messages, %.1f MB, %.2f s\n", msgs,
+        (double)bytes / 1048576, (double)duration / 1000000);
+
+    /* Replay. */
+    chan done = chmake(int, nconns + 1);
+    start = now();
+    uint32_t i;
+    for(i = 0; i <= nconns; ++i)
+        go(player(&conns[i], done));
+    for(i = 0; i <= nconns; ++i)
+        (void)chr(done, int);
+    int64_t elapsed = now() - start;
+    chclose(done);
+    printf("replayed: %.2f s at %gx, %.0f msgs/s, %.1f MB/s, "
+        "lag avg %.2f ms max %d ms, %ld replies\n",
+        (double)elapsed / 1000, speed,
+        (double)msgs * 1000 / (elapsed ? elapsed : 1),
+        (double)bytes / 1048576 * 1000 / (elapsed ? elapsed : 1),
+        speed > 0 && msgs ? (double)lagsum / msgs : 0.0, (int)lagmax,
+        replies);
+
+    for(i = 0; i <= nconns; ++i)
+        free(conns[i].recs);
+    free(conns);
+    free(log);
+    if(ls)
+        wsockclose(ls);
+    return 0;
+}
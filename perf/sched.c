@@ -0,0 +1,178 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../wsock.h"
+
+/* Measures the round-trip time of a light connection doing request/reply
+   while a heavy connection of the same server sends large messages back to
+   back, first without a scheduler and then with both connections attached
+   to one. */
+
+#define PORT 5584
+
+static int rounds;
+static size_t msgsz;
+static int stop;
+
+/* Time in microseconds. */
+static int64_t usecs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+coroutine void dial(chan conns) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", PORT, 0, -1), NULL, "/",
+        -1);
+    assert(s);
+    chs(conns, wsock, s);
+}
+
+/* Server side of the heavy connection. */
+coroutine void heavy(wsock s, chan done) {
+    char *msg = malloc(msgsz);
+    assert(msg);
+    memset(msg, 'x', msgsz);
+    while(!stop) {
+        wsocksend(s, msg, msgsz, -1);
+        assert(errno == 0);
+    }
+    wsocksend(s, "", 0, -1);
+    assert(errno == 0);
+    free(msg);
+    chs(done, int, 0);
+}
+
+/* Client side of the heavy connection. */
+coroutine void drain(wsock s, chan done) {
+    char *buf = malloc(msgsz);
+    assert(buf);
+    while(1) {
+        size_t sz = wsockrecv(s, buf, msgsz, -1);
+        assert(errno == 0);
+        if(sz == 0)
+            break;
+    }
+    free(buf);
+    chs(done, int, 0);
+}
+
+/* Server side of the light connection. */
+coroutine void echo(wsock s, chan done) {
+    char buf[64];
+    while(1) {
+        size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+        assert(errno == 0);
+        wsocksend(s, buf, sz, -1);
+        assert(errno == 0);
+        if(sz == 0)
+            break;
+    }
+    chs(done, int, 0);
+}
+
+static void run(wsock ls, wsocksched sch) {
+    chan conns = chmake(wsock, 1);
+    chan done = chmake(int, 3);
+    go(dial(conns));
+    wsock hs = wsockaccept(ls, -1);
+    assert(hs);
+    wsock hc = chr(conns, wsock);
+    go(dial(conns));
+    wsock ls2 = wsockaccept(ls, -1);
+    assert(ls2);
+    wsock lc = chr(conns, wsock);
+    if(sch) {
+        wsockschedule(hs, sch);
+        wsockschedule(ls2, sch);
+    }
+    stop = 0;
+    go(heavy(hs, done));
+    go(drain(hc, done));
+    go(echo(ls2, done));
+    int64_t *rtt = malloc(rounds * sizeof(int64_t));
+    assert(rtt);
+    char buf[64];
+    int i;
+    for(i = 0; i != rounds; ++i) {
+        int64_t start = usecs();
+        wsocksend(lc, "ping", 4, -1);
+        assert(errno == 0);
+        size_t sz = wsockrecv(lc, buf, sizeof(buf), -1);
+        assert(errno == 0 && sz == 4);
+        rtt[i] = usecs() - start;
+    }
+    stop = 1;
+    wsocksend(lc, "", 0, -1);
+    assert(errno == 0);
+    for(i = 0; i != 3; ++i)
+        (void)chr(done, int);
+    qsort(rtt, rounds, sizeof(int64_t), cmp);
+    printf("%-16s p50 %8lld us  p99 %8lld us  max %8lld us\n",
+        sch ? "scheduled" : "unscheduled", (long long)rtt[rounds / 2],
+        (long long)rtt[rounds * 99 / 100], (long long)rtt[rounds - 1]);
+    if(sch) {
+        struct wsockschedstats st;
+        wsockschedstats(sch, &st);
+        printf("%-16s %llu waits, %llu ms waiting, %d queued at most\n", "",
+            (unsigned long long)st.waits, (unsigned long long)st.waittime,
+            st.maxqueued);
+    }
+    free(rtt);
+    wsockclose(hs);
+    wsockclose(hc);
+    wsockclose(ls2);
+    wsockclose(lc);
+    chclose(conns);
+    chclose(done);
+}
+
+int main(int argc, char *argv[]) {
+    rounds = argc > 1 ? atoi(argv[1]) : 200;
+    msgsz = argc > 2 ? (size_t)atol(argv[2]) : 4 * 1024 * 1024;
+    size_t quantum = argc > 3 ? (size_t)atol(argv[3]) : 0;
+    wsock ls = wsocklisten(iplocal("127.0.0.1", PORT, 0), NULL, 10);
+    assert(ls);
+    run(ls, NULL);
+    wsocksched sch = wsockschedmake(quantum);
+    assert(sch);
+    run(ls, sch);
+    wsockschedclose(sch);
+    wsockclose(ls);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Measures the per-message cost of receiving small messages on the server,
+   one by one and in batches.
+   The client is driven by the codec directly and sends pre-encoded frames
+   in large batches so that the sending side costs next to nothing. */
+
+#define BATCH 1000
+
+static int count;
+
+coroutine void sender(int port, size_t msgsize) {
+    ipaddr addr = ipremote("127.0.0.1", port, 0, -1);
+    tcpsock u = tcpconnect(addr, -1);
+    assert(u);
+    wsockcodec c = wsockcodecclient(NULL, "/");
+    assert(c);
+    const void *out;
+    size_t sz = wsockcodecpending(c, &out);
+    tcpsend(u, out, sz, -1);
+    assert(errno == 0);
+    wsockcodecsent(c, sz);
+    tcpflush(u, -1);
+    assert(errno == 0);
+    while(1) {
+        uint8_t ch;
+        struct wsockevent ev;
+        tcprecv(u, &ch, 1, -1);
+        assert(errno == 0);
+        wsockcodecfeed(c, &ch, 1, &ev);
+        assert(errno == 0);
+        if(ev.type == WSOCK_OPEN)
+            break;
+    }
+    char msg[125];
+    memset(msg, 'x', sizeof(msg));
+    uint8_t *batch = malloc(BATCH * (WSOCK_MAXHEADER + sizeof(msg)));
+    assert(batch);
+    size_t len = 0;
+    int i;
+    for(i = 0; i != BATCH; ++i) {
+        len += wsockcodecencode(c, msg, msgsize, batch + len,
+            WSOCK_MAXHEADER + sizeof(msg));
+        assert(errno == 0);
+    }
+    for(i = 0; i != count / BATCH; ++i) {
+        tcpsend(u, batch, len, -1);
+        assert(errno == 0);
+        tcpflush(u, -1);
+        assert(errno == 0);
+    }
+    free(batch);
+    wsockcodecclose(c);
+    tcpclose(u);
+}
+
+int main(int argc, char *argv[]) {
+    count = argc > 1 ? atoi(argv[1]) : 1000000;
+    count -= count % BATCH;
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5560, 0), NULL, 10);
+    assert(ls);
+    size_t sizes[] = {16, 64, 125};
+    char bufs[64][125];
+    struct wsockmsg msgs[64];
+    int i, j;
+    for(i = 0; i != 64; ++i) {
+        msgs[i].buf = bufs[i];
+        msgs[i].len = sizeof(bufs[i]);
+    }
+    for(i = 0; i != sizeof(sizes) / sizeof(sizes[0]) * 2; ++i) {
+        size_t msgsize = sizes[i / 2];
+        int many = i % 2;
+        go(sender(5560, msgsize));
+        wsock s = wsockaccept(ls, -1);
+        assert(s);
+        int64_t start = now();
+        int received = 0;
+        while(received != count) {
+            if(many) {
+                int n = wsockrecvmany(s, msgs, 64, -1);
+                assert(errno == 0);
+                for(j = 0; j != n; ++j)
+                    assert(msgs[j].size == msgsize);
+                received += n;
+            }
+            else {
+                size_t sz = wsockrecv(s, bufs[0], sizeof(bufs[0]), -1);
+                assert(errno == 0 && sz == msgsize);
+                ++received;
+            }
+        }
+        int64_t elapsed = now() - start;
+        printf("%4zuB %-14s %8.1f ns/msg\n", msgsize,
+            many ? "wsockrecvmany" : "wsockrecv",
+            (double)elapsed * 1000000 / count);
+        wsockclose(s);
+    }
+    wsockclose(ls);
+    return 0;
+}
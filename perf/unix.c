@@ -0,0 +1,108 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+/* Compares loopback TCP with Unix domain sockets. Both peers run in the same
+   process, so the numbers reflect the combined CPU cost of sending and
+   receiving. */
+
+#define ADDR "wsock-perf.sock"
+
+static size_t msgsize;
+static int count;
+
+coroutine void sender(int local) {
+    wsock s = local ? wsockconnectunix(ADDR, NULL, "/", -1) :
+        wsockconnect(ipremote("127.0.0.1", 5555, 0, -1), NULL, "/", -1);
+    assert(s);
+    char *buf = malloc(msgsize);
+    assert(buf);
+    memset(buf, 'x', msgsize);
+    int i;
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, buf, msgsize, -1);
+        assert(errno == 0);
+    }
+    /* Latency: one-byte round trips. */
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, buf, 1, -1);
+        assert(errno == 0);
+        wsockrecv(s, buf, 1, -1);
+        assert(errno == 0);
+    }
+    free(buf);
+    wsockclose(s);
+}
+
+static void run(const char *name, int local) {
+    unlink(ADDR);
+    wsock ls = local ? wsocklistenunix(ADDR, NULL, 10) :
+        wsocklisten(iplocal("127.0.0.1", 5555, 0), NULL, 10);
+    assert(ls);
+    go(sender(local));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    char *buf = malloc(msgsize);
+    assert(buf);
+    int64_t start = now();
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsockrecv(s, buf, msgsize, -1);
+        assert(errno == 0 && sz == msgsize);
+    }
+    int64_t bulk = now() - start;
+    start = now();
+    for(i = 0; i != count; ++i) {
+        wsockrecv(s, buf, 1, -1);
+        assert(errno == 0);
+        wsocksend(s, buf, 1, -1);
+        assert(errno == 0);
+    }
+    int64_t rtt = now() - start;
+    if(bulk == 0)
+        bulk = 1;
+    printf("%-5s  throughput: %8.1f MB/s  round trip: %6.2f us\n",
+        name, (double)msgsize * count / bulk / 1000,
+        (double)rtt * 1000 / count);
+    free(buf);
+    wsockclose(s);
+    wsockclose(ls);
+    unlink(ADDR);
+}
+
+int main(int argc, char *argv[]) {
+    msgsize = argc > 1 ? atol(argv[1]) : 65536;
+    count = argc > 2 ? atoi(argv[2]) : 10000;
+    run("tcp", 0);
+    run("unix", 1);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Many connections doing request/response round trips at the same time,
+   which is where batching the submissions pays off. The backend is chosen
+   at build time, so to compare io_uring with libmill's poller run this
+   program from builds configured with and without --enable-uring. */
+
+static int conns;
+static size_t msgsize;
+static int count;
+static chan done;
+
+coroutine void client(void) {
+    ipaddr addr = ipremote("127.0.0.1", 5555, 0, -1);
+    wsock s = wsockconnect(addr, NULL, "/", -1);
+    assert(s);
+    char *buf = malloc(msgsize);
+    assert(buf);
+    memset(buf, 'x', msgsize);
+    int i;
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, buf, msgsize, -1);
+        assert(errno == 0);
+        size_t sz = wsockrecv(s, buf, msgsize, -1);
+        assert(errno == 0 && sz == msgsize);
+    }
+    free(buf);
+    wsockclose(s);
+    chs(done, int, 0);
+}
+
+coroutine void echo(wsock s) {
+    char *buf = malloc(msgsize);
+    assert(buf);
+    while(1) {
+        size_t sz = wsockrecv(s, buf, msgsize, -1);
+        if(errno != 0)
+            break;
+        wsocksend(s, buf, sz, -1);
+        if(errno != 0)
+            break;
+    }
+    free(buf);
+    wsockclose(s);
+}
+
+int main(int argc, char *argv[]) {
+    conns = argc > 1 ? atoi(argv[1]) : 100;
+    msgsize = argc > 2 ? atol(argv[2]) : 64;
+    count = argc > 3 ? atoi(argv[3]) : 10000;
+    signal(SIGPIPE, SIG_IGN);
+    done = chmake(int, conns);
+    ipaddr addr = iplocal("127.0.0.1", 5555, 0);
+    wsock ls = wsocklisten(addr, NULL, conns);
+    assert(ls);
+    int i;
+    for(i = 0; i != conns; ++i)
+        go(client());
+    for(i = 0; i != conns; ++i) {
+        wsock s = wsockaccept(ls, -1);
+        assert(s);
+        go(echo(s));
+    }
+    int64_t start = now();
+    for(i = 0; i != conns; ++i)
+        (void)chr(done, int);
+    int64_t elapsed = now() - start;
+    if(elapsed == 0)
+        elapsed = 1;
+#if defined WSOCK_HAVE_URING
+    const char *backend = "io_uring";
+#else
+    const char *backend = "libmill";
+#endif
+    printf("%-8s connections: %d  msg size: %zu  round trips: %10.0f/s\n",
+        backend, conns, msgsize, (double)conns * count * 1000 / elapsed);
+    wsockclose(ls);
+    chclose(done);
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../wsock.h"
+
+/* Trades CPU for bandwidth: per-message zstd compression at different levels,
+   with and without a pre-shared dictionary, against uncompressed messages.
+   Messages are JSON-like records, small ones and batches of them. Both peers
+   run in the same process, so the CPU time covers both compression and
+   decompression. */
+
+#define PORT 5575
+#define NSAMPLES 64
+
+static int count;
+static char *samples[NSAMPLES];
+static size_t samplelens[NSAMPLES];
+
+/* Fills in the samples. Records share the field names and some of the
+   values, like real-world traffic does. */
+static void generate(size_t records) {
+    static const char *statuses[] = {"online", "away", "offline", "busy"};
+    int i;
+    for(i = 0; i != NSAMPLES; ++i) {
+        size_t cap = records * 160 + 1;
+        samples[i] = malloc(cap);
+        assert(samples[i]);
+        size_t len = 0;
+        size_t j;
+        for(j = 0; j != records; ++j) {
+            len += snprintf(samples[i] + len, cap - len,
+                "{\"user\": \"user%05d\", \"status\": \"%s\", "
+                "\"seq\": %d, \"score\": %d.%02d, \"tags\": [\"a%d\", "
+                "\"b%d\"]}\n", rand() % 10000, statuses[rand() % 4],
+                rand(), rand() % 1000, rand() % 100, rand() % 8,
+                rand() % 8);
+        }
+        samplelens[i] = len;
+    }
+}
+
+static void release(void) {
+    int i;
+    for(i = 0; i != NSAMPLES; ++i)
+        free(samples[i]);
+}
+
+/* Ratio of bytes on the wire to the bytes of the messages. */
+static double ratio(struct wsockext *ext) {
+    if(!ext)
+        return 1.0;
+    void *state = ext->open(ext->arg, 1);
+    assert(state);
+    size_t in = 0, out = 0;
+    int i;
+    for(i = 0; i != NSAMPLES; ++i) {
+        const void *buf;
+        size_t sz = ext->encode(state, samples[i], samplelens[i], &buf);
+        in += samplelens[i];
+        out += sz ? sz : samplelens[i];
+    }
+    ext->close(state);
+    return (double)out / in;
+}
+
+coroutine void client(struct wsockext *ext, chan done) {
+    ipaddr addr = ipremote("127.0.0.1", PORT, 0, -1);
+    wsock s = ext ? wsockconnectext(addr, NULL, "/", ext, -1) :
+        wsockconnect(addr, NULL, "/", -1);
+    assert(s);
+    int i;
+    for(i = 0; i != count; ++i) {
+        wsocksend(s, samples[i % NSAMPLES], samplelens[i % NSAMPLES], -1);
+        assert(errno == 0);
+    }
+    char c;
+    wsockrecv(s, &c, 1, -1);
+    assert(errno == 0);
+    wsockclose(s);
+    chs(done, int, 0);
+}
+
+static void run(const char *name, struct wsockext *ext) {
+    wsock ls = wsocklisten(iplocal("127.0.0.1", PORT, 0), NULL, 10);
+    assert(ls);
+    if(ext) {
+        int rc = wsockaddext(ls, ext);
+        assert(rc == 0);
+    }
+    chan done = chmake(int, 0);
+    go(client(ext, done));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    assert(!ext || wsockextension(s));
+    size_t bufsz = samplelens[0] * 2;
+    char *buf = malloc(bufsz);
+    assert(buf);
+    int64_t start = now();
+    clock_t cstart = clock();
+    size_t total = 0;
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsockrecv(s, buf, bufsz, -1);
+        assert(errno == 0 && sz == samplelens[i % NSAMPLES]);
+        total += sz;
+    }
+    double cpu = (double)(clock() - cstart) / CLOCKS_PER_SEC;
+    int64_t elapsed = now() - start;
+    wsocksend(s, "", 1, -1);
+    assert(errno == 0);
+    (void)chr(done, int);
+    chclose(done);
+    free(buf);
+    wsockclose(s);
+    wsockclose(ls);
+    printf("%-14s %7zu B %6.3f ratio %8.2f us CPU/msg %9.1f MB/s\n",
+        name, samplelens[0], ratio(ext), cpu * 1000000 / count,
+        elapsed ? (double)total / 1000 / elapsed : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    count = argc > 1 ? atoi(argv[1]) : 20000;
+    struct wsockext *z1 = wsockzstd(1, NULL, 0);
+    if(!z1) {
+        fprintf(stderr, "wsock was built without zstd\n");
+        return 1;
+    }
+    struct wsockext *z3 = wsockzstd(3, NULL, 0);
+    assert(z3);
+    /* Dictionary is a sample of earlier traffic. */
+    generate(40);
+    char *dict = samples[0];
+    samples[0] = NULL;
+    struct wsockext *zd = wsockzstd(1, dict, samplelens[0]);
+    assert(zd);
+    free(dict);
+    release();
+    size_t sizes[] = {1, 100};
+    int i;
+    for(i = 0; i != sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        generate(sizes[i]);
+        run("uncompressed", NULL);
+        run("zstd -1", z1);
+        run("zstd -3", z3);
+        run("zstd -1 dict", zd);
+        release();
+    }
+    wsockzstdfree(z1);
+    wsockzstdfree(z3);
+    wsockzstdfree(zd);
+    return 0;
+}
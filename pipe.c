@@ -0,0 +1,208 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+#include <errno.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+
+/* Capacity of each direction of the pipe. */
+#define WSOCK_PIPE_BUFLEN 65536
+
+struct wsock_pipewait {
+    int waiting;
+    chan wake;
+};
+
+/* One direction of the pipe. It is shared by both endpoints. */
+struct wsock_pipebuf {
+    size_t first;
+    size_t len;
+    /* Set once either endpoint was closed. */
+    int closed;
+    /* Reader waiting for data and writer waiting for space. */
+    struct wsock_pipewait reader;
+    struct wsock_pipewait writer;
+    int refs;
+    uint8_t data[WSOCK_PIPE_BUFLEN];
+};
+
+struct wsock_pipe {
+    struct wsock_pipebuf *in;
+    struct wsock_pipebuf *out;
+};
+
+static void wsock_pipe_notify(struct wsock_pipewait *w) {
+    if(w->waiting) {
+        w->waiting = 0;
+        chs(w->wake, int, 0);
+    }
+}
+
+static int wsock_pipe_wait(struct wsock_pipewait *w, int64_t deadline) {
+    w->waiting = 1;
+    int rc = 0;
+    choose {
+    in(w->wake, int, val):
+        (void)val;
+    deadline(deadline):
+        w->waiting = 0;
+        rc = -1;
+    end
+    }
+    return rc;
+}
+
+static size_t wsock_pipe_send(void *self, const void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_pipebuf *b = ((struct wsock_pipe*)self)->out;
+    size_t sent = 0;
+    while(1) {
+        if(b->closed) {errno = ECONNRESET; return sent;}
+        size_t sz = len - sent;
+        if(sz > WSOCK_PIPE_BUFLEN - b->len)
+            sz = WSOCK_PIPE_BUFLEN - b->len;
+        size_t pos = (b->first + b->len) % WSOCK_PIPE_BUFLEN;
+        size_t chunk = WSOCK_PIPE_BUFLEN - pos < sz ?
+            WSOCK_PIPE_BUFLEN - pos : sz;
+        memcpy(b->data + pos, ((const uint8_t*)buf) + sent, chunk);
+        memcpy(b->data, ((const uint8_t*)buf) + sent + chunk, sz - chunk);
+        b->len += sz;
+        sent += sz;
+        if(sz)
+            wsock_pipe_notify(&b->reader);
+        if(sent == len) {errno = 0; return len;}
+        if(wsock_pipe_wait(&b->writer, deadline) != 0) {
+            errno = ETIMEDOUT; return sent;}
+    }
+}
+
+static void wsock_pipe_flush(void *self, int64_t deadline) {
+    errno = ((struct wsock_pipe*)self)->out->closed ? ECONNRESET : 0;
+}
+
+static size_t wsock_pipe_recv(void *self, void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_pipebuf *b = ((struct wsock_pipe*)self)->in;
+    size_t received = 0;
+    while(1) {
+        size_t sz = len - received < b->len ? len - received : b->len;
+        if(buf) {
+            size_t chunk = WSOCK_PIPE_BUFLEN - b->first < sz ?
+                WSOCK_PIPE_BUFLEN - b->first : sz;
+            memcpy(((uint8_t*)buf) + received, b->data + b->first, chunk);
+            memcpy(((uint8_t*)buf) + received + chunk, b->data, sz - chunk);
+        }
+        b->first = (b->first + sz) % WSOCK_PIPE_BUFLEN;
+        b->len -= sz;
+        received += sz;
+        if(sz)
+            wsock_pipe_notify(&b->writer);
+        if(received == len) {errno = 0; return len;}
+        /* Data written before the peer closed the pipe are still
+           delivered. */
+        if(b->closed) {errno = ECONNRESET; return received;}
+        if(wsock_pipe_wait(&b->reader, deadline) != 0) {
+            errno = ETIMEDOUT; return received;}
+    }
+}
+
+static size_t wsock_pipe_peek(void *self, const void **buf) {
+    struct wsock_pipebuf *b = ((struct wsock_pipe*)self)->in;
+    *buf = b->data + b->first;
+    return WSOCK_PIPE_BUFLEN - b->first < b->len ?
+        WSOCK_PIPE_BUFLEN - b->first : b->len;
+}
+
+static void wsock_pipe_unref(struct wsock_pipebuf *b) {
+    b->closed = 1;
+    wsock_pipe_notify(&b->reader);
+    wsock_pipe_notify(&b->writer);
+    if(--b->refs)
+        return;
+    chclose(b->reader.wake);
+    chclose(b->writer.wake);
+    free(b);
+}
+
+static void wsock_pipe_close(void *self) {
+    struct wsock_pipe *p = (struct wsock_pipe*)self;
+    wsock_pipe_unref(p->in);
+    wsock_pipe_unref(p->out);
+    free(p);
+}
+
+const struct wsock_transport wsock_pipe_transport = {
+    wsock_pipe_send,
+    wsock_pipe_flush,
+    wsock_pipe_recv,
+    wsock_pipe_peek,
+    wsock_pipe_close
+};
+
+static struct wsock_pipebuf *wsock_pipe_buf(void) {
+    struct wsock_pipebuf *b = malloc(sizeof(struct wsock_pipebuf));
+    if(!b)
+        return NULL;
+    b->first = 0;
+    b->len = 0;
+    b->closed = 0;
+    b->reader.waiting = 0;
+    b->reader.wake = chmake(int, 1);
+    b->writer.waiting = 0;
+    b->writer.wake = chmake(int, 1);
+    b->refs = 2;
+    return b;
+}
+
+int wsock_pipe_make(void **a, void **b) {
+    struct wsock_pipe *pa = malloc(sizeof(struct wsock_pipe));
+    if(!pa)
+        goto err0;
+    struct wsock_pipe *pb = malloc(sizeof(struct wsock_pipe));
+    if(!pb)
+        goto err1;
+    pa->in = wsock_pipe_buf();
+    if(!pa->in)
+        goto err2;
+    pa->out = wsock_pipe_buf();
+    if(!pa->out)
+        goto err3;
+    pb->in = pa->out;
+    pb->out = pa->in;
+    *a = pa;
+    *b = pb;
+    return 0;
+err3:
+    chclose(pa->in->reader.wake);
+    chclose(pa->in->writer.wake);
+    free(pa->in);
+err2:
+    free(pb);
+err1:
+    free(pa);
+err0:
+    errno = ENOMEM;
+    return -1;
+}
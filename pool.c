@@ -0,0 +1,247 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "str.h"
+#include "wsock.h"
+
+/* Default limit on connecting and answering pings, unless the health check
+   interval is shorter. */
+#define WSOCK_POOL_TIMEOUT 1000
+
+/* Warm connections to a single (address, url, subprotocol) destination.
+   'conns' is used as a stack so that the most recently checked connections
+   are handed out first. */
+struct wsock_poolentry {
+    struct wsock_poolentry *next;
+    ipaddr addr;
+    struct wsock_str url;
+    struct wsock_str subprotocol;
+    /* Connections being established and being health-checked. */
+    int filling;
+    int checking;
+    int nconns;
+    wsock conns[];
+};
+
+struct wsockpool {
+    struct wsock_poolentry *entries;
+    int size;
+    int64_t interval;
+    int closed;
+    /* Wakes up the health checker when the pool is closed. */
+    chan stop;
+    /* Pool is deallocated once it's closed by the user and all the
+       background coroutines have finished. */
+    int refs;
+};
+
+/* ipaddr may contain uninitialised padding, so only the relevant fields are
+   compared. */
+static int wsock_pool_sameaddr(ipaddr *a, ipaddr *b) {
+    struct sockaddr *sa = (struct sockaddr*)a;
+    struct sockaddr *sb = (struct sockaddr*)b;
+    if(sa->sa_family != sb->sa_family)
+        return 0;
+    if(sa->sa_family == AF_INET) {
+        struct sockaddr_in *ia = (struct sockaddr_in*)sa;
+        struct sockaddr_in *ib = (struct sockaddr_in*)sb;
+        return ia->sin_port == ib->sin_port &&
+            ia->sin_addr.s_addr == ib->sin_addr.s_addr;
+    }
+    struct sockaddr_in6 *ia = (struct sockaddr_in6*)sa;
+    struct sockaddr_in6 *ib = (struct sockaddr_in6*)sb;
+    return ia->sin6_port == ib->sin6_port &&
+        memcmp(&ia->sin6_addr, &ib->sin6_addr, sizeof(ia->sin6_addr)) == 0;
+}
+
+static void wsock_pool_release(struct wsockpool *p) {
+    if(--p->refs)
+        return;
+    while(p->entries) {
+        struct wsock_poolentry *e = p->entries;
+        p->entries = e->next;
+        wsock_str_term(&e->url);
+        wsock_str_term(&e->subprotocol);
+        free(e);
+    }
+    chclose(p->stop);
+    free(p);
+}
+
+static int64_t wsock_pool_timeout(struct wsockpool *p) {
+    return p->interval < WSOCK_POOL_TIMEOUT ? p->interval : WSOCK_POOL_TIMEOUT;
+}
+
+coroutine static void wsock_pool_filler(struct wsockpool *p,
+      struct wsock_poolentry *e) {
+    wsock s = wsockconnect(e->addr, wsock_str_get(&e->subprotocol),
+        wsock_str_get(&e->url), now() + wsock_pool_timeout(p));
+    --e->filling;
+    /* Failures are not retried straight away. The next health check will
+       try again. */
+    if(s) {
+        if(p->closed || e->nconns == p->size)
+            wsockclose(s);
+        else
+            e->conns[e->nconns++] = s;
+    }
+    wsock_pool_release(p);
+}
+
+/* Launches connection attempts to top the entry up to the pool size. */
+static void wsock_pool_fill(struct wsockpool *p, struct wsock_poolentry *e) {
+    while(e->nconns + e->filling + e->checking < p->size) {
+        ++e->filling;
+        ++p->refs;
+        go(wsock_pool_filler(p, e));
+    }
+}
+
+/* Connection is considered healthy if it answers a ping in time. Idle
+   connections are not expected to receive any messages, so one that does
+   is dropped as well. */
+static int wsock_pool_check(struct wsockpool *p, wsock s) {
+    int64_t deadline = now() + wsock_pool_timeout(p);
+    wsockping(s, deadline);
+    if(errno != 0)
+        return -1;
+    wsockrecv(s, NULL, 0, deadline);
+    return errno == EAGAIN ? 0 : -1;
+}
+
+coroutine static void wsock_pool_checker(struct wsockpool *p) {
+    while(!p->closed) {
+        choose {
+        in(p->stop, int, val):
+            (void)val;
+        deadline(now() + p->interval):
+        end
+        }
+        struct wsock_poolentry *e;
+        for(e = p->entries; e && !p->closed; e = e->next) {
+            /* Check each connection that is in the pool at this point once.
+               The connection being checked is taken out of the pool so that
+               it's not handed out in the meantime. */
+            int n = e->nconns;
+            while(n-- && e->nconns && !p->closed) {
+                wsock s = e->conns[0];
+                memmove(e->conns, e->conns + 1,
+                    --e->nconns * sizeof(wsock));
+                ++e->checking;
+                int rc = wsock_pool_check(p, s);
+                --e->checking;
+                if(rc != 0 || p->closed || e->nconns == p->size) {
+                    wsockclose(s);
+                    continue;
+                }
+                e->conns[e->nconns++] = s;
+            }
+            if(!p->closed)
+                wsock_pool_fill(p, e);
+        }
+    }
+    wsock_pool_release(p);
+}
+
+wsockpool wsockpoolmake(int size, int64_t interval) {
+    if(size < 1 || interval <= 0) {errno = EINVAL; return NULL;}
+    struct wsockpool *p = malloc(sizeof(struct wsockpool));
+    if(!p) {errno = ENOMEM; return NULL;}
+    p->entries = NULL;
+    p->size = size;
+    p->interval = interval;
+    p->closed = 0;
+    p->stop = chmake(int, 1);
+    p->refs = 2;
+    go(wsock_pool_checker(p));
+    errno = 0;
+    return p;
+}
+
+static struct wsock_poolentry *wsock_pool_entry(struct wsockpool *p,
+      ipaddr addr, const char *subprotocol, const char *url) {
+    if(!url || !wsock_str_check(url) || !wsock_str_check(subprotocol)) {
+        errno = EINVAL; return NULL;}
+    struct wsock_poolentry *e;
+    for(e = p->entries; e; e = e->next) {
+        if(wsock_pool_sameaddr(&e->addr, &addr) &&
+              wsock_str_eq(wsock_str_get(&e->url), url) &&
+              wsock_str_eq(wsock_str_get(&e->subprotocol), subprotocol))
+            return e;
+    }
+    e = malloc(sizeof(struct wsock_poolentry) + p->size * sizeof(wsock));
+    if(!e) {errno = ENOMEM; return NULL;}
+    e->addr = addr;
+    wsock_str_init(&e->url, url, strlen(url));
+    wsock_str_init(&e->subprotocol, subprotocol, wsock_str_len(subprotocol));
+    e->filling = 0;
+    e->checking = 0;
+    e->nconns = 0;
+    e->next = p->entries;
+    p->entries = e;
+    return e;
+}
+
+void wsockpoolwarm(wsockpool p, ipaddr addr, const char *subprotocol,
+      const char *url) {
+    struct wsock_poolentry *e = wsock_pool_entry(p, addr, subprotocol, url);
+    if(!e)
+        return;
+    wsock_pool_fill(p, e);
+    errno = 0;
+}
+
+wsock wsockpoolconnect(wsockpool p, ipaddr addr, const char *subprotocol,
+      const char *url, int64_t deadline) {
+    struct wsock_poolentry *e = wsock_pool_entry(p, addr, subprotocol, url);
+    if(!e)
+        return NULL;
+    if(e->nconns) {
+        wsock s = e->conns[--e->nconns];
+        wsock_pool_fill(p, e);
+        errno = 0;
+        return s;
+    }
+    /* Nothing warm yet. Connect directly, the pool is being filled
+       in the background. */
+    wsock_pool_fill(p, e);
+    return wsockconnect(addr, subprotocol, url, deadline);
+}
+
+void wsockpoolclose(wsockpool p) {
+    p->closed = 1;
+    struct wsock_poolentry *e;
+    for(e = p->entries; e; e = e->next) {
+        while(e->nconns)
+            wsockclose(e->conns[--e->nconns]);
+    }
+    chs(p->stop, int, 0);
+    wsock_pool_release(p);
+}
@@ -0,0 +1,309 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+#include "wsock.h"
+
+/* Default size of the piece a connection can send in a single turn. */
+#define WSOCK_SCHED_QUANTUM 16384
+/* Rate limits allow for bursts of this many milliseconds worth of
+   traffic. */
+#define WSOCK_SCHED_BURST 100
+
+/* Outgoing data of the attached connections is passed to the transports
+   one piece at a time. Connections waiting for their turn are served by
+   deficit round robin: each time a connection gets to the head of the
+   queue its deficit grows by the quantum and it's allowed to send that
+   many bytes. What it doesn't use, up to another quantum, is kept for later
+   as long as it has more of the message to send. Only one connection holds
+   the turn at a time. */
+struct wsocksched {
+    size_t quantum;
+    struct wsock_schedconn *turn;
+    struct wsock_schedconn *first;
+    struct wsock_schedconn *last;
+    int nconns;
+    struct wsockschedstats stats;
+    /* The user, the listeners and the connections it's attached to. */
+    int refs;
+};
+
+wsocksched wsockschedmake(size_t quantum) {
+    struct wsocksched *sch = malloc(sizeof(struct wsocksched));
+    if(!sch) {errno = ENOMEM; return NULL;}
+    sch->quantum = quantum ? quantum : WSOCK_SCHED_QUANTUM;
+    sch->turn = NULL;
+    sch->first = NULL;
+    sch->last = NULL;
+    sch->nconns = 0;
+    memset(&sch->stats, 0, sizeof(sch->stats));
+    sch->refs = 1;
+    errno = 0;
+    return sch;
+}
+
+void wsockschedstats(wsocksched sch, struct wsockschedstats *stats) {
+    *stats = sch->stats;
+    errno = 0;
+}
+
+void wsockschedclose(wsocksched sch) {
+    wsock_sched_unref(sch);
+}
+
+void wsock_sched_ref(struct wsocksched *sch) {
+    ++sch->refs;
+}
+
+void wsock_sched_unref(struct wsocksched *sch) {
+    if(--sch->refs)
+        return;
+    free(sch);
+}
+
+static void wsock_bucket_init(struct wsock_bucket *b, uint64_t rate) {
+    b->rate = rate;
+    b->burst = rate * WSOCK_SCHED_BURST / 1000;
+    if(b->burst < 1)
+        b->burst = 1;
+    b->level = b->burst * 1000;
+    b->last = now();
+}
+
+/* Takes 'n' tokens from the bucket, waiting for them if needed. 'n' must
+   not exceed the burst. */
+static int wsock_bucket_take(struct wsock_bucket *b, uint64_t n,
+      struct wsock_schedconn *sc, int64_t deadline) {
+    int64_t start = now();
+    int64_t nw = start;
+    int throttled = 0;
+    int timedout = 0;
+    while(1) {
+        b->level += (uint64_t)(nw - b->last) * b->rate;
+        if(b->level > b->burst * 1000)
+            b->level = b->burst * 1000;
+        b->last = nw;
+        if(b->level >= n * 1000)
+            break;
+        if(!throttled) {
+            throttled = 1;
+            ++sc->stats.throttles;
+            if(sc->sch)
+                ++sc->sch->stats.throttles;
+        }
+        int64_t wake = nw + (int64_t)((n * 1000 - b->level + b->rate - 1) /
+            b->rate);
+        if(deadline >= 0 && wake > deadline) {
+            msleep(deadline);
+            timedout = 1;
+            break;
+        }
+        msleep(wake);
+        nw = now();
+    }
+    if(throttled) {
+        nw = now();
+        sc->stats.throttletime += nw - start;
+        if(sc->sch)
+            sc->sch->stats.throttletime += nw - start;
+        if(timedout) {errno = ETIMEDOUT; return -1;}
+    }
+    b->level -= n * 1000;
+    return 0;
+}
+
+void wsock_sched_init(struct wsock_schedconn *sc) {
+    sc->sch = NULL;
+    sc->next = NULL;
+    sc->queued = 0;
+    sc->want = 0;
+    sc->deficit = 0;
+    sc->wake = NULL;
+    wsock_bucket_init(&sc->msgs, 0);
+    wsock_bucket_init(&sc->bytes, 0);
+    memset(&sc->stats, 0, sizeof(sc->stats));
+}
+
+void wsock_sched_term(struct wsock_schedconn *sc) {
+    wsock_sched_attach(sc, NULL);
+}
+
+int wsock_sched_attach(struct wsock_schedconn *sc, struct wsocksched *sch) {
+    if(sc->sch) {
+        --sc->sch->nconns;
+        wsock_sched_unref(sc->sch);
+        chclose(sc->wake);
+        sc->sch = NULL;
+        sc->wake = NULL;
+    }
+    if(sch) {
+        sc->wake = chmake(int, 1);
+        if(!sc->wake) {errno = ENOMEM; return -1;}
+        wsock_sched_ref(sch);
+        ++sch->nconns;
+        sc->sch = sch;
+        sc->deficit = 0;
+    }
+    return 0;
+}
+
+void wsock_sched_limit(struct wsock_schedconn *sc, uint64_t msgrate,
+      uint64_t byterate) {
+    wsock_bucket_init(&sc->msgs, msgrate);
+    wsock_bucket_init(&sc->bytes, byterate);
+}
+
+int wsock_sched_active(struct wsock_schedconn *sc) {
+    return sc->sch || sc->msgs.rate || sc->bytes.rate;
+}
+
+int wsock_sched_msg(struct wsock_schedconn *sc, int64_t deadline) {
+    if(sc->msgs.rate && wsock_bucket_take(&sc->msgs, 1, sc, deadline) != 0)
+        return -1;
+    ++sc->stats.msgs;
+    if(sc->sch)
+        ++sc->sch->stats.msgs;
+    return 0;
+}
+
+/* Gives the turn to the connection at the head of the queue. */
+static void wsock_sched_next(struct wsocksched *sch) {
+    struct wsock_schedconn *sc = sch->first;
+    sch->first = sc->next;
+    if(!sch->first)
+        sch->last = NULL;
+    sc->next = NULL;
+    sc->queued = 0;
+    --sch->stats.queued;
+    sc->stats.queued = 0;
+    sc->deficit += sch->quantum - sc->want;
+    if(sc->deficit > sch->quantum)
+        sc->deficit = sch->quantum;
+    sch->turn = sc;
+    chs(sc->wake, int, 0);
+}
+
+static void wsock_sched_unqueue(struct wsocksched *sch,
+      struct wsock_schedconn *sc) {
+    struct wsock_schedconn **p = &sch->first;
+    struct wsock_schedconn *prev = NULL;
+    while(*p != sc) {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    *p = sc->next;
+    if(sch->last == sc)
+        sch->last = prev;
+    sc->next = NULL;
+    sc->queued = 0;
+    --sch->stats.queued;
+    sc->stats.queued = 0;
+}
+
+size_t wsock_sched_acquire(struct wsock_schedconn *sc, size_t len,
+      int64_t deadline) {
+    struct wsocksched *sch = sc->sch;
+    /* The piece is sized so that the deficit topped up by the quantum is
+       enough for it. */
+    size_t want = len;
+    if(sch && want > sc->deficit + sch->quantum)
+        want = sc->deficit + sch->quantum;
+    if(sc->bytes.rate) {
+        if(want > sc->bytes.burst)
+            want = sc->bytes.burst;
+        if(wsock_bucket_take(&sc->bytes, want, sc, deadline) != 0)
+            return 0;
+    }
+    if(!sch)
+        goto granted;
+    /* Nobody else wants to send. No need to keep track of the deficit. */
+    if(!sch->turn && !sch->first) {
+        sc->deficit = 0;
+        sch->turn = sc;
+        goto granted;
+    }
+    sc->want = want;
+    sc->queued = 1;
+    if(sch->last)
+        sch->last->next = sc;
+    else
+        sch->first = sc;
+    sch->last = sc;
+    sc->stats.queued = 1;
+    if(++sch->stats.queued > sch->stats.maxqueued)
+        sch->stats.maxqueued = sch->stats.queued;
+    ++sc->stats.waits;
+    ++sch->stats.waits;
+    if(!sch->turn)
+        wsock_sched_next(sch);
+    int64_t start = now();
+    int timedout = 0;
+    choose {
+    in(sc->wake, int, val):
+        (void)val;
+    deadline(deadline):
+        timedout = 1;
+    end
+    }
+    sc->stats.waittime += now() - start;
+    sch->stats.waittime += now() - start;
+    if(timedout) {
+        if(sc->queued) {
+            wsock_sched_unqueue(sch, sc);
+            /* The tokens weren't used. */
+            sc->bytes.level += sc->bytes.rate ? want * 1000 : 0;
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        /* The turn came along with the deadline. Take it anyway, the send
+           itself will time out and hand it over. */
+        (void)chr(sc->wake, int);
+    }
+granted:
+    sc->stats.bytes += want;
+    if(sch)
+        sch->stats.bytes += want;
+    return want;
+}
+
+void wsock_sched_release(struct wsock_schedconn *sc, int last) {
+    struct wsocksched *sch = sc->sch;
+    if(!sch)
+        return;
+    int err = errno;
+    if(last)
+        sc->deficit = 0;
+    sch->turn = NULL;
+    if(sch->first)
+        wsock_sched_next(sch);
+    /* Let the other connections get to the scheduler before taking
+       the next turn. */
+    else if(sch->nconns > 1)
+        yield();
+    errno = err;
+}
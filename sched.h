@@ -0,0 +1,92 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#ifndef WSOCK_SCHED_INCLUDED
+#define WSOCK_SCHED_INCLUDED
+
+#include <libmill.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wsock.h"
+
+/*  Token bucket. 'level' is kept in thousandths of a token so that it can
+    be refilled every millisecond without rounding it away. */
+struct wsock_bucket {
+    uint64_t rate;
+    uint64_t burst;
+    uint64_t level;
+    int64_t last;
+};
+
+/*  Sending side of a connection as seen by the scheduler. Embedded into
+    struct wsock. 'sch' is NULL if the connection is not scheduled, in which
+    case only the rate limits apply, if any. */
+struct wsock_schedconn {
+    struct wsocksched *sch;
+    /*  Connections waiting for their turn are queued. 'want' is the size of
+        the piece asked for. */
+    struct wsock_schedconn *next;
+    int queued;
+    size_t want;
+    size_t deficit;
+    chan wake;
+    struct wsock_bucket msgs;
+    struct wsock_bucket bytes;
+    struct wsockschedstats stats;
+};
+
+/*  Scheduler is shared by the user, the listeners and the connections it's
+    attached to. It goes away once all of them are done with it. */
+void wsock_sched_ref(struct wsocksched *sch);
+void wsock_sched_unref(struct wsocksched *sch);
+
+void wsock_sched_init(struct wsock_schedconn *sc);
+void wsock_sched_term(struct wsock_schedconn *sc);
+
+/*  Attaches the connection to the scheduler, or detaches it if 'sch' is
+    NULL. Must not be done while the connection is sending. */
+int wsock_sched_attach(struct wsock_schedconn *sc, struct wsocksched *sch);
+
+/*  Sets the rate limits, 0 meaning no limit. */
+void wsock_sched_limit(struct wsock_schedconn *sc, uint64_t msgrate,
+    uint64_t byterate);
+
+/*  Returns 1 if the connection is scheduled or rate-limited. */
+int wsock_sched_active(struct wsock_schedconn *sc);
+
+/*  Called before the first byte of a message is sent. Waits for the message
+    rate limit. Returns -1 with errno set to ETIMEDOUT if the deadline
+    expires. */
+int wsock_sched_msg(struct wsock_schedconn *sc, int64_t deadline);
+
+/*  Waits until the connection may pass the next piece of the payload, at
+    most 'len' bytes, to the transport. Returns the size of the piece, or 0
+    with errno set to ETIMEDOUT. Once done, the connection has to give
+    the turn back by wsock_sched_release(). 'last' is set if the message
+    is complete. Releasing leaves errno unchanged. */
+size_t wsock_sched_acquire(struct wsock_schedconn *sc, size_t len,
+    int64_t deadline);
+void wsock_sched_release(struct wsock_schedconn *sc, int last);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "sockopt.h"
+#include "wsock.h"
+
+#if !defined SO_BUSY_POLL && defined __linux__
+#define SO_BUSY_POLL 46
+#endif
+
+/* OS-level level and name of each option, indexed by the option.
+   Level 0 means the option is not available on this platform. */
+static const struct {int level; int name;} wsock_sockopts[WSOCK_NSOCKOPTS] = {
+    {0, 0},
+    {IPPROTO_TCP, TCP_NODELAY},
+#if defined TCP_QUICKACK
+    {IPPROTO_TCP, TCP_QUICKACK},
+#else
+    {0, 0},
+#endif
+    {SOL_SOCKET, SO_SNDBUF},
+    {SOL_SOCKET, SO_RCVBUF},
+#if defined SO_BUSY_POLL
+    {SOL_SOCKET, SO_BUSY_POLL},
+#else
+    {0, 0},
+#endif
+#if defined TCP_NOTSENT_LOWAT
+    {IPPROTO_TCP, TCP_NOTSENT_LOWAT}
+#else
+    {0, 0}
+#endif
+};
+
+/* Low latency: no Nagle, no delayed ACKs, short send queue so that fresh
+   messages don't wait behind stale ones and a little busy polling.
+   Bulk: Nagle on and large buffers so that the window never closes. */
+static const struct {
+    const char *name;
+    int vals[WSOCK_NSOCKOPTS];
+} wsock_profiles[] = {
+    {"low-latency", {-1, 1, 1, -1, -1, 50, 16384}},
+    {"bulk", {-1, 0, 0, 4 * 1024 * 1024, 4 * 1024 * 1024, -1, -1}}
+};
+
+int wsock_sockopt_set(int fd, int opt, int val) {
+    if(opt <= 0 || opt >= WSOCK_NSOCKOPTS || val < 0) {
+        errno = EINVAL; return -1;}
+    if(!wsock_sockopts[opt].level) {errno = ENOTSUP; return -1;}
+    if(setsockopt(fd, wsock_sockopts[opt].level, wsock_sockopts[opt].name,
+          &val, sizeof(val)) != 0)
+        return -1;
+    errno = 0;
+    return 0;
+}
+
+int wsock_sockopt_get(int fd, int opt) {
+    if(opt <= 0 || opt >= WSOCK_NSOCKOPTS) {errno = EINVAL; return -1;}
+    if(!wsock_sockopts[opt].level) {errno = ENOTSUP; return -1;}
+    int val;
+    socklen_t sz = sizeof(val);
+    if(getsockopt(fd, wsock_sockopts[opt].level, wsock_sockopts[opt].name,
+          &val, &sz) != 0)
+        return -1;
+    errno = 0;
+    return val;
+}
+
+int wsock_sockopt_profile(const char *name, int *vals) {
+    int i;
+    for(i = 0; i != sizeof(wsock_profiles) / sizeof(wsock_profiles[0]);
+          ++i) {
+        if(strcmp(name, wsock_profiles[i].name) == 0) {
+            memcpy(vals, wsock_profiles[i].vals,
+                sizeof(wsock_profiles[i].vals));
+            errno = 0;
+            return 0;
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+int wsock_sockopt_apply(int fd, const int *vals) {
+    struct sockaddr_storage ss;
+    socklen_t sz = sizeof(ss);
+    if(getsockname(fd, (struct sockaddr*)&ss, &sz) != 0)
+        return -1;
+    int opt;
+    for(opt = 1; opt != WSOCK_NSOCKOPTS; ++opt) {
+        if(vals[opt] < 0 || !wsock_sockopts[opt].level)
+            continue;
+        if(ss.ss_family == AF_UNIX && wsock_sockopts[opt].level == IPPROTO_TCP)
+            continue;
+        if(wsock_sockopt_set(fd, opt, vals[opt]) != 0) {
+            if(opt == WSOCK_BUSYPOLL && errno == EPERM)
+                continue;
+            return -1;
+        }
+    }
+    errno = 0;
+    return 0;
+}
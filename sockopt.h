@@ -0,0 +1,46 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#ifndef WSOCK_SOCKOPT_INCLUDED
+#define WSOCK_SOCKOPT_INCLUDED
+
+/*  Mapping of the WSOCK_* socket options to the OS-level ones. Option values
+    are stored in arrays indexed by the option. -1 means the option is not
+    set. */
+
+#define WSOCK_NSOCKOPTS 7
+
+/*  Set or get a single option. Return -1 with errno set on error. */
+int wsock_sockopt_set(int fd, int opt, int val);
+int wsock_sockopt_get(int fd, int opt);
+
+/*  Fills in the option values of a named profile. Returns -1 and sets errno
+    to EINVAL if there's no such profile. */
+int wsock_sockopt_profile(const char *name, int *vals);
+
+/*  Applies all the set options to the socket. This is best effort: TCP-level
+    options are skipped on Unix domain sockets and busy polling is skipped if
+    the process is not allowed to use it. */
+int wsock_sockopt_apply(int fd, const int *vals);
+
+#endif
@@ -21,6 +21,7 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,3 +68,17 @@ int wsock_str_eq(const char *s1, const char *s2) {
     return strcmp(s1, s2) ? 0 : 1;
 }
 
+/* Strings that go into the HTTP headers must be non-empty and printable.
+   NULL is accepted. Returns 0 and sets errno to EINVAL otherwise. */
+int wsock_str_check(const char *s) {
+    if(s) {
+        int i = 0;
+        while(s[i]) {
+            if(s[i] < 32 || s[i] > 127) {errno = EINVAL; return 0;}
+            ++i;
+        }
+        if(i == 0) {errno = EINVAL; return 0;}
+    }
+    errno = 0;
+    return 1;
+}
@@ -42,5 +42,6 @@ const char *wsock_str_get(struct wsock_str *self);
 
 size_t wsock_str_len(const char *s);
 int wsock_str_eq(const char *s1, const char *s2);
+int wsock_str_check(const char *s);
 
 #endif
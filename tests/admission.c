@@ -0,0 +1,122 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Client that starts the opening handshake and then goes silent. */
+coroutine void slowclient(chan done) {
+    tcpsock s = tcpconnect(iplocal("127.0.0.1", 5555, 0), -1);
+    assert(s);
+    tcpsend(s, "GET / HTTP/1.1\r\n", 16, -1);
+    assert(errno == 0);
+    tcpflush(s, -1);
+    assert(errno == 0);
+    /* Server should give up once the handshake timeout expires. */
+    char c;
+    tcprecv(s, &c, 1, -1);
+    assert(errno == ECONNRESET);
+    tcpclose(s);
+    chs(done, int, 0);
+}
+
+coroutine void client(chan done) {
+    msleep(now() + 50);
+    wsock s = wsockconnect(iplocal("127.0.0.1", 5555, 0), NULL, "/", -1);
+    assert(s);
+    wsockclose(s);
+    chs(done, int, 0);
+}
+
+/* Client that is expected to be turned away because of server overload. */
+coroutine void shedclient(chan done) {
+    msleep(now() + 50);
+    tcpsock s = tcpconnect(iplocal("127.0.0.1", 5555, 0), -1);
+    assert(s);
+    char buf[64];
+    size_t sz = tcprecvuntil(s, buf, sizeof(buf), "\n", 1, -1);
+    assert(errno == 0);
+    assert(sz >= 12 && memcmp(buf, "HTTP/1.1 503", 12) == 0);
+    tcpclose(s);
+    chs(done, int, 0);
+}
+
+int main() {
+    ipaddr addr = iplocal("127.0.0.1", 5555, 0);
+    chan done = chmake(int, 0);
+
+    /* Slow client doesn't block other clients from being accepted. */
+    wsock ls = wsocklisten(addr, NULL, 10);
+    assert(ls);
+    wsockadmission(ls, 500, 2);
+    assert(errno == 0);
+    go(slowclient(done));
+    go(client(done));
+    int64_t start = now();
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    assert(now() - start < 500);
+    wsockclose(s);
+    (void)chr(done, int);
+    /* Slow client is eventually disconnected. */
+    (void)chr(done, int);
+    assert(now() - start >= 500);
+    /* The settings can't be changed once the socket is accepting. */
+    wsockadmission(ls, 500, 10);
+    assert(errno == EBUSY);
+    wsockclose(ls);
+
+    /* Connections over the limit are refused. */
+    ls = wsocklisten(addr, NULL, 10);
+    assert(ls);
+    wsockadmission(ls, 500, 1);
+    assert(errno == 0);
+    go(slowclient(done));
+    go(shedclient(done));
+    s = wsockaccept(ls, now() + 200);
+    assert(!s && errno == ETIMEDOUT);
+    (void)chr(done, int);
+    (void)chr(done, int);
+    wsockclose(ls);
+
+    /* Closing the listener doesn't have to wait for the background
+       accepting to notice. */
+    ls = wsocklisten(addr, NULL, 10);
+    assert(ls);
+    s = wsockaccept(ls, now() + 10);
+    assert(!s && errno == ETIMEDOUT);
+    start = now();
+    wsockclose(ls);
+    assert(now() - start < 50);
+    ls = wsocklisten(addr, NULL, 10);
+    assert(ls);
+    wsockclose(ls);
+
+    chclose(done);
+    return 0;
+}
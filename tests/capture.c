@@ -0,0 +1,200 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+static char path[] = "/tmp/wsockcapXXXXXX";
+static char *log;
+static size_t logsz;
+static size_t logpos;
+
+/* Reads the whole log and checks the header. */
+static struct wsockcaphdr *readlog(void) {
+    free(log);
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    fseek(f, 0, SEEK_END);
+    logsz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    log = malloc(logsz);
+    assert(log);
+    assert(fread(log, 1, logsz, f) == logsz);
+    fclose(f);
+    struct wsockcaphdr *hdr = (struct wsockcaphdr*)log;
+    assert(memcmp(hdr->magic, WSOCK_CAPMAGIC, 8) == 0);
+    assert(hdr->version == WSOCK_CAPVERSION);
+    /* The unused part of the file was cut off. */
+    assert(hdr->used == logsz);
+    logpos = sizeof(struct wsockcaphdr);
+    return hdr;
+}
+
+/* Checks the next record. If 'data' is not NULL it has to match what was
+   stored. */
+static struct wsockcaprec *next(uint32_t conn, int dir, int opcode,
+      uint64_t size, const char *data, size_t stored) {
+    assert(logpos + sizeof(struct wsockcaprec) <= logsz);
+    struct wsockcaprec *rec = (struct wsockcaprec*)(log + logpos);
+    assert(rec->conn == conn && rec->dir == dir && rec->opcode == opcode);
+    assert(rec->size == size && rec->stored == stored);
+    if(data)
+        assert(memcmp(rec + 1, data, stored) == 0);
+    logpos += (sizeof(struct wsockcaprec) + stored + 7) & ~(size_t)7;
+    return rec;
+}
+
+coroutine void connector(chan ch) {
+    wsock c = wsockconnect(ipremote("127.0.0.1", 5581, 0, -1), NULL, "/", -1);
+    chs(ch, wsock, c);
+}
+
+int main() {
+    static char big[1000];
+    memset(big, 'x', sizeof(big));
+    char buf[16];
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    /* Messages and control frames in both directions. */
+    wsockcap cap = wsockcapopen(path, 1024 * 1024, 0);
+    assert(cap);
+    wsock c, s;
+    wsockpair(&c, &s);
+    wsockcapture(c, cap);
+    assert(errno == 0);
+    wsockcapture(s, cap);
+    assert(errno == 0);
+    wsocksend(c, "ABC", 3, -1);
+    assert(errno == 0);
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3);
+    wsocksend(s, big, sizeof(big), -1);
+    assert(errno == 0);
+    sz = wsockrecv(c, buf, 10, -1);
+    assert(errno == 0 && sz == sizeof(big));
+    wsockping(c, -1);
+    assert(errno == 0);
+    wsocksend(c, "X", 1, -1);
+    assert(errno == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 1);
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == EAGAIN);
+    wsockdone(c, -1);
+    assert(errno == 0);
+    wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    /* The log is closed once the connections are gone. */
+    wsockcapclose(cap);
+    wsockclose(c);
+    wsockclose(s);
+    struct wsockcaphdr *hdr = readlog();
+    assert(hdr->flags == 0 && hdr->dropped == 0);
+    next(1, WSOCK_CAPOUT, 2, 3, "ABC", 3);
+    next(2, WSOCK_CAPIN, 2, 3, "ABC", 3);
+    next(2, WSOCK_CAPOUT, 2, sizeof(big), big, sizeof(big));
+    /* Only the part of the message that fit into the buffer is stored. */
+    next(1, WSOCK_CAPIN, 2, sizeof(big), big, 10);
+    next(1, WSOCK_CAPOUT, 9, 0, NULL, 0);
+    next(1, WSOCK_CAPOUT, 2, 1, "X", 1);
+    next(2, WSOCK_CAPIN, 9, 0, NULL, 0);
+    next(2, WSOCK_CAPIN, 2, 1, "X", 1);
+    next(1, WSOCK_CAPIN, 10, 0, NULL, 0);
+    next(1, WSOCK_CAPOUT, 8, 0, NULL, 0);
+    next(2, WSOCK_CAPIN, 8, 0, NULL, 0);
+    struct wsockcaprec *rec = next(1, WSOCK_CAPIN, 8, 0, NULL, 0);
+    assert(logpos == logsz);
+    assert(rec->time < 10000000);
+
+    /* Hashes instead of payloads. The log is passed on to the connections
+       accepted by a listener. */
+    cap = wsockcapopen(path, 1024 * 1024, WSOCK_CAPHASH);
+    assert(cap);
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5581, 0), NULL, 10);
+    assert(ls);
+    wsockcapture(ls, cap);
+    wsockcapclose(cap);
+    chan ch = chmake(wsock, 1);
+    go(connector(ch));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(ch, wsock);
+    assert(c);
+    chclose(ch);
+    wsocksend(c, "ABC", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3);
+    wsockclose(c);
+    wsockclose(s);
+    wsockclose(ls);
+    hdr = readlog();
+    assert(hdr->flags == WSOCK_CAPHASH);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+    for(i = 0; i != 3; ++i) {
+        h ^= (uint8_t)"ABC"[i];
+        h *= 0x100000001b3ULL;
+    }
+    next(1, WSOCK_CAPIN, 2, 3, (const char*)&h, 8);
+    assert(logpos == logsz);
+
+    /* Records that don't fit are dropped. */
+    cap = wsockcapopen(path, sizeof(struct wsockcaphdr) + 64, 0);
+    assert(cap);
+    wsockpair(&c, &s);
+    wsockcapture(c, cap);
+    wsocksend(c, big, 100, -1);
+    assert(errno == 0);
+    wsocksend(c, big, 8, -1);
+    assert(errno == 0);
+    wsockcapclose(cap);
+    wsockclose(c);
+    wsockclose(s);
+    hdr = readlog();
+    assert(hdr->dropped == 1);
+    next(1, WSOCK_CAPOUT, 2, 8, big, 8);
+    assert(logpos == logsz);
+
+    /* Invalid arguments. */
+    cap = wsockcapopen(path, 10, 0);
+    assert(!cap && errno == EINVAL);
+    cap = wsockcapopen(path, 1024, 2);
+    assert(!cap && errno == EINVAL);
+
+    free(log);
+    unlink(path);
+    return 0;
+}
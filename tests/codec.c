@@ -0,0 +1,172 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Moves the queued output of one codec to another one, 'step' bytes at
+   a time. Returns the type of the last event. */
+static int transfer(wsockcodec from, wsockcodec to, size_t step) {
+    const void *out;
+    size_t sz = wsockcodecpending(from, &out);
+    assert(sz > 0);
+    uint8_t *buf = malloc(sz);
+    assert(buf);
+    memcpy(buf, out, sz);
+    wsockcodecsent(from, sz);
+    int type = WSOCK_NONE;
+    size_t pos = 0;
+    while(pos != sz) {
+        size_t len = sz - pos < step ? sz - pos : step;
+        struct wsockevent ev;
+        size_t consumed = wsockcodecfeed(to, buf + pos, len, &ev);
+        assert(errno == 0);
+        if(ev.type != WSOCK_NONE)
+            type = ev.type;
+        pos += consumed;
+    }
+    free(buf);
+    return type;
+}
+
+/* Feeds a complete message to the codec in chunks of 'step' bytes and
+   checks that it's received intact. */
+static void deliver(wsockcodec c, uint8_t *buf, size_t sz, const uint8_t *msg,
+      size_t len, size_t step) {
+    size_t pos = 0;
+    size_t received = 0;
+    int last = 0;
+    while(pos != sz) {
+        size_t chunk = sz - pos < step ? sz - pos : step;
+        struct wsockevent ev;
+        size_t consumed = wsockcodecfeed(c, buf + pos, chunk, &ev);
+        assert(errno == 0);
+        assert(!last);
+        if(ev.type == WSOCK_DATA) {
+            assert(received + ev.len <= len);
+            assert(memcmp(ev.data, msg + received, ev.len) == 0);
+            received += ev.len;
+            last = ev.last;
+        }
+        else {
+            assert(ev.type == WSOCK_NONE);
+        }
+        pos += consumed;
+    }
+    assert(last);
+    assert(received == len);
+}
+
+int main() {
+    /* Opening handshake, one byte at a time in one direction. */
+    wsockcodec c = wsockcodecclient("sp1,sp2", "/a/b");
+    assert(c);
+    wsockcodec s = wsockcodecserver("sp2,sp3");
+    assert(s);
+    assert(wsockcodecwant(s) == 1);
+    assert(transfer(c, s, 1) == WSOCK_OPEN);
+    assert(strcmp(wsockcodecurl(s), "/a/b") == 0);
+    assert(strcmp(wsockcodecsubprotocol(s), "sp2") == 0);
+    assert(transfer(s, c, 1000) == WSOCK_OPEN);
+    assert(strcmp(wsockcodecsubprotocol(c), "sp2") == 0);
+    assert(wsockcodecwant(c) == 2);
+
+    /* Messages of different sizes in both directions, fed in chunks of
+       different sizes. */
+    static uint8_t msg[100000];
+    static uint8_t buf[sizeof(msg) + WSOCK_MAXHEADER];
+    size_t i;
+    for(i = 0; i != sizeof(msg); ++i)
+        msg[i] = (uint8_t)(i * 7);
+    size_t sizes[] = {0, 1, 125, 126, 65535, 65536, sizeof(msg)};
+    size_t steps[] = {1, 7, 4096, sizeof(buf)};
+    size_t j, k;
+    for(j = 0; j != sizeof(sizes) / sizeof(sizes[0]); ++j) {
+        for(k = 0; k != sizeof(steps) / sizeof(steps[0]); ++k) {
+            if(sizes[j] > 1000 && steps[k] < 1000)
+                continue;
+            size_t sz = wsockcodecencode(c, msg, sizes[j], buf, sizeof(buf));
+            assert(errno == 0);
+            deliver(s, buf, sz, msg, sizes[j], steps[k]);
+            /* Server-side frames are not masked. */
+            sz = wsockcodecheader(s, sizes[j], buf);
+            memcpy(buf + sz, msg, sizes[j]);
+            wsockcodecmask(s, buf + sz, sizes[j]);
+            deliver(c, buf, sz + sizes[j], msg, sizes[j], steps[k]);
+        }
+    }
+
+    /* Caller's buffer too small. */
+    size_t sz = wsockcodecencode(c, msg, 100, buf, 101);
+    assert(sz == 0 && errno == ENOBUFS);
+
+    /* Ping is answered automatically. */
+    wsockcodecping(c);
+    assert(errno == 0);
+    assert(transfer(c, s, 1) == WSOCK_PING);
+    assert(transfer(s, c, 1) == WSOCK_PONG);
+
+    /* Closing handshake. */
+    wsockcodecdone(c);
+    assert(errno == 0);
+    assert(transfer(c, s, 3) == WSOCK_CLOSE);
+    assert(transfer(s, c, 3) == WSOCK_CLOSE);
+    const void *out;
+    assert(wsockcodecpending(c, &out) == 0);
+    struct wsockevent ev;
+    wsockcodecfeed(s, buf, 1, &ev);
+    assert(errno == ECONNRESET);
+    wsockcodecclose(c);
+    wsockcodecclose(s);
+
+    /* Unmasked frame from a client is a protocol error. */
+    c = wsockcodecclient(NULL, "/");
+    assert(c);
+    s = wsockcodecserver(NULL);
+    assert(s);
+    assert(transfer(c, s, 100) == WSOCK_OPEN);
+    assert(wsockcodecsubprotocol(s) == NULL);
+    assert(transfer(s, c, 100) == WSOCK_OPEN);
+    uint8_t bad[] = {0x82, 0x01, 'A'};
+    wsockcodecfeed(s, bad, sizeof(bad), &ev);
+    assert(errno == EPROTO);
+    wsockcodecfeed(s, bad, sizeof(bad), &ev);
+    assert(errno == EPROTO);
+    wsockcodecclose(c);
+    wsockcodecclose(s);
+
+    /* Garbage instead of the opening handshake. */
+    s = wsockcodecserver(NULL);
+    assert(s);
+    char req[] = "POST / HTTP/1.1\r\n";
+    wsockcodecfeed(s, req, sizeof(req) - 1, &ev);
+    assert(errno == EPROTO);
+    wsockcodecclose(s);
+
+    return 0;
+}
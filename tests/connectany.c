@@ -0,0 +1,162 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <fcntl.h>
+#include <libmill.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Addresses that accept, refuse and never answer connections. */
+static ipaddr good;
+static ipaddr refused;
+static ipaddr blackhole;
+
+struct dialargs {
+    const ipaddr *addrs;
+    int naddrs;
+    int64_t delay;
+};
+
+coroutine void dial(struct dialargs args, chan conns) {
+    wsock c = wsockconnectany(args.addrs, args.naddrs, NULL, "/", args.delay,
+        now() + 5000);
+    assert(c);
+    chs(conns, wsock, c);
+}
+
+/* Number of open file descriptors. */
+static int countfds(void) {
+    int n = 0;
+    int fd;
+    for(fd = 0; fd != 1024; ++fd) {
+        if(fcntl(fd, F_GETFD) != -1)
+            ++n;
+    }
+    return n;
+}
+
+/* Connects to the listener through the given addresses and returns how long
+   it took. */
+static int64_t race(wsock ls, const ipaddr *addrs, int naddrs,
+      int64_t delay) {
+    chan conns = chmake(wsock, 1);
+    struct dialargs args = {addrs, naddrs, delay};
+    int64_t start = now();
+    go(dial(args, conns));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    wsock c = chr(conns, wsock);
+    int64_t elapsed = now() - start;
+    wsocksend(c, "ABC", 3, -1);
+    assert(errno == 0);
+    char buf[3];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    wsockclose(c);
+    wsockclose(s);
+    chclose(conns);
+    return elapsed;
+}
+
+int main() {
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5588, 0), NULL, 10);
+    assert(ls);
+    good = ipremote("127.0.0.1", 5588, 0, -1);
+    refused = ipremote("127.0.0.1", 5590, 0, -1);
+    /* Once the backlog of a listener that never accepts is full, further
+       connection attempts are left hanging. */
+    tcpsock bls = tcplisten(iplocal("127.0.0.1", 5589, 0), 0);
+    assert(bls);
+    blackhole = ipremote("127.0.0.1", 5589, 0, -1);
+    tcpsock filler = tcpconnect(blackhole, -1);
+    assert(filler);
+
+    /* The first address works. */
+    ipaddr addrs[3] = {good, blackhole, blackhole};
+    int64_t elapsed = race(ls, addrs, 3, 1000);
+    assert(elapsed < 500);
+
+    /* The first address doesn't answer. The second attempt starts after
+       the delay and wins; the first one is cancelled straight away. */
+    addrs[0] = blackhole;
+    addrs[1] = good;
+    /* Closed connections may take a moment to release their sockets. */
+    msleep(now() + 10);
+    int nfds = countfds();
+    elapsed = race(ls, addrs, 2, 250);
+    assert(elapsed >= 200 && elapsed < 1000);
+    msleep(now() + 10);
+    assert(countfds() == nfds);
+
+    /* The first address refuses the connection. The second attempt starts
+       straight away so the third one starts after a single delay. */
+    addrs[0] = refused;
+    addrs[1] = blackhole;
+    addrs[2] = good;
+    elapsed = race(ls, addrs, 3, 1000);
+    assert(elapsed >= 900 && elapsed < 1800);
+    /* With no delay all the attempts start at once. */
+    elapsed = race(ls, addrs + 1, 2, 0);
+    assert(elapsed < 500);
+
+    /* Address families alternate. The IPv6 address is tried second even
+       though it comes last. Skipped if IPv6 isn't available. */
+    wsock ls6 = wsocklisten(iplocal("::1", 5591, 0), NULL, 10);
+    if(ls6) {
+        addrs[0] = blackhole;
+        addrs[1] = blackhole;
+        addrs[2] = ipremote("::1", 5591, 0, -1);
+        elapsed = race(ls6, addrs, 3, 200);
+        assert(elapsed >= 150 && elapsed < 350);
+        wsockclose(ls6);
+    }
+
+    /* All attempts fail. */
+    addrs[0] = refused;
+    addrs[1] = refused;
+    wsock c = wsockconnectany(addrs, 2, NULL, "/", 1000, -1);
+    assert(!c && errno == ECONNREFUSED);
+    int64_t deadline = now() + 300;
+    addrs[1] = blackhole;
+    c = wsockconnectany(addrs, 2, NULL, "/", 1000, deadline);
+    assert(!c && errno == ETIMEDOUT);
+    assert(now() >= deadline - 50 && now() < deadline + 500);
+
+    /* Invalid arguments. */
+    c = wsockconnectany(addrs, 0, NULL, "/", 0, -1);
+    assert(!c && errno == EINVAL);
+    c = wsockconnectany(NULL, 1, NULL, "/", 0, -1);
+    assert(!c && errno == EINVAL);
+    c = wsockconnectany(addrs, 1, NULL, "/", -1, -1);
+    assert(!c && errno == EINVAL);
+
+    tcpclose(filler);
+    tcpclose(bls);
+    wsockclose(ls);
+
+    return 0;
+}
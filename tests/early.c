@@ -0,0 +1,132 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+static char big[10000];
+
+/* Reads the upgrade request and turns it down. */
+coroutine void rejecter(tcpsock ls) {
+    tcpsock u = tcpaccept(ls, -1);
+    assert(errno == 0);
+    char buf[1024];
+    while(1) {
+        size_t sz = tcprecvuntil(u, buf, sizeof(buf), "\n", 1, -1);
+        assert(errno == 0);
+        if(sz <= 2)
+            break;
+    }
+    const char *reply = "HTTP/1.1 403 Forbidden\r\n\r\n";
+    tcpsend(u, reply, strlen(reply), -1);
+    assert(errno == 0);
+    tcpflush(u, -1);
+    assert(errno == 0);
+    tcpclose(u);
+}
+
+static struct wsockmsg msgs[3] = {
+    {"ABC", 3},
+    {NULL, 0},
+    {big, sizeof(big)}
+};
+
+coroutine void connector(chan ch, const char *subprotocol, int nmsgs) {
+    wsock c = wsockconnectearly(ipremote("127.0.0.1", 5564, 0, -1),
+        subprotocol, "/", msgs, nmsgs, -1);
+    assert(c);
+    chs(ch, wsock, c);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != sizeof(big); ++i)
+        big[i] = (char)i;
+
+    /* Messages sent along with the handshake arrive in order. */
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5564, 0), "a,b", 10);
+    assert(ls);
+    chan ch = chmake(wsock, 0);
+    go(connector(ch, "b", 3));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    wsock c = chr(ch, wsock);
+    assert(strcmp(wsocksubprotocol(c), "b") == 0);
+    char buf[sizeof(big)];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == sizeof(big));
+    assert(memcmp(buf, big, sizeof(big)) == 0);
+    wsocksend(s, "DEF", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "DEF", 3) == 0);
+
+    /* The connection goes on as usual afterwards. */
+    wsocksend(c, "GHI", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "GHI", 3) == 0);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* No early messages is the same as wsockconnect(). */
+    go(connector(ch, NULL, 0));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(ch, wsock);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Server doesn't support the subprotocol and drops the connection. */
+    ipaddr addr = ipremote("127.0.0.1", 5564, 0, -1);
+    c = wsockconnectearly(addr, "c", "/", msgs, 3, -1);
+    assert(!c && errno == ECONNRESET);
+    chclose(ch);
+    wsockclose(ls);
+
+    /* Server refuses the upgrade. */
+    tcpsock rls = tcplisten(iplocal("127.0.0.1", 5565, 0), 10);
+    assert(rls);
+    go(rejecter(rls));
+    c = wsockconnectearly(ipremote("127.0.0.1", 5565, 0, -1), NULL, "/",
+        msgs, 3, -1);
+    assert(!c && errno == EPROTO);
+    tcpclose(rls);
+
+    /* Invalid arguments. */
+    c = wsockconnectearly(addr, NULL, "/", NULL, 1, -1);
+    assert(!c && errno == EINVAL);
+    c = wsockconnectearly(addr, NULL, "/", msgs, -1, -1);
+    assert(!c && errno == EINVAL);
+
+    return 0;
+}
@@ -0,0 +1,327 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+/* Inverts all the bits of messages of 4 bytes or more. */
+static int opened = 0;
+static int closed = 0;
+
+static void *inv_open(void *arg, int client) {
+    if(arg) {errno = EACCES; return NULL;}
+    ++opened;
+    return malloc(100000);
+}
+
+static size_t inv_encode(void *state, const void *msg, size_t len,
+      const void **out) {
+    if(len < 4)
+        return 0;
+    assert(len <= 100000);
+    size_t i;
+    for(i = 0; i != len; ++i)
+        ((uint8_t*)state)[i] = ~((const uint8_t*)msg)[i];
+    *out = state;
+    return len;
+}
+
+static size_t inv_decode(void *state, const void *in, size_t inlen,
+      void *out, size_t outlen) {
+    size_t i;
+    for(i = 0; i != inlen && i != outlen; ++i)
+        ((uint8_t*)out)[i] = ~((const uint8_t*)in)[i];
+    errno = 0;
+    return inlen;
+}
+
+static void inv_close(void *state) {
+    ++closed;
+    free(state);
+}
+
+static struct wsockext inv = {"x-inv; v=1", inv_open, inv_encode,
+    inv_decode, inv_close, NULL};
+
+coroutine void makeconn(const struct wsockext *ext, chan ch) {
+    ipaddr addr = ipremote("127.0.0.1", 5574, 0, -1);
+    wsock c = ext ? wsockconnectext(addr, NULL, "/", ext, -1) :
+        wsockconnect(addr, NULL, "/", -1);
+    chs(ch, wsock, c);
+}
+
+/* Connects to the listener and returns both ends of the connection. */
+static void connectpair(wsock ls, const struct wsockext *ext, wsock *c,
+      wsock *s) {
+    chan ch = chmake(wsock, 1);
+    go(makeconn(ext, ch));
+    *s = wsockaccept(ls, -1);
+    assert(*s);
+    *c = chr(ch, wsock);
+    assert(*c);
+    chclose(ch);
+}
+
+/* Sends a message in each direction and checks it arrives intact. */
+static void roundtrip(wsock c, wsock s, const void *msg, size_t len) {
+    static char buf[100000];
+    size_t sz = wsocksend(c, msg, len, -1);
+    assert(errno == 0 && sz == len);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == len && memcmp(buf, msg, len) == 0);
+    sz = wsocksend(s, msg, len, -1);
+    assert(errno == 0 && sz == len);
+    sz = wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == len && memcmp(buf, msg, len) == 0);
+}
+
+/* Does the opening handshake between two codecs. */
+static void handshake(wsockcodec c, wsockcodec s) {
+    struct wsockevent ev;
+    const void *out;
+    size_t sz = wsockcodecpending(c, &out);
+    wsockcodecfeed(s, (void*)out, sz, &ev);
+    assert(errno == 0 && ev.type == WSOCK_OPEN);
+    wsockcodecsent(c, sz);
+    sz = wsockcodecpending(s, &out);
+    wsockcodecfeed(c, (void*)out, sz, &ev);
+    assert(errno == 0 && ev.type == WSOCK_OPEN);
+    wsockcodecsent(s, sz);
+}
+
+int main() {
+    static char big[100000];
+    size_t i;
+    for(i = 0; i != sizeof(big); ++i)
+        big[i] = (char)(i % 251);
+    char buf[16];
+
+    /* Codec reports RSV1 of messages once an extension was agreed on.
+       The server picks the first of the offered extensions it supports,
+       ignoring whitespace in the parameters. */
+    wsockcodec cc = wsockcodecclient(NULL, "/");
+    assert(cc);
+    wsockcodecextensions(cc, "x-a;p=1, x-b");
+    assert(errno == 0);
+    wsockcodec sc = wsockcodecserver(NULL);
+    assert(sc);
+    wsockcodecextensions(sc, "x-b,x-a; p=1");
+    assert(errno == 0);
+    handshake(cc, sc);
+    assert(strcmp(wsockcodecextension(sc), "x-a; p=1") == 0);
+    assert(strcmp(wsockcodecextension(cc), "x-a;p=1") == 0);
+    uint8_t frame[WSOCK_MAXHEADER + 3];
+    size_t hsz = wsockcodecheader(sc, 3, frame);
+    frame[0] |= 0x40;
+    memcpy(frame + hsz, "ABC", 3);
+    struct wsockevent ev;
+    wsockcodecfeed(cc, frame, hsz + 3, &ev);
+    assert(errno == 0 && ev.type == WSOCK_DATA && ev.rsv == 0x40);
+    /* RSV1 is not allowed on control frames. */
+    frame[0] = 0xc9;
+    frame[1] = 0;
+    wsockcodecfeed(cc, frame, 2, &ev);
+    assert(errno == EPROTO);
+    wsockcodecclose(cc);
+    wsockcodecclose(sc);
+
+    /* Offers are compared by name and parameters. A name that only starts
+       the same or a parameter that's missing on one side doesn't match,
+       commas in quoted values don't split the offer and quoting of the
+       values doesn't matter. */
+    cc = wsockcodecclient(NULL, "/");
+    assert(cc);
+    wsockcodecextensions(cc,
+        "xy; param=1, x; q=\"a,b\"; param=1, x, x; param = \"1\"");
+    assert(errno == 0);
+    sc = wsockcodecserver(NULL);
+    assert(sc);
+    wsockcodecextensions(sc, "x; param=1");
+    assert(errno == 0);
+    handshake(cc, sc);
+    assert(strcmp(wsockcodecextension(sc), "x; param=1") == 0);
+    assert(strcmp(wsockcodecextension(cc), "x; param = \"1\"") == 0);
+    wsockcodecclose(cc);
+    wsockcodecclose(sc);
+
+    /* RSV1 without an extension is a protocol error. */
+    cc = wsockcodecclient(NULL, "/");
+    assert(cc);
+    wsockcodecextensions(cc, "x-a");
+    assert(errno == 0);
+    sc = wsockcodecserver(NULL);
+    assert(sc);
+    handshake(cc, sc);
+    assert(!wsockcodecextension(cc) && !wsockcodecextension(sc));
+    hsz = wsockcodecheader(sc, 3, frame);
+    frame[0] |= 0x40;
+    wsockcodecfeed(cc, frame, hsz, &ev);
+    assert(errno == EPROTO);
+    /* Extensions can't be changed once the handshake has started. */
+    wsockcodecextensions(sc, "x-a");
+    assert(errno == EBUSY);
+    wsockcodecclose(cc);
+    wsockcodecclose(sc);
+
+    /* Both peers support the extension. Short messages are sent as they
+       are, longer ones are transformed. */
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5574, 0), NULL, 10);
+    assert(ls);
+    wsockaddext(ls, &inv);
+    assert(errno == 0);
+    assert(strcmp(wsockextension(ls), "x-inv; v=1") == 0);
+    wsock c, s;
+    connectpair(ls, &inv, &c, &s);
+    assert(strcmp(wsockextension(c), "x-inv; v=1") == 0);
+    assert(strcmp(wsockextension(s), "x-inv; v=1") == 0);
+    assert(opened == 2);
+    roundtrip(c, s, "AB", 2);
+    roundtrip(c, s, "ABCDEFGH", 8);
+    roundtrip(c, s, big, sizeof(big));
+
+    /* Transformed message is truncated to the buffer. */
+    wsocksend(c, big, sizeof(big), -1);
+    assert(errno == 0);
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == sizeof(big));
+    assert(memcmp(buf, big, sizeof(buf)) == 0);
+
+    /* Transformed message can be received across a deadline. */
+    wsocksend(s, big, sizeof(big), -1);
+    assert(errno == 0);
+    static char rbuf[sizeof(big)];
+    sz = wsockrecv(c, rbuf, sizeof(rbuf), now() - 1);
+    if(errno == ETIMEDOUT)
+        sz = wsockrecv(c, rbuf, sizeof(rbuf), -1);
+    assert(errno == 0 && sz == sizeof(big));
+    assert(memcmp(rbuf, big, sizeof(big)) == 0);
+
+    /* Connection with an extension can't be migrated. */
+    int sp[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0);
+    wsockmigrate(c, sp[0], -1);
+    assert(errno == ENOTSUP);
+    close(sp[0]);
+    close(sp[1]);
+    roundtrip(c, s, "ABCDEFGH", 8);
+    wsockclose(c);
+    wsockclose(s);
+    assert(closed == 2);
+
+    /* Client doesn't offer the extension. */
+    connectpair(ls, NULL, &c, &s);
+    assert(!wsockextension(c) && !wsockextension(s));
+    roundtrip(c, s, "ABCDEFGH", 8);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Client offers an extension the server doesn't know. */
+    struct wsockext other = inv;
+    other.token = "x-inv; v=2";
+    connectpair(ls, &other, &c, &s);
+    assert(!wsockextension(c) && !wsockextension(s));
+    roundtrip(c, s, "ABCDEFGH", 8);
+    wsockclose(c);
+    wsockclose(s);
+    assert(opened == 2 && closed == 2);
+
+    /* The extension refuses the connection on the client side. */
+    other = inv;
+    other.arg = &other;
+    chan ch = chmake(wsock, 1);
+    go(makeconn(&other, ch));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(ch, wsock);
+    assert(!c);
+    chclose(ch);
+    wsockclose(s);
+
+    /* Invalid arguments. */
+    other = inv;
+    other.token = "x-a,x-b";
+    wsockaddext(ls, &other);
+    assert(errno == EINVAL);
+    c = wsockconnectext(iplocal("127.0.0.1", 5574, 0), NULL, "/", &other, -1);
+    assert(!c && errno == EINVAL);
+    for(i = 1; i != 4; ++i)
+        assert(wsockaddext(ls, &inv) == 0);
+    wsockaddext(ls, &inv);
+    assert(errno == ENOBUFS);
+    wsockclose(ls);
+
+    /* Compression. Skipped if wsock was built without zstd. */
+    struct wsockext *z = wsockzstd(3, NULL, 0);
+    if(!z) {
+        assert(errno == ENOTSUP);
+        return 0;
+    }
+    const char *dict = "{\"user\": \"\", \"status\": \"online\", \"seq\": }";
+    struct wsockext *zd1 = wsockzstd(3, dict, strlen(dict));
+    assert(zd1);
+    struct wsockext *zd2 = wsockzstd(3, "abcdef", 6);
+    assert(zd2);
+    ls = wsocklisten(iplocal("127.0.0.1", 5574, 0), NULL, 10);
+    assert(ls);
+    wsockaddext(ls, zd1);
+    wsockaddext(ls, z);
+    assert(errno == 0);
+    connectpair(ls, z, &c, &s);
+    assert(strcmp(wsockextension(s), "x-wsock-zstd") == 0);
+    for(i = 0; i != sizeof(big); ++i)
+        big[i] = "hello world "[i % 12];
+    roundtrip(c, s, big, sizeof(big));
+    roundtrip(c, s, "ABCDEFGH", 8);
+    wsockclose(c);
+    wsockclose(s);
+    /* Same dictionary on both sides. */
+    connectpair(ls, zd1, &c, &s);
+    assert(strcmp(wsockextension(s), zd1->token) == 0);
+    const char *small = "{\"user\": \"martin\", \"status\": \"online\", "
+        "\"seq\": 1234567}";
+    roundtrip(c, s, small, strlen(small));
+    roundtrip(c, s, big, sizeof(big));
+    wsockclose(c);
+    wsockclose(s);
+    /* Different dictionaries don't match. */
+    connectpair(ls, zd2, &c, &s);
+    assert(!wsockextension(s));
+    roundtrip(c, s, big, sizeof(big));
+    wsockclose(c);
+    wsockclose(s);
+    wsockclose(ls);
+    wsockzstdfree(z);
+    wsockzstdfree(zd1);
+    wsockzstdfree(zd2);
+
+    return 0;
+}
@@ -30,27 +30,45 @@
 
 /* Test composition of a message from multiple fragments. However, given that
    wsock doesn't fragment messages on sending, we'll have to cheat and do it
-   by accessing the underlying TCP socket. */
-
-struct wsock {
-    tcpsock u;
-};
+   by speaking the protocol over a raw TCP connection. */
 
 coroutine void client(void) {
     ipaddr addr = ipremote("127.0.0.1", 5555, 0, -1);
-    wsock s = wsockconnect(addr, NULL, "/", -1);
+    tcpsock s = tcpconnect(addr, -1);
     assert(s);
 
+    const char *request =
+        "GET / HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+    tcpsend(s, request, strlen(request), -1);
+    assert(errno == 0);
+    tcpflush(s, -1);
+    assert(errno == 0);
+    /* Skip the response. */
+    int crlfs = 0;
+    while(crlfs != 4) {
+        char c;
+        tcprecv(s, &c, 1, -1);
+        assert(errno == 0);
+        crlfs = (c == (crlfs % 2 ? '\n' : '\r')) ? crlfs + 1 :
+            (c == '\r' ? 1 : 0);
+    }
+
     uint8_t bytes[] = {0x00, 0x83, 0, 0, 0, 0, 'A', 'B', 'C',
                        0x00, 0x83, 0, 0, 0, 0, 'D', 'E', 'F',
                        0x80, 0x83, 0, 0, 0, 0, 'G', 'H', 'I'};
 
-    tcpsend(s->u, bytes, sizeof(bytes), -1);
+    tcpsend(s, bytes, sizeof(bytes), -1);
     assert(errno == 0);
-    tcpflush(s->u, -1);
+    tcpflush(s, -1);
     assert(errno == 0);
 
-    wsockclose(s);
+    tcpclose(s);
 }
 
 int main() {
@@ -0,0 +1,173 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+#define HANDOFF "wsock-handoff.sock"
+#define ADDR "wsock-handoff-ls.sock"
+
+/* Plays the new process taking over the listener. */
+coroutine void successor(chan ch) {
+    wsock ls = wsockimport(HANDOFF, "a", now() + 5000);
+    assert(ls);
+    chs(ch, wsock, ls);
+}
+
+coroutine void client(ipaddr addr, chan ch) {
+    wsock c = wsockconnect(addr, "a", "/", -1);
+    assert(c);
+    chs(ch, wsock, c);
+}
+
+coroutine void unixclient(chan ch) {
+    wsock c = wsockconnectunix(ADDR, "a", "/", -1);
+    assert(c);
+    chs(ch, wsock, c);
+}
+
+coroutine void closer(wsock s, int64_t deadline) {
+    msleep(deadline);
+    wsockclose(s);
+}
+
+/* Accepts a connection made from a separate coroutine. */
+static void makeconn(ipaddr addr, wsock ls, wsock *c, wsock *s) {
+    chan ch = chmake(wsock, 1);
+    go(client(addr, ch));
+    *s = wsockaccept(ls, -1);
+    assert(*s);
+    *c = chr(ch, wsock);
+    chclose(ch);
+}
+
+int main() {
+    char buf[16];
+    unlink(HANDOFF);
+    unlink(ADDR);
+    ipaddr addr = iplocal("127.0.0.1", 5571, 0);
+    wsock ls = wsocklisten(addr, "a", 10);
+    assert(ls);
+
+    /* Failed handover leaves the listener as it was. */
+    int rc = wsockexport(ls, HANDOFF, -1);
+    assert(rc == -1 && errno != 0);
+    wsock c[3], s[3];
+    int i;
+    for(i = 0; i != 3; ++i)
+        makeconn(addr, ls, &c[i], &s[i]);
+
+    /* Hand the listener over. */
+    chan ch = chmake(wsock, 1);
+    go(successor(ch));
+    rc = wsockexport(ls, HANDOFF, now() + 5000);
+    assert(rc == 0);
+    wsock nls = chr(ch, wsock);
+    assert(access(HANDOFF, F_OK) != 0);
+    assert(strcmp(wsocksubprotocol(nls), "a") == 0);
+    rc = wsockexport(ls, HANDOFF, -1);
+    assert(rc == -1 && errno == ECONNABORTED);
+
+    /* The old listener doesn't accept any more. The new one does. */
+    wsock as = wsockaccept(ls, -1);
+    assert(!as && errno == ECANCELED);
+    wsock nc, ns;
+    makeconn(addr, nls, &nc, &ns);
+    wsocksend(nc, "ABC", 3, -1);
+    assert(errno == 0);
+    size_t sz = wsockrecv(ns, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+
+    /* Existing connections are not affected. */
+    wsocksend(s[0], "DEF", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(c[0], buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "DEF", 3) == 0);
+
+    /* Close frames are spread over the window. */
+    int64_t start = now();
+    rc = wsockdrain(ls, start + 300);
+    assert(rc == 3);
+    assert(now() - start >= 150);
+    for(i = 0; i != 3; ++i) {
+        wsockrecv(c[i], buf, sizeof(buf), -1);
+        assert(errno == ECONNRESET);
+        wsockrecv(s[i], buf, sizeof(buf), -1);
+        assert(errno == ECONNRESET);
+    }
+    wsocksend(s[0], "GHI", 3, -1);
+    assert(errno == EPIPE);
+    rc = wsockdrain(ls, -1);
+    assert(rc == 0);
+    for(i = 0; i != 3; ++i) {
+        wsockclose(c[i]);
+        wsockclose(s[i]);
+    }
+    wsockclose(ls);
+
+    /* Connections closed while the drain is in progress are skipped. */
+    wsock nc2, ns2;
+    makeconn(addr, nls, &nc2, &ns2);
+    go(closer(ns, now() + 50));
+    rc = wsockdrain(nls, now() + 300);
+    assert(rc == 1);
+    wsockrecv(nc2, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockclose(nc);
+    wsockclose(nc2);
+    wsockclose(ns2);
+    wsockclose(nls);
+
+    /* Unix domain listeners can be handed over as well. */
+    ls = wsocklistenunix(ADDR, "a", 10);
+    assert(ls);
+    go(successor(ch));
+    rc = wsockexport(ls, HANDOFF, now() + 5000);
+    assert(rc == 0);
+    nls = chr(ch, wsock);
+    wsockclose(ls);
+    chan uch = chmake(wsock, 1);
+    go(unixclient(uch));
+    ns = wsockaccept(nls, -1);
+    assert(ns);
+    nc = chr(uch, wsock);
+    wsocksend(nc, "JKL", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(ns, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "JKL", 3) == 0);
+    wsockclose(nc);
+    wsockclose(ns);
+    wsockclose(nls);
+    chclose(uch);
+    chclose(ch);
+    unlink(ADDR);
+
+    return 0;
+}
+
@@ -0,0 +1,159 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+static char cookie[1000];
+
+coroutine void client(void) {
+    ipaddr addr = ipremote("127.0.0.1", 5582, 0, -1);
+    tcpsock s = tcpconnect(addr, -1);
+    assert(s);
+    const char *request1 =
+        "GET /app HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Origin: http://example.com\r\n"
+        "authorization:   Bearer   abc  \r\n"
+        "Cookie: ";
+    const char *request2 =
+        "\r\n"
+        "Cookie: second=2\r\n"
+        "\r\n";
+    tcpsend(s, request1, strlen(request1), -1);
+    assert(errno == 0);
+    tcpsend(s, cookie, sizeof(cookie), -1);
+    assert(errno == 0);
+    tcpsend(s, request2, strlen(request2), -1);
+    assert(errno == 0);
+    tcpflush(s, -1);
+    assert(errno == 0);
+    /* Wait for the server to close the connection. */
+    char c;
+    while(1) {
+        tcprecv(s, &c, 1, -1);
+        if(errno != 0)
+            break;
+    }
+    tcpclose(s);
+}
+
+int main() {
+    size_t i;
+    for(i = 0; i != sizeof(cookie); ++i)
+        cookie[i] = 'a' + i % 26;
+
+    /* Fields of the client's request are available after accepting. */
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5582, 0), NULL, 10);
+    assert(ls);
+    go(client());
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    assert(strcmp(wsockurl(s), "/app") == 0);
+    const char *val = wsockheader(s, "origin");
+    assert(errno == 0 && strcmp(val, "http://example.com") == 0);
+    val = wsockheader(s, "Authorization");
+    assert(errno == 0 && strcmp(val, "Bearer abc") == 0);
+    /* Lines longer than 256 bytes are fine. */
+    val = wsockheader(s, "COOKIE");
+    assert(errno == 0 && strlen(val) == sizeof(cookie) &&
+        memcmp(val, cookie, sizeof(cookie)) == 0);
+    val = wsockheader(s, "Accept");
+    assert(!val && errno == ENOENT);
+
+    /* Repeated fields can be enumerated. */
+    const char *name;
+    int n = 0;
+    int cookies = 0;
+    while(1) {
+        val = wsockheaderat(s, n, &name);
+        if(!val)
+            break;
+        if(strcmp(name, "Cookie") == 0)
+            ++cookies;
+        ++n;
+    }
+    assert(errno == ENOENT && n == 9 && cookies == 2);
+    val = wsockheaderat(s, 8, &name);
+    assert(strcmp(name, "Cookie") == 0 && strcmp(val, "second=2") == 0);
+
+    /* Once freed, the fields are gone. */
+    wsockfreeheaders(s);
+    assert(errno == 0);
+    val = wsockheader(s, "Origin");
+    assert(!val && errno == ENOENT);
+    wsockclose(s);
+
+    /* The client sees the fields of the server's reply. */
+    wsock c = wsockconnect(ipremote("127.0.0.1", 5582, 0, -1), NULL, "/", -1);
+    assert(c);
+    s = wsockaccept(ls, -1);
+    assert(s);
+    val = wsockheader(c, "upgrade");
+    assert(errno == 0 && strcmp(val, "websocket") == 0);
+    val = wsockheader(s, "Sec-WebSocket-Key");
+    assert(errno == 0 && strlen(val) == 24);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Not available on a listening socket. */
+    val = wsockheader(ls, "Origin");
+    assert(!val && errno == EOPNOTSUPP);
+    wsockclose(ls);
+
+    /* The codec refuses a handshake that's too large to store. */
+    wsockcodec cd = wsockcodecserver(NULL);
+    assert(cd);
+    const char *start =
+        "GET / HTTP/1.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n";
+    struct wsockevent ev;
+    char buf[128];
+    strcpy(buf, start);
+    size_t sz = wsockcodecfeed(cd, buf, strlen(start), &ev);
+    assert(errno == 0 && sz == strlen(start) && ev.type == WSOCK_NONE);
+    val = wsockcodecfield(cd, "Connection");
+    assert(strcmp(val, "Upgrade") == 0);
+    int err = 0;
+    for(i = 0; i != 1000 && !err; ++i) {
+        memcpy(buf, "X-Filler: 0123456789012345678901234567890123456789\r\n",
+            52);
+        wsockcodecfeed(cd, buf, 52, &ev);
+        err = errno;
+    }
+    assert(err == ENOBUFS && i > 16384 / 52 && i < 16384 / 40);
+    wsockcodecclose(cd);
+
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Extension that sends every message unchanged but marked by RSV1, so that
+   the receiver collects it in a buffer. */
+static void *id_open(void *arg, int client) {
+    return arg;
+}
+
+static size_t id_encode(void *state, const void *msg, size_t len,
+      const void **out) {
+    *out = msg;
+    return len;
+}
+
+static size_t id_decode(void *state, const void *in, size_t inlen,
+      void *out, size_t outlen) {
+    memcpy(out, in, inlen < outlen ? inlen : outlen);
+    errno = 0;
+    return inlen;
+}
+
+static void id_close(void *state) {
+}
+
+static struct wsockext id = {"x-id", id_open, id_encode, id_decode,
+    id_close, &id};
+
+coroutine void makeconn(int ext, chan ch) {
+    ipaddr addr = ipremote("127.0.0.1", 5576, 0, -1);
+    wsock c = ext ? wsockconnectext(addr, NULL, "/", &id, -1) :
+        wsockconnect(addr, NULL, "/", -1);
+    chs(ch, wsock, c);
+}
+
+/* Connects to the listener and returns both ends of the connection. */
+static void connectpair(wsock ls, int ext, wsock *c, wsock *s) {
+    chan ch = chmake(wsock, 1);
+    go(makeconn(ext, ch));
+    *s = wsockaccept(ls, -1);
+    assert(*s);
+    *c = chr(ch, wsock);
+    assert(*c);
+    chclose(ch);
+}
+
+/* Checks that the server has closed the connection with the close frame. */
+static void checkclosed(wsock c) {
+    char buf[16];
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+}
+
+int main() {
+    static char big[100000];
+    memset(big, 'x', sizeof(big));
+    char buf[16];
+    size_t used = wsockbudgetused();
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5576, 0), NULL, 10);
+    assert(ls);
+    wsockaddext(ls, &id);
+    assert(errno == 0);
+
+    /* Messages over the limit are refused. Limits set on the listener
+       apply to accepted connections. */
+    wsocklimits(ls, 1000, 0);
+    assert(errno == 0);
+    wsock c, s;
+    connectpair(ls, 0, &c, &s);
+    wsocksend(c, big, 1000, -1);
+    assert(errno == 0);
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 1000);
+    wsocksend(c, big, sizeof(big), -1);
+    assert(errno == 0);
+    wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == EMSGSIZE);
+    wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == ECONNABORTED);
+    checkclosed(c);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Same for small messages handled by the fast path. */
+    connectpair(ls, 0, &c, &s);
+    wsocklimits(s, 10, 0);
+    wsocksend(c, big, 11, -1);
+    assert(errno == 0);
+    wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == EMSGSIZE);
+    checkclosed(c);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* wsockrecvmany() returns the messages that came before the one over
+       the limit and reports it on the next call. */
+    connectpair(ls, 0, &c, &s);
+    wsocklimits(s, 10, 0);
+    for(sz = 5; sz != 8; ++sz) {
+        wsocksend(c, big, sz == 7 ? 11 : sz, -1);
+        assert(errno == 0);
+    }
+    char mbuf[3][16];
+    struct wsockmsg msgs[3];
+    int i;
+    for(i = 0; i != 3; ++i) {
+        msgs[i].buf = mbuf[i];
+        msgs[i].len = sizeof(mbuf[i]);
+    }
+    int received = 0;
+    while(1) {
+        int n = wsockrecvmany(s, msgs, 3, -1);
+        if(n == 0)
+            break;
+        assert(errno == 0);
+        for(i = 0; i != n; ++i)
+            assert(msgs[i].size == (size_t)(5 + received + i));
+        received += n;
+    }
+    assert(errno == EMSGSIZE && received == 2);
+    checkclosed(c);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Limit on buffered data applies to messages collected for
+       an extension. */
+    connectpair(ls, 1, &c, &s);
+    wsocklimits(s, 0, 1000);
+    wsocksend(c, big, 1000, -1);
+    assert(errno == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 1000);
+    wsocksend(c, big, 1001, -1);
+    assert(errno == 0);
+    wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == EMSGSIZE);
+    checkclosed(c);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Buffers are accounted for. Once the budget is used up, growing
+       a buffer fails. */
+    wsocklimits(ls, 0, 0);
+    connectpair(ls, 1, &c, &s);
+    assert(wsockbudgetused() > used);
+    wsockbudget(wsockbudgetused() + 10000);
+    wsocksend(c, big, 1000, -1);
+    assert(errno == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 1000);
+    wsocksend(c, big, sizeof(big), -1);
+    assert(errno == 0);
+    wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == ENOBUFS);
+    checkclosed(c);
+
+    /* New connections are turned away while over the budget. */
+    wsockbudget(wsockbudgetused());
+    chan ch = chmake(wsock, 1);
+    go(makeconn(0, ch));
+    wsock s2 = wsockaccept(ls, now() + 200);
+    assert(!s2 && errno == ETIMEDOUT);
+    assert(!chr(ch, wsock));
+    chclose(ch);
+    wsockclose(c);
+    wsockclose(s);
+    wsockbudget(0);
+    connectpair(ls, 0, &c, &s);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Everything is given back. */
+    wsockclose(ls);
+    assert(wsockbudgetused() == used);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+#define BIGSZ 4000000
+
+static char big[BIGSZ];
+
+/* Plays the process taking over the connection. */
+coroutine void adopter(int sock, chan ch) {
+    wsock s = wsockadopt(sock, now() + 5000);
+    assert(s);
+    chs(ch, wsock, s);
+}
+
+coroutine void client(ipaddr addr, chan ch) {
+    wsock c = wsockconnect(addr, "a", "/chat", -1);
+    assert(c);
+    chs(ch, wsock, c);
+}
+
+coroutine void bigsender(wsock c, chan done) {
+    wsocksend(c, big, BIGSZ, -1);
+    assert(errno == 0);
+    chs(done, int, 0);
+}
+
+/* Moves the connection over the socket pair and returns the new handle. */
+static wsock migrate(wsock s, int *sp) {
+    chan ch = chmake(wsock, 1);
+    go(adopter(sp[1], ch));
+    int rc = wsockmigrate(s, sp[0], now() + 5000);
+    assert(rc == 0);
+    wsock ns = chr(ch, wsock);
+    chclose(ch);
+    return ns;
+}
+
+int main() {
+    int i;
+    for(i = 0; i != BIGSZ; ++i)
+        big[i] = (char)i;
+    int sp[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
+    assert(rc == 0);
+    ipaddr addr = iplocal("127.0.0.1", 5572, 0);
+    wsock ls = wsocklisten(addr, "a", 10);
+    assert(ls);
+    chan ch = chmake(wsock, 1);
+    go(client(addr, ch));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    wsock c = chr(ch, wsock);
+    chclose(ch);
+
+    /* Received data that weren't consumed yet move along. */
+    wsocksend(c, "A", 1, -1);
+    assert(errno == 0);
+    wsocksend(c, "BB", 2, -1);
+    assert(errno == 0);
+    wsocksend(c, "CCC", 3, -1);
+    assert(errno == 0);
+    char buf[16];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 1 && buf[0] == 'A');
+    wsock ns = migrate(s, sp);
+    assert(strcmp(wsocksubprotocol(ns), "a") == 0);
+    assert(strcmp(wsockurl(ns), "/chat") == 0);
+    const char *val = wsockheader(ns, "upgrade");
+    assert(val && strcmp(val, "websocket") == 0);
+    sz = wsockrecv(ns, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 2 && memcmp(buf, "BB", 2) == 0);
+    sz = wsockrecv(ns, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "CCC", 3) == 0);
+
+    /* The peer doesn't notice. */
+    wsocksend(ns, "DEF", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "DEF", 3) == 0);
+    wsockping(c, -1);
+    assert(errno == 0);
+    wsocksend(c, "GHI", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(ns, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "GHI", 3) == 0);
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == EAGAIN);
+
+    /* Message received only partially continues in the new process. */
+    chan done = chmake(int, 1);
+    go(bigsender(c, done));
+    char *bigbuf = malloc(BIGSZ);
+    assert(bigbuf);
+    sz = wsockrecv(ns, bigbuf, BIGSZ, now() + 1);
+    if(errno == ETIMEDOUT) {
+        ns = migrate(ns, sp);
+        sz = wsockrecv(ns, bigbuf, BIGSZ, -1);
+    }
+    assert(errno == 0 && sz == BIGSZ);
+    assert(memcmp(bigbuf, big, BIGSZ) == 0);
+    (void)chr(done, int);
+    chclose(done);
+    free(bigbuf);
+
+    /* Closing handshake works as usual. */
+    wsockdone(ns, -1);
+    assert(errno == 0);
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockrecv(ns, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockclose(ns);
+    wsockclose(c);
+    wsockclose(ls);
+
+    /* Connections without a socket can't be moved. */
+    wsock pc, ps;
+    wsockpair(&pc, &ps);
+    assert(errno == 0);
+    rc = wsockmigrate(ps, sp[0], -1);
+    assert(rc == -1 && errno == ENOTSUP);
+    wsockclose(pc);
+    wsockclose(ps);
+
+    close(sp[0]);
+    close(sp[1]);
+    return 0;
+}
+
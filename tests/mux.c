@@ -0,0 +1,166 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+#define BIGSZ 1000000
+
+static char big[BIGSZ];
+
+coroutine void client(ipaddr addr, const char *subprotocol, chan ch) {
+    wsock c = wsockconnect(addr, subprotocol, "/", -1);
+    assert(c);
+    chs(ch, wsock, c);
+}
+
+coroutine void sender(wsockchan ch, const void *msg, size_t len,
+      chan done) {
+    size_t sz = wsockchansend(ch, msg, len, -1);
+    assert(errno == 0 && sz == len);
+    chs(done, int, 0);
+}
+
+static void makeconn(ipaddr addr, wsock ls, const char *subprotocol,
+      wsock *c, wsock *s) {
+    chan ch = chmake(wsock, 1);
+    go(client(addr, subprotocol, ch));
+    *s = wsockaccept(ls, -1);
+    assert(*s);
+    *c = chr(ch, wsock);
+    chclose(ch);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != BIGSZ; ++i)
+        big[i] = (char)i;
+    char buf[16];
+    ipaddr addr = iplocal("127.0.0.1", 5573, 0);
+    wsock ls = wsocklisten(addr, WSOCK_MUX ",b", 10);
+    assert(ls);
+
+    /* Multiplexing has to be negotiated. */
+    wsock c, s;
+    makeconn(addr, ls, "b", &c, &s);
+    wsockmux m = wsockmuxmake(c);
+    assert(!m && errno == EPROTO);
+    wsockclose(c);
+    wsockclose(s);
+
+    makeconn(addr, ls, WSOCK_MUX ",b", &c, &s);
+    wsockmux cm = wsockmuxmake(c);
+    assert(cm);
+    wsockmux sm = wsockmuxmake(s);
+    assert(sm);
+
+    /* Channels can be opened from both sides. */
+    wsockchan ca = wsockmuxopen(cm);
+    assert(ca);
+    wsockchansend(ca, "ABC", 3, -1);
+    assert(errno == 0);
+    wsockchan sa = wsockmuxaccept(sm, -1);
+    assert(sa);
+    size_t sz = wsockchanrecv(sa, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    wsockchan sb = wsockmuxopen(sm);
+    assert(sb);
+    wsockchansend(sb, "DEF", 3, -1);
+    assert(errno == 0);
+    wsockchansend(sa, "GHI", 3, -1);
+    assert(errno == 0);
+    wsockchan cb = wsockmuxaccept(cm, -1);
+    assert(cb);
+    sz = wsockchanrecv(cb, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "DEF", 3) == 0);
+    sz = wsockchanrecv(ca, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "GHI", 3) == 0);
+    wsockchan x = wsockmuxaccept(cm, now() + 10);
+    assert(!x && errno == ETIMEDOUT);
+
+    /* A large message doesn't hold up the other channels. Its sender is
+       held back by flow control until the receiver catches up. */
+    chan done = chmake(int, 1);
+    go(sender(ca, big, BIGSZ, done));
+    wsockchansend(cb, "JKL", 3, -1);
+    assert(errno == 0);
+    sz = wsockchanrecv(sb, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "JKL", 3) == 0);
+    msleep(now() + 50);
+    choose {
+    in(done, int, val):
+        (void)val;
+        assert(0);
+    otherwise:
+    end
+    }
+    char *bigbuf = malloc(BIGSZ);
+    assert(bigbuf);
+    sz = wsockchanrecv(sa, bigbuf, BIGSZ, -1);
+    assert(errno == 0 && sz == BIGSZ && memcmp(bigbuf, big, BIGSZ) == 0);
+    (void)chr(done, int);
+
+    /* Messages on several channels are interleaved. */
+    go(sender(ca, big, BIGSZ, done));
+    go(sender(cb, big + 1, BIGSZ - 1, done));
+    sz = wsockchanrecv(sb, bigbuf, BIGSZ, -1);
+    assert(errno == 0 && sz == BIGSZ - 1);
+    assert(memcmp(bigbuf, big + 1, BIGSZ - 1) == 0);
+    sz = wsockchanrecv(sa, bigbuf, BIGSZ, -1);
+    assert(errno == 0 && sz == BIGSZ && memcmp(bigbuf, big, BIGSZ) == 0);
+    (void)chr(done, int);
+    (void)chr(done, int);
+    free(bigbuf);
+
+    /* Nothing to receive. */
+    sz = wsockchanrecv(sa, buf, sizeof(buf), now() + 10);
+    assert(errno == ETIMEDOUT);
+
+    /* Closing a channel doesn't affect the others. */
+    wsockchanclose(ca);
+    sz = wsockchanrecv(sa, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockchansend(sa, "MNO", 3, -1);
+    assert(errno == EPIPE);
+    wsockchanclose(sa);
+    wsockchansend(sb, "PQR", 3, -1);
+    assert(errno == 0);
+    sz = wsockchanrecv(cb, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "PQR", 3) == 0);
+
+    /* Closing the connection fails the channels on the other side. */
+    wsockmuxclose(cm);
+    sz = wsockchanrecv(sb, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockmuxclose(sm);
+    chclose(done);
+    wsockclose(ls);
+    return 0;
+}
+
@@ -0,0 +1,98 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* In-memory connection. Messages larger than the pipe's buffer make
+   the sender wait for the receiver. */
+
+#define NMSGS 1000
+
+static char data[200000];
+
+coroutine void sender(wsock s) {
+    int i;
+    for(i = 0; i != NMSGS; ++i) {
+        size_t sz = wsocksend(s, data + i, (i * 997) % 100000, -1);
+        assert(errno == 0 && sz == (i * 997) % 100000);
+    }
+    /* Non-seekable source with no fd: goes through the chunked path. */
+    FILE *f = tmpfile();
+    assert(f);
+    assert(fwrite(data, 1, 10000, f) == 10000);
+    fflush(f);
+    size_t sz = wsocksendfile(s, fileno(f), 0, 10000, -1);
+    assert(errno == 0 && sz == 10000);
+    fclose(f);
+    wsockdone(s, -1);
+    assert(errno == 0);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != sizeof(data); ++i)
+        data[i] = (char)(i * 7);
+    wsock c, s;
+    static char buf[sizeof(data)];
+    /* Both directions, the client side masks the payload. */
+    int j;
+    for(j = 0; j != 2; ++j) {
+        wsockpair(&c, &s);
+        assert(errno == 0);
+        assert(strcmp(wsockurl(s), "/") == 0);
+        wsock ends[2] = {c, s};
+        go(sender(ends[j]));
+        for(i = 0; i != NMSGS; ++i) {
+            size_t sz = wsockrecv(ends[1 - j], buf, sizeof(buf), -1);
+            assert(errno == 0);
+            assert(sz == (i * 997) % 100000);
+            assert(memcmp(buf, data + i, sz) == 0);
+        }
+        size_t sz = wsockrecv(ends[1 - j], buf, sizeof(buf), -1);
+        assert(errno == 0 && sz == 10000);
+        assert(memcmp(buf, data, sz) == 0);
+        sz = wsockrecv(ends[1 - j], buf, sizeof(buf), -1);
+        assert(errno == ECONNRESET);
+        wsockclose(c);
+        wsockclose(s);
+    }
+
+    /* Deadline and closed peer. */
+    wsockpair(&c, &s);
+    assert(errno == 0);
+    size_t sz = wsockrecv(s, buf, sizeof(buf), now() + 50);
+    assert(sz == 0 && errno == ETIMEDOUT);
+    wsockclose(s);
+    sz = wsocksend(c, "ABC", 3, -1);
+    assert(sz == 0 && errno == ECONNRESET);
+    wsockclose(c);
+
+    return 0;
+}
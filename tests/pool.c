@@ -0,0 +1,130 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+static int accepted = 0;
+/* Number of accepted connections that should never answer. */
+static int mute = 0;
+
+coroutine void handler(wsock s) {
+    if(mute) {
+        --mute;
+        msleep(now() + 1000);
+        wsockclose(s);
+        return;
+    }
+    /* Pings are answered from within wsockrecv(). */
+    while(1) {
+        char buf[16];
+        size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+        if(errno != 0)
+            break;
+        wsocksend(s, buf, sz, -1);
+        if(errno != 0)
+            break;
+    }
+    wsockclose(s);
+}
+
+static int stopping = 0;
+
+coroutine void server(wsock ls, chan done) {
+    while(!stopping) {
+        wsock s = wsockaccept(ls, now() + 50);
+        if(!s)
+            continue;
+        ++accepted;
+        go(handler(s));
+    }
+    chs(done, int, 0);
+}
+
+static void echo(wsock s) {
+    wsocksend(s, "ABC", 3, -1);
+    assert(errno == 0);
+    char buf[3];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+}
+
+int main() {
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5563, 0), NULL, 10);
+    assert(ls);
+    chan done = chmake(int, 0);
+    go(server(ls, done));
+    ipaddr addr = ipremote("127.0.0.1", 5563, 0, -1);
+
+    /* Connections that don't answer pings are replaced. */
+    mute = 2;
+    wsockpool p = wsockpoolmake(2, 50);
+    assert(p);
+    wsockpoolwarm(p, addr, NULL, "/a");
+    assert(errno == 0);
+    msleep(now() + 400);
+    assert(mute == 0);
+    assert(accepted >= 4);
+
+    /* Warm connection is handed out without connecting and the pool gets
+       topped up in the background. */
+    int before = accepted;
+    wsock s = wsockpoolconnect(p, addr, NULL, "/a", -1);
+    assert(s);
+    assert(accepted == before);
+    echo(s);
+    wsockclose(s);
+    msleep(now() + 100);
+    assert(accepted == before + 1);
+
+    /* Different URL is a different destination. Nothing is warm yet, so it
+       connects directly. */
+    before = accepted;
+    s = wsockpoolconnect(p, addr, NULL, "/b", -1);
+    assert(s);
+    assert(strcmp(wsockurl(s), "/b") == 0);
+    echo(s);
+    wsockclose(s);
+    msleep(now() + 100);
+    assert(accepted == before + 3);
+    s = wsockpoolconnect(p, addr, NULL, "/b", -1);
+    assert(s);
+    assert(accepted == before + 3);
+    echo(s);
+    wsockclose(s);
+
+    s = wsockpoolconnect(p, addr, NULL, "", -1);
+    assert(!s && errno == EINVAL);
+
+    wsockpoolclose(p);
+    stopping = 1;
+    (void)chr(done, int);
+    chclose(done);
+    wsockclose(ls);
+
+    return 0;
+}
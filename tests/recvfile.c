@@ -0,0 +1,256 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <fcntl.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+#define BIGSZ (4 * 1024 * 1024)
+
+static char *big;
+
+/* Inverts the bits of messages of 4 to 16 bytes. */
+static void *inv_open(void *arg, int client) {
+    return malloc(16);
+}
+
+static size_t inv_encode(void *state, const void *msg, size_t len,
+      const void **out) {
+    if(len < 4 || len > 16)
+        return 0;
+    size_t i;
+    for(i = 0; i != len; ++i)
+        ((uint8_t*)state)[i] = ~((const uint8_t*)msg)[i];
+    *out = state;
+    return len;
+}
+
+static size_t inv_decode(void *state, const void *in, size_t inlen,
+      void *out, size_t outlen) {
+    size_t i;
+    for(i = 0; i != inlen && i != outlen; ++i)
+        ((uint8_t*)out)[i] = ~((const uint8_t*)in)[i];
+    errno = 0;
+    return inlen;
+}
+
+static void inv_close(void *state) {
+    free(state);
+}
+
+static struct wsockext inv = {"x-inv", inv_open, inv_encode, inv_decode,
+    inv_close, NULL};
+
+/* Checks that the file contains 'len' bytes of 'big' at 'off'. */
+static void check(int fd, off_t off, size_t len) {
+    char *buf = malloc(len);
+    assert(buf);
+    ssize_t sz = pread(fd, buf, len, off);
+    assert(sz == (ssize_t)len && memcmp(buf, big, len) == 0);
+    free(buf);
+}
+
+static int tmpfd(void) {
+    FILE *f = tmpfile();
+    assert(f);
+    return dup(fileno(f));
+}
+
+coroutine void sender(wsock s, size_t len, chan done) {
+    wsocksend(s, big, len, -1);
+    assert(errno == 0);
+    chs(done, int, 0);
+}
+
+coroutine void dial(chan conns) {
+    wsock c = wsockconnect(ipremote("127.0.0.1", 5586, 0, -1), NULL, "/",
+        -1);
+    assert(c);
+    chs(conns, wsock, c);
+}
+
+coroutine void dialext(chan conns) {
+    wsock c = wsockconnectext(ipremote("127.0.0.1", 5592, 0, -1), NULL, "/",
+        &inv, -1);
+    assert(c);
+    chs(conns, wsock, c);
+}
+
+int main() {
+    big = malloc(BIGSZ);
+    assert(big);
+    size_t i;
+    for(i = 0; i != BIGSZ; ++i)
+        big[i] = (char)(i * 7);
+    chan done = chmake(int, 0);
+
+    /* In-memory connection. Payload is copied through the chunk buffer in
+       both directions. */
+    wsock c, s;
+    wsockpair(&c, &s);
+    int fd = tmpfd();
+    go(sender(c, BIGSZ, done));
+    size_t sz = wsockrecvfile(s, fd, 100, -1);
+    assert(errno == 0 && sz == BIGSZ);
+    (void)chr(done, int);
+    check(fd, 100, BIGSZ);
+    go(sender(s, 1000, done));
+    sz = wsockrecvfile(c, fd, 0, -1);
+    assert(errno == 0 && sz == 1000);
+    (void)chr(done, int);
+    check(fd, 0, 1000);
+
+    /* Deadline in the middle of the message. The payload received so far
+       is in the file and the next call continues where this one stopped. */
+    wsocksend(c, big, BIGSZ, now() + 50);
+    assert(errno == ETIMEDOUT);
+    sz = wsockrecvfile(s, fd, 0, now() + 50);
+    assert(errno == ETIMEDOUT);
+    char buf[16];
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == EBUSY);
+    go(sender(c, BIGSZ, done));
+    sz = wsockrecvfile(s, fd, 0, -1);
+    assert(errno == 0 && sz == BIGSZ);
+    (void)chr(done, int);
+    check(fd, 0, BIGSZ);
+
+    /* The other way round. */
+    wsocksend(c, big, BIGSZ, now() + 50);
+    assert(errno == ETIMEDOUT);
+    sz = wsockrecv(s, buf, sizeof(buf), now() + 50);
+    assert(errno == ETIMEDOUT);
+    sz = wsockrecvfile(s, fd, 0, -1);
+    assert(errno == EBUSY);
+    go(sender(c, BIGSZ, done));
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == BIGSZ);
+    (void)chr(done, int);
+    close(fd);
+
+    /* A read-only file. The payload can't be stored and the connection is
+       broken. */
+    fd = open("/dev/null", O_RDONLY);
+    assert(fd >= 0);
+    wsocksend(c, "ABC", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecvfile(s, fd, 0, -1);
+    assert(errno == EBADF);
+    sz = wsockrecvfile(s, fd, 0, -1);
+    assert(errno == ECONNABORTED);
+    close(fd);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* TCP. The server has to unmask the payload. On the client it moves
+       from the socket to the file directly where possible. */
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5586, 0), NULL, 10);
+    assert(ls);
+    sz = wsockrecvfile(ls, 0, 0, -1);
+    assert(errno == EOPNOTSUPP);
+    chan conns = chmake(wsock, 1);
+    go(dial(conns));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(conns, wsock);
+    fd = tmpfd();
+    go(sender(c, BIGSZ, done));
+    sz = wsockrecvfile(s, fd, 0, -1);
+    assert(errno == 0 && sz == BIGSZ);
+    (void)chr(done, int);
+    check(fd, 0, BIGSZ);
+    close(fd);
+    fd = tmpfd();
+    go(sender(s, BIGSZ, done));
+    sz = wsockrecvfile(c, fd, 0, -1);
+    assert(errno == 0 && sz == BIGSZ);
+    (void)chr(done, int);
+    check(fd, 0, BIGSZ);
+    close(fd);
+
+    /* Empty message and a ping on the way. */
+    fd = tmpfd();
+    wsockping(s, -1);
+    assert(errno == 0);
+    wsocksend(s, "", 0, -1);
+    assert(errno == 0);
+    sz = wsockrecvfile(c, fd, 0, -1);
+    assert(errno == 0 && sz == 0);
+    assert(lseek(fd, 0, SEEK_END) == 0);
+    sz = wsockrecvfile(c, fd, -1, -1);
+    assert(errno == EINVAL);
+    close(fd);
+
+    /* File opened for appending. Older kernels refuse to splice to it. */
+    fd = tmpfd();
+    assert(fcntl(fd, F_SETFL, O_APPEND) == 0);
+    go(sender(s, BIGSZ, done));
+    sz = wsockrecvfile(c, fd, 0, -1);
+    assert(errno == 0 && sz == BIGSZ);
+    (void)chr(done, int);
+    check(fd, 0, BIGSZ);
+    close(fd);
+
+    wsockclose(c);
+    wsockclose(s);
+    wsockclose(ls);
+
+    /* Extension. Messages it didn't transform are stored to the file.
+       A transformed one is refused and can be received by wsockrecv(). */
+    ls = wsocklisten(iplocal("127.0.0.1", 5592, 0), NULL, 10);
+    assert(ls);
+    assert(wsockaddext(ls, &inv) == 0);
+    go(dialext(conns));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(conns, wsock);
+    fd = tmpfd();
+    wsocksend(c, big, 3, -1);
+    assert(errno == 0);
+    wsocksend(c, big, 10, -1);
+    assert(errno == 0);
+    sz = wsockrecvfile(s, fd, 0, -1);
+    assert(errno == 0 && sz == 3);
+    check(fd, 0, 3);
+    sz = wsockrecvfile(s, fd, 0, -1);
+    assert(errno == ENOTSUP);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 10 && memcmp(buf, big, 10) == 0);
+    close(fd);
+    wsockclose(c);
+    wsockclose(s);
+    wsockclose(ls);
+    chclose(conns);
+    chclose(done);
+    free(big);
+
+    return 0;
+}
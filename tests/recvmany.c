@@ -0,0 +1,133 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+#define NMSGS 1000
+#define NSLOTS 16
+
+static char data[100000];
+
+/* Mostly small messages, with the last one larger than any buffer. */
+static size_t msgsize(int i) {
+    return i == NMSGS - 1 ? sizeof(data) - NMSGS : (i * 37) % 300;
+}
+
+coroutine void sender(wsock s) {
+    int i;
+    for(i = 0; i != NMSGS; ++i) {
+        wsocksend(s, data + i, msgsize(i), -1);
+        assert(errno == 0);
+        if(i % 100 == 50) {
+            wsockpong(s, -1);
+            assert(errno == 0);
+        }
+    }
+}
+
+coroutine void connector(chan ch) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", 5562, 0, -1), NULL, "/", -1);
+    assert(s);
+    chs(ch, wsock, s);
+}
+
+static void check(wsock from, wsock to) {
+    go(sender(from));
+    struct wsockmsg msgs[NSLOTS];
+    int i;
+    for(i = 0; i != NSLOTS; ++i) {
+        msgs[i].buf = malloc(sizeof(data));
+        assert(msgs[i].buf);
+        msgs[i].len = sizeof(data);
+    }
+    int received = 0;
+    int batched = 0;
+    while(received != NMSGS) {
+        int n = wsockrecvmany(to, msgs, NSLOTS, -1);
+        assert(errno == 0 && n >= 1 && n <= NSLOTS);
+        if(n > 1)
+            batched = 1;
+        /* Pongs in between are skipped. */
+        for(i = 0; i != n; ++i) {
+            size_t sz = msgsize(received);
+            assert(msgs[i].size == sz);
+            assert(memcmp(msgs[i].buf, data + received, sz) == 0);
+            ++received;
+        }
+    }
+    assert(batched);
+    for(i = 0; i != NSLOTS; ++i)
+        free(msgs[i].buf);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != sizeof(data); ++i)
+        data[i] = (char)(i * 7 + 3);
+
+    wsock c, s;
+    wsockpair(&c, &s);
+    assert(errno == 0);
+    check(c, s);
+    check(s, c);
+    wsockclose(c);
+    wsockclose(s);
+
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5562, 0), NULL, 10);
+    assert(ls);
+    chan ch = chmake(wsock, 0);
+    go(connector(ch));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(ch, wsock);
+    check(c, s);
+    check(s, c);
+
+    /* Messages that don't fit into the slot are truncated. */
+    wsocksend(c, data, 100, -1);
+    assert(errno == 0);
+    wsocksend(c, data, 200, -1);
+    assert(errno == 0);
+    char buf1[50], buf2[50];
+    struct wsockmsg msgs[2] = {{buf1, sizeof(buf1)}, {buf2, sizeof(buf2)}};
+    int n = 0;
+    while(n != 2) {
+        int rc = wsockrecvmany(s, msgs + n, 2 - n, -1);
+        assert(errno == 0);
+        n += rc;
+    }
+    assert(msgs[0].size == 100 && memcmp(buf1, data, 50) == 0);
+    assert(msgs[1].size == 200 && memcmp(buf2, data, 50) == 0);
+    wsockclose(c);
+    wsockclose(s);
+    chclose(ch);
+    wsockclose(ls);
+
+    return 0;
+}
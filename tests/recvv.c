@@ -0,0 +1,220 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Inverts all the bits of the message. */
+static void *inv_open(void *arg, int client) {
+    return malloc(10000);
+}
+
+static size_t inv_encode(void *state, const void *msg, size_t len,
+      const void **out) {
+    size_t i;
+    for(i = 0; i != len; ++i)
+        ((uint8_t*)state)[i] = ~((const uint8_t*)msg)[i];
+    *out = state;
+    return len;
+}
+
+static size_t inv_decode(void *state, const void *in, size_t inlen,
+      void *out, size_t outlen) {
+    size_t i;
+    for(i = 0; i != inlen && i != outlen; ++i)
+        ((uint8_t*)out)[i] = ~((const uint8_t*)in)[i];
+    errno = 0;
+    return inlen;
+}
+
+static void inv_close(void *state) {
+    free(state);
+}
+
+static struct wsockext inv = {"x-inv", inv_open, inv_encode, inv_decode,
+    inv_close, NULL};
+
+/* Speaks the protocol over a raw TCP connection to send a message in three
+   masked fragments. The last one is held back until told to go. */
+coroutine void fragments(chan go) {
+    tcpsock s = tcpconnect(ipremote("127.0.0.1", 5585, 0, -1), -1);
+    assert(s);
+    const char *request =
+        "GET / HTTP/1.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "\r\n";
+    tcpsend(s, request, strlen(request), -1);
+    assert(errno == 0);
+    tcpflush(s, -1);
+    assert(errno == 0);
+    int crlfs = 0;
+    while(crlfs != 4) {
+        char c;
+        tcprecv(s, &c, 1, -1);
+        assert(errno == 0);
+        crlfs = (c == (crlfs % 2 ? '\n' : '\r')) ? crlfs + 1 :
+            (c == '\r' ? 1 : 0);
+    }
+    uint8_t frames[] = {
+        0x02, 0x83, 1, 2, 3, 4, 'A' ^ 1, 'B' ^ 2, 'C' ^ 3,
+        0x00, 0x84, 5, 6, 7, 8, 'D' ^ 5, 'E' ^ 6, 'F' ^ 7, 'G' ^ 8,
+        0x80, 0x83, 9, 10, 11, 12, 'H' ^ 9, 'I' ^ 10, 'J' ^ 11};
+    tcpsend(s, frames, 19, -1);
+    assert(errno == 0);
+    tcpflush(s, -1);
+    assert(errno == 0);
+    (void)chr(go, int);
+    tcpsend(s, frames + 19, sizeof(frames) - 19, -1);
+    assert(errno == 0);
+    tcpflush(s, -1);
+    assert(errno == 0);
+    (void)chr(go, int);
+    tcpclose(s);
+}
+
+coroutine void dial(chan conns) {
+    wsock c = wsockconnectext(ipremote("127.0.0.1", 5585, 0, -1), NULL, "/",
+        &inv, -1);
+    assert(c);
+    chs(conns, wsock, c);
+}
+
+int main() {
+    char msg[5008];
+    size_t i;
+    for(i = 0; i != sizeof(msg); ++i)
+        msg[i] = (char)i;
+
+    /* Fixed-size header and the body go to separate buffers. */
+    wsock c, s;
+    wsockpair(&c, &s);
+    char hdr[8];
+    char *body = malloc(5000);
+    assert(body);
+    struct iovec iov[4] = {{hdr, sizeof(hdr)}, {body, 5000}};
+    wsocksend(c, msg, sizeof(msg), -1);
+    assert(errno == 0);
+    size_t sz = wsockrecvv(s, iov, 2, -1);
+    assert(errno == 0 && sz == sizeof(msg));
+    assert(memcmp(hdr, msg, 8) == 0 && memcmp(body, msg + 8, 5000) == 0);
+
+    /* Small messages, unmasked in the other direction. Empty buffers are
+       skipped. */
+    memset(hdr, 0, sizeof(hdr));
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 0;
+    iov[1].iov_base = hdr;
+    iov[1].iov_len = 3;
+    iov[2].iov_base = hdr + 3;
+    iov[2].iov_len = 5;
+    wsocksend(s, "ABCDEFGH", 8, -1);
+    assert(errno == 0);
+    sz = wsockrecvv(c, iov, 3, -1);
+    assert(errno == 0 && sz == 8 && memcmp(hdr, "ABCDEFGH", 8) == 0);
+    wsocksend(s, "", 0, -1);
+    assert(errno == 0);
+    sz = wsockrecvv(c, iov, 3, -1);
+    assert(errno == 0 && sz == 0);
+
+    /* Message larger than the buffers is reported. The part that fits is
+       stored, the rest is dropped and the connection goes on. */
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = body;
+    iov[1].iov_len = 100;
+    wsocksend(c, msg, sizeof(msg), -1);
+    assert(errno == 0);
+    sz = wsockrecvv(s, iov, 2, -1);
+    assert(errno == EOVERFLOW && sz == sizeof(msg));
+    assert(memcmp(hdr, msg, 8) == 0 && memcmp(body, msg + 8, 100) == 0);
+    wsocksend(c, msg, 108, -1);
+    assert(errno == 0);
+    sz = wsockrecvv(s, iov, 2, -1);
+    assert(errno == 0 && sz == 108);
+
+    /* Invalid arguments. */
+    sz = wsockrecvv(s, iov, 0, -1);
+    assert(errno == EINVAL && sz == 0);
+    wsockclose(c);
+    wsockclose(s);
+
+    /* Fragments are scattered across the buffers regardless of where they
+       start and the payload is unmasked in place. A deadline in the middle
+       of the message leaves the part received so far in the buffers. */
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5585, 0), NULL, 10);
+    assert(ls);
+    wsockaddext(ls, &inv);
+    assert(errno == 0);
+    chan go = chmake(int, 0);
+    go(fragments(go));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    char a[2], b[5], d[10];
+    struct iovec parts[3] = {{a, 2}, {b, 5}, {d, 10}};
+    sz = wsockrecvv(s, parts, 3, now() + 50);
+    assert(errno == ETIMEDOUT);
+    chs(go, int, 0);
+    sz = wsockrecvv(s, parts, 3, -1);
+    assert(errno == 0 && sz == 10);
+    assert(memcmp(a, "AB", 2) == 0 && memcmp(b, "CDEFG", 5) == 0 &&
+        memcmp(d, "HIJ", 3) == 0);
+    chs(go, int, 0);
+    wsockclose(s);
+
+    /* Messages transformed by an extension are scattered once decoded. */
+    chan conns = chmake(wsock, 1);
+    go(dial(conns));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(conns, wsock);
+    assert(wsockextension(s) && strcmp(wsockextension(s), "x-inv") == 0);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = body;
+    iov[1].iov_len = 5000;
+    wsocksend(c, msg, sizeof(msg), -1);
+    assert(errno == 0);
+    sz = wsockrecvv(s, iov, 2, -1);
+    assert(errno == 0 && sz == sizeof(msg));
+    assert(memcmp(hdr, msg, 8) == 0 && memcmp(body, msg + 8, 5000) == 0);
+    wsocksend(c, msg, 1000, -1);
+    assert(errno == 0);
+    sz = wsockrecvv(s, iov, 1, -1);
+    assert(errno == EOVERFLOW && sz == 1000 && memcmp(hdr, msg, 8) == 0);
+    wsockclose(c);
+    wsockclose(s);
+    wsockclose(ls);
+    chclose(conns);
+    chclose(go);
+    free(body);
+
+    return 0;
+}
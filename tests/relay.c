@@ -0,0 +1,215 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+struct result {
+    size_t sz;
+    int err;
+};
+
+static char big[100000];
+
+coroutine void makeconn(int port, chan ch) {
+    wsock c = wsockconnect(ipremote("127.0.0.1", port, 0, -1), NULL, "/", -1);
+    chs(ch, wsock, c);
+}
+
+/* Connects to the listener and returns both ends of the connection. */
+static void connectpair(wsock ls, int port, wsock *c, wsock *s) {
+    chan ch = chmake(wsock, 1);
+    go(makeconn(port, ch));
+    *s = wsockaccept(ls, -1);
+    assert(*s);
+    *c = chr(ch, wsock);
+    assert(*c);
+    chclose(ch);
+}
+
+coroutine void relayone(wsock src, wsock dst, chan ch) {
+    struct result res;
+    res.sz = wsockrelay(src, dst, -1);
+    res.err = errno;
+    chs(ch, struct result, res);
+}
+
+/* Speaks the protocol over a raw TCP connection to send a fragmented message
+   with a ping in the middle. The client's masks are not trivial so that
+   the relay has to remove them. */
+static void frame(tcpsock s, uint8_t first, const char *data) {
+    uint8_t bytes[9] = {first, 0x83, 1, 2, 3, 4};
+    int i;
+    for(i = 0; i != 3; ++i)
+        bytes[6 + i] = data[i] ^ bytes[2 + i % 4];
+    tcpsend(s, bytes, data[1] ? 9 : 7, -1);
+    assert(errno == 0);
+}
+
+coroutine void rawclient(chan cont) {
+    tcpsock s = tcpconnect(ipremote("127.0.0.1", 5577, 0, -1), -1);
+    assert(s);
+    const char *request =
+        "GET / HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+    tcpsend(s, request, strlen(request), -1);
+    assert(errno == 0);
+    frame(s, 0x02, "ABC");
+    tcpflush(s, -1);
+    assert(errno == 0);
+    (void)chr(cont, int);
+    uint8_t ping[] = {0x89, 0x81, 1, 2, 3, 4, 'p' ^ 1};
+    tcpsend(s, ping, sizeof(ping), -1);
+    assert(errno == 0);
+    frame(s, 0x00, "DEF");
+    frame(s, 0x80, "GHI");
+    tcpflush(s, -1);
+    assert(errno == 0);
+    (void)chr(cont, int);
+    tcpclose(s);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != sizeof(big); ++i)
+        big[i] = (char)(i * 7);
+    static char buf[sizeof(big)];
+    wsock ls1 = wsocklisten(iplocal("127.0.0.1", 5577, 0), NULL, 10);
+    assert(ls1);
+    wsock ls2 = wsocklisten(iplocal("127.0.0.1", 5578, 0), NULL, 10);
+    assert(ls2);
+
+    /* Client 'c' talks to the proxy's 'fs'. The proxy forwards the messages
+       over 'pc' to the backend's 'bs'. */
+    wsock c, fs, pc, bs;
+    connectpair(ls1, 5577, &c, &fs);
+    connectpair(ls2, 5578, &pc, &bs);
+    chan ch = chmake(struct result, 0);
+
+    /* Large messages in both directions. Client to server masking is
+       replaced, server to client payload is passed through as is. */
+    wsocksend(c, big, sizeof(big), -1);
+    assert(errno == 0);
+    go(relayone(fs, pc, ch));
+    size_t sz = wsockrecv(bs, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == sizeof(big));
+    assert(memcmp(buf, big, sizeof(big)) == 0);
+    struct result res = chr(ch, struct result);
+    assert(res.err == 0 && res.sz == sizeof(big));
+    go(relayone(pc, fs, ch));
+    wsocksend(bs, big, sizeof(big), -1);
+    assert(errno == 0);
+    sz = wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == sizeof(big));
+    assert(memcmp(buf, big, sizeof(big)) == 0);
+    res = chr(ch, struct result);
+    assert(res.err == 0 && res.sz == sizeof(big));
+
+    /* Pings are passed on and answered. Pongs are passed on as well. */
+    wsockping(c, -1);
+    assert(errno == 0);
+    wsocksend(c, "ABC", 3, -1);
+    assert(errno == 0);
+    sz = wsockrelay(fs, pc, -1);
+    assert(errno == 0 && sz == 3);
+    sz = wsockrecv(bs, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == EAGAIN);
+    sz = wsockrelay(pc, fs, now() + 100);
+    assert(errno == ETIMEDOUT);
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == EAGAIN);
+
+    /* Empty message. */
+    wsocksend(bs, NULL, 0, -1);
+    assert(errno == 0);
+    sz = wsockrelay(pc, fs, -1);
+    assert(errno == 0 && sz == 0);
+    sz = wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 0);
+
+    /* Invalid use. */
+    wsockrelay(ls1, pc, -1);
+    assert(errno == EOPNOTSUPP);
+    wsockrelay(fs, fs, -1);
+    assert(errno == EINVAL);
+
+    /* Close frame is passed on. */
+    wsockdone(c, -1);
+    assert(errno == 0);
+    wsockrelay(fs, pc, -1);
+    assert(errno == ECONNRESET);
+    wsockrecv(bs, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockrelay(pc, fs, -1);
+    assert(errno == ECONNRESET);
+    wsockrecv(c, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockclose(c);
+    wsockclose(fs);
+    wsockclose(pc);
+    wsockclose(bs);
+
+    /* Fragments are streamed one by one and a deadline in the middle of
+       a message leaves the connections usable. */
+    chan cont = chmake(int, 0);
+    go(rawclient(cont));
+    fs = wsockaccept(ls1, -1);
+    assert(fs);
+    connectpair(ls2, 5578, &pc, &bs);
+    wsockrelay(fs, pc, now() + 100);
+    assert(errno == ETIMEDOUT);
+    wsockrecv(fs, buf, sizeof(buf), -1);
+    assert(errno == EBUSY);
+    wsocksend(pc, "X", 1, -1);
+    assert(errno == EBUSY);
+    chs(cont, int, 0);
+    sz = wsockrelay(fs, pc, -1);
+    assert(errno == 0 && sz == 9);
+    sz = wsockrecv(bs, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 9 && memcmp(buf, "ABCDEFGHI", 9) == 0);
+    wsocksend(pc, "X", 1, -1);
+    assert(errno == 0);
+    chs(cont, int, 0);
+    chclose(cont);
+    wsockclose(fs);
+    wsockclose(pc);
+    wsockclose(bs);
+
+    chclose(ch);
+    wsockclose(ls2);
+    wsockclose(ls1);
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Deadlines expiring in the middle of a message don't break the connection.
+   The next call continues from where the previous one stopped. */
+
+#define NMSGS 20
+#define MSGSIZE 300000
+
+static char data[MSGSIZE + NMSGS];
+
+static size_t msgsize(int i) {
+    return MSGSIZE - i * 1000;
+}
+
+/* Sends all the messages using very short deadlines. */
+coroutine void sender(wsock s, chan done) {
+    int i;
+    for(i = 0; i != NMSGS; ++i) {
+        while(1) {
+            size_t sz = wsocksend(s, data + i, msgsize(i), now() + 1);
+            if(errno != ETIMEDOUT) {
+                assert(errno == 0 && sz == msgsize(i));
+                break;
+            }
+        }
+    }
+    chs(done, int, 0);
+}
+
+/* Receives on the sending side so that pings get answered. Pongs are
+   held back while a message is half-sent. */
+coroutine void ponger(wsock s, chan done) {
+    char buf[10];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3);
+    chs(done, int, 0);
+}
+
+/* Alternates between the two sides, each of them making as much progress
+   as the in-memory pipe allows before the deadline expires. */
+static void alternate(wsock from, wsock to, char *buf) {
+    int sent = 0;
+    int received = 0;
+    int rounds = 0;
+    while(!sent || !received) {
+        if(!sent) {
+            size_t sz = wsocksend(from, data, MSGSIZE, now() + 10);
+            if(errno == 0) {
+                assert(sz == MSGSIZE);
+                sent = 1;
+            }
+            else {
+                assert(errno == ETIMEDOUT);
+                /* Only the same message can be sent now. */
+                sz = wsocksend(from, data, 10, now() + 10);
+                assert(sz == 0 && errno == EINVAL);
+            }
+        }
+        size_t sz = wsockrecv(to, buf, MSGSIZE, now() + 10);
+        if(errno == 0) {
+            assert(sz == MSGSIZE && memcmp(buf, data, MSGSIZE) == 0);
+            received = 1;
+        }
+        else {
+            assert(errno == ETIMEDOUT);
+        }
+        ++rounds;
+    }
+    assert(rounds > 2);
+}
+
+/* Both sides use short deadlines while pings fly in the opposite
+   direction. */
+static void concurrent(wsock from, wsock to, char *buf) {
+    chan done = chmake(int, 2);
+    go(sender(from, done));
+    go(ponger(from, done));
+    int i, pings = 0, pongs = 0, timeouts = 0;
+    for(i = 0; i != NMSGS;) {
+        size_t sz = wsockrecv(to, buf, MSGSIZE, now() + 1);
+        if(errno == ETIMEDOUT) {
+            if(++timeouts % 5 == 0) {
+                wsockping(to, -1);
+                assert(errno == 0);
+                ++pings;
+            }
+            continue;
+        }
+        if(errno == EAGAIN) {
+            ++pongs;
+            continue;
+        }
+        assert(errno == 0 && sz == msgsize(i));
+        assert(memcmp(buf, data + i, sz) == 0);
+        ++i;
+    }
+    (void)chr(done, int);
+    while(pongs != pings) {
+        wsockrecv(to, buf, MSGSIZE, -1);
+        assert(errno == EAGAIN);
+        ++pongs;
+    }
+    wsocksend(to, "ABC", 3, -1);
+    assert(errno == 0);
+    (void)chr(done, int);
+    chclose(done);
+}
+
+coroutine void connector(chan ch) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", 5570, 0, -1), NULL, "/", -1);
+    assert(s);
+    chs(ch, wsock, s);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != sizeof(data); ++i)
+        data[i] = (char)(i * 13 + 5);
+    char *buf = malloc(MSGSIZE);
+    assert(buf);
+
+    wsock c, s;
+    wsockpair(&c, &s);
+    assert(errno == 0);
+    alternate(c, s, buf);
+    alternate(s, c, buf);
+    concurrent(c, s, buf);
+    concurrent(s, c, buf);
+    wsockclose(c);
+    wsockclose(s);
+
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5570, 0), NULL, 10);
+    assert(ls);
+    chan ch = chmake(wsock, 0);
+    go(connector(ch));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(ch, wsock);
+    concurrent(c, s, buf);
+    concurrent(s, c, buf);
+
+    /* The connection is still in a good shape. */
+    wsocksend(c, "ABC", 3, -1);
+    assert(errno == 0);
+    size_t sz = wsockrecv(s, buf, MSGSIZE, -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    wsockclose(c);
+    wsockclose(s);
+    chclose(ch);
+    wsockclose(ls);
+    free(buf);
+
+    return 0;
+}
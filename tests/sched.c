@@ -0,0 +1,215 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+/* UNIX domain sockets leave the socket buffers the only buffering, so that
+   a peer that doesn't read blocks the sender early. */
+#define ADDR "wsock-sched.sock"
+
+static char big[50000];
+
+coroutine void sender(wsock s, size_t len, int count, chan done) {
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsocksend(s, big, len, -1);
+        assert(errno == 0 && sz == len);
+    }
+    chs(done, int, 0);
+}
+
+coroutine void filesender(wsock s, int fd, chan done) {
+    size_t sz = wsocksendfile(s, fd, 0, sizeof(big), -1);
+    assert(errno == 0 && sz == sizeof(big));
+    chs(done, int, 0);
+}
+
+coroutine void connector(chan conns) {
+    wsock c = wsockconnectunix(ADDR, NULL, "/", -1);
+    assert(c);
+    chs(conns, wsock, c);
+}
+
+static void receive(wsock s, size_t len, int count) {
+    static char buf[sizeof(big)];
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+        assert(errno == 0 && sz == len && memcmp(buf, big, len) == 0);
+    }
+}
+
+int main() {
+    size_t i;
+    for(i = 0; i != sizeof(big); ++i)
+        big[i] = (char)i;
+
+    /* Listener passes the scheduler on to the accepted connections. */
+    wsocksched sch = wsockschedmake(1000);
+    assert(sch);
+    unlink(ADDR);
+    wsock ls = wsocklistenunix(ADDR, NULL, 10);
+    assert(ls);
+    wsockschedule(ls, sch);
+    assert(errno == 0);
+    chan conns = chmake(wsock, 1);
+    go(connector(conns));
+    wsock s1 = wsockaccept(ls, -1);
+    assert(s1);
+    wsock c1 = chr(conns, wsock);
+    go(connector(conns));
+    wsock s2 = wsockaccept(ls, -1);
+    assert(s2);
+    wsock c2 = chr(conns, wsock);
+
+    /* Connections sharing the scheduler take turns. Small quantum makes for
+       lots of them. A client is scheduled as well so that masking is
+       covered. The first connection is not read from until the others are
+       done, so it keeps running into a full socket buffer and the others
+       have to wait for it. */
+    wsockschedule(c2, sch);
+    assert(errno == 0);
+    wsocksetopt(s1, WSOCK_SNDBUF, 8192);
+    wsocksetopt(c1, WSOCK_RCVBUF, 8192);
+    chan done = chmake(int, 3);
+    go(sender(s1, sizeof(big), 20, done));
+    go(sender(s2, 30000, 4, done));
+    go(sender(c2, 30000, 4, done));
+    receive(c2, 30000, 4);
+    receive(s2, 30000, 4);
+    receive(c1, sizeof(big), 20);
+    (void)chr(done, int);
+    (void)chr(done, int);
+    (void)chr(done, int);
+    struct wsockschedstats st;
+    wsockschedstats(sch, &st);
+    assert(errno == 0);
+    assert(st.msgs == 28 && st.bytes == 20 * sizeof(big) + 8 * 30000);
+    assert(st.queued == 0 && st.maxqueued >= 1 && st.maxqueued <= 2);
+    assert(st.waits > 0 && st.throttles == 0);
+    wsocksendstats(s1, &st);
+    assert(st.msgs == 20 && st.bytes == 20 * sizeof(big));
+    wsocksendstats(c1, &st);
+    assert(st.msgs == 0 && st.bytes == 0);
+
+    /* Message rate limit. 50 messages a second allows for bursts of 5.
+       A stale errno is not mistaken for an expired deadline. */
+    wsockratelimit(s1, 50, 0);
+    assert(errno == 0);
+    int64_t start = now();
+    for(i = 0; i != 15; ++i) {
+        errno = ETIMEDOUT;
+        wsocksend(s1, big, 10, -1);
+        assert(errno == 0);
+    }
+    int64_t elapsed = now() - start;
+    assert(elapsed >= 150 && elapsed < 1000);
+    receive(c1, 10, 15);
+    wsocksendstats(s1, &st);
+    assert(st.msgs == 35 && st.throttles > 0 && st.throttletime >= 150);
+
+    /* Byte rate limit. The message is passed on in pieces as the bucket
+       refills. */
+    wsockratelimit(s1, 0, 20000);
+    assert(errno == 0);
+    start = now();
+    wsocksend(s1, big, 10000, -1);
+    assert(errno == 0);
+    elapsed = now() - start;
+    assert(elapsed >= 300 && elapsed < 2000);
+    receive(c1, 10000, 1);
+
+    /* Waiting for the rate limit times out without breaking the
+       connection. */
+    wsockratelimit(s1, 1, 0);
+    wsocksend(s1, big, 10, -1);
+    assert(errno == 0);
+    wsocksend(s1, big, 10, now() + 50);
+    assert(errno == ETIMEDOUT);
+    wsockratelimit(s1, 0, 0);
+    wsocksend(s1, big, 10, -1);
+    assert(errno == 0);
+    receive(c1, 10, 2);
+
+    /* Files are sent in turns as well. The light connection gets its
+       message through while the file is stuck on the peer that doesn't
+       read. */
+    FILE *f = tmpfile();
+    assert(f);
+    size_t fsz = fwrite(big, 1, sizeof(big), f);
+    assert(fsz == sizeof(big));
+    fflush(f);
+    wsockschedstats(sch, &st);
+    uint64_t bytes = st.bytes;
+    uint64_t waits = st.waits;
+    go(filesender(s1, fileno(f), done));
+    wsocksend(s2, big, 30000, -1);
+    assert(errno == 0);
+    receive(c2, 30000, 1);
+    receive(c1, sizeof(big), 1);
+    (void)chr(done, int);
+    wsockschedstats(sch, &st);
+    assert(st.bytes == bytes + sizeof(big) + 30000 && st.waits > waits);
+    fclose(f);
+
+    /* Detaching. */
+    wsockschedule(s1, NULL);
+    assert(errno == 0);
+    wsockschedule(c2, NULL);
+    assert(errno == 0);
+    wsockclose(c1);
+    wsockclose(s1);
+    wsockclose(c2);
+    wsockclose(s2);
+
+    /* Listener passes the limits on as well. The scheduler outlives
+       the user's handle while it's in use. */
+    wsockratelimit(ls, 1000, 1000000);
+    assert(errno == 0);
+    go(connector(conns));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    wsock c = chr(conns, wsock);
+    wsockschedclose(sch);
+    wsocksend(s, big, 100, -1);
+    assert(errno == 0);
+    receive(c, 100, 1);
+    wsocksendstats(s, &st);
+    assert(st.msgs == 1 && st.bytes == 100);
+    wsockclose(c);
+    wsockclose(s);
+    wsockclose(ls);
+    unlink(ADDR);
+    chclose(conns);
+    chclose(done);
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+static char data[100000];
+static chan done;
+
+coroutine void client(int fd) {
+    ipaddr addr = ipremote("127.0.0.1", 5555, 0, -1);
+    wsock s = wsockconnect(addr, NULL, "/", -1);
+    assert(s);
+    static char buf[sizeof(data)];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0);
+    assert(sz == sizeof(data) - 10);
+    assert(memcmp(buf, data + 10, sz) == 0);
+    /* Client has to mask the payload. */
+    sz = wsocksendfile(s, fd, 0, 1000, -1);
+    assert(errno == 0);
+    assert(sz == 1000);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 10);
+    assert(memcmp(buf, data + sizeof(data) - 10, 10) == 0);
+    (void)chr(done, int);
+    wsockclose(s);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != sizeof(data); ++i)
+        data[i] = (char)(i * 7);
+    FILE *f = tmpfile();
+    assert(f);
+    size_t sz = fwrite(data, 1, sizeof(data), f);
+    assert(sz == sizeof(data));
+    fflush(f);
+    int fd = fileno(f);
+    done = chmake(int, 0);
+
+    ipaddr addr = iplocal("127.0.0.1", 5555, 0);
+    wsock ls = wsocklisten(addr, NULL, 10);
+    assert(ls);
+    go(client(fd));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    sz = wsocksendfile(s, fd, 10, sizeof(data) - 10, -1);
+    assert(errno == 0);
+    assert(sz == sizeof(data) - 10);
+    char buf[1000];
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0);
+    assert(sz == 1000);
+    assert(memcmp(buf, data, 1000) == 0);
+
+    /* File shorter than the message is refused before anything is sent.
+       The connection remains usable. */
+    sz = wsocksendfile(s, fd, sizeof(data) - 10, 20, -1);
+    assert(sz == 0 && errno == EINVAL);
+    sz = wsocksendfile(s, fd, sizeof(data) + 10, 0, -1);
+    assert(sz == 0 && errno == EINVAL);
+    sz = wsocksendfile(s, -1, 0, 10, -1);
+    assert(sz == 0 && errno == EINVAL);
+    sz = wsocksend(s, "ABC", 3, -1);
+    assert(errno == 0 && sz == 3);
+    sz = wsocksendfile(s, fd, sizeof(data) - 10, 10, -1);
+    assert(errno == 0 && sz == 10);
+
+    chs(done, int, 0);
+    wsockclose(s);
+    wsockclose(ls);
+    chclose(done);
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+/* Small messages take a shortcut on the receiving side. Check them around
+   the boundaries of the shortcut, both over a transport that allows peeking
+   into its buffer (in-memory pipe) and one that doesn't (TCP). */
+
+static char data[200];
+
+coroutine void sender(wsock s) {
+    int i;
+    for(i = 0; i != 130; ++i) {
+        size_t sz = wsocksend(s, data + i, i, -1);
+        assert(errno == 0 && sz == i);
+        /* Control frames in between the messages. */
+        if(i % 10 == 0) {
+            wsockpong(s, -1);
+            assert(errno == 0);
+        }
+    }
+    wsocksend(s, data, 100, -1);
+    assert(errno == 0);
+    wsocksend(s, data, 10, -1);
+    assert(errno == 0);
+}
+
+coroutine void connector(chan ch) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", 5561, 0, -1), NULL, "/", -1);
+    assert(s);
+    chs(ch, wsock, s);
+}
+
+static void check(wsock from, wsock to) {
+    go(sender(from));
+    char buf[sizeof(data)];
+    int i;
+    for(i = 0; i != 130; ++i) {
+        size_t sz = wsockrecv(to, buf, sizeof(buf), -1);
+        assert(errno == 0 && sz == i);
+        assert(memcmp(buf, data + i, sz) == 0);
+        if(i % 10 == 0) {
+            sz = wsockrecv(to, buf, sizeof(buf), -1);
+            assert(sz == 0 && errno == EAGAIN);
+        }
+    }
+    /* Message that doesn't fit into the buffer. */
+    memset(buf, 0, sizeof(buf));
+    size_t sz = wsockrecv(to, buf, 50, -1);
+    assert(errno == 0 && sz == 100);
+    assert(memcmp(buf, data, 50) == 0 && buf[50] == 0);
+    sz = wsockrecv(to, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 10);
+    assert(memcmp(buf, data, 10) == 0);
+}
+
+int main() {
+    int i;
+    for(i = 0; i != sizeof(data); ++i)
+        data[i] = (char)(i * 13 + 1);
+
+    wsock c, s;
+    wsockpair(&c, &s);
+    assert(errno == 0);
+    check(c, s);
+    check(s, c);
+    wsockclose(c);
+    wsockclose(s);
+
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5561, 0), NULL, 10);
+    assert(ls);
+    chan ch = chmake(wsock, 0);
+    go(connector(ch));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(ch, wsock);
+    check(c, s);
+    check(s, c);
+    wsockclose(c);
+    wsockclose(s);
+    chclose(ch);
+    wsockclose(ls);
+
+    return 0;
+}
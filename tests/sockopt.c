@@ -0,0 +1,136 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#include <assert.h>
+#include <libmill.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+coroutine void connector(chan ch) {
+    wsock s = wsockconnect(ipremote("127.0.0.1", 5568, 0, -1), NULL, "/", -1);
+    assert(s);
+    chs(ch, wsock, s);
+}
+
+coroutine void unixconnector(chan ch) {
+    wsock s = wsockconnectunix("wsock-sockopt.sock", NULL, "/", -1);
+    assert(s);
+    chs(ch, wsock, s);
+}
+
+int main() {
+    /* Options set on the listener are applied to accepted connections. */
+    wsock ls = wsocklisten(iplocal("127.0.0.1", 5568, 0), NULL, 10);
+    assert(ls);
+    int rc = wsockgetopt(ls, WSOCK_NODELAY);
+    assert(rc == -1 && errno == ENOENT);
+    rc = wsocksetopt(ls, WSOCK_NODELAY, 1);
+    assert(rc == 0);
+    rc = wsocksetopt(ls, WSOCK_RCVBUF, 65536);
+    assert(rc == 0);
+    assert(wsockgetopt(ls, WSOCK_NODELAY) == 1);
+    rc = wsocksetopt(ls, 0, 1);
+    assert(rc == -1 && errno == EINVAL);
+    rc = wsocksetopt(ls, WSOCK_SNDBUF, -1);
+    assert(rc == -1 && errno == EINVAL);
+    chan ch = chmake(wsock, 0);
+    go(connector(ch));
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    wsock c = chr(ch, wsock);
+    assert(wsockgetopt(s, WSOCK_NODELAY) != 0);
+    assert(wsockgetopt(s, WSOCK_RCVBUF) >= 65536);
+    assert(wsockgetopt(c, WSOCK_NODELAY) == 0);
+
+    /* Options on a connection. */
+    rc = wsocksetopt(c, WSOCK_NODELAY, 1);
+    assert(rc == 0);
+    assert(wsockgetopt(c, WSOCK_NODELAY) != 0);
+    rc = wsocksetopt(c, WSOCK_SNDBUF, 32768);
+    assert(rc == 0);
+    assert(wsockgetopt(c, WSOCK_SNDBUF) >= 32768);
+    rc = wsockgetopt(c, 100);
+    assert(rc == -1 && errno == EINVAL);
+
+    /* Profiles. */
+    rc = wsockprofile(c, "bulk");
+    assert(rc == 0);
+    assert(wsockgetopt(c, WSOCK_NODELAY) == 0);
+    assert(wsockgetopt(c, WSOCK_RCVBUF) >= 65536);
+    rc = wsockprofile(c, "low-latency");
+    assert(rc == 0);
+    assert(wsockgetopt(c, WSOCK_NODELAY) != 0);
+    rc = wsockprofile(c, "fast");
+    assert(rc == -1 && errno == EINVAL);
+    rc = wsockprofile(ls, "low-latency");
+    assert(rc == 0);
+    assert(wsockgetopt(ls, WSOCK_NODELAY) == 1);
+    assert(wsockgetopt(ls, WSOCK_RCVBUF) == 65536);
+
+    /* The connection still works. */
+    wsocksend(c, "ABC", 3, -1);
+    assert(errno == 0);
+    char buf[3];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0 && sz == 3);
+    wsockclose(c);
+    wsockclose(s);
+    chclose(ch);
+    wsockclose(ls);
+
+    /* TCP-level options are skipped on Unix domain sockets. */
+    unlink("wsock-sockopt.sock");
+    ls = wsocklistenunix("wsock-sockopt.sock", NULL, 10);
+    assert(ls);
+    rc = wsockprofile(ls, "low-latency");
+    assert(rc == 0);
+    ch = chmake(wsock, 0);
+    go(unixconnector(ch));
+    s = wsockaccept(ls, -1);
+    assert(s);
+    c = chr(ch, wsock);
+    rc = wsockprofile(c, "bulk");
+    assert(rc == 0);
+    assert(wsockgetopt(c, WSOCK_SNDBUF) >= 65536);
+    rc = wsocksetopt(c, WSOCK_NODELAY, 1);
+    assert(rc == -1);
+    wsockclose(c);
+    wsockclose(s);
+    chclose(ch);
+    wsockclose(ls);
+    unlink("wsock-sockopt.sock");
+
+    /* In-memory connections have no socket options. */
+    wsockpair(&c, &s);
+    rc = wsocksetopt(c, WSOCK_NODELAY, 1);
+    assert(rc == -1 && errno == ENOTSUP);
+    rc = wsockprofile(s, "bulk");
+    assert(rc == -1 && errno == ENOTSUP);
+    wsockclose(c);
+    wsockclose(s);
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../wsock.h"
+
+#define ADDR "wsock-unix-test.sock"
+
+coroutine void client(void) {
+    wsock s = wsockconnectunix(ADDR, "b", "/chat", -1);
+    assert(s);
+    assert(strcmp(wsocksubprotocol(s), "b") == 0);
+    wsocksend(s, "ABC", 3, -1);
+    assert(errno == 0);
+    char buf[3];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0);
+    assert(sz == 3 && memcmp(buf, "DEF", 3) == 0);
+    wsockdone(s, -1);
+    assert(errno == 0);
+    wsockclose(s);
+}
+
+int main() {
+    unlink(ADDR);
+    wsock ls = wsocklistenunix(ADDR, "a,b", 10);
+    assert(ls);
+    go(client());
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    assert(strcmp(wsockurl(s), "/chat") == 0);
+    assert(strcmp(wsocksubprotocol(s), "b") == 0);
+    char buf[3];
+    size_t sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == 0);
+    assert(sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    wsocksend(s, "DEF", 3, -1);
+    assert(errno == 0);
+    sz = wsockrecv(s, buf, sizeof(buf), -1);
+    assert(errno == ECONNRESET);
+    wsockclose(s);
+
+    /* Connecting to a socket nobody listens on fails straight away. */
+    wsockclose(ls);
+    unlink(ADDR);
+    s = wsockconnectunix(ADDR, NULL, "/", -1);
+    assert(!s && errno != 0);
+
+    return 0;
+}
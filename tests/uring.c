@@ -0,0 +1,115 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <libmill.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wsock.h"
+
+#define NCLIENTS 50
+
+static char data[300000];
+static chan done;
+
+/* Each client sends messages of increasing size and expects them echoed. */
+coroutine void client(int id) {
+    ipaddr addr = ipremote("127.0.0.1", 5555, 0, -1);
+    wsock s = wsockconnect(addr, NULL, "/", -1);
+    assert(s);
+    static char buf[NCLIENTS][sizeof(data)];
+    size_t sizes[] = {1, 125, 126, 4000, 4096, 10000, 200000};
+    int i;
+    for(i = 0; i != sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        size_t sz = wsocksend(s, data + id, sizes[i] - id % 2, -1);
+        assert(errno == 0);
+        sz = wsockrecv(s, buf[id], sizeof(buf[id]), -1);
+        assert(errno == 0);
+        assert(sz == sizes[i] - id % 2);
+        assert(memcmp(buf[id], data + id, sz) == 0);
+    }
+    wsockclose(s);
+    chs(done, int, id);
+}
+
+coroutine void echo(wsock s) {
+    char *buf = malloc(sizeof(data));
+    assert(buf);
+    while(1) {
+        size_t sz = wsockrecv(s, buf, sizeof(data), -1);
+        if(errno != 0)
+            break;
+        wsocksend(s, buf, sz, -1);
+        assert(errno == 0);
+    }
+    assert(errno == ECONNRESET);
+    wsockclose(s);
+    free(buf);
+}
+
+int main() {
+#if !defined WSOCK_HAVE_URING
+    return 77;
+#endif
+    /* Allows wsock to send from registered buffers via IORING_OP_WRITE_FIXED
+       on kernels that don't support them with IORING_OP_SEND. */
+    signal(SIGPIPE, SIG_IGN);
+    int i;
+    for(i = 0; i != sizeof(data); ++i)
+        data[i] = (char)(i * 7);
+    done = chmake(int, NCLIENTS);
+
+    ipaddr addr = iplocal("127.0.0.1", 5555, 0);
+    wsock ls = wsocklisten(addr, NULL, NCLIENTS);
+    assert(ls);
+    for(i = 0; i != NCLIENTS; ++i)
+        go(client(i));
+    for(i = 0; i != NCLIENTS; ++i) {
+        wsock s = wsockaccept(ls, -1);
+        assert(s);
+        go(echo(s));
+    }
+    for(i = 0; i != NCLIENTS; ++i)
+        (void)chr(done, int);
+
+    /* Deadline expiring while receiving. */
+    wsock c = wsockconnect(iplocal("127.0.0.1", 5555, 0), NULL, "/", -1);
+    assert(c);
+    wsock s = wsockaccept(ls, -1);
+    assert(s);
+    char buf[10];
+    int64_t start = now();
+    size_t sz = wsockrecv(c, buf, sizeof(buf), start + 100);
+    assert(sz == 0 && errno == ETIMEDOUT);
+    assert(now() - start >= 90);
+    wsockclose(c);
+    wsockclose(s);
+
+    wsockclose(ls);
+    chclose(done);
+    return 0;
+}
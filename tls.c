@@ -0,0 +1,335 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#if defined WSOCK_HAVE_TLS
+
+/* OpenSSL headers must precede libmill.h which defines macros such as 'end'
+   that clash with OpenSSL's identifiers. */
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libmill.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "tls.h"
+
+/* One TLS record is written per flush of a full buffer. */
+#define WSOCK_TLS_BUFLEN 4096
+
+struct wsock_tls {
+    SSL *ssl;
+    int fd;
+    size_t ifirst;
+    size_t ilen;
+    size_t olen;
+    uint8_t ibuf[WSOCK_TLS_BUFLEN];
+    uint8_t obuf[WSOCK_TLS_BUFLEN];
+};
+
+static SSL_CTX *wsock_tls_ctx(const SSL_METHOD *method, int ktls) {
+    SSL_CTX *ctx = SSL_CTX_new(method);
+    if(!ctx) {errno = ENOMEM; return NULL;}
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if defined SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* Report peer closing the TCP connection as ECONNRESET, same as with
+       plain TCP. */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#if defined SSL_OP_ENABLE_KTLS
+    if(ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    /* A write interrupted by a deadline is retried with the same data, but
+       not necessarily from the same buffer. */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return ctx;
+}
+
+struct ssl_ctx_st *wsock_tls_server(const char *cert, const char *key,
+      int ktls) {
+    SSL_CTX *ctx = wsock_tls_ctx(TLS_server_method(), ktls);
+    if(!ctx)
+        return NULL;
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+          SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+          SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_clear_error();
+        SSL_CTX_free(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+    return ctx;
+}
+
+struct ssl_ctx_st *wsock_tls_client(const char *cafile, int ktls) {
+    SSL_CTX *ctx = wsock_tls_ctx(TLS_client_method(), ktls);
+    if(!ctx)
+        return NULL;
+    int rc = cafile ? SSL_CTX_load_verify_locations(ctx, cafile, NULL) :
+        SSL_CTX_set_default_verify_paths(ctx);
+    if(rc != 1) {
+        ERR_clear_error();
+        SSL_CTX_free(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+void wsock_tls_term(struct ssl_ctx_st *ctx) {
+    SSL_CTX_free(ctx);
+}
+
+/* Waits till the failed SSL operation can be retried. Returns 0 if so,
+   -1 with errno set if the operation has failed. */
+static int wsock_tls_wait(struct wsock_tls *self, int rc, int64_t deadline) {
+    int events;
+    switch(SSL_get_error(self->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        events = FDW_IN;
+        break;
+    case SSL_ERROR_WANT_WRITE:
+        events = FDW_OUT;
+        break;
+    case SSL_ERROR_ZERO_RETURN:
+        errno = ECONNRESET;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        ERR_clear_error();
+        if(rc == 0 || errno == 0 || errno == EPIPE)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
+    if(!fdwait(self->fd, events, deadline)) {errno = ETIMEDOUT; return -1;}
+    return 0;
+}
+
+static struct wsock_tls *wsock_tls_handshake(SSL_CTX *ctx, int fd,
+      const char *host, int server, int64_t deadline) {
+    int err;
+    struct wsock_tls *self = malloc(sizeof(struct wsock_tls));
+    if(!self) {err = ENOMEM; goto err0;}
+    self->fd = fd;
+    self->ifirst = 0;
+    self->ilen = 0;
+    self->olen = 0;
+    /* libmill sockets are non-blocking but let's make sure. */
+    int opt = fcntl(fd, F_GETFL, 0);
+    if(opt == -1 || fcntl(fd, F_SETFL, opt | O_NONBLOCK) == -1) {
+        err = errno; goto err1;}
+    self->ssl = SSL_new(ctx);
+    if(!self->ssl) {err = ENOMEM; goto err1;}
+    if(SSL_set_fd(self->ssl, fd) != 1) {err = ENOMEM; goto err2;}
+    if(server) {
+        SSL_set_accept_state(self->ssl);
+    }
+    else {
+        SSL_set_connect_state(self->ssl);
+        if(host) {
+            if(SSL_set_tlsext_host_name(self->ssl, host) != 1 ||
+                  SSL_set1_host(self->ssl, host) != 1) {
+                err = EINVAL; goto err2;}
+        }
+    }
+    while(1) {
+        int rc = SSL_do_handshake(self->ssl);
+        if(rc == 1)
+            break;
+        if(wsock_tls_wait(self, rc, deadline) != 0) {err = errno; goto err2;}
+    }
+    wsock_budget_charge(sizeof(struct wsock_tls));
+    errno = 0;
+    return self;
+err2:
+    SSL_free(self->ssl);
+err1:
+    free(self);
+err0:
+    fdclean(fd);
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+struct wsock_tls *wsock_tls_accept(struct ssl_ctx_st *ctx, int fd,
+      int64_t deadline) {
+    return wsock_tls_handshake(ctx, fd, NULL, 1, deadline);
+}
+
+struct wsock_tls *wsock_tls_connect(struct ssl_ctx_st *ctx, int fd,
+      const char *host, int64_t deadline) {
+    return wsock_tls_handshake(ctx, fd, host, 0, deadline);
+}
+
+/* Writes the whole buffer as one or more TLS records. Returns the number
+   of bytes written. If it's less than 'len', errno is set. */
+static size_t wsock_tls_write(struct wsock_tls *self, const void *buf,
+      size_t len, int64_t deadline) {
+    size_t written = 0;
+    while(written != len) {
+        size_t chunk = len - written > INT_MAX ? INT_MAX : len - written;
+        int rc = SSL_write(self->ssl, (const uint8_t*)buf + written,
+            (int)chunk);
+        if(rc <= 0) {
+            if(wsock_tls_wait(self, rc, deadline) != 0)
+                return written;
+            continue;
+        }
+        written += rc;
+    }
+    errno = 0;
+    return len;
+}
+
+static void wsock_tls_flush(void *hndl, int64_t deadline) {
+    struct wsock_tls *self = (struct wsock_tls*)hndl;
+    size_t sz = wsock_tls_write(self, self->obuf, self->olen, deadline);
+    memmove(self->obuf, self->obuf + sz, self->olen - sz);
+    self->olen -= sz;
+}
+
+static size_t wsock_tls_send(void *hndl, const void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_tls *self = (struct wsock_tls*)hndl;
+    /* Small writes are batched into a single record. */
+    if(WSOCK_TLS_BUFLEN - self->olen >= len) {
+        memcpy(self->obuf + self->olen, buf, len);
+        self->olen += len;
+        errno = 0;
+        return len;
+    }
+    wsock_tls_flush(self, deadline);
+    if(errno != 0)
+        return 0;
+    if(len <= WSOCK_TLS_BUFLEN) {
+        memcpy(self->obuf, buf, len);
+        self->olen = len;
+        errno = 0;
+        return len;
+    }
+    /* Large writes bypass the buffer. */
+    return wsock_tls_write(self, buf, len, deadline);
+}
+
+static size_t wsock_tls_recv(void *hndl, void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_tls *self = (struct wsock_tls*)hndl;
+    size_t received = 0;
+    while(1) {
+        /* Use the buffered data first. */
+        size_t sz = len - received < self->ilen ? len - received : self->ilen;
+        if(buf)
+            memcpy(((uint8_t*)buf) + received, self->ibuf + self->ifirst, sz);
+        self->ifirst += sz;
+        self->ilen -= sz;
+        received += sz;
+        if(received == len) {errno = 0; return len;}
+        /* Large reads go directly to the user's buffer. */
+        size_t remaining = len - received;
+        uint8_t *dst = self->ibuf;
+        size_t dstsz = WSOCK_TLS_BUFLEN;
+        if(buf && remaining >= WSOCK_TLS_BUFLEN) {
+            dst = ((uint8_t*)buf) + received;
+            dstsz = remaining > INT_MAX ? INT_MAX : remaining;
+        }
+        int rc = SSL_read(self->ssl, dst, (int)dstsz);
+        if(rc <= 0) {
+            if(wsock_tls_wait(self, rc, deadline) != 0)
+                return received;
+            continue;
+        }
+        if(dst == self->ibuf) {
+            self->ifirst = 0;
+            self->ilen = rc;
+        }
+        else {
+            received += rc;
+        }
+    }
+}
+
+static size_t wsock_tls_peek(void *hndl, const void **buf) {
+    struct wsock_tls *self = (struct wsock_tls*)hndl;
+    *buf = self->ibuf + self->ifirst;
+    return self->ilen;
+}
+
+int wsock_tls_ktls(struct wsock_tls *self) {
+#if HAVE_DECL_BIO_GET_KTLS_SEND
+    return BIO_get_ktls_send(SSL_get_wbio(self->ssl)) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+#if defined HAVE_SSL_SENDFILE
+size_t wsock_tls_sendfile(struct wsock_tls *self, int fd, off_t off,
+      size_t len, int64_t deadline) {
+    size_t sent = 0;
+    while(sent != len) {
+        ossl_ssize_t rc = SSL_sendfile(self->ssl, fd, off + sent, len - sent,
+            0);
+        if(rc <= 0) {
+            if(wsock_tls_wait(self, (int)rc, deadline) != 0)
+                return sent;
+            continue;
+        }
+        sent += rc;
+    }
+    errno = 0;
+    return len;
+}
+#endif
+
+static void wsock_tls_close(void *hndl) {
+    struct wsock_tls *self = (struct wsock_tls*)hndl;
+    /* Send close_notify if it can be done without blocking. */
+    SSL_shutdown(self->ssl);
+    ERR_clear_error();
+    SSL_free(self->ssl);
+    fdclean(self->fd);
+    close(self->fd);
+    wsock_budget_give(sizeof(struct wsock_tls));
+    free(self);
+}
+
+const struct wsock_transport wsock_tls_transport = {
+    wsock_tls_send,
+    wsock_tls_flush,
+    wsock_tls_recv,
+    wsock_tls_peek,
+    wsock_tls_close
+};
+
+#endif
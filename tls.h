@@ -0,0 +1,72 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+#ifndef WSOCK_TLS_INCLUDED
+#define WSOCK_TLS_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "transport.h"
+
+/*  TLS layer on top of a raw non-blocking socket. It is buffered the same
+    way as libmill's tcpsock so that wsock can use it interchangeably.
+    Available only if wsock was configured with --enable-tls. */
+
+/*  OpenSSL's SSL_CTX. Declared here so that users of this header don't have
+    to include OpenSSL headers. */
+struct ssl_ctx_st;
+
+struct wsock_tls;
+
+/*  Create a TLS context. If 'ktls' is set, kernel TLS offload will be used
+    for connections where both OpenSSL and the kernel support it. Return NULL
+    and set errno in case of error. */
+struct ssl_ctx_st *wsock_tls_server(const char *cert, const char *key,
+    int ktls);
+struct ssl_ctx_st *wsock_tls_client(const char *cafile, int ktls);
+void wsock_tls_term(struct ssl_ctx_st *ctx);
+
+/*  Do the TLS handshake on the socket. The socket is owned by the TLS object
+    from now on; it is closed even if the handshake fails. */
+struct wsock_tls *wsock_tls_accept(struct ssl_ctx_st *ctx, int fd,
+    int64_t deadline);
+struct wsock_tls *wsock_tls_connect(struct ssl_ctx_st *ctx, int fd,
+    const char *host, int64_t deadline);
+
+/*  Returns 1 if encryption of outgoing data was offloaded to the kernel. */
+int wsock_tls_ktls(struct wsock_tls *self);
+
+#if defined HAVE_SSL_SENDFILE
+/*  Sends data from a file without copying it to the user space. Works only
+    if wsock_tls_ktls() returns 1. The send buffer must be flushed
+    beforehand. Returns the number of bytes sent. If it's less than 'len',
+    errno is set. */
+size_t wsock_tls_sendfile(struct wsock_tls *self, int fd, off_t off,
+    size_t len, int64_t deadline);
+#endif
+
+/*  Connection's I/O. The instance is the struct wsock_tls. */
+extern const struct wsock_transport wsock_tls_transport;
+
+#endif
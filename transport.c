@@ -0,0 +1,240 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libmill.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "budget.h"
+#include "transport.h"
+
+/* Size of the receive and send buffers of a connection. */
+#define WSOCK_FD_BUFLEN 4096
+
+/* Plain TCP or UNIX domain socket. libmill's sockets would do, except that
+   they don't give access to the data they have buffered, which is what
+   the receive fast paths need. */
+struct wsock_fd {
+    int fd;
+    size_t ifirst;
+    size_t ilen;
+    size_t olen;
+    uint8_t ibuf[WSOCK_FD_BUFLEN];
+    uint8_t obuf[WSOCK_FD_BUFLEN];
+};
+
+/* Writes the whole buffer to the socket. */
+static size_t wsock_fd_write(struct wsock_fd *self, const uint8_t *buf,
+      size_t len, int64_t deadline) {
+    size_t sent = 0;
+    while(sent != len) {
+        ssize_t sz = send(self->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if(sz < 0) {
+            if(errno == EPIPE)
+                errno = ECONNRESET;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return sent;
+            if(!fdwait(self->fd, FDW_OUT, deadline)) {
+                errno = ETIMEDOUT; return sent;}
+            continue;
+        }
+        sent += sz;
+    }
+    errno = 0;
+    return len;
+}
+
+static void wsock_fd_flush(void *hndl, int64_t deadline) {
+    struct wsock_fd *self = (struct wsock_fd*)hndl;
+    size_t sz = wsock_fd_write(self, self->obuf, self->olen, deadline);
+    memmove(self->obuf, self->obuf + sz, self->olen - sz);
+    self->olen -= sz;
+}
+
+static size_t wsock_fd_send(void *hndl, const void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_fd *self = (struct wsock_fd*)hndl;
+    if(self->olen + len > WSOCK_FD_BUFLEN) {
+        wsock_fd_flush(self, deadline);
+        if(errno != 0)
+            return 0;
+        /* Large writes go directly to the socket. */
+        if(len >= WSOCK_FD_BUFLEN)
+            return wsock_fd_write(self, (const uint8_t*)buf, len, deadline);
+    }
+    memcpy(self->obuf + self->olen, buf, len);
+    self->olen += len;
+    errno = 0;
+    return len;
+}
+
+static size_t wsock_fd_recv(void *hndl, void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_fd *self = (struct wsock_fd*)hndl;
+    size_t received = 0;
+    while(1) {
+        /* Use the buffered data first. */
+        size_t sz = len - received < self->ilen ? len - received : self->ilen;
+        if(buf)
+            memcpy(((uint8_t*)buf) + received, self->ibuf + self->ifirst, sz);
+        self->ifirst += sz;
+        self->ilen -= sz;
+        received += sz;
+        if(received == len) {errno = 0; return len;}
+        /* Large reads go directly to the user's buffer. */
+        size_t remaining = len - received;
+        uint8_t *dst = self->ibuf;
+        size_t dstsz = WSOCK_FD_BUFLEN;
+        if(buf && remaining >= WSOCK_FD_BUFLEN) {
+            dst = ((uint8_t*)buf) + received;
+            dstsz = remaining;
+        }
+        ssize_t rc = recv(self->fd, dst, dstsz, 0);
+        if(rc == 0) {errno = ECONNRESET; return received;}
+        if(rc < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return received;
+            if(!fdwait(self->fd, FDW_IN, deadline)) {
+                errno = ETIMEDOUT; return received;}
+            continue;
+        }
+        if(dst == self->ibuf) {
+            self->ifirst = 0;
+            self->ilen = rc;
+        }
+        else {
+            received += rc;
+        }
+    }
+}
+
+static size_t wsock_fd_peek(void *hndl, const void **buf) {
+    struct wsock_fd *self = (struct wsock_fd*)hndl;
+    *buf = self->ibuf + self->ifirst;
+    return self->ilen;
+}
+
+static void wsock_fd_close(void *hndl) {
+    struct wsock_fd *self = (struct wsock_fd*)hndl;
+    fdclean(self->fd);
+    close(self->fd);
+    wsock_budget_give(sizeof(struct wsock_fd));
+    free(self);
+}
+
+const struct wsock_transport wsock_fd_transport = {
+    wsock_fd_send,
+    wsock_fd_flush,
+    wsock_fd_recv,
+    wsock_fd_peek,
+    wsock_fd_close
+};
+
+void *wsock_fd_attach(int fd) {
+    int opt = fcntl(fd, F_GETFL, 0);
+    if(opt == -1 || fcntl(fd, F_SETFL, opt | O_NONBLOCK) == -1)
+        return NULL;
+    struct wsock_fd *self = malloc(sizeof(struct wsock_fd));
+    if(!self) {errno = ENOMEM; return NULL;}
+    wsock_budget_charge(sizeof(struct wsock_fd));
+    self->fd = fd;
+    self->ifirst = 0;
+    self->ilen = 0;
+    self->olen = 0;
+    return self;
+}
+
+/* Data received by some other transport instance, typically in another
+   process, is replayed before reading from the underlying transport. */
+struct wsock_replay {
+    const struct wsock_transport *tr;
+    void *t;
+    size_t first;
+    size_t len;
+    uint8_t buf[];
+};
+
+static size_t wsock_replay_send(void *hndl, const void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_replay *self = (struct wsock_replay*)hndl;
+    return self->tr->send(self->t, buf, len, deadline);
+}
+
+static void wsock_replay_flush(void *hndl, int64_t deadline) {
+    struct wsock_replay *self = (struct wsock_replay*)hndl;
+    self->tr->flush(self->t, deadline);
+}
+
+static size_t wsock_replay_recv(void *hndl, void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_replay *self = (struct wsock_replay*)hndl;
+    size_t sz = len < self->len ? len : self->len;
+    if(buf)
+        memcpy(buf, self->buf + self->first, sz);
+    self->first += sz;
+    self->len -= sz;
+    if(sz == len) {errno = 0; return len;}
+    return sz + self->tr->recv(self->t, buf ? (uint8_t*)buf + sz : NULL,
+        len - sz, deadline);
+}
+
+static size_t wsock_replay_peek(void *hndl, const void **buf) {
+    struct wsock_replay *self = (struct wsock_replay*)hndl;
+    if(self->len) {
+        *buf = self->buf + self->first;
+        return self->len;
+    }
+    return self->tr->peek ? self->tr->peek(self->t, buf) : 0;
+}
+
+static void wsock_replay_close(void *hndl) {
+    struct wsock_replay *self = (struct wsock_replay*)hndl;
+    self->tr->close(self->t);
+    wsock_budget_give(sizeof(struct wsock_replay) + self->first + self->len);
+    free(self);
+}
+
+const struct wsock_transport wsock_replay_transport = {
+    wsock_replay_send,
+    wsock_replay_flush,
+    wsock_replay_recv,
+    wsock_replay_peek,
+    wsock_replay_close
+};
+
+void *wsock_replay_attach(const struct wsock_transport *tr, void *t,
+      const void *buf, size_t len) {
+    struct wsock_replay *self = malloc(sizeof(struct wsock_replay) + len);
+    if(!self) {errno = ENOMEM; return NULL;}
+    wsock_budget_charge(sizeof(struct wsock_replay) + len);
+    self->tr = tr;
+    self->t = t;
+    self->first = 0;
+    self->len = len;
+    memcpy(self->buf, buf, len);
+    return self;
+}
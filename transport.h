@@ -0,0 +1,72 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+#ifndef WSOCK_TRANSPORT_INCLUDED
+#define WSOCK_TRANSPORT_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  Byte stream underneath the WebSocket framing. All the functions have
+    the same semantics as the corresponding libmill tcpsock functions.
+    Outgoing data may be buffered until flush is called. send and recv
+    return the number of bytes processed even if they fail, and the data
+    accepted by send stay buffered if flush fails, so that the caller can
+    resume after a deadline expires. recv with buf set to NULL drops the
+    data. peek returns the received data that is available without
+    blocking, or at least its contiguous part, without consuming it. It is
+    NULL if the transport can't do that. */
+struct wsock_transport {
+    size_t (*send)(void *self, const void *buf, size_t len, int64_t deadline);
+    void (*flush)(void *self, int64_t deadline);
+    size_t (*recv)(void *self, void *buf, size_t len, int64_t deadline);
+    size_t (*peek)(void *self, const void **buf);
+    void (*close)(void *self);
+};
+
+/*  Buffered TCP or UNIX domain socket. */
+extern const struct wsock_transport wsock_fd_transport;
+
+/*  Creates the transport on top of a connected socket. The socket is
+    switched to non-blocking mode. Returns NULL and sets errno in case of
+    error, the socket is left open. */
+void *wsock_fd_attach(int fd);
+
+/*  Wraps another transport instance so that 'len' bytes of 'buf' are
+    received before anything else. Used to carry over data that were
+    received but not consumed when a connection moves between processes.
+    Returns NULL and sets errno in case of error, the wrapped instance is
+    left open. */
+extern const struct wsock_transport wsock_replay_transport;
+void *wsock_replay_attach(const struct wsock_transport *tr, void *t,
+    const void *buf, size_t len);
+
+/*  In-memory pipe made of two ring buffers. Both endpoints have to live
+    in the same process. Useful for measuring the cost of the framing code
+    without the kernel involved. */
+extern const struct wsock_transport wsock_pipe_transport;
+
+/*  Creates a pair of connected pipe endpoints. Returns -1 and sets errno
+    in case of error. */
+int wsock_pipe_make(void **a, void **b);
+
+#endif
@@ -0,0 +1,925 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+#if defined WSOCK_HAVE_URING
+
+/* Linux headers must precede libmill.h which defines macros such as 'in'
+   and 'end'. */
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <libmill.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* Size of the submission queue. The completion queue is larger because
+   a single multishot receive can produce many completions. */
+#define WSOCK_URING_SQENTRIES 256
+#define WSOCK_URING_CQENTRIES 4096
+/* Sockets are registered in the fixed file table under their own file
+   descriptor number. The table covers RLIMIT_NOFILE, but at most this many
+   descriptors. Sockets beyond it fall back to libmill. */
+#define WSOCK_URING_MAXFILES 65536
+/* Each connection has two output buffers of this size, one being filled
+   while the other one is being sent. They are allocated and registered
+   in chunks of WSOCK_URING_OCHUNK connections. */
+#define WSOCK_URING_BUFLEN 4096
+#define WSOCK_URING_OCHUNK 16
+/* Provided receive buffers are shared by all the connections. They are
+   allocated in chunks of WSOCK_URING_RCHUNK buffers whenever the kernel
+   runs out of them, up to WSOCK_URING_RBUFS buffers. Both must be powers
+   of two. */
+#define WSOCK_URING_RBUFS 4096
+#define WSOCK_URING_RCHUNK 32
+#define WSOCK_URING_BGID 0
+/* How long a closed connection keeps sending the data flushed before. */
+#define WSOCK_URING_LINGER 1
+
+/* Kinds of operations. Stored in the lowest byte of the user data, the rest
+   being the file descriptor and its generation. */
+#define WSOCK_URING_RECV 1
+#define WSOCK_URING_SEND 2
+#define WSOCK_URING_CANCEL 3
+#define WSOCK_URING_LINGERTIMER 4
+#define WSOCK_URING_GENMASK 0xffffff
+
+/* Receiving and sending may be done by different coroutines at the same
+   time, so each of them has its own waiter. */
+struct wsock_uring_waiter {
+    /* Set when a coroutine is waiting for 'wake'. */
+    int waiting;
+    chan wake;
+};
+
+/* Free output buffer. */
+struct wsock_uring_obuf {
+    struct wsock_uring_obuf *next;
+    /* Index in the registered buffer table, -1 if not registered. */
+    int idx;
+};
+
+struct wsock_uring {
+    int fd;
+    uint32_t gen;
+    /* Received data not yet consumed by the user. A linked list of provided
+       buffers; 'roff' is the number of bytes already consumed from the first
+       one. */
+    int rfirst;
+    int rlast;
+    size_t roff;
+    /* Receiving is paused when the data not yet consumed fill 'rmax'
+       buffers, i.e. the socket's receive buffer, so that a slow reader gets
+       TCP flow control rather than taking the buffers of the others. */
+    int rheld;
+    int rmax;
+    /* Set while the multishot receive is active. */
+    int rarmed;
+    /* Set if the receive is being cancelled. */
+    int rcancel;
+    /* Set if the receive was terminated because the provided buffers ran
+       out. */
+    int rstarved;
+    /* Set while the connection is in the list of those waiting for
+       provided buffers. */
+    int rlisted;
+    struct wsock_uring *rnextstarved;
+    /* Sticky receive error. */
+    int rerr;
+    /* Pair of output buffers. 'ocur' is the one being filled. */
+    uint8_t *obuf;
+    int oidx;
+    int ocur;
+    size_t olen;
+    /* The send in flight. There's at most one so that the data stay in
+       order. Short sends are resumed from the completion. */
+    int sbusy;
+    const uint8_t *sbuf;
+    size_t slen;
+    size_t soff;
+    int sfixed;
+    /* Set if the send is being cancelled and must not be resumed. */
+    int scancel;
+    /* Sticky send error. As flushing doesn't wait for the send, it is
+       reported by the next operation. */
+    int serr;
+    /* The instance is freed once the user closed it and all its
+       operations have completed. */
+    int closed;
+    struct wsock_uring_waiter rw;
+    struct wsock_uring_waiter sw;
+};
+
+static struct {
+    /* -1 if not initialised yet, -2 if io_uring is not available. */
+    int fd;
+    /* Processes forked after the ring was created can't use it. */
+    pid_t pid;
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqflags;
+    unsigned *sqarray;
+    unsigned sqmask;
+    unsigned sqentries;
+    /* Tail of the SQEs prepared but not yet made visible to the kernel. */
+    unsigned sqlocal;
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t ringssz;
+    /* Signalled by the kernel when there are completions to reap. With
+       deferred task work, polling the ring itself doesn't tell that. */
+    int evfd;
+    /* The submitter coroutine. It's woken up by the first SQE prepared in
+       a scheduler round and, as the coroutines that are ready run first,
+       submits all the SQEs of the round in a single io_uring_enter(). */
+    chan kick;
+    int kicked;
+    /* Size of the fixed file table. */
+    int nfiles;
+    /* Size of the registered buffer table and the number of its entries
+       in use. Zero if registered buffers are not available. */
+    int nbufs;
+    int nochunks;
+    struct wsock_uring_obuf *ofree;
+    /* Cleared if the kernel doesn't support registered buffers with
+       IORING_OP_SEND. */
+    int fixedsend;
+    /* IORING_OP_WRITE_FIXED can't suppress SIGPIPE so it's used only if
+       the application ignores the signal. */
+    int fixedwrite;
+    /* Provided receive buffers. 'rheld' is the number of them holding data
+       not yet consumed by the connections. */
+    struct io_uring_buf_ring *br;
+    uint8_t *rchunks[WSOCK_URING_RBUFS / WSOCK_URING_RCHUNK];
+    int nrbufs;
+    int rheld;
+    uint16_t brtail;
+    int rnext[WSOCK_URING_RBUFS];
+    unsigned rlen[WSOCK_URING_RBUFS];
+    /* Connections waiting for provided buffers to be returned. */
+    struct wsock_uring *starved;
+    /* Connections indexed by file descriptor. Grown on demand. */
+    struct wsock_uring **conns;
+    uint32_t *gens;
+    int nconns;
+} wsock_ring = {-1};
+
+static int wsock_uring_register(unsigned opcode, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, wsock_ring.fd, opcode, arg,
+        nr);
+}
+
+static uint8_t *wsock_uring_rbuf(int bid) {
+    return wsock_ring.rchunks[bid / WSOCK_URING_RCHUNK] +
+        (size_t)(bid % WSOCK_URING_RCHUNK) * WSOCK_URING_BUFLEN;
+}
+
+/* Returns provided buffer to the kernel. */
+static void wsock_uring_recycle(int bid) {
+    struct io_uring_buf *b =
+        &wsock_ring.br->bufs[wsock_ring.brtail & (WSOCK_URING_RBUFS - 1)];
+    b->addr = (uintptr_t)wsock_uring_rbuf(bid);
+    b->len = WSOCK_URING_BUFLEN;
+    b->bid = (uint16_t)bid;
+    ++wsock_ring.brtail;
+    __atomic_store_n(&wsock_ring.br->tail, wsock_ring.brtail,
+        __ATOMIC_RELEASE);
+}
+
+/* Adds a chunk of provided buffers. */
+static int wsock_uring_grow(void) {
+    if(wsock_ring.nrbufs == WSOCK_URING_RBUFS)
+        return -1;
+    uint8_t *chunk = mmap(NULL, WSOCK_URING_RCHUNK * WSOCK_URING_BUFLEN,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(chunk == MAP_FAILED)
+        return -1;
+    wsock_ring.rchunks[wsock_ring.nrbufs / WSOCK_URING_RCHUNK] = chunk;
+    int i;
+    for(i = 0; i != WSOCK_URING_RCHUNK; ++i)
+        wsock_uring_recycle(wsock_ring.nrbufs + i);
+    wsock_ring.nrbufs += WSOCK_URING_RCHUNK;
+    return 0;
+}
+
+/* Takes a pair of output buffers from the pool. */
+static uint8_t *wsock_uring_oalloc(int *idx) {
+    if(!wsock_ring.ofree) {
+        size_t sz = WSOCK_URING_OCHUNK * 2 * WSOCK_URING_BUFLEN;
+        uint8_t *chunk = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(chunk == MAP_FAILED)
+            return NULL;
+        /* If it can't be registered it's used as a normal buffer. */
+        int cidx = -1;
+        if(wsock_ring.nochunks < wsock_ring.nbufs) {
+            struct iovec iov = {chunk, sz};
+            struct io_uring_rsrc_update2 up;
+            memset(&up, 0, sizeof(up));
+            up.offset = (uint32_t)wsock_ring.nochunks;
+            up.data = (uintptr_t)&iov;
+            up.nr = 1;
+            if(wsock_uring_register(IORING_REGISTER_BUFFERS_UPDATE, &up,
+                  sizeof(up)) == 1)
+                cidx = wsock_ring.nochunks++;
+        }
+        int i;
+        for(i = 0; i != WSOCK_URING_OCHUNK; ++i) {
+            struct wsock_uring_obuf *ob = (struct wsock_uring_obuf*)
+                (chunk + (size_t)i * 2 * WSOCK_URING_BUFLEN);
+            ob->next = wsock_ring.ofree;
+            ob->idx = cidx;
+            wsock_ring.ofree = ob;
+        }
+    }
+    struct wsock_uring_obuf *ob = wsock_ring.ofree;
+    wsock_ring.ofree = ob->next;
+    *idx = ob->idx;
+    return (uint8_t*)ob;
+}
+
+static void wsock_uring_ofree(uint8_t *buf, int idx) {
+    struct wsock_uring_obuf *ob = (struct wsock_uring_obuf*)buf;
+    ob->next = wsock_ring.ofree;
+    ob->idx = idx;
+    wsock_ring.ofree = ob;
+}
+
+/* Passes all the prepared SQEs to the kernel. The kernel also posts
+   the completions it deferred till the ring is entered. */
+static void wsock_uring_enter(void) {
+    __atomic_store_n(wsock_ring.sqtail, wsock_ring.sqlocal, __ATOMIC_RELEASE);
+    while(1) {
+        unsigned n = wsock_ring.sqlocal -
+            __atomic_load_n(wsock_ring.sqhead, __ATOMIC_ACQUIRE);
+        if(n == 0)
+            return;
+        int rc = (int)syscall(__NR_io_uring_enter, wsock_ring.fd, n, 0,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        if(rc >= 0 || errno != EINTR)
+            return;
+    }
+}
+
+static struct io_uring_sqe *wsock_uring_sqe(void) {
+    if(wsock_ring.sqlocal - __atomic_load_n(wsock_ring.sqhead,
+          __ATOMIC_ACQUIRE) == wsock_ring.sqentries)
+        wsock_uring_enter();
+    unsigned idx = wsock_ring.sqlocal & wsock_ring.sqmask;
+    struct io_uring_sqe *sqe = &wsock_ring.sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    wsock_ring.sqarray[idx] = idx;
+    ++wsock_ring.sqlocal;
+    if(!wsock_ring.kicked) {
+        wsock_ring.kicked = 1;
+        chs(wsock_ring.kick, int, 0);
+    }
+    return sqe;
+}
+
+static uint64_t wsock_uring_data(struct wsock_uring *self, int kind) {
+    return ((uint64_t)self->fd << 32) | ((uint64_t)self->gen << 8) | kind;
+}
+
+static void wsock_uring_wake(struct wsock_uring_waiter *w) {
+    if(w->waiting) {
+        w->waiting = 0;
+        chs(w->wake, int, 0);
+    }
+}
+
+/* Waits till the waiter is woken up. Returns -1 if the deadline
+   expires. */
+static int wsock_uring_wait(struct wsock_uring_waiter *w, int64_t deadline) {
+    w->waiting = 1;
+    int rc;
+    choose {
+    in(w->wake, int, val):
+        rc = val;
+    deadline(deadline):
+        w->waiting = 0;
+        rc = -1;
+    end
+    }
+    return rc;
+}
+
+static void wsock_uring_cancel(struct wsock_uring *self, int kind) {
+    struct io_uring_sqe *sqe = wsock_uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = wsock_uring_data(self, kind);
+    sqe->user_data = wsock_uring_data(self, WSOCK_URING_CANCEL);
+}
+
+/* Sends the rest of the data in flight. */
+static void wsock_uring_post(struct wsock_uring *self) {
+    struct io_uring_sqe *sqe = wsock_uring_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = self->fd;
+    sqe->addr = (uintptr_t)(self->sbuf + self->soff);
+    sqe->len = self->slen - self->soff > 0x40000000 ? 0x40000000 :
+        (unsigned)(self->slen - self->soff);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    int own = self->sbuf >= self->obuf &&
+        self->sbuf < self->obuf + 2 * WSOCK_URING_BUFLEN;
+    self->sfixed = own && self->oidx >= 0 && wsock_ring.fixedsend;
+    if(self->sfixed) {
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+        sqe->buf_index = (uint16_t)self->oidx;
+    }
+    else if(own && self->oidx >= 0 && wsock_ring.fixedwrite) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->msg_flags = 0;
+        sqe->buf_index = (uint16_t)self->oidx;
+    }
+    sqe->user_data = wsock_uring_data(self, WSOCK_URING_SEND);
+    self->sbusy = 1;
+}
+
+/* Frees the resources of a closed connection once the kernel is done
+   with them. */
+static void wsock_uring_release(struct wsock_uring *self) {
+    int fd = -1;
+    struct io_uring_files_update up = {(uint32_t)self->fd, 0,
+        (uintptr_t)&fd};
+    wsock_uring_register(IORING_REGISTER_FILES_UPDATE, &up, 1);
+    wsock_ring.conns[self->fd] = NULL;
+    wsock_ring.gens[self->fd] = (self->gen + 1) & WSOCK_URING_GENMASK;
+    close(self->fd);
+    wsock_uring_ofree(self->obuf, self->oidx);
+    free(self);
+}
+
+static void wsock_uring_complete(uint64_t data, int res, unsigned flags) {
+    int fd = (int)(data >> 32);
+    uint32_t gen = (uint32_t)(data >> 8) & WSOCK_URING_GENMASK;
+    int kind = (int)(data & 0xff);
+    int bid = -1;
+    if(flags & IORING_CQE_F_BUFFER)
+        bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+    struct wsock_uring *self = wsock_ring.conns[fd];
+    /* Completion for a connection that was already released. */
+    if(!self || self->gen != gen || kind == WSOCK_URING_CANCEL) {
+        if(bid >= 0)
+            wsock_uring_recycle(bid);
+        return;
+    }
+    if(kind == WSOCK_URING_LINGERTIMER) {
+        if(self->sbusy) {
+            self->scancel = 1;
+            wsock_uring_cancel(self, WSOCK_URING_SEND);
+        }
+        return;
+    }
+    if(kind == WSOCK_URING_RECV) {
+        if(res > 0 && bid >= 0 && !self->closed) {
+            wsock_ring.rlen[bid] = (unsigned)res;
+            wsock_ring.rnext[bid] = -1;
+            if(self->rlast >= 0)
+                wsock_ring.rnext[self->rlast] = bid;
+            else
+                self->rfirst = bid;
+            self->rlast = bid;
+            ++self->rheld;
+            ++wsock_ring.rheld;
+            if(self->rheld >= self->rmax && self->rarmed &&
+                  !self->rcancel && flags & IORING_CQE_F_MORE) {
+                self->rcancel = 1;
+                wsock_uring_cancel(self, WSOCK_URING_RECV);
+            }
+        }
+        else {
+            if(bid >= 0)
+                wsock_uring_recycle(bid);
+            if(res == 0)
+                self->rerr = ECONNRESET;
+            else if(res == -ENOBUFS)
+                self->rstarved = 1;
+            else if(res < 0 && (res != -ECANCELED || !self->rcancel))
+                self->rerr = -res;
+        }
+        if(!(flags & IORING_CQE_F_MORE)) {
+            self->rarmed = 0;
+            self->rcancel = 0;
+        }
+        if(!self->closed)
+            wsock_uring_wake(&self->rw);
+    }
+    else {
+        if(res == -EINVAL && self->sfixed) {
+            wsock_ring.fixedsend = 0;
+            wsock_uring_post(self);
+            return;
+        }
+        if(res > 0)
+            self->soff += res;
+        if(res > 0 && self->soff < self->slen && !self->scancel) {
+            wsock_uring_post(self);
+            return;
+        }
+        /* Cancellation is not an error, the caller finds out how much was
+           sent from 'soff'. */
+        if(res < 0 && res != -ECANCELED)
+            self->serr = res == -EPIPE ? ECONNRESET : -res;
+        self->sbusy = 0;
+        self->scancel = 0;
+        if(!self->closed)
+            wsock_uring_wake(&self->sw);
+    }
+    if(self->closed && !self->rarmed && !self->sbusy)
+        wsock_uring_release(self);
+}
+
+static void wsock_uring_reap(void) {
+    unsigned head = *wsock_ring.cqhead;
+    unsigned tail = __atomic_load_n(wsock_ring.cqtail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+        struct io_uring_cqe *cqe = &wsock_ring.cqes[head & wsock_ring.cqmask];
+        wsock_uring_complete(cqe->user_data, cqe->res, cqe->flags);
+        ++head;
+        /* Completions may have overflown the ring. Ask the kernel to move
+           them into the ring and continue. */
+        if(head == tail) {
+            __atomic_store_n(wsock_ring.cqhead, head, __ATOMIC_RELEASE);
+            if(*wsock_ring.sqflags & IORING_SQ_CQ_OVERFLOW)
+                syscall(__NR_io_uring_enter, wsock_ring.fd, 0, 0,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+            tail = __atomic_load_n(wsock_ring.cqtail, __ATOMIC_ACQUIRE);
+        }
+    }
+    __atomic_store_n(wsock_ring.cqhead, head, __ATOMIC_RELEASE);
+}
+
+/* Dispatches completions to the connections whenever the kernel signals
+   there are some. */
+coroutine static void wsock_uring_reaper(void) {
+    while(1) {
+        fdwait(wsock_ring.evfd, FDW_IN, -1);
+        /* The completions belong to the parent process. */
+        if(wsock_ring.pid != getpid())
+            return;
+        uint64_t n;
+        ssize_t sz = read(wsock_ring.evfd, &n, sizeof(n));
+        (void)sz;
+        /* Have the kernel post the deferred completions. */
+        syscall(__NR_io_uring_enter, wsock_ring.fd, 0, 0,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        wsock_uring_reap();
+    }
+}
+
+coroutine static void wsock_uring_submitter(void) {
+    while(chr(wsock_ring.kick, int) == 0) {
+        wsock_ring.kicked = 0;
+        wsock_uring_enter();
+        /* Operations on sockets that are ready complete inline. */
+        wsock_uring_reap();
+    }
+}
+
+static int wsock_uring_init(void) {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        goto err0;
+    wsock_ring.nfiles = rl.rlim_cur < WSOCK_URING_MAXFILES ?
+        (int)rl.rlim_cur : WSOCK_URING_MAXFILES;
+    /* The ring is only used by this thread, so the kernel can defer
+       the completion work till the ring is entered rather than interrupt
+       the thread each time a socket becomes ready. Older kernels don't know
+       the flags though. */
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_DEFER_TASKRUN |
+        IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = WSOCK_URING_CQENTRIES;
+    wsock_ring.fd = (int)syscall(__NR_io_uring_setup, WSOCK_URING_SQENTRIES,
+        &p);
+    if(wsock_ring.fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = WSOCK_URING_CQENTRIES;
+        wsock_ring.fd = (int)syscall(__NR_io_uring_setup,
+            WSOCK_URING_SQENTRIES, &p);
+    }
+    if(wsock_ring.fd < 0)
+        goto err0;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+          !(p.features & IORING_FEAT_NODROP))
+        goto err1;
+    /* Map the rings. */
+    size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    wsock_ring.ringssz = sqsz > cqsz ? sqsz : cqsz;
+    wsock_ring.rings = mmap(NULL, wsock_ring.ringssz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, wsock_ring.fd, IORING_OFF_SQ_RING);
+    if(wsock_ring.rings == MAP_FAILED)
+        goto err1;
+    uint8_t *r = (uint8_t*)wsock_ring.rings;
+    wsock_ring.sqhead = (unsigned*)(r + p.sq_off.head);
+    wsock_ring.sqtail = (unsigned*)(r + p.sq_off.tail);
+    wsock_ring.sqflags = (unsigned*)(r + p.sq_off.flags);
+    wsock_ring.sqarray = (unsigned*)(r + p.sq_off.array);
+    wsock_ring.sqmask = *(unsigned*)(r + p.sq_off.ring_mask);
+    wsock_ring.sqentries = p.sq_entries;
+    wsock_ring.sqlocal = *wsock_ring.sqtail;
+    wsock_ring.cqhead = (unsigned*)(r + p.cq_off.head);
+    wsock_ring.cqtail = (unsigned*)(r + p.cq_off.tail);
+    wsock_ring.cqmask = *(unsigned*)(r + p.cq_off.ring_mask);
+    wsock_ring.cqes = (struct io_uring_cqe*)(r + p.cq_off.cqes);
+    wsock_ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, wsock_ring.fd,
+        IORING_OFF_SQES);
+    if(wsock_ring.sqes == MAP_FAILED)
+        goto err2;
+    wsock_ring.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wsock_ring.evfd < 0)
+        goto err3;
+    if(wsock_uring_register(IORING_REGISTER_EVENTFD, &wsock_ring.evfd,
+          1) < 0)
+        goto err4;
+    /* Sparse fixed file table. */
+    struct io_uring_rsrc_register rr;
+    memset(&rr, 0, sizeof(rr));
+    rr.nr = (uint32_t)wsock_ring.nfiles;
+    rr.flags = IORING_RSRC_REGISTER_SPARSE;
+    if(wsock_uring_register(IORING_REGISTER_FILES2, &rr, sizeof(rr)) < 0)
+        goto err4;
+    /* Sparse registered buffer table, filled in as the output buffers are
+       allocated. Plain buffers are used if it's not available. */
+    rr.nr = (uint32_t)(wsock_ring.nfiles / WSOCK_URING_OCHUNK + 1);
+    if(wsock_uring_register(IORING_REGISTER_BUFFERS2, &rr, sizeof(rr)) == 0)
+        wsock_ring.nbufs = (int)rr.nr;
+    wsock_ring.fixedsend = 1;
+    struct sigaction sa;
+    wsock_ring.fixedwrite = sigaction(SIGPIPE, NULL, &sa) == 0 &&
+        sa.sa_handler == SIG_IGN;
+    /* Provided receive buffers. */
+    size_t brsz = WSOCK_URING_RBUFS * sizeof(struct io_uring_buf);
+    wsock_ring.br = mmap(NULL, brsz, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(wsock_ring.br == MAP_FAILED)
+        goto err4;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)wsock_ring.br;
+    reg.ring_entries = WSOCK_URING_RBUFS;
+    reg.bgid = WSOCK_URING_BGID;
+    if(wsock_uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto err5;
+    wsock_ring.brtail = 0;
+    if(wsock_uring_grow() != 0)
+        goto err5;
+    wsock_ring.pid = getpid();
+    wsock_ring.kick = chmake(int, 1);
+    go(wsock_uring_reaper());
+    go(wsock_uring_submitter());
+    return 0;
+err5:
+    munmap(wsock_ring.br, brsz);
+err4:
+    close(wsock_ring.evfd);
+err3:
+    munmap(wsock_ring.sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+err2:
+    munmap(wsock_ring.rings, wsock_ring.ringssz);
+err1:
+    close(wsock_ring.fd);
+err0:
+    wsock_ring.fd = -2;
+    return -1;
+}
+
+/* Makes room for connection with file descriptor 'fd'. */
+static int wsock_uring_reserve(int fd) {
+    if(fd < wsock_ring.nconns)
+        return 0;
+    int n = wsock_ring.nconns ? wsock_ring.nconns : 64;
+    while(n <= fd)
+        n *= 2;
+    struct wsock_uring **conns = realloc(wsock_ring.conns,
+        n * sizeof(struct wsock_uring*));
+    if(!conns)
+        return -1;
+    wsock_ring.conns = conns;
+    uint32_t *gens = realloc(wsock_ring.gens, n * sizeof(uint32_t));
+    if(!gens)
+        return -1;
+    wsock_ring.gens = gens;
+    memset(conns + wsock_ring.nconns, 0,
+        (n - wsock_ring.nconns) * sizeof(struct wsock_uring*));
+    memset(gens + wsock_ring.nconns, 0,
+        (n - wsock_ring.nconns) * sizeof(uint32_t));
+    wsock_ring.nconns = n;
+    return 0;
+}
+
+struct wsock_uring *wsock_uring_attach(int fd) {
+    if(wsock_ring.fd == -1)
+        wsock_uring_init();
+    if(wsock_ring.fd < 0 || wsock_ring.pid != getpid() ||
+          fd >= wsock_ring.nfiles) {
+        errno = ENOTSUP; return NULL;}
+    if(wsock_uring_reserve(fd) != 0) {errno = ENOMEM; return NULL;}
+    struct wsock_uring *self = malloc(sizeof(struct wsock_uring));
+    if(!self) {errno = ENOMEM; return NULL;}
+    self->obuf = wsock_uring_oalloc(&self->oidx);
+    if(!self->obuf) {
+        free(self);
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct io_uring_files_update up = {(uint32_t)fd, 0, (uintptr_t)&fd};
+    if(wsock_uring_register(IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) {
+        wsock_uring_ofree(self->obuf, self->oidx);
+        free(self);
+        errno = ENOTSUP;
+        return NULL;
+    }
+    self->fd = fd;
+    self->gen = wsock_ring.gens[fd];
+    self->rfirst = -1;
+    self->rlast = -1;
+    self->roff = 0;
+    self->rheld = 0;
+    self->rmax = 1;
+    self->rarmed = 0;
+    self->rcancel = 0;
+    self->rstarved = 0;
+    self->rlisted = 0;
+    self->rnextstarved = NULL;
+    self->rerr = 0;
+    self->ocur = 0;
+    self->olen = 0;
+    self->sbusy = 0;
+    self->sbuf = NULL;
+    self->slen = 0;
+    self->soff = 0;
+    self->sfixed = 0;
+    self->scancel = 0;
+    self->serr = 0;
+    self->closed = 0;
+    self->rw.waiting = 0;
+    self->rw.wake = chmake(int, 1);
+    self->sw.waiting = 0;
+    self->sw.wake = chmake(int, 1);
+    wsock_ring.conns[fd] = self;
+    errno = 0;
+    return self;
+}
+
+int wsock_uring_drain(struct wsock_uring *self, int64_t deadline) {
+    while(self->sbusy) {
+        if(wsock_uring_wait(&self->sw, deadline) != 0) {
+            errno = ETIMEDOUT; return -1;}
+    }
+    if(self->serr) {errno = self->serr; return -1;}
+    errno = 0;
+    return 0;
+}
+
+/* Starts sending the buffered data. Waits only if the previous send is
+   still in flight. */
+static void wsock_uring_flush(void *hndl, int64_t deadline) {
+    struct wsock_uring *self = (struct wsock_uring*)hndl;
+    if(self->olen == 0) {errno = self->serr; return;}
+    if(wsock_uring_drain(self, deadline) != 0)
+        return;
+    self->sbuf = self->obuf + self->ocur * WSOCK_URING_BUFLEN;
+    self->slen = self->olen;
+    self->soff = 0;
+    wsock_uring_post(self);
+    self->ocur ^= 1;
+    self->olen = 0;
+    errno = 0;
+}
+
+static size_t wsock_uring_send(void *hndl, const void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_uring *self = (struct wsock_uring*)hndl;
+    if(self->serr) {errno = self->serr; return 0;}
+    /* Small writes are batched in the output buffer. */
+    if(WSOCK_URING_BUFLEN - self->olen >= len) {
+        memcpy(self->obuf + self->ocur * WSOCK_URING_BUFLEN + self->olen,
+            buf, len);
+        self->olen += len;
+        errno = 0;
+        return len;
+    }
+    wsock_uring_flush(self, deadline);
+    if(errno != 0)
+        return 0;
+    if(len <= WSOCK_URING_BUFLEN) {
+        memcpy(self->obuf + self->ocur * WSOCK_URING_BUFLEN, buf, len);
+        self->olen = len;
+        errno = 0;
+        return len;
+    }
+    /* Large writes are sent directly from the user's buffer, so they
+       have to complete before returning. */
+    if(wsock_uring_drain(self, deadline) != 0)
+        return 0;
+    self->sbuf = (const uint8_t*)buf;
+    self->slen = len;
+    self->soff = 0;
+    wsock_uring_post(self);
+    if(wsock_uring_drain(self, deadline) == 0)
+        return len;
+    if(self->sbusy) {
+        /* The send may still be using the buffer and may have sent part
+           of it. Wait for the cancellation to complete to find out. It
+           doesn't depend on the peer. */
+        self->scancel = 1;
+        wsock_uring_cancel(self, WSOCK_URING_SEND);
+        while(self->sbusy)
+            wsock_uring_wait(&self->sw, -1);
+        errno = ETIMEDOUT;
+    }
+    return self->soff;
+}
+
+/* Removes the connection from the list of those waiting for provided
+   buffers. */
+static void wsock_uring_unlist(struct wsock_uring *self) {
+    if(!self->rlisted)
+        return;
+    struct wsock_uring **it = &wsock_ring.starved;
+    while(*it != self)
+        it = &(*it)->rnextstarved;
+    *it = self->rnextstarved;
+    self->rlisted = 0;
+}
+
+/* Returns the buffer consumed by a connection and wakes up those waiting
+   for buffers. */
+static void wsock_uring_putback(struct wsock_uring *self, int bid) {
+    --self->rheld;
+    --wsock_ring.rheld;
+    wsock_uring_recycle(bid);
+    while(wsock_ring.starved) {
+        struct wsock_uring *c = wsock_ring.starved;
+        wsock_ring.starved = c->rnextstarved;
+        c->rlisted = 0;
+        wsock_uring_wake(&c->rw);
+    }
+}
+
+static size_t wsock_uring_recv(void *hndl, void *buf, size_t len,
+      int64_t deadline) {
+    struct wsock_uring *self = (struct wsock_uring*)hndl;
+    size_t received = 0;
+    while(1) {
+        /* Consume the data already received. */
+        while(received != len && self->rfirst >= 0) {
+            int bid = self->rfirst;
+            size_t sz = wsock_ring.rlen[bid] - self->roff;
+            if(sz > len - received)
+                sz = len - received;
+            if(buf)
+                memcpy(((uint8_t*)buf) + received,
+                    wsock_uring_rbuf(bid) + self->roff, sz);
+            self->roff += sz;
+            received += sz;
+            if(self->roff == wsock_ring.rlen[bid]) {
+                self->rfirst = wsock_ring.rnext[bid];
+                if(self->rfirst < 0)
+                    self->rlast = -1;
+                self->roff = 0;
+                wsock_uring_putback(self, bid);
+            }
+        }
+        if(received == len) {errno = 0; return len;}
+        if(self->rerr) {errno = self->rerr; return received;}
+        if(!self->rarmed && self->rstarved) {
+            /* The kernel ran out of provided buffers. Add more of them or
+               wait till other connections return some. */
+            if(wsock_ring.rheld < wsock_ring.nrbufs || wsock_uring_grow() == 0)
+                self->rstarved = 0;
+            else if(!self->rlisted) {
+                self->rnextstarved = wsock_ring.starved;
+                wsock_ring.starved = self;
+                self->rlisted = 1;
+            }
+        }
+        if(!self->rarmed && !self->rstarved) {
+            int rcvbuf;
+            socklen_t optlen = sizeof(rcvbuf);
+            self->rmax = 1;
+            if(getsockopt(self->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                  &optlen) == 0 && rcvbuf > WSOCK_URING_BUFLEN)
+                self->rmax = rcvbuf / WSOCK_URING_BUFLEN;
+            struct io_uring_sqe *sqe = wsock_uring_sqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+            sqe->fd = self->fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->buf_group = WSOCK_URING_BGID;
+            sqe->user_data = wsock_uring_data(self, WSOCK_URING_RECV);
+            self->rarmed = 1;
+        }
+        if(wsock_uring_wait(&self->rw, deadline) != 0) {
+            wsock_uring_unlist(self);
+            errno = ETIMEDOUT;
+            return received;
+        }
+    }
+}
+
+static size_t wsock_uring_peek(void *hndl, const void **buf) {
+    struct wsock_uring *self = (struct wsock_uring*)hndl;
+    if(self->rfirst < 0)
+        return 0;
+    *buf = wsock_uring_rbuf(self->rfirst) + self->roff;
+    return wsock_ring.rlen[self->rfirst] - self->roff;
+}
+
+int wsock_uring_quiesce(struct wsock_uring *self, int64_t deadline) {
+    if(wsock_uring_drain(self, deadline) != 0)
+        return -1;
+    if(self->rarmed) {
+        wsock_uring_cancel(self, WSOCK_URING_RECV);
+        /* The final completion of the multishot receive clears 'rarmed'.
+           Cancellation doesn't depend on the peer. */
+        while(self->rarmed)
+            wsock_uring_wait(&self->rw, -1);
+    }
+    wsock_uring_unlist(self);
+    self->rstarved = 0;
+    if(!self->rerr)
+        self->rerr = ECANCELED;
+    return 0;
+}
+
+static void wsock_uring_close(void *hndl) {
+    struct wsock_uring *self = (struct wsock_uring*)hndl;
+    self->closed = 1;
+    if(self->rarmed)
+        wsock_uring_cancel(self, WSOCK_URING_RECV);
+    /* Data flushed before closing are still sent unless the peer doesn't
+       take them within the linger period. */
+    if(self->sbusy) {
+        static struct __kernel_timespec linger = {WSOCK_URING_LINGER, 0};
+        struct io_uring_sqe *sqe = wsock_uring_sqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)&linger;
+        sqe->len = 1;
+        sqe->user_data = wsock_uring_data(self, WSOCK_URING_LINGERTIMER);
+    }
+    while(self->rfirst >= 0) {
+        int bid = self->rfirst;
+        self->rfirst = wsock_ring.rnext[bid];
+        wsock_uring_putback(self, bid);
+    }
+    wsock_uring_unlist(self);
+    fdclean(self->fd);
+    chclose(self->rw.wake);
+    chclose(self->sw.wake);
+    /* Otherwise the kernel may still be using the socket and the output
+       buffer. They are released by the last completion. */
+    if(!self->rarmed && !self->sbusy)
+        wsock_uring_release(self);
+}
+
+const struct wsock_transport wsock_uring_transport = {
+    wsock_uring_send,
+    wsock_uring_flush,
+    wsock_uring_recv,
+    wsock_uring_peek,
+    wsock_uring_close
+};
+
+#endif
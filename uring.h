@@ -0,0 +1,65 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+#ifndef WSOCK_URING_INCLUDED
+#define WSOCK_URING_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "transport.h"
+
+/*  io_uring-based transport for plain TCP connections. All connections share
+    a single ring. SQEs prepared within one scheduler round are submitted by
+    a single io_uring_enter() call, output goes through registered buffers,
+    input is received via multishot recv into a ring of provided buffers and
+    sockets are referred to via the fixed file table. Buffers are allocated
+    as connections are added. Flushing doesn't wait for the data to be sent;
+    a failure is reported by the next operation. Closing doesn't wait
+    either, the data already flushed are still sent for up to a second.
+    Available only if wsock was configured with --enable-uring. */
+
+struct wsock_uring;
+
+/*  Takes ownership of a connected non-blocking socket. Returns NULL with
+    errno set to ENOTSUP if io_uring is not available (old kernel, seccomp
+    policy etc.) or the descriptor doesn't fit RLIMIT_NOFILE as it was when
+    the ring was created. In that case the caller still owns the socket and
+    should fall back to libmill's tcpsock. */
+struct wsock_uring *wsock_uring_attach(int fd);
+
+/*  Waits till the flushed data are sent. Returns -1 and sets errno in case
+    of error. Needed before writing to the socket directly. */
+int wsock_uring_drain(struct wsock_uring *self, int64_t deadline);
+
+/*  Waits till the flushed data are sent and stops receiving in
+    the background so that no more data are taken from the socket. Data
+    already received can still be read, but reading past them fails. Used
+    before the socket is passed to another process. Returns -1 and sets
+    errno in case of error; if it's ETIMEDOUT the receiving wasn't stopped
+    yet. */
+int wsock_uring_quiesce(struct wsock_uring *self, int64_t deadline);
+
+/*  Connection's I/O. The instance is the struct wsock_uring. */
+extern const struct wsock_transport wsock_uring_transport;
+
+#endif
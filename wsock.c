@@ -23,17 +23,34 @@
 
 */
 
-#include <assert.h>
-#include <ctype.h>
+#if defined HAVE_SPLICE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
 #include <libmill.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
-#include "base64.h"
-#include "random.h"
-#include "sha1.h"
+#include "budget.h"
+#include "capture.h"
+#include "codec.h"
+#include "handoff.h"
+#include "sched.h"
+#include "sockopt.h"
 #include "str.h"
+#include "tls.h"
+#include "transport.h"
+#include "uring.h"
 #include "wire.h"
 #include "wsock.h"
 
@@ -41,401 +58,966 @@
 #define WSOCK_LISTENING 1
 /* 0 on server, 1 on client. */
 #define WSOCK_CLIENT 2
-/* TCP connection broken or deadline occured while sending or receiving a
-   message. In such case the message is half-processed. There's no way to
-   continue or even do the final handshake. */
+/* Connection failed or the peer violated the protocol while sending or
+   receiving a message. In such case the message is half-processed. There's
+   no way to continue or even do the final handshake. Deadlines don't break
+   the connection, see WSOCK_SENDING and 'rpos'. */
 #define WSOCK_BROKEN 4
 /* Set if wsockdone() was already called. */
 #define WSOCK_DONE 8
+/* Listening socket only. Set once the acceptor coroutine was launched. */
+#define WSOCK_ACCEPTING 16
+/* A message is being sent. It may have been interrupted by a deadline,
+   in which case the next call continues from where it stopped. */
+#define WSOCK_SENDING 32
+/* The whole message was passed to the transport but not flushed yet. */
+#define WSOCK_FLUSHING 64
+/* Listening socket only. Set once the socket was handed over to another
+   process by wsockexport(). */
+#define WSOCK_EXPORTED 128
+/* wsockdrain() is sending the close frame. If wsockclose() is called in
+   the meantime it sets WSOCK_CLOSING and leaves the deallocation to
+   the drain. */
+#define WSOCK_DRAINING 256
+#define WSOCK_CLOSING 512
+/* The message being received was transformed by the extension. Its payload
+   is collected in 'rext' and decoded once complete. */
+#define WSOCK_REXT 1024
+/* wsockrelay() is in the middle of a message received from this connection
+   or sent to it. */
+#define WSOCK_RELAYIN 2048
+#define WSOCK_RELAYOUT 4096
+/* wsockrecvfile() stored part of the message to the file. 'rpos' is the
+   position in the file rather than in the user's buffers. */
+#define WSOCK_RFILE 8192
+
+/* Default limits on the server-side opening handshake. */
+#define WSOCK_HSTIMEOUT 10000
+#define WSOCK_MAXPENDING 128
+/* How long the acceptor coroutine backs off after a failed accept(). */
+#define WSOCK_ACCEPTBACKOFF 100
+/* How long wsockdrain() waits for a single close frame to go out. */
+#define WSOCK_DRAINTIMEOUT 1000
+/* Extensions a listener can offer and the maximum size of a transformed
+   message before it's decoded. */
+#define WSOCK_MAXEXTS 4
+#define WSOCK_MAXEXTMSG (64 * 1024 * 1024)
+/* Size of the pieces the payload of a message received to a file is moved
+   in, when copied through the user space and when spliced through a pipe
+   respectively. */
+#define WSOCK_FILECHUNK 65536
+#define WSOCK_SPLICECHUNK (1024 * 1024)
+/* Close status codes used when the peer exceeds a limit. */
+#define WSOCK_TOOBIG 1009
+#define WSOCK_TRYLATER 1013
 
-/* Used when hashing WebSocket keys. See RFC 6455, chapter 4. */
-static const char *wsock_uuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+/* State of a connection moved by wsockmigrate(): magic, version, flags,
+   'rpos', size of the codec state and size of the received data that
+   weren't consumed yet. Codec state and the data follow. */
+#define WSOCK_MIGRATE_MAGIC 0x57534b4d
+#define WSOCK_MIGRATE_VERSION 1
+#define WSOCK_MIGRATE_HDRSZ 20
 
 struct wsock {
-    tcpsock u;
+    /* Connection's byte stream: the implementation and its instance. */
+    const struct wsock_transport *tr;
+    void *t;
     int flags;
-    struct wsock_str url;
-    struct wsock_str subprotocol;
+    /* Underlying OS-level socket. Used for the operations that libmill
+       doesn't provide. -1 if there's none. */
+    int fd;
+    /* Framing and the opening handshake. On a listening socket only the list
+       of available subprotocols is used. */
+    struct wsockcodec c;
+    /* Message being sent. 'shdr' is its frame header, 'slen' the size of
+       the payload and 'spos' the number of bytes of the frame, header
+       included, already passed to the transport. */
+    uint8_t shdr[WSOCK_MAXHEADER];
+    size_t shdrlen;
+    size_t slen;
+    size_t spos;
+    /* Size of the message as passed by the user. It differs from 'slen' if
+       the message was transformed by the extension. */
+    size_t smsglen;
+    /* Size of the message being received so far, including the part that
+       didn't fit into the user's buffer. */
+    size_t rpos;
+    /* Listening socket only. Either 'u' or 'us' is set. 'tlsctx' is set if
+       accepted connections should use TLS. */
+    tcpsock u;
+    unixsock us;
+    struct ssl_ctx_st *tlsctx;
+    /* Extension agreed on in the opening handshake and its state. 'sext'
+       is the transformed message being sent, 'sextlen' its size, 0 if the
+       message is sent unchanged. 'rext' collects the payload of
+       a transformed message being received. */
+    const struct wsockext *ext;
+    void *extstate;
+    const void *sext;
+    size_t sextlen;
+    uint8_t *rext;
+    size_t rextcap;
+    /* Page-aligned buffer the payload of messages received to a file is
+       unmasked in. Allocated on first use. */
+    uint8_t *rchunk;
+    /* Limits on the size of a received message and on the data buffered on
+       behalf of the connection, 0 meaning no limit. A listening socket
+       passes them on to the accepted connections. */
+    size_t maxmsg;
+    size_t maxbuf;
+    /* Log the traffic is captured to and the ID of the connection in it.
+       A listening socket attaches the log to the accepted connections. */
+    struct wsockcap *cap;
+    uint32_t capconn;
+    /* Scheduler and rate limits of outgoing messages. A listening socket
+       passes them on to the accepted connections. */
+    struct wsock_schedconn sched;
+    /* Listening socket only. Extensions available to the clients. */
+    const struct wsockext *exts[WSOCK_MAXEXTS];
+    int nexts;
+    /* Listening socket only. Accepted connections are handshaken in parallel
+       and queued in 'ready' until claimed by wsockaccept(). 'pending' counts
+       both the handshakes in progress and the queued connections. */
+    chan ready;
+    chan stopped;
+    int pending;
+    int maxpending;
+    int64_t hstimeout;
+    /* Listening socket only. Socket options to apply to accepted
+       connections, -1 meaning the system default. */
+    int opts[WSOCK_NSOCKOPTS];
+    int refs;
+    /* Connections claimed from a listener are kept on its 'conns' list so
+       that wsockdrain() can find them. 'ls' is NULL for connections that
+       didn't come from a listener or whose listener was closed. */
+    struct wsock *ls;
+    struct wsock *prev;
+    struct wsock *next;
+    struct wsock *conns;
 };
 
-/* Gets one CRLF-delimited line from the socket. Trims all leading and trailing
-   whitesepace. Replaces any remaining whitespace sequences by single space. */
-static int wsock_getline(wsock s, char *buf, size_t len, int64_t deadline) {
-    size_t sz = tcprecvuntil(s->u, buf, len, "\r", 1, deadline);
-    if(errno != 0)
-        return -1;
-    sz--;
-    char c;
-    tcprecv(s->u, &c, 1, deadline);
-    if(errno != 0)
-        return -1;
-    if(c != '\n') {
-        errno = EPROTO;
+/* Sets up the transport of a plain connection. io_uring is used for TCP if
+   available, buffered non-blocking socket otherwise. libmill doesn't expose
+   the file descriptor of a socket, so we get it by detaching the socket.
+   This must be done while the socket buffers are still empty. The socket
+   is closed in case of error. */
+static int wsock_attach(struct wsock *s, int fd, int local) {
+    s->fd = fd;
+#if defined WSOCK_HAVE_URING
+    if(!local) {
+        s->tr = &wsock_uring_transport;
+        s->t = wsock_uring_attach(fd);
+        if(s->t)
+            return 0;
+    }
+#endif
+    s->tr = &wsock_fd_transport;
+    s->t = wsock_fd_attach(fd);
+    if(!s->t) {
+        int err = errno;
+        close(fd);
+        errno = err;
         return -1;
     }
-    size_t i;
-    for(i = 0; i != sz; ++i) {
-        if(buf[i] < 32 || buf[i] > 127) {
-            errno = EPROTO;
-            return -1;
+    return 0;
+}
+
+/* Transport-level I/O. These have the same semantics as the corresponding
+   libmill tcpsock functions. */
+static size_t wsock_usend(struct wsock *s, const void *buf, size_t len,
+      int64_t deadline) {
+    return s->tr->send(s->t, buf, len, deadline);
+}
+
+static void wsock_uflush(struct wsock *s, int64_t deadline) {
+    s->tr->flush(s->t, deadline);
+}
+
+static size_t wsock_urecv(struct wsock *s, void *buf, size_t len,
+      int64_t deadline) {
+    return s->tr->recv(s->t, buf, len, deadline);
+}
+
+/* Sends whatever the codec has queued, i.e. the opening handshake and
+   control frames, and flushes the transport. Whatever wasn't sent before
+   the deadline is sent by the next call. */
+static int wsock_flushcodec(struct wsock *s, int64_t deadline) {
+    /* Other coroutines may queue frames while we are flushing, e.g. a pong
+       or the close frame from wsockdrain(). Those go out as well. */
+    while(1) {
+        const void *buf;
+        size_t sz = wsockcodecpending(&s->c, &buf);
+        if(sz) {
+            sz = wsock_usend(s, buf, sz, deadline);
+            wsockcodecsent(&s->c, sz);
+            if(errno != 0)
+                return -1;
         }
+        wsock_uflush(s, deadline);
+        if(errno != 0)
+            return -1;
+        if(!wsockcodecpending(&s->c, &buf))
+            return 0;
     }
-    i = 0;
-    while(i != sz && isspace(buf[i]))
-        ++i;
-    size_t pos = 0;
-    while(i != sz) {
-        if(isspace(buf[i])) {
-            while(i != sz && isspace(buf[i]))
-                ++i;
-            --i;
-        }
-        buf[pos++] = buf[i++];
-    }
-    if(pos && isspace(buf[pos - 1]))
-        --pos;
-    return pos;
-}
-
-static const char *wsock_hassubprotocol(const char *available,
-      const char *requested, size_t rqsz, size_t *ressz) {
-    /* This algorithm has quadratic complexity but we assume the list of
-       subprotocols is short, so we don't care. */
-    /* Walk through all requested subprotocols. */
-    while(rqsz) {
-        size_t rsz = 0;
-        while(rqsz && requested[rsz] != ',')
-            ++rsz, --rqsz;
-        if(rqsz)
-            --rqsz;
-        /* Walk through all the available subprotocols. */
-        const char *av = available;
-        while(av[0]) {
-            size_t asz = 0;
-            while(av[asz] != 0 && av[asz] != ',')
-                ++asz;
-            if(rsz == asz && memcmp(requested, av, asz) == 0) {
-                if(ressz)
-                    *ressz = asz;
-                return av;
-            }
-            av += asz + 1;
+}
+
+/* Deals with a failure to send. Deadline leaves the connection usable. Any
+   other error breaks it. */
+static size_t wsock_senderr(struct wsock *s) {
+    if(errno != ETIMEDOUT)
+        s->flags |= WSOCK_BROKEN;
+    return 0;
+}
+
+/* Starts sending a frame, or continues sending the one interrupted by
+   a deadline, by passing its header to the transport. 'first' is the first
+   byte of the header, i.e. the flags and the opcode. */
+static int wsock_sendhdr(struct wsock *s, size_t len, int first,
+      int64_t deadline) {
+    if(!(s->flags & WSOCK_SENDING)) {
+        s->shdrlen = wsockcodecheader(&s->c, len, s->shdr);
+        s->shdr[0] = (uint8_t)first;
+        s->slen = len;
+        s->spos = 0;
+        s->flags |= WSOCK_SENDING;
+    }
+    if(s->spos < s->shdrlen) {
+        s->spos += wsock_usend(s, s->shdr + s->spos, s->shdrlen - s->spos,
+            deadline);
+        if(errno != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Passes the payload of the message being sent to the transport, up to
+   'upto'. Returns 0 on success, -1 on error with errno set. */
+static int wsock_sendbody(struct wsock *s, const void *msg, size_t upto,
+      int64_t deadline) {
+    size_t pos = s->spos - s->shdrlen;
+    if(s->flags & WSOCK_CLIENT) {
+        /* Client-side payload is masked chunk by chunk on the way. */
+        uint8_t chunk[4096];
+        while(pos != upto) {
+            size_t tosend = upto - pos < sizeof(chunk) ?
+                upto - pos : sizeof(chunk);
+            memcpy(chunk, (const uint8_t*)msg + pos, tosend);
+            s->c.smaskoff = pos % 4;
+            wsockcodecmask(&s->c, chunk, tosend);
+            size_t sz = wsock_usend(s, chunk, tosend, deadline);
+            pos += sz;
+            s->spos += sz;
+            if(errno != 0)
+                return -1;
         }
-        requested += rsz + 1;
     }
-    return NULL;
+    else if(pos != upto) {
+        s->spos += wsock_usend(s, (const uint8_t*)msg + pos, upto - pos,
+            deadline);
+        if(errno != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Writes a single message into the transport without flushing it.
+   Returns 0 on success, -1 on error with errno set. */
+static int wsock_sendmsg(struct wsock *s, const void *msg, size_t len,
+      int rsv, int64_t deadline) {
+    if(wsock_sendhdr(s, len, 0x82 | rsv, deadline) != 0)
+        return -1;
+    if(!wsock_sched_active(&s->sched)) {
+        if(wsock_sendbody(s, msg, len, deadline) != 0)
+            return -1;
+        s->flags &= ~WSOCK_SENDING;
+        return 0;
+    }
+    while(s->spos - s->shdrlen != len) {
+        size_t pos = s->spos - s->shdrlen;
+        size_t piece = wsock_sched_acquire(&s->sched, len - pos, deadline);
+        if(!piece)
+            return -1;
+        /* While holding the turn, only what the transport takes without
+           waiting is passed to it. The rest is sent after the turn was
+           handed over, so that a slow peer doesn't hold up the others. */
+        int rc = wsock_sendbody(s, msg, pos + piece, now());
+        wsock_sched_release(&s->sched, s->spos - s->shdrlen == len);
+        if(rc != 0 && (errno != ETIMEDOUT ||
+              wsock_sendbody(s, msg, pos + piece, deadline) != 0))
+            return -1;
+    }
+    s->flags &= ~WSOCK_SENDING;
+    return 0;
+}
+
+/* Does the opening handshake, either the client or the server side of it
+   depending on how the codec was initialised. Bytes are passed to the codec
+   one by one so that nothing past the end of the handshake is consumed.
+   All the transports are buffered so this is cheap. Returns 0 on success,
+   -1 on error with errno set. */
+static int wsock_openhandshake(struct wsock *s, int64_t deadline) {
+    if(wsock_flushcodec(s, deadline) != 0)
+        return -1;
+    while(1) {
+        uint8_t c;
+        wsock_urecv(s, &c, 1, deadline);
+        if(errno != 0)
+            return -1;
+        struct wsockevent ev;
+        wsockcodecfeed(&s->c, &c, 1, &ev);
+        if(errno != 0)
+            return -1;
+        if(ev.type == WSOCK_OPEN)
+            break;
+    }
+    return wsock_flushcodec(s, deadline);
 }
 
-static int wsock_checkstring(const char *s) {
-    if(s) {
-        int i = 0;
-        while(s[i]) {
-            if(s[i] < 32 || s[i] > 127) {errno = EINVAL; return 0;}
-            ++i;
+/* Sets up the extension agreed on in the opening handshake, if any. The codec
+   has stored the token of the chosen one. Returns 0 on success, -1 on error
+   with errno set. */
+static int wsock_extopen(struct wsock *s, const struct wsockext *const *exts,
+      int nexts) {
+    const char *token = wsockcodecextension(&s->c);
+    if(!token)
+        return 0;
+    int i;
+    for(i = 0; i != nexts; ++i) {
+        if(strcmp(exts[i]->token, token) != 0)
+            continue;
+        errno = 0;
+        s->extstate = exts[i]->open(exts[i]->arg, !!(s->flags & WSOCK_CLIENT));
+        if(!s->extstate) {
+            if(errno == 0)
+                errno = ECONNABORTED;
+            return -1;
         }
-        if(i == 0) {errno = EINVAL; return 0;}
+        s->ext = exts[i];
+        return 0;
     }
-    errno = 0;
-    return 1;
+    errno = EPROTO;
+    return -1;
+}
+
+/* Allocates a listening socket. The caller fills in the underlying socket. */
+static struct wsock *wsock_listener(const char *subprotocol) {
+    struct wsock *s = (struct wsock*)malloc(sizeof(struct wsock));
+    if(!s) {errno = ENOMEM; return NULL;}
+    s->tr = NULL;
+    s->t = NULL;
+    s->flags = WSOCK_LISTENING;
+    s->fd = -1;
+    s->u = NULL;
+    s->us = NULL;
+    s->tlsctx = NULL;
+    s->ext = NULL;
+    s->rext = NULL;
+    s->rchunk = NULL;
+    s->maxmsg = 0;
+    s->maxbuf = 0;
+    s->cap = NULL;
+    wsock_sched_init(&s->sched);
+    s->nexts = 0;
+    wsock_codec_init(&s->c, 0, subprotocol, NULL);
+    s->ready = NULL;
+    s->stopped = NULL;
+    s->pending = 0;
+    s->maxpending = WSOCK_MAXPENDING;
+    s->hstimeout = WSOCK_HSTIMEOUT;
+    int i;
+    for(i = 0; i != WSOCK_NSOCKOPTS; ++i)
+        s->opts[i] = -1;
+    s->refs = 1;
+    s->ls = NULL;
+    s->conns = NULL;
+    return s;
 }
 
 wsock wsocklisten(ipaddr addr, const char *subprotocol, int backlog) {
     /* Check the arguments. */
-    if(!wsock_checkstring(subprotocol))
+    if(!wsock_str_check(subprotocol))
         return NULL;
 
-    struct wsock *s = (struct wsock*)malloc(sizeof(struct wsock));
-    if(!s) {errno = ENOMEM; return NULL;}
-    s->flags = WSOCK_LISTENING;
-    s->u = tcplisten(addr, backlog);
-    if(!s->u) {free(s); return NULL;}
-    wsock_str_init(&s->url, NULL, 0);
-    wsock_str_init(&s->subprotocol, subprotocol, wsock_str_len(subprotocol));
+    tcpsock u = tcplisten(addr, backlog);
+    if(!u)
+        return NULL;
+    /* The acceptor waits for the file descriptor directly and
+       wsockexport() passes it on. Detaching and re-attaching an idle
+       listening socket is harmless. */
+    int fd = tcpdetach(u);
+    u = tcpattach(fd, 1);
+    if(!u) {close(fd); return NULL;}
+    struct wsock *s = wsock_listener(subprotocol);
+    if(!s) {tcpclose(u); errno = ENOMEM; return NULL;}
+    s->u = u;
+    s->fd = fd;
     return s;
 }
 
-wsock wsockaccept(wsock s, int64_t deadline) {
-    int err = 0;
-    if(!(s->flags & WSOCK_LISTENING)) {err = EOPNOTSUPP; goto err0;}
+wsock wsocklistenunix(const char *addr, const char *subprotocol,
+      int backlog) {
+    /* Check the arguments. */
+    if(!wsock_str_check(subprotocol))
+        return NULL;
+
+    unixsock us = unixlisten(addr, backlog);
+    if(!us)
+        return NULL;
+    int fd = unixdetach(us);
+    us = unixattach(fd, 1);
+    if(!us) {close(fd); return NULL;}
+    struct wsock *s = wsock_listener(subprotocol);
+    if(!s) {unixclose(us); errno = ENOMEM; return NULL;}
+    s->us = us;
+    s->fd = fd;
+    return s;
+}
+
+wsock wsocklistentls(ipaddr addr, const char *subprotocol, int backlog,
+      const char *cert, const char *key, int flags) {
+#if defined WSOCK_HAVE_TLS
+    struct ssl_ctx_st *ctx = wsock_tls_server(cert, key, flags & WSOCK_KTLS);
+    if(!ctx)
+        return NULL;
+    struct wsock *s = wsocklisten(addr, subprotocol, backlog);
+    if(!s) {
+        int err = errno;
+        wsock_tls_term(ctx);
+        errno = err;
+        return NULL;
+    }
+    s->tlsctx = ctx;
+    return s;
+#else
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+void wsockadmission(wsock s, int64_t timeout, int maxpending) {
+    if(!(s->flags & WSOCK_LISTENING)) {errno = EOPNOTSUPP; return;}
+    if(maxpending < 1) {errno = EINVAL; return;}
+    /* The ready queue is sized when the first wsockaccept() is called. */
+    if(s->flags & WSOCK_ACCEPTING) {errno = EBUSY; return;}
+    s->hstimeout = timeout;
+    s->maxpending = maxpending;
+    errno = 0;
+}
+
+void wsockcapture(wsock s, wsockcap cap) {
+    if(s->cap)
+        wsock_cap_unref(s->cap);
+    s->cap = cap;
+    if(cap) {
+        wsock_cap_ref(cap);
+        if(!(s->flags & WSOCK_LISTENING))
+            s->capconn = wsock_cap_conn(cap);
+    }
+    errno = 0;
+}
+
+/* Records a frame in the capture log, if there's one. */
+static void wsock_capture(struct wsock *s, int dir, int opcode,
+      const void *data, size_t len, uint64_t size) {
+    if(s->cap)
+        wsock_cap_record(s->cap, s->capconn, dir, opcode, data, len, size);
+}
+
+void wsockschedule(wsock s, wsocksched sch) {
+    if(s->flags & (WSOCK_SENDING | WSOCK_FLUSHING | WSOCK_RELAYOUT)) {
+        errno = EBUSY; return;}
+    if(s->flags & WSOCK_LISTENING) {
+        if(s->sched.sch)
+            wsock_sched_unref(s->sched.sch);
+        s->sched.sch = sch;
+        if(sch)
+            wsock_sched_ref(sch);
+        errno = 0;
+        return;
+    }
+    if(wsock_sched_attach(&s->sched, sch) != 0)
+        return;
+    errno = 0;
+}
+
+void wsockratelimit(wsock s, uint64_t msgrate, uint64_t byterate) {
+    wsock_sched_limit(&s->sched, msgrate, byterate);
+    errno = 0;
+}
+
+void wsocksendstats(wsock s, struct wsockschedstats *stats) {
+    *stats = s->sched.stats;
+    errno = 0;
+}
+
+void wsocklimits(wsock s, size_t maxmsg, size_t maxbuf) {
+    s->maxmsg = maxmsg;
+    s->maxbuf = maxbuf;
+    errno = 0;
+}
+
+int wsockaddext(wsock s, const struct wsockext *ext) {
+    if(!(s->flags & WSOCK_LISTENING)) {errno = EOPNOTSUPP; return -1;}
+    if(!ext || !ext->token || !wsock_str_check(ext->token) ||
+          strchr(ext->token, ',')) {
+        errno = EINVAL; return -1;}
+    if(s->nexts == WSOCK_MAXEXTS) {errno = ENOBUFS; return -1;}
+    /* Accepted connections get the list of tokens from the listener's
+       codec. */
+    const char *list = wsock_str_get(&s->c.extensions);
+    size_t listlen = wsock_str_len(list);
+    size_t toklen = strlen(ext->token);
+    char *buf = malloc(listlen + toklen + 2);
+    if(!buf) {errno = ENOMEM; return -1;}
+    if(list) {
+        memcpy(buf, list, listlen);
+        buf[listlen++] = ',';
+    }
+    memcpy(buf + listlen, ext->token, toklen + 1);
+    wsock_codec_extensions(&s->c, buf);
+    free(buf);
+    s->exts[s->nexts++] = ext;
+    errno = 0;
+    return 0;
+}
+
+/* Deallocates a connection. */
+static void wsock_free(struct wsock *s) {
+    if(s->cap)
+        wsock_cap_unref(s->cap);
+    wsock_sched_term(&s->sched);
+    if(s->ext)
+        s->ext->close(s->extstate);
+    wsock_budget_give(s->rextcap);
+    free(s->rext);
+    if(s->rchunk)
+        wsock_budget_give(WSOCK_FILECHUNK);
+    free(s->rchunk);
+    s->tr->close(s->t);
+    wsock_codec_term(&s->c);
+    free(s);
+}
+
+/* Listening socket is deallocated once it's closed by the user and all the
+   handshakes that were started from it have finished. */
+static void wsock_release(struct wsock *s) {
+    if(--s->refs)
+        return;
+    if(s->ready)
+        chclose(s->ready);
+    if(s->cap)
+        wsock_cap_unref(s->cap);
+    if(s->sched.sch)
+        wsock_sched_unref(s->sched.sch);
+#if defined WSOCK_HAVE_TLS
+    if(s->tlsctx)
+        wsock_tls_term(s->tlsctx);
+#endif
+    wsock_codec_term(&s->c);
+    free(s);
+}
+
+/* Runs the handshake for a single accepted connection. Successfully
+   handshaken connections are passed to wsockaccept() via the ready queue. */
+coroutine static void wsock_handshake(struct wsock *s, int fd) {
     struct wsock *as = (struct wsock*)malloc(sizeof(struct wsock));
-    if(!as) {err = ENOMEM; goto err0;}
+    if(!as) {close(fd); goto done;}
     as->flags = 0;
-    as->u = tcpaccept(s->u, deadline);
-    if(errno != 0) {err = errno; goto err1;}
-    wsock_str_init(&as->url, NULL, 0);
-    wsock_str_init(&as->subprotocol, NULL, 0);
-
-    /* Parse request. */
-    char buf[256];
-    size_t sz = wsock_getline(as, buf, sizeof(buf), deadline);
-    if(sz < 0) {err = errno; goto err2;}
-    char *lend = buf + sz;
-    char *wstart = buf;
-    char *wend = (char*)memchr(buf, ' ', lend - wstart);
-    if(!wend || wend - wstart != 3 || memcmp(wstart, "GET", 3) != 0) {
-        err = EPROTO; goto err2;}
-    wstart = wend + 1;
-    wend = (char*)memchr(wstart, ' ', lend - wstart);
-    if(!wend) {err = EPROTO; goto err2;}
-    wsock_str_init(&as->url, wstart, wend - wstart);
-    wstart = wend + 1;
-    wend = (char*)memchr(wstart, ' ', lend - wstart);
-    if(wend || lend - wstart != 8 || memcmp(wstart, "HTTP/1.1", 8) != 0) {
-        err = EPROTO; goto err2;}
-    int hasupgrade = 0;
-    int hasconnection = 0;
-    int haskey = 0;
-    int seensubprotocol = 0;
-    int hassubprotocol = 0;
-    const char *subprotocol = NULL;
-    size_t subprotocolsz = 0;
-    struct wsock_sha1 sha1;
+    as->rpos = 0;
+    as->ls = NULL;
+    as->u = NULL;
+    as->us = NULL;
+    as->tlsctx = NULL;
+    as->ext = NULL;
+    as->rext = NULL;
+    as->rextcap = 0;
+    as->rchunk = NULL;
+    as->maxmsg = s->maxmsg;
+    as->maxbuf = s->maxbuf;
+    as->cap = NULL;
+    wsock_sched_init(&as->sched);
+    int64_t deadline = s->hstimeout < 0 ? -1 : now() + s->hstimeout;
+    /* Options are best effort. Failing to set one is no reason to turn
+       the client away. */
+    wsock_sockopt_apply(fd, s->opts);
+#if defined WSOCK_HAVE_TLS
+    if(s->tlsctx) {
+        as->fd = fd;
+        as->tr = &wsock_tls_transport;
+        as->t = wsock_tls_accept(s->tlsctx, fd, deadline);
+        if(!as->t) {free(as); goto done;}
+    }
+    else
+#endif
+    {
+        if(wsock_attach(as, fd, s->us != NULL) != 0) {free(as); goto done;}
+    }
+    wsock_codec_init(&as->c, 0, wsock_str_get(&s->c.protocols), NULL);
+    wsock_codec_extensions(&as->c, wsock_str_get(&s->c.extensions));
+    int rc = wsock_openhandshake(as, deadline);
+    if(rc == 0)
+        rc = wsock_extopen(as, s->exts, s->nexts);
+    /* Don't hand the connection over if the listener was closed in the
+       meantime. */
+    if(rc != 0 || s->flags & WSOCK_DONE) {wsockclose(as); goto done;}
+    /* The queue is large enough to hold all pending connections so this
+       never blocks. */
+    chs(s->ready, struct wsock*, as);
+    wsock_release(s);
+    return;
+done:
+    --s->pending;
+    /* After wsockexport() there are no new connections. Let wsockaccept()
+       know it has nothing more to wait for. */
+    if(s->flags & WSOCK_EXPORTED && !s->pending && !(s->flags & WSOCK_DONE))
+        chs(s->ready, struct wsock*, NULL);
+    wsock_release(s);
+}
+
+/* Tells the client that we are over capacity. This is best effort: we don't
+   want to wait for a peer we've already decided not to serve. */
+static void wsock_shed(int fd) {
+    const char *lit1 =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+    ssize_t sz = send(fd, lit1, strlen(lit1), MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)sz;
+    close(fd);
+}
+
+/* Closes the listening socket, if it wasn't closed yet. */
+static void wsock_closelistener(struct wsock *s) {
+    if(s->us)
+        unixclose(s->us);
+    else if(s->u)
+        tcpclose(s->u);
+    s->us = NULL;
+    s->u = NULL;
+    s->fd = -1;
+}
+
+/* go() does setjmp(). Calling it from here rather than from the acceptor
+   loop keeps the variables of the loop from being clobbered. */
+static void wsock_handshakestart(struct wsock *s, int fd) {
+    go(wsock_handshake(s, fd));
+}
+
+/* Accepts connections and launches a handshake for each of them. Closes
+   the listening socket on its way out. wsockclose() shuts the socket down
+   to wake it up and waits for it. An exported socket can't be shut down,
+   it's shared with the successor. The acceptor keeps waiting until the next
+   incoming connection, which is the successor's to take, and holds
+   a reference to the listener until then. */
+coroutine static void wsock_acceptor(struct wsock *s) {
     while(1) {
-        sz = wsock_getline(as, buf, sizeof(buf), deadline);
-        if(sz < 0) {err = errno; goto err2;}
-        if(sz == 0)
+        fdwait(s->fd, FDW_IN, -1);
+        if(s->flags & (WSOCK_DONE | WSOCK_EXPORTED))
             break;
-        lend = buf + sz;
-        char *nstart = buf;
-        char *nend = (char*)memchr(buf, ':', lend - nstart);
-        size_t nsz = nend - nstart;
-        if(!nend || nsz < 1) {err = EPROTO; goto err2;}
-        char *vstart = nend + 1;
-        while(vstart != lend && isspace(*vstart))
-            ++vstart;
-        size_t vsz = lend - vstart;
-        if(nsz == 7 && strncasecmp(nstart, "Upgrade", 7) == 0) {
-            if(hasupgrade || vsz != 9 || memcmp(vstart, "websocket", 9) != 0) {
-                err = EPROTO; goto err2;}
-            hasupgrade = 1;
-            continue;
+        int fd = -1;
+        if(s->us) {
+            unixsock us = unixaccept(s->us, now());
+            if(us)
+                fd = unixdetach(us);
         }
-        if(nsz == 10 && strncasecmp(nstart, "Connection", 10) == 0) {
-            if(hasconnection || vsz != 7 || memcmp(vstart, "Upgrade", 7) != 0) {
-                err = EPROTO; goto err2;}
-            hasconnection = 1;
-            continue;
+        else {
+            tcpsock u = tcpaccept(s->u, now());
+            if(u)
+                fd = tcpdetach(u);
         }
-        if(nsz == 17 && strncasecmp(nstart, "Sec-WebSocket-Key", 17) == 0) {
-            if(haskey) {err = EPROTO; goto err2;}
-            wsock_sha1_init(&sha1);
-            int i;
-            for(i = 0; i != vsz; ++i)
-                wsock_sha1_hashbyte(&sha1, vstart[i]);
-            for(i = 0; i != 36; ++i)
-                wsock_sha1_hashbyte(&sha1, wsock_uuid[i]);
-            haskey = 1;
+        if(fd < 0) {
+            /* Back off on errors such as EMFILE to avoid busy-looping.
+               ETIMEDOUT means someone else took the connection. */
+            if(errno != ETIMEDOUT)
+                msleep(now() + WSOCK_ACCEPTBACKOFF);
             continue;
         }
-        if(nsz == 22 &&
-              strncasecmp(nstart, "Sec-WebSocket-Protocol", 22) == 0) {
-            seensubprotocol = 1;
-            /* RFC6455, section 11.3.4 allows for multiple instances of
-               this field. Therefore we are going to ignore it once we have
-               a subprotocol selected. */
-            if(!hassubprotocol) {
-                const char *available = wsock_str_get(&s->subprotocol);
-                if(available) {
-                    subprotocol = wsock_hassubprotocol(available, vstart, vsz,
-                        &subprotocolsz);
-                    /* No matching subprotocol? Never mind, there may be one
-                       present in following instance of this field. */
-                    if(!subprotocol)
-                        continue;
-                }
-                else {
-                    subprotocol = vstart;
-                    subprotocolsz = vsz;
-                }
-                hassubprotocol = 1;
-                wsock_str_init(&as->subprotocol, subprotocol, subprotocolsz);
-            }
+        /* Turn new clients away when over capacity or when the memory
+           budget is used up. */
+        if(s->pending >= s->maxpending || wsock_budget_exceeded()) {
+            wsock_shed(fd);
             continue;
         }
+        ++s->pending;
+        ++s->refs;
+        wsock_handshakestart(s, fd);
+    }
+    wsock_closelistener(s);
+    if(s->flags & WSOCK_EXPORTED) {
+        chclose(s->stopped);
+        wsock_release(s);
+        return;
     }
-    if(!hasupgrade || !hasconnection || !haskey) {err = EPROTO; goto err2;}
-    if(seensubprotocol && !hassubprotocol) {err = EPROTO; goto err2;}
+    chs(s->stopped, int, 0);
+}
 
-    /* If the subprotocol was not specified by the client, we still want to
-       use one of the suerver-supported protocols locally. */
-    if(!subprotocol) {
-        const char *available = wsock_str_get(&s->subprotocol);
-        if(available) {
-            size_t asz = 0;
-            while(available[asz] != 0 && available[asz] != ',')
-                ++asz;
-            wsock_str_init(&as->subprotocol, available, asz);
-        }
+wsock wsockaccept(wsock s, int64_t deadline) {
+    if(!(s->flags & WSOCK_LISTENING)) {errno = EOPNOTSUPP; return NULL;}
+    if(s->flags & WSOCK_DONE) {errno = ECONNABORTED; return NULL;}
+    /* The socket was handed over and all the connections accepted before
+       that were already claimed. */
+    if(s->flags & WSOCK_EXPORTED && !s->pending) {
+        errno = ECANCELED; return NULL;}
+    /* Start accepting connections in the background once the user asks
+       for the first one. */
+    if(!(s->flags & WSOCK_ACCEPTING)) {
+        s->ready = chmake(struct wsock*, s->maxpending);
+        s->stopped = chmake(int, 0);
+        s->flags |= WSOCK_ACCEPTING;
+        go(wsock_acceptor(s));
+    }
+    struct wsock *as = NULL;
+    int timedout = 0;
+    choose {
+    in(s->ready, struct wsock*, hs):
+        as = hs;
+    deadline(deadline):
+        timedout = 1;
+    end
     }
+    if(timedout) {errno = ETIMEDOUT; return NULL;}
+    if(!as) {errno = ECANCELED; return NULL;}
+    --s->pending;
+    if(s->cap)
+        wsockcapture(as, s->cap);
+    if(s->sched.sch)
+        wsockschedule(as, s->sched.sch);
+    wsock_sched_limit(&as->sched, s->sched.msgs.rate, s->sched.bytes.rate);
+    as->ls = s;
+    as->prev = NULL;
+    as->next = s->conns;
+    if(s->conns)
+        s->conns->prev = as;
+    s->conns = as;
+    errno = 0;
+    return as;
+}
 
-    /* Send reply. */
-    const char *lit1 =
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: ";
-    tcpsend(as->u, lit1, strlen(lit1), deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    char key[32];
-    sz = wsock_base64_encode(wsock_sha1_result(&sha1), 20, key, sizeof(key));
-    assert(sz > 0);
-    tcpsend(as->u, key, sz, deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    if(hassubprotocol) {
-        tcpsend(as->u, "\r\nSec-WebSocket-Protocol: ", 26, deadline);
-        if(errno != 0) {err = errno; goto err2;}
-        tcpsend(as->u, subprotocol, subprotocolsz, deadline);
-        if(errno != 0) {err = errno; goto err2;}
-    }
-    tcpsend(as->u, "\r\n\r\n", 4, deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    tcpflush(as->u, deadline);
-    if(errno != 0) {err = errno; goto err2;}
+int wsockexport(wsock s, const char *path, int64_t deadline) {
+    if(!(s->flags & WSOCK_LISTENING)) {errno = EOPNOTSUPP; return -1;}
+    if(s->flags & (WSOCK_DONE | WSOCK_EXPORTED)) {
+        errno = ECONNABORTED; return -1;}
+    if(!path) {errno = EINVAL; return -1;}
+    /* Connecting to a Unix domain socket never blocks. */
+    unixsock us = unixconnect(path);
+    if(!us)
+        return -1;
+    int sock = unixdetach(us);
+    /* Keep accepting until the successor confirms it has the socket. */
+    if(wsock_handoff_send(sock, s->fd, deadline) != 0 ||
+          wsock_handoff_wait(sock, deadline) != 0) {
+        int err = errno;
+        fdclean(sock);
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    fdclean(sock);
+    close(sock);
+    /* Stop accepting. Connections already accepted are still handshaken
+       and handed out by wsockaccept(). The successor has its own copy of
+       the socket, so ours is closed as soon as the acceptor is done with
+       it. */
+    s->flags |= WSOCK_EXPORTED;
+    if(s->flags & WSOCK_ACCEPTING) {
+        ++s->refs;
+        if(!s->pending)
+            chs(s->ready, struct wsock*, NULL);
+    }
+    else {
+        wsock_closelistener(s);
+    }
+    errno = 0;
+    return 0;
+}
 
-    return as;
+wsock wsockimport(const char *path, const char *subprotocol,
+      int64_t deadline) {
+    /* Check the arguments. */
+    if(!path) {errno = EINVAL; return NULL;}
+    if(!wsock_str_check(subprotocol))
+        return NULL;
+
+    int err;
+    unixsock hs = unixlisten(path, 1);
+    if(!hs)
+        return NULL;
+    unixsock us = unixaccept(hs, deadline);
+    if(!us) {err = errno; goto err1;}
+    int sock = unixdetach(us);
+    int fd = wsock_handoff_recv(sock, deadline);
+    if(fd < 0) {err = errno; goto err2;}
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if(getsockname(fd, (struct sockaddr*)&addr, &addrlen) != 0) {
+        err = errno; close(fd); goto err2;}
+    struct wsock *s = wsock_listener(subprotocol);
+    if(!s) {err = ENOMEM; close(fd); goto err2;}
+    if(addr.ss_family == AF_UNIX)
+        s->us = unixattach(fd, 1);
+    else
+        s->u = tcpattach(fd, 1);
+    if(!s->us && !s->u) {err = errno; close(fd); goto err3;}
+    s->fd = fd;
+    /* From now on the predecessor doesn't accept any more connections. */
+    if(wsock_handoff_ack(sock, deadline) != 0) {err = errno; goto err4;}
+    fdclean(sock);
+    close(sock);
+    unixclose(hs);
+    unlink(path);
+    errno = 0;
+    return s;
 
+err4:
+    wsockclose(s);
+    goto err2;
+err3:
+    wsock_release(s);
 err2:
-    tcpclose(as->u);
+    fdclean(sock);
+    close(sock);
 err1:
-    free(as);
-err0:
+    unixclose(hs);
+    unlink(path);
     errno = err;
     return NULL;
 }
 
-wsock wsockconnect(ipaddr addr, const char *subprotocol, const char *url,
-      int64_t deadline) {
-    /* Check the arguments. */
-    if(!wsock_checkstring(url))
+wsock wsockimporttls(const char *path, const char *subprotocol,
+      const char *cert, const char *key, int flags, int64_t deadline) {
+#if defined WSOCK_HAVE_TLS
+    struct ssl_ctx_st *ctx = wsock_tls_server(cert, key, flags & WSOCK_KTLS);
+    if(!ctx)
         return NULL;
-    if(subprotocol) {
-        if(!wsock_checkstring(subprotocol))
+    struct wsock *s = wsockimport(path, subprotocol, deadline);
+    if(!s) {
+        int err = errno;
+        wsock_tls_term(ctx);
+        errno = err;
         return NULL;
     }
+    s->tlsctx = ctx;
+    return s;
+#else
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+/* Sends the close frame to a single connection claimed from the listener.
+   If a message is being sent the frame goes out once that's done. */
+coroutine static void wsock_drainone(struct wsock *s, chan done) {
+    s->flags |= WSOCK_DRAINING;
+    wsockcodecdone(&s->c);
+    s->flags |= WSOCK_DONE;
+    if(!(s->flags & (WSOCK_SENDING | WSOCK_FLUSHING | WSOCK_BROKEN))) {
+        if(wsock_flushcodec(s, now() + WSOCK_DRAINTIMEOUT) != 0)
+            wsock_senderr(s);
+    }
+    s->flags &= ~WSOCK_DRAINING;
+    if(s->flags & WSOCK_CLOSING)
+        wsock_free(s);
+    chs(done, int, 0);
+}
 
-    /* Open TCP connection. */
+/* Keeps setjmp() done by go() out of wsockdrain() so that its local
+   variables can't be clobbered. */
+static void wsock_drainstart(struct wsock *as, chan done) {
+    go(wsock_drainone(as, done));
+}
+
+int wsockdrain(wsock s, int64_t deadline) {
+    if(!(s->flags & WSOCK_LISTENING)) {errno = EOPNOTSUPP; return -1;}
+    int n = 0;
+    struct wsock *as;
+    for(as = s->conns; as; as = as->next) {
+        if(!(as->flags & WSOCK_DONE))
+            ++n;
+    }
+    if(!n) {errno = 0; return 0;}
+    /* Close frames are spread evenly over the window so that the clients
+       don't all come back at the same time. */
+    int64_t start = now();
+    int64_t window = deadline < 0 || deadline < start ? 0 : deadline - start;
+    chan done = chmake(int, n);
+    int i;
+    int sent = 0;
+    for(i = 0; i != n; ++i) {
+        msleep(start + window * i / n);
+        /* Connections may have been closed, or closed by the peer, while we
+           were waiting. */
+        for(as = s->conns; as; as = as->next) {
+            if(!(as->flags & WSOCK_DONE))
+                break;
+        }
+        if(!as)
+            break;
+        wsock_drainstart(as, done);
+        ++sent;
+    }
+    for(i = 0; i != sent; ++i)
+        (void)chr(done, int);
+    chclose(done);
+    errno = 0;
+    return sent;
+}
+
+/* Creates a client-side wsock on top of a connected socket and does
+   the opening handshake. If there are any early messages, they are written
+   right behind the upgrade request and go out in the same flush. The socket
+   is closed in case of error. */
+static wsock wsock_connect(int fd, int local, const char *subprotocol,
+      const char *url, const struct wsockext *ext,
+      const struct wsockmsg *msgs, int nmsgs, int64_t deadline) {
     int err = 0;
     struct wsock *s = (struct wsock*)malloc(sizeof(struct wsock));
-    if(!s) {err = ENOMEM; goto err0;}
+    if(!s) {close(fd); err = ENOMEM; goto err0;}
     s->flags = WSOCK_CLIENT;
-    s->u = tcpconnect(addr, deadline);
-    if(errno != 0) {err = errno; goto err1;}
-    wsock_str_init(&s->url, url, strlen(url));
-    wsock_str_init(&s->subprotocol, NULL, 0);
-
-    /* Send request. */
-    tcpsend(s->u, "GET ", 4, deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    tcpsend(s->u, url, strlen(url), deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    const char *lit1 =
-        " HTTP/1.1\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Key: ";
-    tcpsend(s->u, lit1, strlen(lit1), deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    uint32_t nonce[4];
-    int i;
-    for(i = 0; i != 4; ++i)
-        nonce[i] = wsock_random();
-    char swsk[32];
-    int swsksz = wsock_base64_encode((uint8_t*)nonce, sizeof(nonce),
-        swsk, sizeof(swsk));
-    assert(swsksz > 0);
-    tcpsend(s->u, swsk, swsksz, deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    if(subprotocol) {
-        tcpsend(s->u, "\r\nSec-WebSocket-Protocol: ", 26, deadline);
-        if(errno != 0) {err = errno; goto err2;}
-        tcpsend(s->u, subprotocol, strlen(subprotocol), deadline);
-        if(errno != 0) {err = errno; goto err2;}
-    }
-    tcpsend(s->u, "\r\n\r\n", 4, deadline);
-    if(errno != 0) {err = errno; goto err2;}
-    tcpflush(s->u, deadline);
-    if(errno != 0) {err = errno; goto err2;}
-
-    /* Parse reply. */
-    char buf[256];
-    size_t sz = wsock_getline(s, buf, sizeof(buf), deadline);
-    if(sz < 0) {err = errno; goto err2;}
-    char *lend = buf + sz;
-    char *wstart = buf;
-    char *wend = (char*)memchr(buf, ' ', lend - wstart);
-    if(!wend || wend - wstart != 8 || memcmp(wstart, "HTTP/1.1", 8) != 0) {
-        err = EPROTO; goto err2;}
-    wstart = wend + 1;
-    wend = (char*)memchr(wstart, ' ', lend - wstart);
-    if(!wend || wend - wstart != 3 || memcmp(wstart, "101", 3) != 0) {
-        err = EPROTO; goto err2;}
-    int hasupgrade = 0;
-    int hasconnection = 0;
-    int haskey = 0;
-    int hassubprotocol = 0;
-    while(1) {
-        sz = wsock_getline(s, buf, sizeof(buf), deadline);
-        if(sz < 0) {err = errno; goto err2;}
-        if(sz == 0)
-            break;
-        lend = buf + sz;
-        char *nstart = buf;
-        char *nend = (char*)memchr(buf, ':', lend - nstart);
-        size_t nsz = nend - nstart;
-        if(!nend || nsz < 1) {err = EPROTO; goto err2;}
-        char *vstart = nend + 1;
-        while(vstart != lend && isspace(*vstart))
-            ++vstart;
-        size_t vsz = lend - vstart;
-        if(nsz == 7 && strncasecmp(nstart, "Upgrade", 7) == 0) {
-            if(hasupgrade || vsz != 9 || memcmp(vstart, "websocket", 9) != 0) {
-                err = EPROTO; goto err2;}
-            hasupgrade = 1;
-            continue;
-        }
-        if(nsz == 10 && strncasecmp(nstart, "Connection", 10) == 0) {
-            if(hasconnection || vsz != 7 || memcmp(vstart, "Upgrade", 7) != 0) {
-                err = EPROTO; goto err2;}
-            hasconnection = 1;
-            continue;
-        }
-        if(nsz == 20 && strncasecmp(nstart, "Sec-WebSocket-Accept", 20) == 0) {
-            if(haskey) {err = EPROTO; goto err2;}
-            /* Compute the expected value of the key. */
-            struct wsock_sha1 sha1;
-            wsock_sha1_init(&sha1);
-            for(i = 0; i != swsksz; ++i)
-                wsock_sha1_hashbyte(&sha1, swsk[i]);
-            for(i = 0; i != 36; ++i)
-                wsock_sha1_hashbyte(&sha1, wsock_uuid[i]);
-            char key[32];
-            size_t keysz = wsock_base64_encode(wsock_sha1_result(&sha1), 20,
-                key, sizeof(key));
-            assert(sz > 0);
-            /* Check whether the received key matches the expected one. */
-            if(vsz != keysz || memcmp(vstart, key, vsz) != 0) {
-                err = EPROTO; goto err2;}
-            haskey = 1;
-            continue;
-        }
-        if(nsz == 22 &&
-              strncasecmp(nstart, "Sec-WebSocket-Protocol", 22) == 0) {
-            if(hassubprotocol) {err = EPROTO; goto err2;}
-            for(i = 0; i != vsz; ++i)
-                if(vstart[i] == ',') {err = EPROTO; goto err2;}
-            if(!wsock_hassubprotocol(subprotocol, vstart, vsz, NULL)) {
-                err = EPROTO; goto err2;}
-            wsock_str_init(&s->subprotocol, vstart, vsz);
-            hassubprotocol = 1;
-            continue;
+    s->rpos = 0;
+    s->ls = NULL;
+    s->u = NULL;
+    s->us = NULL;
+    s->tlsctx = NULL;
+    s->ext = NULL;
+    s->rext = NULL;
+    s->rextcap = 0;
+    s->rchunk = NULL;
+    s->maxmsg = 0;
+    s->maxbuf = 0;
+    s->cap = NULL;
+    wsock_sched_init(&s->sched);
+    if(wsock_codec_init(&s->c, WSOCK_CODEC_CLIENT, subprotocol, url) != 0) {
+        err = errno; close(fd); goto err1;}
+    if(ext && wsock_codec_extensions(&s->c, ext->token) != 0) {
+        err = errno; close(fd); goto err2;}
+    if(wsock_attach(s, fd, local) != 0) {err = errno; goto err2;}
+
+    if(nmsgs > 0) {
+        const void *buf;
+        size_t sz = wsockcodecpending(&s->c, &buf);
+        wsock_usend(s, buf, sz, deadline);
+        if(errno != 0) {err = errno; goto err3;}
+        wsockcodecsent(&s->c, sz);
+        int i;
+        for(i = 0; i != nmsgs; ++i) {
+            if(wsock_sendmsg(s, msgs[i].buf, msgs[i].len, 0,
+                  deadline) != 0) {
+                err = errno; goto err3;}
         }
+        wsock_uflush(s, deadline);
+        if(errno != 0) {err = errno; goto err3;}
     }
-    if(!hasupgrade || !hasconnection || !haskey) {err = EPROTO; goto err2;}
-
+    if(wsock_openhandshake(s, deadline) != 0) {err = errno; goto err3;}
+    if(wsock_extopen(s, &ext, ext ? 1 : 0) != 0) {err = errno; goto err3;}
     return s;
 
+err3:
+    wsockclose(s);
+    errno = err;
+    return NULL;
 err2:
-    tcpclose(s->u);
+    wsock_codec_term(&s->c);
 err1:
     free(s);
 err0:
@@ -443,184 +1025,1700 @@ err0:
     return NULL;
 }
 
-const char *wsockurl(wsock s) {
-    return wsock_str_get(&s->url);
+wsock wsockconnect(ipaddr addr, const char *subprotocol, const char *url,
+      int64_t deadline) {
+    /* Check the arguments. */
+    if(!wsock_str_check(url))
+        return NULL;
+    if(subprotocol) {
+        if(!wsock_str_check(subprotocol))
+        return NULL;
+    }
+
+    /* Open TCP connection. */
+    tcpsock u = tcpconnect(addr, deadline);
+    if(errno != 0)
+        return NULL;
+    return wsock_connect(tcpdetach(u), 0, subprotocol, url, NULL, NULL, 0,
+        deadline);
 }
 
-const char *wsocksubprotocol(wsock s) {
-    return wsock_str_get(&s->subprotocol);
+wsock wsockconnectearly(ipaddr addr, const char *subprotocol,
+      const char *url, const struct wsockmsg *msgs, int nmsgs,
+      int64_t deadline) {
+    /* Check the arguments. */
+    if(!wsock_str_check(url))
+        return NULL;
+    if(subprotocol) {
+        if(!wsock_str_check(subprotocol))
+        return NULL;
+    }
+    if(nmsgs < 0 || (nmsgs > 0 && !msgs)) {errno = EINVAL; return NULL;}
+
+    /* Open TCP connection. */
+    tcpsock u = tcpconnect(addr, deadline);
+    if(errno != 0)
+        return NULL;
+    return wsock_connect(tcpdetach(u), 0, subprotocol, url, NULL, msgs,
+        nmsgs, deadline);
 }
 
-size_t wsocksend(wsock s, const void *msg, size_t len, int64_t deadline) {
-    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return 0;}
-    if(s->flags & WSOCK_BROKEN) {errno = ECONNABORTED; return 0;}
-    uint8_t buf[12];
-    size_t sz;
-    buf[0] = 0x82;
-    if(len > 0xffff) {
-        buf[1] = 127;
-        wsock_putll(buf + 2, len);
-        sz = 10;
+wsock wsockconnectext(ipaddr addr, const char *subprotocol,
+      const char *url, const struct wsockext *ext, int64_t deadline) {
+    /* Check the arguments. */
+    if(!wsock_str_check(url))
+        return NULL;
+    if(subprotocol) {
+        if(!wsock_str_check(subprotocol))
+        return NULL;
     }
-    else if(len > 125) {
-        buf[1] = 126;
-        wsock_puts(buf + 2, len);
-        sz = 4;
+    if(!ext || !ext->token || !wsock_str_check(ext->token) ||
+          strchr(ext->token, ',')) {
+        errno = EINVAL; return NULL;}
+
+    /* Open TCP connection. */
+    tcpsock u = tcpconnect(addr, deadline);
+    if(errno != 0)
+        return NULL;
+    return wsock_connect(tcpdetach(u), 0, subprotocol, url, ext, NULL, 0,
+        deadline);
+}
+
+/* Connection attempts racing in wsockconnectany() share this. The state is
+   deallocated once the caller and all the attempts are done with it. */
+struct wsock_race {
+    /* Outcomes of the attempts: a connected socket or an error. */
+    chan results;
+    /* Set once there's a winner or the race was given up. */
+    int done;
+    int refs;
+    /* Sockets of the attempts still connecting, -1 for the others. Once
+       the race is over they are shut down, which wakes the attempts up. */
+    int fds[];
+};
+
+struct wsock_attempt {
+    int fd;
+    int err;
+};
+
+static void wsock_race_release(struct wsock_race *r) {
+    if(--r->refs)
+        return;
+    chclose(r->results);
+    free(r);
+}
+
+/* Opens a TCP connection without blocking other attempts. libmill's
+   tcpconnect() can't be interrupted, so the socket is connected by hand
+   and published in the race's 'fds' for the caller to shut it down. */
+static int wsock_race_connect(struct wsock_race *r, int slot, ipaddr addr,
+      int64_t deadline) {
+    struct sockaddr *sa = (struct sockaddr*)&addr;
+    socklen_t len = sa->sa_family == AF_INET ?
+        sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    int opt = fcntl(fd, F_GETFL, 0);
+    if(opt == -1 || fcntl(fd, F_SETFL, opt | O_NONBLOCK) == -1)
+        goto error;
+    if(connect(fd, sa, len) == 0)
+        return fd;
+    if(errno != EINPROGRESS)
+        goto error;
+    r->fds[slot] = fd;
+    int rc = fdwait(fd, FDW_OUT, deadline);
+    r->fds[slot] = -1;
+    if(r->done) {errno = ECANCELED; goto error;}
+    if(!rc) {errno = ETIMEDOUT; goto error;}
+    int err;
+    socklen_t errsz = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errsz) != 0)
+        goto error;
+    if(err != 0) {errno = err; goto error;}
+    return fd;
+error:
+    err = errno;
+    fdclean(fd);
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+coroutine static void wsock_race_attempt(struct wsock_race *r, int slot,
+      ipaddr addr, int64_t deadline) {
+    struct wsock_attempt res;
+    res.fd = wsock_race_connect(r, slot, addr, deadline);
+    res.err = errno;
+    /* Lost the race. */
+    if(r->done) {
+        if(res.fd >= 0) {
+            fdclean(res.fd);
+            close(res.fd);
+        }
     }
     else {
-        buf[1] = (uint8_t)len;
-        sz = 2;
+        chs(r->results, struct wsock_attempt, res);
     }
-    uint8_t mask[4];
-    if(s->flags & WSOCK_CLIENT) {
-        *((uint32_t*)mask) = wsock_random();
-        buf[1] |= 0x80;
-        memcpy(buf + sz, mask, 4);
-        sz += 4;
+    wsock_race_release(r);
+}
+
+/* Picks the address for the n-th attempt. Address families alternate,
+   starting with the family of the first address, so that a family that
+   doesn't work delays the connection by a single attempt. 'next' holds
+   the position of the next unused address of the first family and of
+   the others respectively. */
+static int wsock_race_pick(const ipaddr *addrs, int naddrs, int *next,
+      int n) {
+    int family = ((struct sockaddr*)&addrs[0])->sa_family;
+    int i;
+    for(i = 0; i != 2; ++i) {
+        int k = (n + i) % 2;
+        while(next[k] != naddrs) {
+            int idx = next[k]++;
+            int f = ((struct sockaddr*)&addrs[idx])->sa_family;
+            if((f == family) == (k == 0))
+                return idx;
+        }
     }
-    tcpsend(s->u, buf, sz, deadline);
-    if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
-    if(s->flags & WSOCK_CLIENT) {
-        /* TODO: Use static buffer or something. This way of implementing
-           mapping is performance nightmare. */
-        uint8_t *masked = malloc(len);
-        if(!masked) {s->flags |= WSOCK_BROKEN; errno = ENOMEM; return 0;}
-        size_t i;
-        for(i = 0; i != len; ++i)
-            masked[i] = ((uint8_t*)msg)[i] ^ mask[i % 4];
-        tcpsend(s->u, masked, len, deadline);
+    return -1;
+}
+
+/* Launches the attempt outside of wsockconnectany() so that setjmp() done
+   by go() can't clobber the local variables there. */
+static void wsock_race_start(struct wsock_race *r, int slot, ipaddr addr,
+      int64_t deadline) {
+    ++r->refs;
+    go(wsock_race_attempt(r, slot, addr, deadline));
+}
+
+wsock wsockconnectany(const ipaddr *addrs, int naddrs,
+      const char *subprotocol, const char *url, int64_t delay,
+      int64_t deadline) {
+    /* Check the arguments. */
+    if(!wsock_str_check(url))
+        return NULL;
+    if(subprotocol) {
+        if(!wsock_str_check(subprotocol))
+        return NULL;
+    }
+    if(!addrs || naddrs < 1 || delay < 0) {errno = EINVAL; return NULL;}
+
+    /* Race the TCP connections. */
+    if((size_t)naddrs > (SIZE_MAX - sizeof(struct wsock_race)) / sizeof(int)) {
+        errno = ENOMEM; return NULL;}
+    struct wsock_race *r = malloc(sizeof(struct wsock_race) +
+        naddrs * sizeof(int));
+    if(!r) {errno = ENOMEM; return NULL;}
+    r->results = chmake(struct wsock_attempt, naddrs);
+    if(!r->results) {free(r); errno = ENOMEM; return NULL;}
+    r->done = 0;
+    r->refs = 1;
+    int i;
+    for(i = 0; i != naddrs; ++i)
+        r->fds[i] = -1;
+    int next[2] = {0, 0};
+    int started = 0;
+    int finished = 0;
+    int fd = -1;
+    int err = ETIMEDOUT;
+    int64_t start = now();
+    while(1) {
+        if(started != naddrs && now() >= start) {
+            int idx = wsock_race_pick(addrs, naddrs, next, started);
+            wsock_race_start(r, started, addrs[idx], deadline);
+            ++started;
+            start = now() + delay;
+        }
+        if(finished == started && started == naddrs)
+            break;
+        int64_t wake = started != naddrs &&
+            (deadline < 0 || start < deadline) ? start : deadline;
+        int timedout = 0;
+        struct wsock_attempt res;
+        choose {
+        in(r->results, struct wsock_attempt, val):
+            res = val;
+        deadline(wake):
+            timedout = 1;
+        end
+        }
+        if(timedout) {
+            if(deadline >= 0 && now() >= deadline) {err = ETIMEDOUT; break;}
+            continue;
+        }
+        ++finished;
+        if(res.fd >= 0) {fd = res.fd; break;}
+        /* A failed attempt lets the next one start straight away. */
+        err = res.err;
+        start = now();
+    }
+    /* Cancel the attempts still in progress. Connections that were
+       established at the same time as the winner are closed. */
+    r->done = 1;
+    for(i = 0; i != started; ++i) {
+        if(r->fds[i] >= 0)
+            shutdown(r->fds[i], SHUT_RDWR);
+    }
+    while(finished != started) {
+        int drained = 0;
+        choose {
+        in(r->results, struct wsock_attempt, val):
+            if(val.fd >= 0) {
+                fdclean(val.fd);
+                close(val.fd);
+            }
+        otherwise:
+            drained = 1;
+        end
+        }
+        if(drained)
+            break;
+        ++finished;
+    }
+    wsock_race_release(r);
+    if(fd < 0) {errno = err; return NULL;}
+    return wsock_connect(fd, 0, subprotocol, url, NULL, NULL, 0, deadline);
+}
+
+wsock wsockconnectunix(const char *addr, const char *subprotocol,
+      const char *url, int64_t deadline) {
+    /* Check the arguments. */
+    if(!wsock_str_check(url))
+        return NULL;
+    if(subprotocol) {
+        if(!wsock_str_check(subprotocol))
+        return NULL;
+    }
+
+    /* Connecting to a Unix domain socket never blocks. */
+    unixsock us = unixconnect(addr);
+    if(errno != 0)
+        return NULL;
+    return wsock_connect(unixdetach(us), 1, subprotocol, url, NULL, NULL,
+        0, deadline);
+}
+
+wsock wsockconnecttls(ipaddr addr, const char *subprotocol, const char *url,
+      const char *host, const char *cafile, int flags, int64_t deadline) {
+#if defined WSOCK_HAVE_TLS
+    /* Check the arguments. */
+    if(!wsock_str_check(url))
+        return NULL;
+    if(subprotocol) {
+        if(!wsock_str_check(subprotocol))
+        return NULL;
+    }
+
+    int err = 0;
+    struct wsock *s = (struct wsock*)malloc(sizeof(struct wsock));
+    if(!s) {err = ENOMEM; goto err0;}
+    s->flags = WSOCK_CLIENT;
+    s->rpos = 0;
+    s->ls = NULL;
+    s->u = NULL;
+    s->us = NULL;
+    s->tlsctx = NULL;
+    s->ext = NULL;
+    s->rext = NULL;
+    s->rextcap = 0;
+    s->rchunk = NULL;
+    s->maxmsg = 0;
+    s->maxbuf = 0;
+    s->cap = NULL;
+    wsock_sched_init(&s->sched);
+    if(wsock_codec_init(&s->c, WSOCK_CODEC_CLIENT, subprotocol, url) != 0) {
+        err = errno; goto err1;}
+    struct ssl_ctx_st *ctx = wsock_tls_client(cafile, flags & WSOCK_KTLS);
+    if(!ctx) {err = errno; goto err2;}
+    tcpsock u = tcpconnect(addr, deadline);
+    if(errno != 0) {err = errno; goto err3;}
+    /* The context is reference-counted by OpenSSL and stays alive as long
+       as the connection does. */
+    s->fd = tcpdetach(u);
+    s->tr = &wsock_tls_transport;
+    s->t = wsock_tls_connect(ctx, s->fd, host, deadline);
+    if(!s->t) {err = errno; goto err3;}
+    wsock_tls_term(ctx);
+
+    if(wsock_openhandshake(s, deadline) != 0) {err = errno; goto err4;}
+    return s;
+
+err4:
+    wsockclose(s);
+    errno = err;
+    return NULL;
+err3:
+    wsock_tls_term(ctx);
+err2:
+    wsock_codec_term(&s->c);
+err1:
+    free(s);
+err0:
+    errno = err;
+    return NULL;
+#else
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+/* Creates one end of an in-memory connection. */
+static struct wsock *wsock_pipeend(void *t, int flags) {
+    struct wsock *s = (struct wsock*)malloc(sizeof(struct wsock));
+    if(!s)
+        return NULL;
+    s->tr = &wsock_pipe_transport;
+    s->t = t;
+    s->flags = flags;
+    s->rpos = 0;
+    s->ls = NULL;
+    s->fd = -1;
+    wsock_codec_init(&s->c, WSOCK_CODEC_OPEN |
+        (flags & WSOCK_CLIENT ? WSOCK_CODEC_CLIENT : 0), NULL, "/");
+    s->u = NULL;
+    s->us = NULL;
+    s->tlsctx = NULL;
+    s->ext = NULL;
+    s->rext = NULL;
+    s->rextcap = 0;
+    s->rchunk = NULL;
+    s->maxmsg = 0;
+    s->maxbuf = 0;
+    s->cap = NULL;
+    wsock_sched_init(&s->sched);
+    return s;
+}
+
+void wsockpair(wsock *client, wsock *server) {
+    void *a, *b;
+    if(wsock_pipe_make(&a, &b) != 0)
+        return;
+    struct wsock *c = wsock_pipeend(a, WSOCK_CLIENT);
+    struct wsock *s = wsock_pipeend(b, 0);
+    if(!c || !s) {
+        if(c)
+            wsockclose(c);
+        else
+            wsock_pipe_transport.close(a);
+        if(s)
+            wsockclose(s);
+        else
+            wsock_pipe_transport.close(b);
+        errno = ENOMEM;
+        return;
+    }
+    *client = c;
+    *server = s;
+    errno = 0;
+}
+
+int wsockktls(wsock s) {
+#if defined WSOCK_HAVE_TLS
+    if(s->tr == &wsock_tls_transport)
+        return wsock_tls_ktls((struct wsock_tls*)s->t);
+#endif
+    return 0;
+}
+
+int wsocksetopt(wsock s, int opt, int val) {
+    if(s->flags & WSOCK_LISTENING) {
+        if(opt <= 0 || opt >= WSOCK_NSOCKOPTS || val < 0) {
+            errno = EINVAL; return -1;}
+        s->opts[opt] = val;
+        errno = 0;
+        return 0;
+    }
+    if(s->fd < 0) {errno = ENOTSUP; return -1;}
+    return wsock_sockopt_set(s->fd, opt, val);
+}
+
+int wsockgetopt(wsock s, int opt) {
+    if(s->flags & WSOCK_LISTENING) {
+        if(opt <= 0 || opt >= WSOCK_NSOCKOPTS) {errno = EINVAL; return -1;}
+        if(s->opts[opt] < 0) {errno = ENOENT; return -1;}
+        errno = 0;
+        return s->opts[opt];
+    }
+    if(s->fd < 0) {errno = ENOTSUP; return -1;}
+    return wsock_sockopt_get(s->fd, opt);
+}
+
+int wsockprofile(wsock s, const char *name) {
+    int vals[WSOCK_NSOCKOPTS];
+    if(!name) {errno = EINVAL; return -1;}
+    if(wsock_sockopt_profile(name, vals) != 0)
+        return -1;
+    if(s->flags & WSOCK_LISTENING) {
+        int i;
+        for(i = 0; i != WSOCK_NSOCKOPTS; ++i) {
+            if(vals[i] >= 0)
+                s->opts[i] = vals[i];
+        }
+        errno = 0;
+        return 0;
+    }
+    if(s->fd < 0) {errno = ENOTSUP; return -1;}
+    return wsock_sockopt_apply(s->fd, vals);
+}
+
+int wsockmigrate(wsock s, int sock, int64_t deadline) {
+    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return -1;}
+    if(s->flags & WSOCK_BROKEN) {errno = ECONNABORTED; return -1;}
+    if(s->flags & (WSOCK_SENDING | WSOCK_FLUSHING | WSOCK_DRAINING |
+          WSOCK_RELAYIN | WSOCK_RELAYOUT)) {
+        errno = EBUSY; return -1;}
+    /* TLS session state lives in the user space and can't be moved. */
+    if(s->fd < 0 || !s->tr->peek) {errno = ENOTSUP; return -1;}
+#if defined WSOCK_HAVE_TLS
+    if(s->tr == &wsock_tls_transport) {errno = ENOTSUP; return -1;}
+#endif
+    if(wsock_handoff_init(sock) != 0)
+        return -1;
+    /* The successor starts with nothing queued for sending. */
+    if(wsock_flushcodec(s, deadline) != 0) {
         int err = errno;
-        free(masked);
+        wsock_senderr(s);
         errno = err;
+        return -1;
     }
-    else {
-        tcpsend(s->u, msg, len, deadline);
+    size_t csz = wsock_codec_save(&s->c, NULL);
+    if(!csz)
+        return -1;
+    /* Sizes are passed on as 16 and 32-bit numbers. */
+    if(csz > UINT16_MAX) {errno = EMSGSIZE; return -1;}
+    uint8_t *state = malloc(WSOCK_MIGRATE_HDRSZ + csz);
+    if(!state) {errno = ENOMEM; return -1;}
+    wsock_codec_save(&s->c, state + WSOCK_MIGRATE_HDRSZ);
+#if defined WSOCK_HAVE_URING
+    /* Wait till io_uring sends the data in the background and stop it from
+       receiving. */
+    if(s->tr == &wsock_uring_transport &&
+          wsock_uring_quiesce((struct wsock_uring*)s->t, deadline) != 0) {
+        int err = errno;
+        wsock_senderr(s);
+        free(state);
+        errno = err;
+        return -1;
+    }
+#endif
+
+    /* Collect the data received but not consumed yet. From here on
+       the connection is unusable if the migration fails. */
+    int err;
+    uint8_t *in = NULL;
+    size_t insz = 0;
+    while(1) {
+        const void *p;
+        size_t sz = s->tr->peek(s->t, &p);
+        if(!sz)
+            break;
+        if(sz > UINT32_MAX - insz) {err = EMSGSIZE; goto error;}
+        uint8_t *newin = realloc(in, insz + sz);
+        if(!newin) {err = ENOMEM; goto error;}
+        in = newin;
+        memcpy(in + insz, p, sz);
+        insz += sz;
+        /* Drops the data that was already copied. Never blocks. */
+        wsock_urecv(s, NULL, sz, deadline);
+        if(errno != 0) {err = errno; goto error;}
+    }
+
+    wsock_putl(state, WSOCK_MIGRATE_MAGIC);
+    state[4] = WSOCK_MIGRATE_VERSION;
+    state[5] = (s->flags & WSOCK_CLIENT ? 1 : 0) |
+        (s->flags & WSOCK_DONE ? 2 : 0) | (s->flags & WSOCK_RFILE ? 4 : 0);
+    wsock_putll(state + 6, s->rpos);
+    wsock_puts(state + 14, (uint16_t)csz);
+    wsock_putl(state + 16, (uint32_t)insz);
+    if(wsock_handoff_send(sock, s->fd, deadline) != 0 ||
+          wsock_handoff_write(sock, state, WSOCK_MIGRATE_HDRSZ + csz,
+              deadline) != 0 ||
+          wsock_handoff_write(sock, in, insz, deadline) != 0 ||
+          wsock_handoff_wait(sock, deadline) != 0) {
+        err = errno;
+        goto error;
+    }
+    free(in);
+    free(state);
+    /* The successor has its own copy of the socket. Closing ours doesn't
+       affect the connection. */
+    wsockclose(s);
+    errno = 0;
+    return 0;
+
+error:
+    s->flags |= WSOCK_BROKEN;
+    free(in);
+    free(state);
+    errno = err;
+    return -1;
+}
+
+wsock wsockadopt(int sock, int64_t deadline) {
+    if(wsock_handoff_init(sock) != 0)
+        return NULL;
+    int fd = wsock_handoff_recv(sock, deadline);
+    if(fd < 0)
+        return NULL;
+    int err;
+    uint8_t hdr[WSOCK_MIGRATE_HDRSZ];
+    if(wsock_handoff_read(sock, hdr, sizeof(hdr), deadline) != 0) {
+        err = errno; goto err0;}
+    if(wsock_getl(hdr) != WSOCK_MIGRATE_MAGIC ||
+          hdr[4] != WSOCK_MIGRATE_VERSION || hdr[5] & ~3) {
+        err = EPROTO; goto err0;}
+    int client = hdr[5] & 1;
+    size_t csz = wsock_gets(hdr + 14);
+    size_t insz = wsock_getl(hdr + 16);
+    uint8_t *state = malloc(csz + insz);
+    if(!state) {err = ENOMEM; goto err0;}
+    if(wsock_handoff_read(sock, state, csz + insz, deadline) != 0) {
+        err = errno; goto err1;}
+    struct wsock *s = (struct wsock*)malloc(sizeof(struct wsock));
+    if(!s) {err = ENOMEM; goto err1;}
+    s->flags = (client ? WSOCK_CLIENT : 0) | (hdr[5] & 2 ? WSOCK_DONE : 0) |
+        (hdr[5] & 4 ? WSOCK_RFILE : 0);
+    s->rpos = (size_t)wsock_getll(hdr + 6);
+    s->u = NULL;
+    s->us = NULL;
+    s->tlsctx = NULL;
+    s->ext = NULL;
+    s->rext = NULL;
+    s->rextcap = 0;
+    s->rchunk = NULL;
+    s->maxmsg = 0;
+    s->maxbuf = 0;
+    s->cap = NULL;
+    wsock_sched_init(&s->sched);
+    s->ls = NULL;
+    wsock_codec_init(&s->c, WSOCK_CODEC_OPEN |
+        (client ? WSOCK_CODEC_CLIENT : 0), NULL, NULL);
+    size_t sz = wsock_codec_load(&s->c, state, csz);
+    if(sz != csz) {err = sz ? EPROTO : errno; goto err2;}
+    /* Leftover data are replayed on top of a plain socket. io_uring could
+       pull more data from the socket in the background, which would make
+       it impossible to move the connection again. */
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int local = insz || (getsockname(fd, (struct sockaddr*)&addr,
+        &addrlen) == 0 && addr.ss_family == AF_UNIX);
+    if(wsock_attach(s, fd, local) != 0) {err = errno; fd = -1; goto err2;}
+    if(insz) {
+        void *t = wsock_replay_attach(s->tr, s->t, state + csz, insz);
+        if(!t) {err = errno; goto err3;}
+        s->tr = &wsock_replay_transport;
+        s->t = t;
+    }
+    if(wsock_handoff_ack(sock, deadline) != 0) {err = errno; goto err3;}
+    free(state);
+    errno = 0;
+    return s;
+
+err3:
+    wsockclose(s);
+    free(state);
+    errno = err;
+    return NULL;
+err2:
+    wsock_codec_term(&s->c);
+    free(s);
+err1:
+    free(state);
+err0:
+    if(fd >= 0)
+        close(fd);
+    errno = err;
+    return NULL;
+}
+
+const char *wsockurl(wsock s) {
+    return wsockcodecurl(&s->c);
+}
+
+const char *wsocksubprotocol(wsock s) {
+    if(s->flags & WSOCK_LISTENING)
+        return wsock_str_get(&s->c.protocols);
+    return wsockcodecsubprotocol(&s->c);
+}
+
+const char *wsockextension(wsock s) {
+    if(s->flags & WSOCK_LISTENING)
+        return wsock_str_get(&s->c.extensions);
+    return wsockcodecextension(&s->c);
+}
+
+const char *wsockheader(wsock s, const char *name) {
+    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return NULL;}
+    const char *value = wsock_codec_field(&s->c, name);
+    errno = value ? 0 : ENOENT;
+    return value;
+}
+
+const char *wsockheaderat(wsock s, int idx, const char **name) {
+    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return NULL;}
+    if(idx < 0) {errno = EINVAL; return NULL;}
+    const char *value = wsock_codec_fieldat(&s->c, (size_t)idx, name);
+    errno = value ? 0 : ENOENT;
+    return value;
+}
+
+void wsockfreeheaders(wsock s) {
+    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return;}
+    wsock_codec_dropfields(&s->c);
+    errno = 0;
+}
+
+size_t wsocksend(wsock s, const void *msg, size_t len, int64_t deadline) {
+    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return 0;}
+    if(s->flags & WSOCK_BROKEN) {errno = ECONNABORTED; return 0;}
+    /* No new messages after the close frame. */
+    if(s->flags & WSOCK_DONE &&
+          !(s->flags & (WSOCK_SENDING | WSOCK_FLUSHING))) {
+        errno = EPIPE; return 0;}
+    if(s->flags & WSOCK_RELAYOUT) {errno = EBUSY; return 0;}
+    /* Message interrupted by a deadline has to be finished first. */
+    if(s->flags & (WSOCK_SENDING | WSOCK_FLUSHING) && len != s->smsglen) {
+        errno = EINVAL; return 0;}
+    if(!(s->flags & WSOCK_FLUSHING)) {
+        if(!(s->flags & WSOCK_SENDING)) {
+            /* Nothing is sent until the rate limit allows for it, so
+               the deadline leaves no message half-sent. */
+            if(wsock_sched_active(&s->sched) &&
+                  wsock_sched_msg(&s->sched, deadline) != 0)
+                return 0;
+            s->smsglen = len;
+            s->sextlen = s->ext ?
+                s->ext->encode(s->extstate, msg, len, &s->sext) : 0;
+        }
+        /* Messages transformed by the extension are marked by RSV1. */
+        int rc = s->sextlen ?
+            wsock_sendmsg(s, s->sext, s->sextlen, 0x40, deadline) :
+            wsock_sendmsg(s, msg, len, 0, deadline);
+        if(rc != 0)
+            return wsock_senderr(s);
+        s->flags |= WSOCK_FLUSHING;
     }
-    if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
-    tcpflush(s->u, deadline);
-    if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
+    /* Control frames held back while the message was being sent go out
+       along with it. */
+    if(wsock_flushcodec(s, deadline) != 0)
+        return wsock_senderr(s);
+    s->flags &= ~WSOCK_FLUSHING;
+    wsock_capture(s, WSOCK_CAPOUT, 2, msg, len, len);
     return len;
 }
 
-size_t wsockrecv(wsock s, void *msg, size_t len, int64_t deadline) {
+/* Sends the body of a file-backed message by copying it in chunks through
+   the socket buffer. Client-side payload is masked on the way. */
+static int wsock_sendchunked(struct wsock *s, int fd, off_t off, size_t len,
+      int64_t deadline) {
+    uint8_t chunk[8192];
+    while(s->spos - s->shdrlen != len) {
+        size_t pos = s->spos - s->shdrlen;
+        size_t tosend = len - pos < sizeof(chunk) ? len - pos : sizeof(chunk);
+        ssize_t sz = pread(fd, chunk, tosend, off + pos);
+        if(sz < 0)
+            return -1;
+        /* File is shorter than the advertised message. */
+        if(sz == 0) {errno = EINVAL; return -1;}
+        s->c.smaskoff = pos % 4;
+        wsockcodecmask(&s->c, chunk, sz);
+        s->spos += wsock_usend(s, chunk, sz, deadline);
+        if(errno != 0)
+            return -1;
+    }
+    return 0;
+}
+
+#if defined HAVE_SYS_SENDFILE_H
+/* Moves the data from the file directly to the socket, without copying it
+   to the user space. Returns 1 if the file doesn't support this. */
+static int wsock_sendfd(struct wsock *s, int fd, off_t off, size_t len,
+      int64_t deadline) {
+    size_t sent = 0;
+    while(sent != len) {
+        ssize_t sz = sendfile(s->fd, fd, &off, len - sent);
+        if(sz < 0) {
+            if(sent == 0 && (errno == EINVAL || errno == ENOSYS))
+                return 1;
+            if(errno == EPIPE)
+                errno = ECONNRESET;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if(!fdwait(s->fd, FDW_OUT, deadline)) {
+                errno = ETIMEDOUT; return -1;}
+            continue;
+        }
+        if(sz == 0) {errno = EINVAL; return -1;}
+        sent += sz;
+        s->spos += sz;
+    }
+    return 0;
+}
+#endif
+
+/* Returns 1 if the payload of file-backed messages can be passed from
+   the file to the kernel as is, bypassing the transport's buffer. That's
+   the case for server-side payload, which is not masked. */
+static int wsock_filedirect(struct wsock *s) {
+    if(s->flags & WSOCK_CLIENT)
+        return 0;
+#if defined WSOCK_HAVE_TLS
+    /* Without SSL_sendfile() the file is read and passed to SSL_write(). */
+    if(s->tr == &wsock_tls_transport) {
+#if defined HAVE_SSL_SENDFILE
+        return wsock_tls_ktls((struct wsock_tls*)s->t);
+#else
+        return 0;
+#endif
+    }
+#endif
+#if defined HAVE_SYS_SENDFILE_H
+    return s->fd >= 0;
+#else
+    return 0;
+#endif
+}
+
+/* Passes the payload of the file-backed message being sent to the
+   transport, up to 'upto'. Returns 0 on success, -1 on error with errno
+   set. */
+static int wsock_sendfilebody(struct wsock *s, int fd, off_t off,
+      size_t upto, int64_t deadline) {
+    size_t pos = s->spos - s->shdrlen;
+    int rc = 1;
+    if(wsock_filedirect(s)) {
+#if defined WSOCK_HAVE_TLS && defined HAVE_SSL_SENDFILE
+        if(s->tr == &wsock_tls_transport) {
+            s->spos += wsock_tls_sendfile((struct wsock_tls*)s->t, fd,
+                off + pos, upto - pos, deadline);
+            rc = errno != 0 ? -1 : 0;
+        }
+        else
+#endif
+        {
+#if defined HAVE_SYS_SENDFILE_H
+            rc = wsock_sendfd(s, fd, off + pos, upto - pos, deadline);
+#endif
+        }
+    }
+    if(rc > 0)
+        rc = wsock_sendchunked(s, fd, off, upto, deadline);
+    return rc;
+}
+
+/* Like wsock_sendmsg() except that the header is already passed to
+   the transport and the payload comes from a file. */
+static int wsock_sendfilemsg(struct wsock *s, int fd, off_t off, size_t len,
+      int64_t deadline) {
+    if(!wsock_sched_active(&s->sched))
+        return wsock_sendfilebody(s, fd, off, len, deadline);
+    while(s->spos - s->shdrlen != len) {
+        size_t pos = s->spos - s->shdrlen;
+        size_t piece = wsock_sched_acquire(&s->sched, len - pos, deadline);
+        if(!piece)
+            return -1;
+        int rc = wsock_sendfilebody(s, fd, off, pos + piece, now());
+        wsock_sched_release(&s->sched, s->spos - s->shdrlen == len);
+        if(rc != 0 && (errno != ETIMEDOUT ||
+              wsock_sendfilebody(s, fd, off, pos + piece, deadline) != 0))
+            return -1;
+    }
+    return 0;
+}
+
+size_t wsocksendfile(wsock s, int fd, off_t off, size_t len,
+      int64_t deadline) {
     if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return 0;}
     if(s->flags & WSOCK_BROKEN) {errno = ECONNABORTED; return 0;}
-    size_t res = 0;
-    while(1) {
-        uint8_t hdr1[2];
-        tcprecv(s->u, hdr1, 2, deadline);
+    /* No new messages after the close frame. */
+    if(s->flags & WSOCK_DONE &&
+          !(s->flags & (WSOCK_SENDING | WSOCK_FLUSHING))) {
+        errno = EPIPE; return 0;}
+    if(s->flags & WSOCK_RELAYOUT) {errno = EBUSY; return 0;}
+    if(s->flags & (WSOCK_SENDING | WSOCK_FLUSHING) && len != s->smsglen) {
+        errno = EINVAL; return 0;}
+    if(!(s->flags & WSOCK_FLUSHING)) {
+        if(!(s->flags & WSOCK_SENDING)) {
+            /* Once the header is out, the message can't be taken back.
+               Make sure the file is long enough beforehand. Only regular
+               files have a size to check. */
+            struct stat st;
+            if(off < 0 || fstat(fd, &st) != 0) {errno = EINVAL; return 0;}
+            if(S_ISREG(st.st_mode) && (off > st.st_size ||
+                  len > (uint64_t)(st.st_size - off))) {
+                errno = EINVAL; return 0;}
+            if(wsock_sched_active(&s->sched) &&
+                  wsock_sched_msg(&s->sched, deadline) != 0)
+                return 0;
+            s->smsglen = len;
+        }
+        if(wsock_sendhdr(s, len, 0x82, deadline) != 0)
+            return wsock_senderr(s);
+        /* The header has to be flushed before the body bypasses
+           the transport's buffer. */
+        if(wsock_filedirect(s)) {
+            wsock_uflush(s, deadline);
+            if(errno != 0)
+                return wsock_senderr(s);
+#if defined WSOCK_HAVE_URING
+            /* The header may still be in flight. */
+            if(s->tr == &wsock_uring_transport && wsock_uring_drain(
+                  (struct wsock_uring*)s->t, deadline) != 0)
+                return wsock_senderr(s);
+#endif
+        }
+        if(wsock_sendfilemsg(s, fd, off, len, deadline) != 0)
+            return wsock_senderr(s);
+        s->flags &= ~WSOCK_SENDING;
+        s->flags |= WSOCK_FLUSHING;
+    }
+    if(wsock_flushcodec(s, deadline) != 0)
+        return wsock_senderr(s);
+    s->flags &= ~WSOCK_FLUSHING;
+    wsock_capture(s, WSOCK_CAPOUT, 2, NULL, 0, len);
+    return len;
+}
+
+/* Finds where the byte at offset 'off' of the message being received goes
+   in the user's buffers. Returns the number of bytes that can be stored
+   there contiguously, 0 if the buffers end before 'off'. */
+static size_t wsock_iovat(const struct iovec *iov, int iovcnt, size_t off,
+      uint8_t **dst) {
+    int i;
+    for(i = 0; i != iovcnt; ++i) {
+        if(off < iov[i].iov_len) {
+            *dst = (uint8_t*)iov[i].iov_base + off;
+            return iov[i].iov_len - off;
+        }
+        off -= iov[i].iov_len;
+    }
+    return 0;
+}
+
+/* Stores data into the user's buffers starting at offset 'off' of
+   the message. What doesn't fit is dropped. The data may already be in
+   place. */
+static void wsock_iovput(const struct iovec *iov, int iovcnt, size_t off,
+      const uint8_t *data, size_t len) {
+    while(len) {
+        uint8_t *dst;
+        size_t room = wsock_iovat(iov, iovcnt, off, &dst);
+        if(!room)
+            return;
+        if(room > len)
+            room = len;
+        memmove(dst, data, room);
+        data += room;
+        len -= room;
+        off += room;
+    }
+}
+
+/* Deals with a failure to receive. If it was the deadline, the bytes
+   received so far are passed to the codec and the payload among them is
+   stored in the user's buffers so that the next call can continue where
+   this one stopped. Any other error breaks the connection. */
+static size_t wsock_recverr(struct wsock *s, uint8_t *buf, size_t sz,
+      const struct iovec *iov, int iovcnt) {
+    if(errno != ETIMEDOUT) {s->flags |= WSOCK_BROKEN; return 0;}
+    while(sz) {
+        struct wsockevent ev;
+        size_t fed = wsockcodecfeed(&s->c, buf, sz, &ev);
         if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
-        if(hdr1[0] & 0x70) {
-            s->flags &= WSOCK_BROKEN; errno = EPROTO; return 0;}
-        int opcode = hdr1[0] & 0x0f;
-        if(opcode == 8) {
-            if(!(s->flags & WSOCK_DONE)) {
-                /* TODO: Close frames from client should be masked. */
-                tcpsend(s->u, "\x88\x00", 2, deadline);
-                tcpflush(s->u, deadline);
-                s->flags |= (WSOCK_BROKEN & WSOCK_DONE);
+        /* The frame is incomplete, so it can only be a piece of payload.
+           Payload of a transformed message was read into 'rext' in place. */
+        if(ev.type == WSOCK_DATA) {
+            if(!(s->flags & WSOCK_REXT))
+                wsock_iovput(iov, iovcnt, s->rpos, ev.data, ev.len);
+            s->rpos += ev.len;
+        }
+        buf += fed;
+        sz -= fed;
+    }
+    errno = ETIMEDOUT;
+    return 0;
+}
+
+/* The peer has exceeded a limit. The connection is closed straight away:
+   the close frame with the status code goes out if that can be done without
+   waiting and the socket is shut down so that nothing more is read. */
+static size_t wsock_overlimit(struct wsock *s, int code, int err) {
+    if(!(s->flags & WSOCK_SENDING) && wsock_codec_close(&s->c, code) == 0)
+        wsock_flushcodec(s, now());
+    if(s->fd >= 0)
+        shutdown(s->fd, SHUT_RDWR);
+    s->flags |= WSOCK_BROKEN | WSOCK_DONE;
+    errno = err;
+    return 0;
+}
+
+/* Makes room in 'rext' for the next 'sz' bytes of payload. */
+static int wsock_rextgrow(struct wsock *s, size_t sz) {
+    if(sz > WSOCK_MAXEXTMSG - s->rpos ||
+          (s->maxbuf && sz > s->maxbuf - s->rpos)) {
+        errno = EMSGSIZE; return -1;}
+    if(s->rpos + sz <= s->rextcap)
+        return 0;
+    size_t cap = s->rextcap ? s->rextcap : 4096;
+    while(cap < s->rpos + sz)
+        cap *= 2;
+    if(wsock_budget_take(cap - s->rextcap) != 0)
+        return -1;
+    uint8_t *rext = realloc(s->rext, cap);
+    if(!rext) {
+        wsock_budget_give(cap - s->rextcap);
+        errno = ENOMEM;
+        return -1;
+    }
+    s->rext = rext;
+    s->rextcap = cap;
+    return 0;
+}
+
+/* Decodes a transformed message into the user's buffers. The extension
+   needs a contiguous buffer so the message is decoded to a temporary one
+   first. */
+static size_t wsock_decodev(struct wsock *s, size_t sz,
+      const struct iovec *iov, int iovcnt, size_t total) {
+    uint8_t *tmp = malloc(total ? total : 1);
+    if(!tmp) {errno = ENOMEM; return 0;}
+    errno = 0;
+    size_t res = s->ext->decode(s->extstate, s->rext, sz, tmp, total);
+    if(errno == 0)
+        wsock_iovput(iov, iovcnt, 0, tmp, res < total ? res : total);
+    free(tmp);
+    return res;
+}
+
+/* Handles a control frame received while waiting for a message. Returns -1
+   and sets errno if the receiving function should return. */
+static int wsock_recvctl(struct wsock *s, const struct wsockevent *ev,
+      int64_t deadline) {
+    switch(ev->type) {
+    case WSOCK_PING:
+        wsock_capture(s, WSOCK_CAPIN, 9, ev->data, ev->len, ev->len);
+        /* The codec has queued the pong. If a message or the close
+           frame is being sent it will go out once that's done. */
+        if(s->flags & (WSOCK_SENDING | WSOCK_DRAINING)) {
+            /* Don't let the peer pile up pongs. */
+            const void *p;
+            if(s->maxbuf && wsockcodecpending(&s->c, &p) > s->maxbuf) {
+                wsock_overlimit(s, WSOCK_TOOBIG, EMSGSIZE);
+                return -1;
             }
-            errno = ECONNRESET;
             return 0;
         }
-        if(opcode == 9) {
-            /* TODO: Account for pings and pongs with payload. */
-            if(!(s->flags & WSOCK_DONE)) {
-                tcpsend(s->u, "\x8A\x00", 2, deadline);
-                if(errno != 0) {s->flags &= WSOCK_BROKEN; return 0;}
-                tcpflush(s->u, deadline);
-                if(errno != 0) {s->flags &= WSOCK_BROKEN; return 0;}
+        if(wsock_flushcodec(s, deadline) != 0) {
+            wsock_senderr(s);
+            return -1;
+        }
+        return 0;
+    case WSOCK_PONG:
+        wsock_capture(s, WSOCK_CAPIN, 10, ev->data, ev->len, ev->len);
+        /* TODO: Do we want to make exiting the function here optional? */
+        errno = EAGAIN;
+        return -1;
+    case WSOCK_CLOSE:
+        wsock_capture(s, WSOCK_CAPIN, 8, ev->data, ev->len, ev->len);
+        /* The codec has queued the reply unless wsockdone() was already
+           called. */
+        if(!(s->flags & (WSOCK_SENDING | WSOCK_DRAINING)))
+            wsock_flushcodec(s, deadline);
+        s->flags |= WSOCK_DONE;
+        errno = ECONNRESET;
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+/* Receives a message into the user's buffers. Returns the full size of
+   the message; what doesn't fit into the buffers is dropped. */
+static size_t wsock_recv(struct wsock *s, const struct iovec *iov,
+      int iovcnt, int64_t deadline) {
+    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return 0;}
+    if(s->flags & WSOCK_BROKEN) {errno = ECONNABORTED; return 0;}
+    if(s->flags & (WSOCK_RELAYIN | WSOCK_RFILE)) {errno = EBUSY; return 0;}
+    /* A single buffer is the common case. Small messages take the fast
+       path only then. */
+    void *msg = iovcnt == 1 ? iov[0].iov_base : NULL;
+    size_t len = iovcnt == 1 ? iov[0].iov_len : 0;
+    size_t total = 0;
+    int i;
+    for(i = 0; i != iovcnt; ++i)
+        total += iov[i].iov_len;
+    uint8_t buf[256];
+    while(1) {
+        uint8_t *dst = buf;
+        size_t sz;
+        if(iovcnt == 1 && s->rpos == 0 &&
+              s->c.state == WSOCK_CODEC_HEADER && s->c.hdrlen == 0) {
+            /* Fast path for small messages. If the whole frame was already
+               buffered by the transport, decode it in one go. Otherwise get
+               the first two bytes and, if they turn out to start a small
+               frame, read the rest of it at once. */
+            size_t msgsz;
+            if(s->tr->peek) {
+                const void *p;
+                size_t avail = s->tr->peek(s->t, &p);
+                sz = wsock_codec_frame(&s->c, p, avail, msg, len, &msgsz);
+                if(sz) {
+                    wsock_urecv(s, NULL, sz, deadline);
+                    if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
+                    if(s->maxmsg && msgsz > s->maxmsg)
+                        return wsock_overlimit(s, WSOCK_TOOBIG, EMSGSIZE);
+                    return msgsz;
+                }
+            }
+            sz = wsock_urecv(s, buf, 2, deadline);
+            if(errno != 0)
+                return wsock_recverr(s, buf, sz, iov, iovcnt);
+            size_t framesz = wsock_codec_smallsize(&s->c, buf);
+            if(framesz) {
+                sz = wsock_urecv(s, buf + 2, framesz - 2, deadline);
+                if(errno != 0)
+                    return wsock_recverr(s, buf, 2 + sz, iov, iovcnt);
+                wsock_codec_frame(&s->c, buf, framesz, msg, len, &msgsz);
+                if(s->maxmsg && msgsz > s->maxmsg)
+                    return wsock_overlimit(s, WSOCK_TOOBIG, EMSGSIZE);
+                errno = 0;
+                return msgsz;
             }
-            continue;
         }
-        if(opcode == 10) {
-            /* TODO: Account for pings and pongs with payload. */
-            /* TODO: Do we want to make exiting the function here optional? */
-            errno = EAGAIN;
-            return 0;
+        else {
+            /* Read exactly as much as the codec asks for. Message payload
+               goes directly to the user's buffer. Whatever doesn't fit is
+               read into the scratch buffer and dropped. */
+            sz = wsockcodecwant(&s->c);
+            if(sz == 0) {errno = ECONNRESET; return 0;}
+            /* The frame header tells how large the message is going to be
+               so we can refuse it before reading any of the payload. */
+            if(s->c.state == WSOCK_CODEC_PAYLOAD && s->maxmsg &&
+                  s->c.remaining > s->maxmsg - s->rpos)
+                return wsock_overlimit(s, WSOCK_TOOBIG, EMSGSIZE);
+            /* RSV1 on the first frame marks a message transformed by
+               the extension. Such a message is collected as a whole. */
+            if(s->c.state == WSOCK_CODEC_PAYLOAD && s->c.hdr[0] & 0x40)
+                s->flags |= WSOCK_REXT;
+            if(s->c.state == WSOCK_CODEC_PAYLOAD && s->flags & WSOCK_REXT) {
+                if(wsock_rextgrow(s, sz) != 0)
+                    return wsock_overlimit(s, errno == EMSGSIZE ?
+                        WSOCK_TOOBIG : WSOCK_TRYLATER, errno);
+                dst = s->rext + s->rpos;
+            }
+            else if(s->c.state == WSOCK_CODEC_PAYLOAD && s->rpos < total) {
+                size_t room = wsock_iovat(iov, iovcnt, s->rpos, &dst);
+                if(sz > room)
+                    sz = room;
+            }
+            else if(sz > sizeof(buf)) {
+                sz = sizeof(buf);
+            }
+            sz = wsock_urecv(s, dst, sz, deadline);
+            if(errno != 0)
+                return wsock_recverr(s, dst, sz, iov, iovcnt);
         }
-        if(!!(s->flags & WSOCK_CLIENT) ^ !(hdr1[1] & 0x80)) {
-            s->flags &= WSOCK_BROKEN; errno = EPROTO; return 0;}
-        size_t sz = hdr1[1] & 0x7f;
-        if(sz == 126) {
-            uint8_t hdr2[2];
-            tcprecv(s->u, hdr2, 2, deadline);
-            if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
-            sz = wsock_gets(hdr2);
+        struct wsockevent ev;
+        wsockcodecfeed(&s->c, dst, sz, &ev);
+        if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
+        switch(ev.type) {
+        case WSOCK_DATA:
+            if(ev.rsv)
+                s->flags |= WSOCK_REXT;
+            s->rpos += ev.len;
+            if(ev.last) {
+                size_t res = s->rpos;
+                s->rpos = 0;
+                if(s->flags & WSOCK_REXT) {
+                    s->flags &= ~WSOCK_REXT;
+                    errno = 0;
+                    res = iovcnt == 1 ?
+                        s->ext->decode(s->extstate, s->rext, res, msg, len) :
+                        wsock_decodev(s, res, iov, iovcnt, total);
+                    if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
+                }
+                errno = 0;
+                return res;
+            }
+            break;
+        case WSOCK_PING:
+        case WSOCK_PONG:
+        case WSOCK_CLOSE:
+            if(wsock_recvctl(s, &ev, deadline) != 0)
+                return 0;
+            break;
         }
-        else if(sz == 127) {
-            uint8_t hdr2[8];
-            tcprecv(s->u, hdr2, 8, deadline);
+    }
+}
+
+size_t wsockrecv(wsock s, void *msg, size_t len, int64_t deadline) {
+    struct iovec iov = {msg, len};
+    size_t sz = wsock_recv(s, &iov, 1, deadline);
+    if(errno == 0)
+        wsock_capture(s, WSOCK_CAPIN, 2, msg, sz < len ? sz : len, sz);
+    return sz;
+}
+
+size_t wsockrecvv(wsock s, const struct iovec *iov, int iovcnt,
+      int64_t deadline) {
+    if(iovcnt < 1 || !iov) {errno = EINVAL; return 0;}
+    size_t sz = wsock_recv(s, iov, iovcnt, deadline);
+    if(errno != 0)
+        return sz;
+    /* Only the part in the first buffer is recorded. */
+    wsock_capture(s, WSOCK_CAPIN, 2, iov[0].iov_base,
+        sz < iov[0].iov_len ? sz : iov[0].iov_len, sz);
+    size_t total = 0;
+    int i;
+    for(i = 0; i != iovcnt; ++i)
+        total += iov[i].iov_len;
+    if(sz > total)
+        errno = EOVERFLOW;
+    return sz;
+}
+
+int wsockrecvmany(wsock s, struct wsockmsg *msgs, int nmsgs,
+      int64_t deadline) {
+    if(nmsgs < 1) {errno = EINVAL; return 0;}
+    /* Only the first message is waited for. Unlike wsockrecv(), a pong
+       doesn't end the wait. */
+    size_t sz;
+    while(1) {
+        sz = wsockrecv(s, msgs[0].buf, msgs[0].len, deadline);
+        if(errno != EAGAIN)
+            break;
+    }
+    if(errno != 0)
+        return 0;
+    msgs[0].size = sz;
+    /* Then take all the complete messages the transport has already
+       buffered. Anything else, e.g. a control frame or a message that was
+       received only partially, is left to the next call. */
+    int i = 1;
+    if(s->tr->peek) {
+        for(; i != nmsgs; ++i) {
+            const void *p;
+            size_t avail = s->tr->peek(s->t, &p);
+            sz = wsock_codec_frame(&s->c, p, avail, msgs[i].buf, msgs[i].len,
+                &msgs[i].size);
+            if(!sz)
+                break;
+            /* The messages received so far are returned. The one over
+               the limit is left for the next call to report. */
+            if(s->maxmsg && msgs[i].size > s->maxmsg)
+                break;
+            /* Drops the data that was already copied. Never blocks. */
+            wsock_urecv(s, NULL, sz, deadline);
             if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
-            sz = wsock_getll(hdr2);
+            wsock_capture(s, WSOCK_CAPIN, 2, msgs[i].buf,
+                msgs[i].size < msgs[i].len ? msgs[i].size : msgs[i].len,
+                msgs[i].size);
         }
-        uint8_t mask[4];
-        if(!(s->flags & WSOCK_CLIENT)) {
-            tcprecv(s->u, mask, 4, deadline);
-            if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
+    }
+    errno = 0;
+    return i;
+}
+
+/* Writes the whole buffer to the file at the given offset. */
+static int wsock_pwriteall(int fd, const uint8_t *buf, size_t len,
+      off_t off) {
+    while(len) {
+        ssize_t sz = pwrite(fd, buf, len, off);
+        if(sz < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
         }
-        size_t toread = sz < len ? sz : len;
-        if(toread > 0) {
-            tcprecv(s->u, msg, toread, deadline);
-            if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
+        buf += sz;
+        len -= sz;
+        off += sz;
+    }
+    return 0;
+}
+
+/* Receives the next piece of payload into the chunk buffer, unmasks it and
+   writes it to the file. Returns 1 if that completes the message. Whatever
+   was received before a failure is written out as well. */
+static int wsock_recvchunk(struct wsock *s, int fd, off_t off, size_t len,
+      int64_t deadline) {
+    if(len > WSOCK_FILECHUNK)
+        len = WSOCK_FILECHUNK;
+    size_t sz = wsock_urecv(s, s->rchunk, len, deadline);
+    int err = errno;
+    struct wsockevent ev;
+    wsockcodecfeed(&s->c, s->rchunk, sz, &ev);
+    if(errno != 0)
+        return -1;
+    if(wsock_pwriteall(fd, s->rchunk, sz, off + s->rpos) != 0)
+        return -1;
+    s->rpos += sz;
+    if(err != 0) {errno = err; return -1;}
+    return ev.last;
+}
+
+#if defined HAVE_SPLICE
+/* Moves the next piece of unmasked payload from the socket to the file
+   through a pipe, without copying it to the user space. Returns 1 if that
+   completes the message. If the file doesn't support splicing, the data
+   are taken out of the pipe, written the usual way, and the pipe is closed
+   so that the rest of the message goes through the chunk buffer. */
+static int wsock_splicechunk(struct wsock *s, int fd, off_t off, size_t len,
+      int p[2], int64_t deadline) {
+    if(len > WSOCK_SPLICECHUNK)
+        len = WSOCK_SPLICECHUNK;
+    ssize_t sz;
+    while(1) {
+        sz = splice(s->fd, NULL, p[1], NULL, len,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(sz > 0)
+            break;
+        if(sz == 0) {errno = ECONNRESET; return -1;}
+        if(errno == EINTR)
+            continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(!fdwait(s->fd, FDW_IN, deadline)) {errno = ETIMEDOUT; return -1;}
+    }
+    /* The data have left the socket. They must end up in the file. */
+    int last = wsock_codec_skip(&s->c, sz);
+    size_t done = 0;
+    while(done != (size_t)sz) {
+        loff_t pos = off + s->rpos + done;
+        ssize_t rc = splice(p[0], NULL, fd, &pos, sz - done, SPLICE_F_MOVE);
+        if(rc >= 0) {
+            done += rc;
+            continue;
         }
-        if(!(s->flags & WSOCK_CLIENT)) {
-            size_t i;
-            for(i = 0; i != toread; ++i)
-                ((uint8_t*)msg)[i] ^= mask[i % 4];
+        if(errno == EINTR)
+            continue;
+        if(errno != EINVAL)
+            return -1;
+        while(done != (size_t)sz) {
+            rc = read(p[0], s->rchunk, sz - done < WSOCK_FILECHUNK ?
+                sz - done : WSOCK_FILECHUNK);
+            if(rc < 0 && errno == EINTR)
+                continue;
+            if(rc <= 0 || wsock_pwriteall(fd, s->rchunk, rc,
+                  off + s->rpos + done) != 0)
+                return -1;
+            done += rc;
         }
-        if(sz > toread) {
-            tcprecv(s->u, NULL, sz - toread, deadline);
-            if(errno != 0) {s->flags |= WSOCK_BROKEN; return 0;}
+        close(p[0]);
+        close(p[1]);
+        p[0] = p[1] = -1;
+    }
+    s->rpos += sz;
+    errno = 0;
+    return last;
+}
+#endif
+
+/* The first frame of a transformed message has no payload. If there are
+   more frames the message is left to wsockrecv(). An empty transformed
+   message is decoded right away. */
+static size_t wsock_recvfileext(struct wsock *s, int fd, off_t off,
+      const struct wsockevent *ev) {
+    s->flags |= WSOCK_REXT;
+    if(!ev->last) {errno = ENOTSUP; return 0;}
+    s->flags &= ~WSOCK_REXT;
+    errno = 0;
+    size_t sz = s->ext->decode(s->extstate, s->rext, 0, s->rchunk,
+        WSOCK_FILECHUNK);
+    if(errno == 0 && sz > WSOCK_FILECHUNK)
+        errno = EMSGSIZE;
+    if(errno != 0 || wsock_pwriteall(fd, s->rchunk, sz, off) != 0) {
+        s->flags |= WSOCK_BROKEN;
+        return 0;
+    }
+    errno = 0;
+    return sz;
+}
+
+static size_t wsock_recvfile(struct wsock *s, int fd, off_t off, int p[2],
+      int64_t deadline) {
+    while(1) {
+        int rc;
+        if(s->c.state == WSOCK_CODEC_PAYLOAD) {
+            /* RSV1 on the first frame marks a message transformed by the
+               extension. It's refused before any of the payload is read
+               so that wsockrecv() can still get it. */
+            if(s->c.hdr[0] & 0x40 || s->flags & WSOCK_REXT) {
+                s->flags |= WSOCK_REXT;
+                errno = ENOTSUP;
+                return 0;
+            }
+            if(s->maxmsg && s->c.remaining > s->maxmsg - s->rpos)
+                return wsock_overlimit(s, WSOCK_TOOBIG, EMSGSIZE);
+            size_t sz = wsockcodecwant(&s->c);
+#if defined HAVE_SPLICE
+            /* Splice only once the data buffered by the transport are
+               used up. */
+            const void *buf;
+            if(p[0] >= 0 && s->tr->peek(s->t, &buf) == 0)
+                rc = wsock_splicechunk(s, fd, off, sz, p, deadline);
+            else
+#endif
+            rc = wsock_recvchunk(s, fd, off, sz, deadline);
+            if(s->rpos)
+                s->flags |= WSOCK_RFILE;
+            if(rc < 0) {
+                if(errno != ETIMEDOUT)
+                    s->flags |= WSOCK_BROKEN;
+                return 0;
+            }
+            if(rc > 0)
+                break;
+            continue;
         }
-        res += sz;
-        if(hdr1[0] & 0x80)
-            break;
-        msg = ((uint8_t*)msg) + sz;
-        len -= sz;
+        /* Frame headers and control frames. Exactly as much as the codec
+           asks for is read so an incomplete read just leaves it waiting
+           for the rest. */
+        uint8_t buf[256];
+        size_t sz = wsockcodecwant(&s->c);
+        if(sz == 0) {errno = ECONNRESET; return 0;}
+        if(sz > sizeof(buf))
+            sz = sizeof(buf);
+        sz = wsock_urecv(s, buf, sz, deadline);
+        int err = errno;
+        struct wsockevent ev;
+        wsockcodecfeed(&s->c, buf, sz, &ev);
+        if(errno != 0 || err != 0) {
+            if(errno == 0)
+                errno = err;
+            if(errno != ETIMEDOUT)
+                s->flags |= WSOCK_BROKEN;
+            return 0;
+        }
+        /* A frame with no payload. */
+        if(ev.type == WSOCK_DATA && ev.rsv)
+            return wsock_recvfileext(s, fd, off, &ev);
+        if(ev.type == WSOCK_DATA) {
+            if(ev.last)
+                break;
+            continue;
+        }
+        if(wsock_recvctl(s, &ev, deadline) != 0)
+            return 0;
     }
+    size_t res = s->rpos;
+    s->rpos = 0;
+    s->flags &= ~WSOCK_RFILE;
+    errno = 0;
     return res;
 }
 
+size_t wsockrecvfile(wsock s, int fd, off_t off, int64_t deadline) {
+    if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return 0;}
+    if(s->flags & WSOCK_BROKEN) {errno = ECONNABORTED; return 0;}
+    if(s->flags & WSOCK_RELAYIN) {errno = EBUSY; return 0;}
+    /* A message partially received by wsockrecv() has to be finished
+       there. */
+    if(s->rpos && !(s->flags & WSOCK_RFILE)) {errno = EBUSY; return 0;}
+    if(off < 0) {errno = EINVAL; return 0;}
+    if(!s->rchunk) {
+        if(wsock_budget_take(WSOCK_FILECHUNK) != 0)
+            return 0;
+        void *chunk;
+        int rc = posix_memalign(&chunk, sysconf(_SC_PAGESIZE),
+            WSOCK_FILECHUNK);
+        if(rc != 0) {
+            wsock_budget_give(WSOCK_FILECHUNK);
+            errno = rc;
+            return 0;
+        }
+        s->rchunk = chunk;
+    }
+    int p[2] = {-1, -1};
+#if defined HAVE_SPLICE
+    /* Client-side payload is not masked so it can be moved from the socket
+       to the file by the kernel. That's only possible with a plain
+       socket. */
+    if(s->flags & WSOCK_CLIENT && s->tr == &wsock_fd_transport &&
+          pipe2(p, O_NONBLOCK | O_CLOEXEC) != 0)
+        p[0] = p[1] = -1;
+    /* Larger pipe means fewer system calls. If it can't be resized it's
+       just less efficient. */
+    if(p[0] >= 0)
+        fcntl(p[1], F_SETPIPE_SZ, WSOCK_SPLICECHUNK);
+#endif
+    size_t sz = wsock_recvfile(s, fd, off, p, deadline);
+    int err = errno;
+    if(p[0] >= 0) {
+        close(p[0]);
+        close(p[1]);
+    }
+    errno = err;
+    if(errno == 0)
+        /* Payload goes straight to the file and isn't captured. */
+        wsock_capture(s, WSOCK_CAPIN, 2, NULL, 0, sz);
+    return sz;
+}
+
+/* Relaying failed. Unless it was the deadline, neither connection can go
+   on: a message may have been cut short on one and can't be finished on
+   the other. */
+static size_t wsock_relayerr(struct wsock *src, struct wsock *dst) {
+    if(errno != ETIMEDOUT) {
+        src->flags |= WSOCK_BROKEN;
+        dst->flags |= WSOCK_BROKEN;
+    }
+    return 0;
+}
+
+/* Sends whatever the codec has queued unless a frame is being sent on
+   the connection, in which case it goes out once that's done. */
+static int wsock_relayctl(struct wsock *s, int64_t deadline) {
+    if(s->flags & (WSOCK_SENDING | WSOCK_DRAINING))
+        return 0;
+    return wsock_flushcodec(s, deadline);
+}
+
+size_t wsockrelay(wsock src, wsock dst, int64_t deadline) {
+    if((src->flags | dst->flags) & WSOCK_LISTENING) {
+        errno = EOPNOTSUPP; return 0;}
+    if((src->flags | dst->flags) & WSOCK_BROKEN) {
+        errno = ECONNABORTED; return 0;}
+    if(src == dst) {errno = EINVAL; return 0;}
+    if(!(src->flags & WSOCK_RELAYIN)) {
+        /* The message was forwarded as a whole but the deadline expired
+           before it was flushed. */
+        if(dst->flags & WSOCK_RELAYOUT) {
+            if(!(dst->flags & WSOCK_FLUSHING)) {errno = EBUSY; return 0;}
+            goto flush;
+        }
+        /* Neither side may be in the middle of a message of its own. */
+        if(src->rpos || src->c.state == WSOCK_CODEC_PAYLOAD ||
+              dst->flags & (WSOCK_SENDING | WSOCK_FLUSHING)) {
+            errno = EBUSY; return 0;}
+        /* Messages transformed by an extension are passed on as they are
+           so both sides must have agreed on the same one. */
+        const char *e1 = wsockcodecextension(&src->c);
+        const char *e2 = wsockcodecextension(&dst->c);
+        if((e1 || e2) && (!e1 || !e2 || strcmp(e1, e2) != 0)) {
+            errno = ENOTSUP; return 0;}
+    }
+    else if(!(dst->flags & WSOCK_RELAYOUT)) {
+        errno = EBUSY; return 0;
+    }
+    uint8_t chunk[16384];
+    while(1) {
+        if(dst->flags & WSOCK_SENDING) {
+            /* Forward the frame in bounded chunks. Every chunk taken from
+               'src' is passed on before the next one is read so that
+               a deadline leaves both sides at the same position. */
+            if(wsock_sendhdr(dst, dst->slen, dst->shdr[0], deadline) != 0)
+                return wsock_relayerr(src, dst);
+            while(dst->spos - dst->shdrlen != dst->slen) {
+                size_t sz = dst->slen - (dst->spos - dst->shdrlen);
+                if(sz > sizeof(chunk))
+                    sz = sizeof(chunk);
+                sz = wsock_urecv(src, chunk, sz, deadline);
+                int err = errno;
+                if(sz) {
+                    wsock_codec_relay(&src->c, &dst->c, chunk, sz);
+                    size_t sent = wsock_usend(dst, chunk, sz, deadline);
+                    dst->spos += sent;
+                    if(errno != 0) {
+                        /* The rest of the chunk would be lost. */
+                        if(sent != sz) {
+                            src->flags |= WSOCK_BROKEN;
+                            dst->flags |= WSOCK_BROKEN;
+                            return 0;
+                        }
+                        return wsock_relayerr(src, dst);
+                    }
+                }
+                if(err != 0) {
+                    errno = err;
+                    return wsock_relayerr(src, dst);
+                }
+            }
+            dst->flags &= ~WSOCK_SENDING;
+            if(dst->shdr[0] & 0x80) {
+                src->flags &= ~WSOCK_RELAYIN;
+                dst->flags |= WSOCK_FLUSHING;
+                /* Payload passes through in chunks and isn't captured. */
+                wsock_capture(src, WSOCK_CAPIN, 2, NULL, 0, dst->smsglen);
+                wsock_capture(dst, WSOCK_CAPOUT, 2, NULL, 0, dst->smsglen);
+                goto flush;
+            }
+            /* Fragments are flushed one by one, along with the control
+               frames held back while they were being sent. */
+            if(wsock_flushcodec(dst, deadline) != 0)
+                return wsock_relayerr(src, dst);
+            continue;
+        }
+        /* Read the next frame header or control frame. Whatever arrives
+           before the deadline is fed to the codec. */
+        uint8_t buf[256];
+        size_t sz = wsockcodecwant(&src->c);
+        if(sz == 0) {errno = ECONNRESET; return 0;}
+        if(sz > sizeof(buf))
+            sz = sizeof(buf);
+        sz = wsock_urecv(src, buf, sz, deadline);
+        int err = errno;
+        struct wsockevent ev;
+        wsockcodecfeed(&src->c, buf, sz, &ev);
+        if(errno != 0 || err != 0) {
+            if(errno == 0)
+                errno = err;
+            return wsock_relayerr(src, dst);
+        }
+        switch(ev.type) {
+        case WSOCK_NONE:
+        case WSOCK_DATA:
+            /* Wait till the header is complete. A frame with no payload is
+               reported straight away. */
+            if(ev.type == WSOCK_NONE && src->c.state != WSOCK_CODEC_PAYLOAD)
+                break;
+            sz = ev.type == WSOCK_DATA ? 0 : src->c.remaining;
+            /* Control frames can still be passed on after the close frame
+               was sent, messages can't. */
+            if(dst->flags & WSOCK_DONE) {
+                errno = EPIPE;
+                return wsock_relayerr(src, dst);
+            }
+            if(!(src->flags & WSOCK_RELAYIN)) {
+                src->flags |= WSOCK_RELAYIN;
+                dst->flags |= WSOCK_RELAYOUT;
+                dst->smsglen = 0;
+            }
+            if(src->maxmsg && sz > src->maxmsg - dst->smsglen) {
+                wsock_overlimit(src, WSOCK_TOOBIG, EMSGSIZE);
+                return wsock_relayerr(src, dst);
+            }
+            dst->smsglen += sz;
+            /* The frame is passed on with the same flags and opcode. */
+            if(wsock_sendhdr(dst, sz, src->c.hdr[0], deadline) != 0)
+                return wsock_relayerr(src, dst);
+            break;
+        case WSOCK_PING:
+        case WSOCK_PONG:
+            wsock_capture(src, WSOCK_CAPIN, ev.type == WSOCK_PING ? 9 : 10,
+                ev.data, ev.len, ev.len);
+            wsock_capture(dst, WSOCK_CAPOUT, ev.type == WSOCK_PING ? 9 : 10,
+                ev.data, ev.len, ev.len);
+            /* The codec has queued the pong. Control frames are passed on
+               between the frames of the message. */
+            if(wsock_relayctl(src, deadline) != 0 ||
+                  wsock_codec_ctl(&dst->c, ev.type == WSOCK_PING ?
+                  0x09 : 0x0a, ev.data, ev.len) != 0 ||
+                  wsock_relayctl(dst, deadline) != 0)
+                return wsock_relayerr(src, dst);
+            break;
+        case WSOCK_CLOSE:
+            wsock_capture(src, WSOCK_CAPIN, 8, ev.data, ev.len, ev.len);
+            wsock_capture(dst, WSOCK_CAPOUT, 8, ev.data, ev.len, ev.len);
+            /* The close frame is passed on, status code included. */
+            src->flags |= WSOCK_DONE;
+            src->flags &= ~WSOCK_RELAYIN;
+            dst->flags &= ~WSOCK_RELAYOUT;
+            wsock_relayctl(src, deadline);
+            if(wsock_codec_ctl(&dst->c, 0x08, ev.data, ev.len) == 0)
+                wsock_relayctl(dst, deadline);
+            dst->flags |= WSOCK_DONE;
+            errno = ECONNRESET;
+            return 0;
+        }
+    }
+flush:
+    if(wsock_flushcodec(dst, deadline) != 0)
+        return wsock_relayerr(src, dst);
+    dst->flags &= ~(WSOCK_FLUSHING | WSOCK_RELAYOUT);
+    errno = 0;
+    return dst->smsglen;
+}
+
+/* Sends the control frame queued by the codec unless a message is being
+   sent, in which case it goes out once that's done. */
+static void wsock_sendctl(struct wsock *s, int64_t deadline) {
+    if(errno == 0 && !(s->flags & WSOCK_SENDING))
+        wsock_flushcodec(s, deadline);
+    if(errno != 0 && errno != ETIMEDOUT)
+        s->flags |= WSOCK_BROKEN;
+    errno = 0;
+}
+
 void wsockping(wsock s, int64_t deadline) {
     if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return;}
     if(s->flags & (WSOCK_BROKEN | WSOCK_DONE)) {errno = ECONNABORTED; return;}
-    tcpsend(s->u, "\x89\x00", 2, deadline);
-    if(errno != 0) {s->flags |= WSOCK_BROKEN;}
-    tcpflush(s->u, deadline);
-    if(errno != 0) {s->flags |= WSOCK_BROKEN;}
-    errno = 0;
+    wsockcodecping(&s->c);
+    wsock_capture(s, WSOCK_CAPOUT, 9, NULL, 0, 0);
+    wsock_sendctl(s, deadline);
 }
 
 void wsockpong(wsock s, int64_t deadline) {
     if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return;}
     if(s->flags & (WSOCK_BROKEN | WSOCK_DONE)) {errno = ECONNABORTED; return;}
-    tcpsend(s->u, "\x8A\x00", 2, deadline);
-    if(errno != 0) {s->flags |= WSOCK_BROKEN;}
-    tcpflush(s->u, deadline);
-    if(errno != 0) {s->flags |= WSOCK_BROKEN;}
-    errno = 0;
+    wsockcodecpong(&s->c);
+    wsock_capture(s, WSOCK_CAPOUT, 10, NULL, 0, 0);
+    wsock_sendctl(s, deadline);
 }
 
 void wsockdone(wsock s, int64_t deadline) {
     if(s->flags & WSOCK_LISTENING) {errno = EOPNOTSUPP; return;}
     if(s->flags & WSOCK_BROKEN) {errno = ECONNABORTED; return;}
     if(!(s->flags & WSOCK_DONE)) {
-        if(s->flags & WSOCK_DONE) {errno = EPROTO; return;}
-        tcpsend(s->u, "\x88\x00", 2, deadline);
-        if(errno != 0) {s->flags |= WSOCK_BROKEN;}
-        tcpflush(s->u, deadline);
-        if(errno != 0) {s->flags |= WSOCK_BROKEN;}
+        wsockcodecdone(&s->c);
+        wsock_capture(s, WSOCK_CAPOUT, 8, NULL, 0, 0);
+        wsock_sendctl(s, deadline);
         s->flags |= WSOCK_DONE;
     }
     errno = 0;
 }
 
 void wsockclose(wsock s) {
-    assert(s->u);
-    tcpclose(s->u);
-    wsock_str_term(&s->url);
-    wsock_str_term(&s->subprotocol);
-    free(s);
+    if(s->flags & WSOCK_LISTENING) {
+        s->flags |= WSOCK_DONE;
+        if(s->flags & WSOCK_ACCEPTING) {
+            /* Wake the acceptor up. It closes the socket on its way out. */
+            if(!(s->flags & WSOCK_EXPORTED)) {
+                shutdown(s->fd, SHUT_RDWR);
+                (void)chr(s->stopped, int);
+                chclose(s->stopped);
+            }
+            /* Drop connections that were never claimed by the user. NULL is
+               the wake-up left by wsockexport(). */
+            int more = 1;
+            while(more) {
+                choose {
+                in(s->ready, struct wsock*, as):
+                    if(as) {
+                        --s->pending;
+                        wsockclose(as);
+                    }
+                otherwise:
+                    more = 0;
+                end
+                }
+            }
+        }
+        else {
+            wsock_closelistener(s);
+        }
+        struct wsock *as;
+        for(as = s->conns; as; as = as->next)
+            as->ls = NULL;
+        wsock_release(s);
+        return;
+    }
+    if(s->ls) {
+        if(s->prev)
+            s->prev->next = s->next;
+        else
+            s->ls->conns = s->next;
+        if(s->next)
+            s->next->prev = s->prev;
+        s->ls = NULL;
+    }
+    /* wsockdrain() is using the connection. It will deallocate it once
+       it's done. */
+    if(s->flags & WSOCK_DRAINING) {
+        s->flags |= WSOCK_CLOSING;
+        return;
+    }
+    wsock_free(s);
 }
 
@@ -26,6 +26,10 @@
 #define WSOCK_H_INCLUDED
 
 #include <libmill.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "wsockcodec.h"
 
 /******************************************************************************/
 /*  ABI versioning support                                                    */
@@ -45,31 +49,6 @@
 /*  How many past interface versions are still supported. */
 #define WSOCK_VERSION_AGE 0
 
-/******************************************************************************/
-/*  Symbol visibility                                                         */
-/******************************************************************************/
-
-#if defined WSOCK_NO_EXPORTS
-#   define WSOCK_EXPORT
-#else
-#   if defined _WIN32
-#      if defined WSOCK_EXPORTS
-#          define WSOCK_EXPORT __declspec(dllexport)
-#      else
-#          define WSOCK_EXPORT __declspec(dllimport)
-#      endif
-#   else
-#      if defined __SUNPRO_C
-#          define WSOCK_EXPORT __global
-#      elif (defined __GNUC__ && __GNUC__ >= 4) || \
-             defined __INTEL_COMPILER || defined __clang__
-#          define WSOCK_EXPORT __attribute__ ((visibility("default")))
-#      else
-#          define WSOCK_EXPORT
-#      endif
-#   endif
-#endif
-
 /******************************************************************************/
 /*  wsock library                                                             */
 /******************************************************************************/
@@ -78,19 +57,210 @@ typedef struct wsock *wsock;
 
 WSOCK_EXPORT wsock wsocklisten(ipaddr addr, const char *subprotocol,
     int backlog);
+#define WSOCK_KTLS 1
+
+WSOCK_EXPORT wsock wsocklistentls(ipaddr addr, const char *subprotocol,
+    int backlog, const char *cert, const char *key, int flags);
+WSOCK_EXPORT wsock wsocklistenunix(const char *addr,
+    const char *subprotocol, int backlog);
+WSOCK_EXPORT void wsockadmission(wsock s, int64_t timeout, int maxpending);
+WSOCK_EXPORT void wsocklimits(wsock s, size_t maxmsg, size_t maxbuf);
+WSOCK_EXPORT void wsockbudget(size_t bytes);
+WSOCK_EXPORT size_t wsockbudgetused(void);
 WSOCK_EXPORT wsock wsockaccept(wsock s, int64_t deadline);
+WSOCK_EXPORT int wsockexport(wsock s, const char *path, int64_t deadline);
+WSOCK_EXPORT wsock wsockimport(const char *path, const char *subprotocol,
+    int64_t deadline);
+WSOCK_EXPORT wsock wsockimporttls(const char *path, const char *subprotocol,
+    const char *cert, const char *key, int flags, int64_t deadline);
+WSOCK_EXPORT int wsockdrain(wsock s, int64_t deadline);
+
+/*  Per-message extension, agreed on in the opening handshake by exchanging
+    'token' in Sec-WebSocket-Extensions. Messages it has transformed are
+    marked by RSV1. */
+struct wsockext {
+    /*  Name of the extension and its parameters, e.g. "x-foo; level=3".
+        Both peers have to use the same token. */
+    const char *token;
+    /*  Creates per-connection state once the extension was agreed on.
+        Returns NULL with errno set to drop the connection. */
+    void *(*open)(void *arg, int client);
+    /*  Transforms an outgoing message. The result stays valid until the next
+        call. Returns its size, or 0 to send the message unchanged. */
+    size_t (*encode)(void *state, const void *msg, size_t len,
+        const void **out);
+    /*  Reverses the transformation. Stores at most 'outlen' bytes to 'out'
+        and returns the full size of the message. Sets errno on failure. */
+    size_t (*decode)(void *state, const void *in, size_t inlen, void *out,
+        size_t outlen);
+    void (*close)(void *state);
+    void *arg;
+};
+
+WSOCK_EXPORT int wsockaddext(wsock s, const struct wsockext *ext);
+WSOCK_EXPORT struct wsockext *wsockzstd(int level, const void *dict,
+    size_t dictlen);
+WSOCK_EXPORT void wsockzstdfree(struct wsockext *ext);
+
+struct wsockmsg {
+    /*  Filled in by the user. When sending, 'len' is the size of the
+        message. When receiving, it's the size of the buffer. */
+    void *buf;
+    size_t len;
+    /*  Filled in by wsockrecvmany(). */
+    size_t size;
+};
+
 WSOCK_EXPORT wsock wsockconnect(ipaddr addr, const char *subprotocol,
     const char *url, int64_t deadline);
+WSOCK_EXPORT wsock wsockconnectearly(ipaddr addr, const char *subprotocol,
+    const char *url, const struct wsockmsg *msgs, int nmsgs,
+    int64_t deadline);
+WSOCK_EXPORT wsock wsockconnectext(ipaddr addr, const char *subprotocol,
+    const char *url, const struct wsockext *ext, int64_t deadline);
+WSOCK_EXPORT wsock wsockconnectany(const ipaddr *addrs, int naddrs,
+    const char *subprotocol, const char *url, int64_t delay,
+    int64_t deadline);
+WSOCK_EXPORT wsock wsockconnectunix(const char *addr,
+    const char *subprotocol, const char *url, int64_t deadline);
+WSOCK_EXPORT wsock wsockconnecttls(ipaddr addr, const char *subprotocol,
+    const char *url, const char *host, const char *cafile, int flags,
+    int64_t deadline);
+WSOCK_EXPORT void wsockpair(wsock *client, wsock *server);
+WSOCK_EXPORT int wsockktls(wsock s);
+
+#define WSOCK_NODELAY 1
+#define WSOCK_QUICKACK 2
+#define WSOCK_SNDBUF 3
+#define WSOCK_RCVBUF 4
+#define WSOCK_BUSYPOLL 5
+#define WSOCK_NOTSENTLOWAT 6
+
+WSOCK_EXPORT int wsocksetopt(wsock s, int opt, int val);
+WSOCK_EXPORT int wsockgetopt(wsock s, int opt);
+WSOCK_EXPORT int wsockprofile(wsock s, const char *name);
+WSOCK_EXPORT int wsockmigrate(wsock s, int sock, int64_t deadline);
+WSOCK_EXPORT wsock wsockadopt(int sock, int64_t deadline);
+
 WSOCK_EXPORT const char *wsockurl(wsock s);
 WSOCK_EXPORT const char *wsocksubprotocol(wsock s);
+WSOCK_EXPORT const char *wsockextension(wsock s);
+WSOCK_EXPORT const char *wsockheader(wsock s, const char *name);
+WSOCK_EXPORT const char *wsockheaderat(wsock s, int idx, const char **name);
+WSOCK_EXPORT void wsockfreeheaders(wsock s);
 WSOCK_EXPORT size_t wsocksend(wsock s, const void *msg, size_t len,
     int64_t deadline);
+WSOCK_EXPORT size_t wsocksendfile(wsock s, int fd, off_t off, size_t len,
+    int64_t deadline);
 WSOCK_EXPORT size_t wsockrecv(wsock s, void *msg, size_t len,
     int64_t deadline); 
+
+WSOCK_EXPORT size_t wsockrecvv(wsock s, const struct iovec *iov, int iovcnt,
+    int64_t deadline);
+WSOCK_EXPORT size_t wsockrecvfile(wsock s, int fd, off_t off,
+    int64_t deadline);
+WSOCK_EXPORT int wsockrecvmany(wsock s, struct wsockmsg *msgs, int nmsgs,
+    int64_t deadline);
+WSOCK_EXPORT size_t wsockrelay(wsock src, wsock dst, int64_t deadline);
 WSOCK_EXPORT void wsockping(wsock s, int64_t deadline);
 WSOCK_EXPORT void wsockpong(wsock s, int64_t deadline);
 WSOCK_EXPORT void wsockdone(wsock s, int64_t deadline);
 WSOCK_EXPORT void wsockclose(wsock s);
 
+/*  Capture log. The file starts with the header, followed by the records.
+    Each record is followed by the payload, or its 64-bit FNV-1a hash if
+    WSOCK_CAPHASH was used, and padded to a multiple of 8 bytes. Integers
+    are in the host byte order. */
+#define WSOCK_CAPMAGIC "WSOCKCAP"
+#define WSOCK_CAPVERSION 1
+#define WSOCK_CAPHASH 1
+#define WSOCK_CAPIN 0
+#define WSOCK_CAPOUT 1
+
+struct wsockcaphdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    /*  Bytes of the file used so far, the header included. */
+    uint64_t used;
+    /*  Records that didn't fit into the file. */
+    uint64_t dropped;
+};
+
+struct wsockcaprec {
+    /*  Microseconds since the log was opened. */
+    uint64_t time;
+    /*  Full size of the payload. */
+    uint64_t size;
+    /*  Connection, numbered from 1 in the order they were attached. */
+    uint32_t conn;
+    /*  Bytes of the payload or the hash that follow. */
+    uint32_t stored;
+    /*  WSOCK_CAPIN or WSOCK_CAPOUT. */
+    uint8_t dir;
+    /*  Opcode as in RFC 6455, 2 for messages. */
+    uint8_t opcode;
+    uint8_t reserved[6];
+};
+
+typedef struct wsockcap *wsockcap;
+
+WSOCK_EXPORT wsockcap wsockcapopen(const char *path, size_t size,
+    int flags);
+WSOCK_EXPORT void wsockcapture(wsock s, wsockcap cap);
+WSOCK_EXPORT void wsockcapclose(wsockcap cap);
+
+struct wsockschedstats {
+    /*  Messages started and bytes of payload passed to the transport. */
+    uint64_t msgs;
+    uint64_t bytes;
+    /*  How many times a write waited for its turn and the total time spent
+        waiting, in milliseconds. */
+    uint64_t waits;
+    uint64_t waittime;
+    /*  Same for waiting for the rate limits. */
+    uint64_t throttles;
+    uint64_t throttletime;
+    /*  Writes waiting for their turn now and the most that ever did at
+        the same time. */
+    int queued;
+    int maxqueued;
+};
+
+typedef struct wsocksched *wsocksched;
+
+WSOCK_EXPORT wsocksched wsockschedmake(size_t quantum);
+WSOCK_EXPORT void wsockschedule(wsock s, wsocksched sch);
+WSOCK_EXPORT void wsockratelimit(wsock s, uint64_t msgrate,
+    uint64_t byterate);
+WSOCK_EXPORT void wsockschedstats(wsocksched sch,
+    struct wsockschedstats *stats);
+WSOCK_EXPORT void wsocksendstats(wsock s, struct wsockschedstats *stats);
+WSOCK_EXPORT void wsockschedclose(wsocksched sch);
+
+typedef struct wsockpool *wsockpool;
+
+WSOCK_EXPORT wsockpool wsockpoolmake(int size, int64_t interval);
+WSOCK_EXPORT void wsockpoolwarm(wsockpool p, ipaddr addr,
+    const char *subprotocol, const char *url);
+WSOCK_EXPORT wsock wsockpoolconnect(wsockpool p, ipaddr addr,
+    const char *subprotocol, const char *url, int64_t deadline);
+WSOCK_EXPORT void wsockpoolclose(wsockpool p);
+
+#define WSOCK_MUX "wsock.mux"
+
+typedef struct wsockmux *wsockmux;
+typedef struct wsockchan *wsockchan;
+
+WSOCK_EXPORT wsockmux wsockmuxmake(wsock s);
+WSOCK_EXPORT wsockchan wsockmuxopen(wsockmux m);
+WSOCK_EXPORT wsockchan wsockmuxaccept(wsockmux m, int64_t deadline);
+WSOCK_EXPORT size_t wsockchansend(wsockchan ch, const void *msg, size_t len,
+    int64_t deadline);
+WSOCK_EXPORT size_t wsockchanrecv(wsockchan ch, void *msg, size_t len,
+    int64_t deadline);
+WSOCK_EXPORT void wsockchanclose(wsockchan ch);
+WSOCK_EXPORT void wsockmuxclose(wsockmux m);
+
 #endif
 
@@ -0,0 +1,164 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik  All rights reserved
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef WSOCKCODEC_H_INCLUDED
+#define WSOCKCODEC_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************/
+/*  Symbol visibility                                                         */
+/******************************************************************************/
+
+#if defined WSOCK_NO_EXPORTS
+#   define WSOCK_EXPORT
+#else
+#   if defined _WIN32
+#      if defined WSOCK_EXPORTS
+#          define WSOCK_EXPORT __declspec(dllexport)
+#      else
+#          define WSOCK_EXPORT __declspec(dllimport)
+#      endif
+#   else
+#      if defined __SUNPRO_C
+#          define WSOCK_EXPORT __global
+#      elif (defined __GNUC__ && __GNUC__ >= 4) || \
+             defined __INTEL_COMPILER || defined __clang__
+#          define WSOCK_EXPORT __attribute__ ((visibility("default")))
+#      else
+#          define WSOCK_EXPORT
+#      endif
+#   endif
+#endif
+
+/******************************************************************************/
+/*  WebSocket codec                                                           */
+/******************************************************************************/
+
+/*  The framing and the opening handshake as a state machine that does no I/O
+    by itself. The user feeds it incoming bytes and gets events back. Outgoing
+    bytes are either written to user's buffers or queued in the codec to be
+    picked up by the user. This makes it possible to use the protocol from
+    any event loop. This header doesn't depend on libmill. */
+
+typedef struct wsockcodec *wsockcodec;
+
+/*  Maximum size of a frame header. */
+#define WSOCK_MAXHEADER 14
+
+/*  Types of events returned by wsockcodecfeed(). */
+#define WSOCK_NONE 0
+#define WSOCK_OPEN 1
+#define WSOCK_DATA 2
+#define WSOCK_PING 3
+#define WSOCK_PONG 4
+#define WSOCK_CLOSE 5
+
+struct wsockevent {
+    int type;
+    /*  WSOCK_DATA only. Set on the last chunk of a message. */
+    int last;
+    /*  Message chunk or payload of the control frame. */
+    const uint8_t *data;
+    size_t len;
+    /*  WSOCK_DATA only. RSV bits of the frame. Only RSV1 (0x40) can be set
+        and only on the first frame of a message, if an extension was
+        agreed on. */
+    int rsv;
+};
+
+/*  Creates the server side of a connection. Returns NULL and sets errno to
+    EINVAL if the subprotocol list is malformed or to ENOMEM. */
+WSOCK_EXPORT wsockcodec wsockcodecserver(const char *subprotocol);
+/*  Creates the client side of a connection. The opening handshake is queued
+    straight away, to be picked up by wsockcodecpending(). Errors are the
+    same as with wsockcodecserver(). The strings are copied. */
+WSOCK_EXPORT wsockcodec wsockcodecclient(const char *subprotocol,
+    const char *url);
+/*  Sets the comma-separated extensions the client offers or the server
+    supports. The client's queued handshake is rebuilt. Returns -1 and sets
+    errno to EBUSY once the handshake has started, i.e. bytes were fed or
+    wsockcodecsent() was called, to EINVAL or to ENOMEM. */
+WSOCK_EXPORT int wsockcodecextensions(wsockcodec c,
+    const char *extensions);
+/*  Consumes received bytes up to the first event and returns how many were
+    consumed; the rest has to be fed again. Message payload is unmasked in
+    place and 'data' points into 'buf', so the buffer must be kept intact
+    while the event is processed. Payload of control frames points into the
+    codec and is valid until the next call. Replies to pings and closes are
+    queued, so wsockcodecpending() should be checked after each call. Sets
+    errno to EPROTO if the peer violated the protocol, to ECONNRESET once
+    the close frame was received. */
+WSOCK_EXPORT size_t wsockcodecfeed(wsockcodec c, void *buf, size_t len,
+    struct wsockevent *ev);
+/*  Returns the number of bytes needed to get to the next event. Reading no
+    more than that leaves bytes past the handshake or a message in the
+    socket. Zero once the connection is closed or broken. */
+WSOCK_EXPORT size_t wsockcodecwant(wsockcodec c);
+/*  Returns the size of the data queued for sending and points 'buf' to it.
+    The data is owned by the codec and is valid until wsockcodecsent() or
+    any call that queues more data: wsockcodecfeed(), wsockcodecextensions(),
+    wsockcodecping(), wsockcodecpong() or wsockcodecdone(). */
+WSOCK_EXPORT size_t wsockcodecpending(wsockcodec c, const void **buf);
+/*  Drops 'len' bytes, no more than wsockcodecpending() returned, from the
+    head of the queue. Must be called after writing them to the network,
+    partial writes included. */
+WSOCK_EXPORT void wsockcodecsent(wsockcodec c, size_t len);
+/*  Writes the header of a binary message of 'len' bytes into 'buf', which
+    must hold WSOCK_MAXHEADER bytes, and returns its size. On the client
+    side a new mask is picked for the payload that follows. Doesn't go
+    through the queue; the user sends the header and the payload. */
+WSOCK_EXPORT size_t wsockcodecheader(wsockcodec c, size_t len, void *buf);
+/*  Masks the next chunk of the payload following wsockcodecheader() in
+    place. The chunks must be passed in order. Does nothing on the server
+    side. */
+WSOCK_EXPORT void wsockcodecmask(wsockcodec c, void *buf, size_t len);
+/*  Writes a complete binary message, header and masked payload, into the
+    user's buffer and returns its size. Returns 0 and sets errno to ENOBUFS
+    if it doesn't fit. */
+WSOCK_EXPORT size_t wsockcodecencode(wsockcodec c, const void *msg,
+    size_t len, void *buf, size_t bufsz);
+/*  Queues a ping. Sets errno to ENOMEM or ENOBUFS if it can't be queued. */
+WSOCK_EXPORT void wsockcodecping(wsockcodec c);
+/*  Queues an unsolicited pong. Errors are the same as with wsockcodecping(). */
+WSOCK_EXPORT void wsockcodecpong(wsockcodec c);
+/*  Queues a close frame unless one was queued already. Errors are the same
+    as with wsockcodecping(). */
+WSOCK_EXPORT void wsockcodecdone(wsockcodec c);
+/*  Returns the requested URL, i.e. the one passed to wsockcodecclient() or
+    the one received by the server, NULL before the handshake. */
+WSOCK_EXPORT const char *wsockcodecurl(wsockcodec c);
+/*  Returns the agreed subprotocol or NULL if there's none. */
+WSOCK_EXPORT const char *wsockcodecsubprotocol(wsockcodec c);
+/*  Returns the agreed extension token or NULL if there's none. */
+WSOCK_EXPORT const char *wsockcodecextension(wsockcodec c);
+/*  Returns the value of a header field of the peer's handshake, NULL if
+    there's no such field. The name is case-insensitive. */
+WSOCK_EXPORT const char *wsockcodecfield(wsockcodec c, const char *name);
+/*  Deallocates the codec. The strings returned by the functions above are
+    owned by the codec and valid until then. */
+WSOCK_EXPORT void wsockcodecclose(wsockcodec c);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+    Copyright (c) 2015 Martin Sustrik  All rights reserved.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom
+    the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included
+    in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+    IN THE SOFTWARE.
+*/
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wsock.h"
+
+#if defined WSOCK_HAVE_ZSTD
+
+#include <zstd.h>
+
+/* Messages shorter than this are not worth compressing. */
+#define WSOCK_ZSTD_MINSIZE 64
+/* Guards against messages that decompress to excessive sizes. */
+#define WSOCK_ZSTD_MAXSIZE (64 * 1024 * 1024)
+
+/* Each message is compressed as a standalone zstd frame, no state is carried
+   over between messages. A pre-shared dictionary makes up for that with
+   small messages. Its hash is a part of the token so that peers using
+   different dictionaries don't agree on the extension. */
+struct wsock_zstd {
+    struct wsockext ext;
+    char token[32];
+    int level;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+};
+
+struct wsock_zstdconn {
+    struct wsock_zstd *z;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    uint8_t *out;
+    size_t outcap;
+};
+
+static void *wsock_zstd_open(void *arg, int client) {
+    struct wsock_zstdconn *zc = calloc(1, sizeof(struct wsock_zstdconn));
+    if(!zc) {errno = ENOMEM; return NULL;}
+    zc->z = (struct wsock_zstd*)arg;
+    zc->cctx = ZSTD_createCCtx();
+    zc->dctx = ZSTD_createDCtx();
+    if(!zc->cctx || !zc->dctx) {
+        ZSTD_freeCCtx(zc->cctx);
+        ZSTD_freeDCtx(zc->dctx);
+        free(zc);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return zc;
+}
+
+static size_t wsock_zstd_encode(void *state, const void *msg, size_t len,
+      const void **out) {
+    struct wsock_zstdconn *zc = (struct wsock_zstdconn*)state;
+    if(len < WSOCK_ZSTD_MINSIZE)
+        return 0;
+    size_t bound = ZSTD_compressBound(len);
+    if(bound > zc->outcap) {
+        uint8_t *buf = realloc(zc->out, bound);
+        if(!buf)
+            return 0;
+        zc->out = buf;
+        zc->outcap = bound;
+    }
+    size_t sz = zc->z->cdict ?
+        ZSTD_compress_usingCDict(zc->cctx, zc->out, bound, msg, len,
+            zc->z->cdict) :
+        ZSTD_compressCCtx(zc->cctx, zc->out, bound, msg, len, zc->z->level);
+    /* Incompressible messages are sent as they are. */
+    if(ZSTD_isError(sz) || sz >= len)
+        return 0;
+    *out = zc->out;
+    return sz;
+}
+
+static size_t wsock_zstd_decode(void *state, const void *in, size_t inlen,
+      void *out, size_t outlen) {
+    struct wsock_zstdconn *zc = (struct wsock_zstdconn*)state;
+    /* Single-shot compression always records the size of the content. */
+    unsigned long long sz = ZSTD_getFrameContentSize(in, inlen);
+    if(sz == ZSTD_CONTENTSIZE_ERROR || sz == ZSTD_CONTENTSIZE_UNKNOWN) {
+        errno = EPROTO; return 0;}
+    if(sz > WSOCK_ZSTD_MAXSIZE) {errno = EMSGSIZE; return 0;}
+    /* Message that doesn't fit into the user's buffer is decompressed in
+       full and truncated. */
+    uint8_t *dst = out;
+    if(sz > outlen) {
+        dst = malloc(sz);
+        if(!dst) {errno = ENOMEM; return 0;}
+    }
+    size_t rc = zc->z->ddict ?
+        ZSTD_decompress_usingDDict(zc->dctx, dst, sz, in, inlen,
+            zc->z->ddict) :
+        ZSTD_decompressDCtx(zc->dctx, dst, sz, in, inlen);
+    if(dst != out) {
+        memcpy(out, dst, outlen);
+        free(dst);
+    }
+    if(ZSTD_isError(rc) || rc != sz) {errno = EPROTO; return 0;}
+    errno = 0;
+    return sz;
+}
+
+static void wsock_zstd_close(void *state) {
+    struct wsock_zstdconn *zc = (struct wsock_zstdconn*)state;
+    ZSTD_freeCCtx(zc->cctx);
+    ZSTD_freeDCtx(zc->dctx);
+    free(zc->out);
+    free(zc);
+}
+
+struct wsockext *wsockzstd(int level, const void *dict, size_t dictlen) {
+    if(!dict != !dictlen || level < ZSTD_minCLevel() ||
+          level > ZSTD_maxCLevel()) {
+        errno = EINVAL; return NULL;}
+    struct wsock_zstd *z = calloc(1, sizeof(struct wsock_zstd));
+    if(!z) {errno = ENOMEM; return NULL;}
+    z->level = level;
+    if(dict) {
+        z->cdict = ZSTD_createCDict(dict, dictlen, level);
+        z->ddict = ZSTD_createDDict(dict, dictlen);
+        if(!z->cdict || !z->ddict) {
+            ZSTD_freeCDict(z->cdict);
+            ZSTD_freeDDict(z->ddict);
+            free(z);
+            errno = ENOMEM;
+            return NULL;
+        }
+        /* FNV-1a. */
+        uint32_t hash = 2166136261u;
+        size_t i;
+        for(i = 0; i != dictlen; ++i)
+            hash = (hash ^ ((const uint8_t*)dict)[i]) * 16777619u;
+        snprintf(z->token, sizeof(z->token), "x-wsock-zstd; dict=%08x",
+            (unsigned)hash);
+    }
+    else {
+        strcpy(z->token, "x-wsock-zstd");
+    }
+    z->ext.token = z->token;
+    z->ext.open = wsock_zstd_open;
+    z->ext.encode = wsock_zstd_encode;
+    z->ext.decode = wsock_zstd_decode;
+    z->ext.close = wsock_zstd_close;
+    z->ext.arg = z;
+    errno = 0;
+    return &z->ext;
+}
+
+void wsockzstdfree(struct wsockext *ext) {
+    struct wsock_zstd *z = (struct wsock_zstd*)ext->arg;
+    ZSTD_freeCDict(z->cdict);
+    ZSTD_freeDDict(z->ddict);
+    free(z);
+}
+
+#else
+
+struct wsockext *wsockzstd(int level, const void *dict, size_t dictlen) {
+    (void)level;
+    (void)dict;
+    (void)dictlen;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+void wsockzstdfree(struct wsockext *ext) {
+    (void)ext;
+}
+
+#endif